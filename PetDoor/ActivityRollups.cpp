@@ -0,0 +1,322 @@
+#include "ActivityRollups.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#ifndef _WIN32
+#include <codecvt>
+#include <locale>
+#endif
+
+namespace PetDoor
+{
+	namespace
+	{
+		const uint32_t RollupMagic = 0x52445050; // "PPDR"
+		const uint32_t RollupVersion = 1;
+
+		const int64_t TicksPerHour = 36000000000LL;
+
+		struct RollupHeader
+		{
+			uint32_t magic;
+			uint32_t version;
+			uint32_t hourSlots;
+			uint32_t daySlots;
+		};
+
+		FILE* OpenRollupFile(const std::wstring& path, const char* mode)
+		{
+#ifdef _WIN32
+			std::wstring wideMode(mode, mode + strlen(mode));
+			return _wfopen(path.c_str(), wideMode.c_str());
+#else
+			return fopen(std::wstring_convert<std::codecvt_utf8<wchar_t>>().to_bytes(path).c_str(), mode);
+#endif
+		}
+
+		// Floor division, so timestamps before 1601 still map to the right (negative) period
+		int64_t PeriodOf(int64_t ticks, int64_t ticksPerPeriod)
+		{
+			return ticks >= 0 ? ticks / ticksPerPeriod : -((-ticks + ticksPerPeriod - 1) / ticksPerPeriod);
+		}
+
+		int SlotOf(int64_t period, int slots)
+		{
+			return static_cast<int>(((period % slots) + slots) % slots);
+		}
+	}
+
+	void ActivityRollups::Totals::Add(const Bucket& bucket)
+	{
+		entries += bucket.entries;
+		exits += bucket.exits;
+		blocked += bucket.blocked;
+		for (int i = 0; i < LatencyBuckets::Count; i++)
+		{
+			latency[i] += bucket.latency[i];
+		}
+	}
+
+	// Only takes out an hour of a day already added: every event in an hour bucket is also in its day's
+	void ActivityRollups::Totals::Subtract(const Bucket& bucket)
+	{
+		entries -= bucket.entries;
+		exits -= bucket.exits;
+		blocked -= bucket.blocked;
+		for (int i = 0; i < LatencyBuckets::Count; i++)
+		{
+			latency[i] -= bucket.latency[i];
+		}
+	}
+
+	ActivitySummary ActivityRollups::Totals::Summarize(int64_t from, int64_t to) const
+	{
+		ActivitySummary summary;
+		summary.from = from;
+		summary.to = to;
+		summary.entries = entries;
+		summary.exits = exits;
+		summary.blocked = blocked;
+		summary.latencyP50Microseconds = LatencyBuckets::Percentile(latency, 0.50);
+		summary.latencyP95Microseconds = LatencyBuckets::Percentile(latency, 0.95);
+		summary.latencyP99Microseconds = LatencyBuckets::Percentile(latency, 0.99);
+		return summary;
+	}
+
+	ActivityRollups::ActivityRollups(const std::wstring& path)
+		: _path(path)
+		, _loaded(false)
+		, _newestHour(-1)
+		, _dirty(HourSlots + DaySlots, false)
+	{
+		static_assert(sizeof(Bucket) == 16 + 2 * LatencyBuckets::Count, "Bucket is a fixed on-disk layout");
+
+		Bucket empty = {};
+		empty.period = -1;
+		_buckets.assign(HourSlots + DaySlots, empty);
+		_dirtySlots.reserve(HourSlots + DaySlots);
+
+		FILE* file = OpenRollupFile(_path, "rb");
+		if (file == nullptr) return;
+
+		RollupHeader header;
+		if (fread(&header, sizeof(header), 1, file) == 1
+			&& header.magic == RollupMagic && header.version == RollupVersion
+			&& header.hourSlots == HourSlots && header.daySlots == DaySlots)
+		{
+			_loaded = fread(_buckets.data(), sizeof(Bucket), _buckets.size(), file) == _buckets.size();
+		}
+		fclose(file);
+
+		if (!_loaded)
+		{
+			_buckets.assign(HourSlots + DaySlots, empty);
+			return;
+		}
+
+		for (int slot = 0; slot < HourSlots; slot++)
+		{
+			_newestHour = std::max<int64_t>(_newestHour, _buckets[slot].period);
+		}
+	}
+
+	void ActivityRollups::Record(const DoorEventRecord& record)
+	{
+		int64_t hour = PeriodOf(record.timestamp, TicksPerHour);
+		int64_t day = PeriodOf(hour, 24);
+		int hourSlot = SlotOf(hour, HourSlots);
+		int daySlot = HourSlots + SlotOf(day, DaySlots);
+
+		std::lock_guard<std::mutex> lock(_lock);
+		_newestHour = std::max(_newestHour, hour);
+		int64_t newestDay = PeriodOf(_newestHour, 24);
+
+		// An event that arrives after its hour or day has left the ring, e.g. from a clock that was
+		// set back, is dropped from that ring rather than counted in a period it does not belong to
+		if (hour > _newestHour - HourSlots && Count(_buckets[hourSlot], static_cast<int32_t>(hour), record)) MarkDirty(hourSlot);
+		if (day > newestDay - DaySlots && Count(_buckets[daySlot], static_cast<int32_t>(day), record)) MarkDirty(daySlot);
+	}
+
+	bool ActivityRollups::Count(Bucket& bucket, int32_t period, const DoorEventRecord& record)
+	{
+		// The slot has moved on to a newer period, which this event would wipe out
+		if (bucket.period > period) return false;
+
+		// A slot still holding an older period has aged out of the ring; start it over
+		if (bucket.period < period)
+		{
+			memset(&bucket, 0, sizeof(bucket));
+			bucket.period = period;
+		}
+
+		switch (record.decision)
+		{
+		case DoorDecision::Entered:
+			bucket.entries++;
+			break;
+		case DoorDecision::Exited:
+			bucket.exits++;
+			break;
+		case DoorDecision::Blocked:
+			bucket.blocked++;
+			break;
+		}
+
+		// Only outdoor events run the detector
+		if (record.sensor == DoorSensor::Outdoor)
+		{
+			uint16_t& count = bucket.latency[LatencyBuckets::Index(record.detectionLatencyMicroseconds)];
+			if (count < UINT16_MAX) count++;
+		}
+		return true;
+	}
+
+	void ActivityRollups::MarkDirty(int slot)
+	{
+		if (!_dirty[slot])
+		{
+			_dirty[slot] = true;
+			_dirtySlots.push_back(slot);
+		}
+	}
+
+	void ActivityRollups::Flush()
+	{
+		// Copy the changed buckets out so the file is written without holding the lock
+		std::vector<std::pair<int, Bucket>> changed;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			if (_dirtySlots.empty()) return;
+
+			changed.reserve(_dirtySlots.size());
+			for (int slot : _dirtySlots)
+			{
+				changed.emplace_back(slot, _buckets[slot]);
+				_dirty[slot] = false;
+			}
+			_dirtySlots.clear();
+		}
+
+		FILE* file = OpenRollupFile(_path, "r+b");
+		if (file == nullptr)
+		{
+			// First flush: lay out the whole file
+			file = OpenRollupFile(_path, "wb");
+			if (file == nullptr) return;
+
+			RollupHeader header = { RollupMagic, RollupVersion, HourSlots, DaySlots };
+			std::vector<Bucket> buckets;
+			{
+				std::lock_guard<std::mutex> lock(_lock);
+				buckets = _buckets;
+			}
+			fwrite(&header, sizeof(header), 1, file);
+			fwrite(buckets.data(), sizeof(Bucket), buckets.size(), file);
+			fclose(file);
+			return;
+		}
+
+		std::sort(changed.begin(), changed.end(), [](const std::pair<int, Bucket>& a, const std::pair<int, Bucket>& b) { return a.first < b.first; });
+		for (auto& slot : changed)
+		{
+			long offset = static_cast<long>(sizeof(RollupHeader) + slot.first * sizeof(Bucket));
+			if (fseek(file, offset, SEEK_SET) != 0 || fwrite(&slot.second, sizeof(Bucket), 1, file) != 1)
+			{
+				break;
+			}
+		}
+		fclose(file);
+	}
+
+	const ActivityRollups::Bucket* ActivityRollups::FindHour(int64_t hour) const
+	{
+		const Bucket& bucket = _buckets[SlotOf(hour, HourSlots)];
+		return bucket.period == hour ? &bucket : nullptr;
+	}
+
+	const ActivityRollups::Bucket* ActivityRollups::FindDay(int64_t day) const
+	{
+		const Bucket& bucket = _buckets[HourSlots + SlotOf(day, DaySlots)];
+		return bucket.period == day ? &bucket : nullptr;
+	}
+
+	ActivitySummary ActivityRollups::Query(int64_t from, int64_t to)
+	{
+		int64_t firstHour = PeriodOf(from, TicksPerHour);
+		int64_t endHour = PeriodOf(to + TicksPerHour - 1, TicksPerHour);
+
+		Totals totals;
+		std::lock_guard<std::mutex> lock(_lock);
+
+		// Hours older than this have been overwritten in the hour ring
+		int64_t oldestRetainedHour = _newestHour - HourSlots + 1;
+		// The hours the totals cover, wider than asked where aged-out hours could not be left out
+		int64_t coveredFirstHour = firstHour;
+		int64_t coveredEndHour = endHour;
+
+		for (int64_t hour = firstHour; hour < endHour;)
+		{
+			int64_t day = PeriodOf(hour, 24);
+			int64_t dayStart = day * 24;
+			int64_t dayEnd = dayStart + 24;
+			bool wholeDay = hour == dayStart && dayEnd <= endHour;
+
+			if (wholeDay)
+			{
+				const Bucket* bucket = FindDay(day);
+				if (bucket != nullptr) totals.Add(*bucket);
+				hour = dayEnd;
+			}
+			else if (hour < oldestRetainedHour)
+			{
+				// Part of the range is in hours that have aged out, so the day bucket stands in for it,
+				// less the day's hours still in the ring that are out of range. The aged-out hours are the
+				// start of the day; those out of range are still in the totals, and the range widens to them.
+				const Bucket* bucket = FindDay(day);
+				if (bucket != nullptr)
+				{
+					totals.Add(*bucket);
+					for (int64_t dayHour = std::max(dayStart, oldestRetainedHour); dayHour < dayEnd; dayHour++)
+					{
+						if (dayHour >= firstHour && dayHour < endHour) continue;
+						const Bucket* hourBucket = FindHour(dayHour);
+						if (hourBucket != nullptr) totals.Subtract(*hourBucket);
+					}
+					if (dayStart < firstHour) coveredFirstHour = std::min(coveredFirstHour, dayStart);
+					if (endHour < oldestRetainedHour) coveredEndHour = std::max(coveredEndHour, std::min(dayEnd, oldestRetainedHour));
+				}
+				hour = dayEnd;
+			}
+			else
+			{
+				const Bucket* bucket = FindHour(hour);
+				if (bucket != nullptr) totals.Add(*bucket);
+				hour++;
+			}
+		}
+
+		return totals.Summarize(coveredFirstHour * TicksPerHour, coveredEndHour * TicksPerHour);
+	}
+
+	std::vector<ActivitySummary> ActivityRollups::Series(int64_t from, int64_t to, RollupGranularity granularity)
+	{
+		int64_t ticksPerPeriod = granularity == RollupGranularity::Day ? TicksPerHour * 24 : TicksPerHour;
+		int64_t first = PeriodOf(from, ticksPerPeriod);
+		int64_t end = PeriodOf(to + ticksPerPeriod - 1, ticksPerPeriod);
+
+		std::vector<ActivitySummary> series;
+		series.reserve(static_cast<size_t>(std::max<int64_t>(0, end - first)));
+
+		std::lock_guard<std::mutex> lock(_lock);
+		for (int64_t period = first; period < end; period++)
+		{
+			Totals totals;
+			const Bucket* bucket = granularity == RollupGranularity::Day ? FindDay(period) : FindHour(period);
+			if (bucket != nullptr) totals.Add(*bucket);
+			series.push_back(totals.Summarize(period * ticksPerPeriod, (period + 1) * ticksPerPeriod));
+		}
+		return series;
+	}
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "DoorEvent.h"
+#include "LatencyBuckets.h"
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace PetDoor
+{
+	// Door activity over some time range, answered from the rollups alone
+	struct ActivitySummary
+	{
+		int64_t from = 0;
+		int64_t to = 0;
+		uint64_t entries = 0;
+		uint64_t exits = 0;
+		uint64_t blocked = 0;
+		// Detection latency of outdoor events, 0 if there were none
+		uint64_t latencyP50Microseconds = 0;
+		uint64_t latencyP95Microseconds = 0;
+		uint64_t latencyP99Microseconds = 0;
+	};
+
+	enum class RollupGranularity
+	{
+		Hour,
+		Day
+	};
+
+	// Per-hour and per-day door activity counts, kept up to date one event at a
+	// time. Buckets live in two fixed rings (31 days of hours, two years of
+	// days) so recording is O(1), and are persisted as fixed size slots so a
+	// flush only rewrites the buckets that changed. Hours and days are UTC.
+	class ActivityRollups
+	{
+	public:
+		static const int HourSlots = 31 * 24;
+		static const int DaySlots = 732;
+
+		// path: rollup file, loaded if it exists and created on the first Flush otherwise
+		ActivityRollups(const std::wstring& path);
+
+		// False if there was no usable rollup file, e.g. on first run
+		bool Loaded() const { return _loaded; }
+
+		void Record(const DoorEventRecord& record);
+
+		// Writes the buckets changed since the last flush
+		void Flush();
+
+		// Totals for from <= t < to, rounded out to whole hours. Where some of a
+		// day's hours have already left the hour ring, its day bucket is used less
+		// the hours still in the ring that are out of range. Aged-out hours out of
+		// range cannot be taken out, so they are counted and the summary's from and
+		// to are widened to include them.
+		ActivitySummary Query(int64_t from, int64_t to);
+
+		// One summary per hour or day in the range, e.g. to draw the dashboard
+		std::vector<ActivitySummary> Series(int64_t from, int64_t to, RollupGranularity granularity);
+
+	private:
+		struct Bucket
+		{
+			// Hours or days since 1601-01-01, -1 for an unused slot
+			int32_t period;
+			uint32_t entries;
+			uint32_t exits;
+			uint32_t blocked;
+			uint16_t latency[LatencyBuckets::Count];
+		};
+
+		struct Totals
+		{
+			uint64_t entries = 0;
+			uint64_t exits = 0;
+			uint64_t blocked = 0;
+			uint64_t latency[LatencyBuckets::Count] = {};
+
+			void Add(const Bucket& bucket);
+			void Subtract(const Bucket& bucket);
+			ActivitySummary Summarize(int64_t from, int64_t to) const;
+		};
+
+		// Returns false, counting nothing, if the slot already holds a newer period
+		static bool Count(Bucket& bucket, int32_t period, const DoorEventRecord& record);
+		const Bucket* FindHour(int64_t hour) const;
+		const Bucket* FindDay(int64_t day) const;
+		void MarkDirty(int slot);
+
+		std::wstring _path;
+		bool _loaded;
+		int64_t _newestHour;
+		std::mutex _lock;
+		// Hour slots first, then day slots, in the same order as the file
+		std::vector<Bucket> _buckets;
+		std::vector<bool> _dirty;
+		std::vector<int> _dirtySlots;
+	};
+}
@@ -0,0 +1,96 @@
+#include "AllocationCounter.h"
+
+#if PETDOOR_COUNT_ALLOCATIONS
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+	// Constant-initialized, so touching it from inside operator new allocates nothing itself
+	thread_local uint64_t threadAllocations = 0;
+	std::atomic<uint64_t> totalAllocations(0);
+
+	void* Allocate(size_t size)
+	{
+		threadAllocations++;
+		totalAllocations.fetch_add(1, std::memory_order_relaxed);
+		return malloc(size ? size : 1);
+	}
+
+	void* AllocateOrThrow(size_t size)
+	{
+		void* block = Allocate(size);
+		if (block == nullptr) throw std::bad_alloc();
+		return block;
+	}
+}
+
+void* operator new(size_t size)
+{
+	return AllocateOrThrow(size);
+}
+
+void* operator new[](size_t size)
+{
+	return AllocateOrThrow(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	return Allocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+	return Allocate(size);
+}
+
+void operator delete(void* block) noexcept
+{
+	free(block);
+}
+
+void operator delete[](void* block) noexcept
+{
+	free(block);
+}
+
+void operator delete(void* block, size_t) noexcept
+{
+	free(block);
+}
+
+void operator delete[](void* block, size_t) noexcept
+{
+	free(block);
+}
+
+void operator delete(void* block, const std::nothrow_t&) noexcept
+{
+	free(block);
+}
+
+void operator delete[](void* block, const std::nothrow_t&) noexcept
+{
+	free(block);
+}
+
+namespace PetDoor
+{
+	namespace AllocationCounter
+	{
+		uint64_t ThreadAllocations()
+		{
+			return threadAllocations;
+		}
+
+		uint64_t TotalAllocations()
+		{
+			return totalAllocations.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+
+// Set to 1 to count heap allocations. This replaces the global operator new
+// and delete for the whole program, so only the desktop tools turn it on.
+#ifndef PETDOOR_COUNT_ALLOCATIONS
+#define PETDOOR_COUNT_ALLOCATIONS 0
+#endif
+
+namespace PetDoor
+{
+	namespace AllocationCounter
+	{
+#if PETDOOR_COUNT_ALLOCATIONS
+		// operator new calls made by the calling thread. cv::Mat buffers are included:
+		// OpenCV allocates the reference-counted header of each one with new.
+		uint64_t ThreadAllocations();
+
+		// operator new calls made by every thread
+		uint64_t TotalAllocations();
+#endif
+	}
+}
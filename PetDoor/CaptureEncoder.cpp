@@ -0,0 +1,107 @@
+#include "CaptureEncoder.h"
+#include "VisionCore.h"
+
+#include <algorithm>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/imgcodecs/imgcodecs.hpp>
+
+#define CROP_JPEG_QUALITY 90
+#define THUMBNAIL_JPEG_QUALITY 70
+#define FRAME_JPEG_QUALITY 90 // What BitmapEncoder uses by default
+
+namespace PetDoor
+{
+	const char* PersistenceModeName(PersistenceMode mode)
+	{
+		switch (mode)
+		{
+		case PersistenceMode::CropsAndThumbnail:
+			return "crops+thumbnail";
+		case PersistenceMode::FullFrame:
+		default:
+			return "full frame";
+		}
+	}
+
+	void PersistenceStats::Add(unsigned long long eventBytes, double eventEncodeMilliseconds)
+	{
+		events++;
+		bytes += eventBytes;
+		encodeMilliseconds += eventEncodeMilliseconds;
+	}
+
+	double PersistenceStats::AverageBytes() const
+	{
+		return events == 0 ? 0 : static_cast<double>(bytes) / events;
+	}
+
+	double PersistenceStats::AverageEncodeMilliseconds() const
+	{
+		return events == 0 ? 0 : encodeMilliseconds / events;
+	}
+
+	CaptureEncoder::CaptureEncoder(double padding, int thumbnailWidth)
+		: _padding(padding)
+		, _thumbnailWidth(thumbnailWidth)
+		, _params({ cv::IMWRITE_JPEG_QUALITY, 0 })
+	{
+	}
+
+	void CaptureEncoder::EncodeCrops(const cv::Mat& rgbaFrame, const std::vector<cv::Rect>& objects, std::vector<EncodedCapture>& captures)
+	{
+		const cv::Rect frameRect(0, 0, rgbaFrame.cols, rgbaFrame.rows);
+
+		for (unsigned int x = 0; x < objects.size(); x++)
+		{
+			// Grow the detection on every side so the whole head is kept, then clip to the frame
+			int padX = static_cast<int>(objects[x].width * _padding);
+			int padY = static_cast<int>(objects[x].height * _padding);
+			cv::Rect padded(objects[x].x - padX, objects[x].y - padY, objects[x].width + 2 * padX, objects[x].height + 2 * padY);
+			padded &= frameRect;
+			if (padded.area() == 0) continue;
+
+			Encode(rgbaFrame(padded), "Cat" + std::to_string(x + 1) + ".jpg", CROP_JPEG_QUALITY, captures);
+		}
+	}
+
+	void CaptureEncoder::EncodeThumbnail(const cv::Mat& rgbaFrame, std::vector<EncodedCapture>& captures, const std::vector<cv::Rect>& objects)
+	{
+		if (rgbaFrame.empty()) return;
+
+		int width = std::min(_thumbnailWidth, rgbaFrame.cols);
+		int height = std::max(1, rgbaFrame.rows * width / rgbaFrame.cols);
+		cv::resize(rgbaFrame, _thumbnail, cv::Size(width, height), 0, 0, cv::INTER_AREA);
+		drawRectOverObjects(_thumbnail, objects, static_cast<double>(width) / rgbaFrame.cols);
+
+		Encode(_thumbnail, "Thumbnail.jpg", THUMBNAIL_JPEG_QUALITY, captures);
+	}
+
+	void CaptureEncoder::EncodeFrame(const cv::Mat& rgbaFrame, std::vector<EncodedCapture>& captures)
+	{
+		if (rgbaFrame.empty()) return;
+
+		Encode(rgbaFrame, "PreviewFrame.jpg", FRAME_JPEG_QUALITY, captures);
+	}
+
+	unsigned long long CaptureEncoder::TotalBytes(const std::vector<EncodedCapture>& captures)
+	{
+		unsigned long long total = 0;
+		for (auto& capture : captures)
+		{
+			total += capture.bytes.size();
+		}
+		return total;
+	}
+
+	void CaptureEncoder::Encode(const cv::Mat& rgba, const std::string& name, int quality, std::vector<EncodedCapture>& captures)
+	{
+		// Preview frames are RGBA, imencode expects BGR
+		cv::cvtColor(rgba, _bgr, cv::COLOR_RGBA2BGR);
+
+		_params[1] = quality;
+		EncodedCapture capture;
+		capture.name = name;
+		cv::imencode(".jpg", _bgr, capture.bytes, _params);
+		captures.push_back(std::move(capture));
+	}
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+// Fraction of a detection's size added on every side of its crop
+#define CAPTURE_CROP_PADDING 0.25
+
+namespace PetDoor
+{
+	// How an outdoor trigger is persisted to the capture folder
+	enum class PersistenceMode
+	{
+		// The full annotated preview frame for every trigger
+		FullFrame,
+		// Padded crops of every detected face plus a small full-frame thumbnail;
+		// blocked entries (no cat found) still keep the full frame
+		CropsAndThumbnail
+	};
+
+	const char* PersistenceModeName(PersistenceMode mode);
+
+	// A JPEG ready to be written to disk
+	struct EncodedCapture
+	{
+		std::string name;
+		std::vector<unsigned char> bytes;
+	};
+
+	// Running storage/encode totals for one persistence mode
+	struct PersistenceStats
+	{
+		unsigned int events = 0;
+		unsigned long long bytes = 0;
+		double encodeMilliseconds = 0;
+
+		void Add(unsigned long long eventBytes, double eventEncodeMilliseconds);
+		double AverageBytes() const;
+		double AverageEncodeMilliseconds() const;
+	};
+
+	class CaptureEncoder
+	{
+	public:
+		// padding: fraction of the detection size added on every side of a crop
+		// thumbnailWidth: width in pixels of the full-frame thumbnail
+		CaptureEncoder(double padding = CAPTURE_CROP_PADDING, int thumbnailWidth = 160);
+
+		// Encodes a padded crop of every detection in an RGBA frame.
+		// Call before the frame is annotated so the crops stay clean.
+		void EncodeCrops(const cv::Mat& rgbaFrame, const std::vector<cv::Rect>& objects, std::vector<EncodedCapture>& captures);
+
+		// Encodes a downscaled copy of the whole RGBA frame, with objects (in frame coordinates) drawn over the copy
+		void EncodeThumbnail(const cv::Mat& rgbaFrame, std::vector<EncodedCapture>& captures,
+			const std::vector<cv::Rect>& objects = std::vector<cv::Rect>());
+
+		// Encodes the whole RGBA frame at full size, for when there is no bitmap of it to hand to BitmapEncoder
+		void EncodeFrame(const cv::Mat& rgbaFrame, std::vector<EncodedCapture>& captures);
+
+		static unsigned long long TotalBytes(const std::vector<EncodedCapture>& captures);
+
+	private:
+		void Encode(const cv::Mat& rgba, const std::string& name, int quality, std::vector<EncodedCapture>& captures);
+
+		double _padding;
+		int _thumbnailWidth;
+		// Kept between calls, so an encoder that is kept reuses them
+		cv::Mat _bgr;
+		cv::Mat _thumbnail;
+		std::vector<int> _params;
+	};
+}
@@ -0,0 +1,62 @@
+#include "CaptureFormat.h"
+
+#include <cmath>
+#include <sstream>
+
+// Frame rates are reported as ratios; two formats this close run at the same rate
+#define FRAME_RATE_TOLERANCE 0.01
+
+namespace PetDoor
+{
+	double FaceWidthPixels(const CaptureFormat& format, const CameraGeometry& geometry)
+	{
+		const double pi = 3.14159265358979323846;
+		double halfAngle = geometry.horizontalFieldOfViewDegrees * pi / 360;
+		double seenMillimeters = 2 * geometry.doorDistanceMillimeters * std::tan(halfAngle);
+		if (seenMillimeters <= 0) return 0;
+		return format.width * geometry.faceWidthMillimeters / seenMillimeters;
+	}
+
+	double SubtypeCost(const std::string& subtype)
+	{
+		// Bytes per pixel for the raw ones; the compressed ones have to be decoded first
+		if (subtype == "NV12" || subtype == "I420" || subtype == "IYUV" || subtype == "YV12") return 0.375;
+		if (subtype == "YUY2" || subtype == "UYVY") return 0.5;
+		if (subtype == "RGB24") return 0.75;
+		if (subtype == "RGB32" || subtype == "ARGB32") return 1;
+		if (subtype == "MJPG") return 4;
+		return 8;
+	}
+
+	size_t ChooseCaptureFormat(const std::vector<CaptureFormat>& formats, const CameraGeometry& geometry, int minFacePixels)
+	{
+		size_t best = formats.size();
+		double bestCost = 0;
+		for (size_t i = 0; i < formats.size(); i++)
+		{
+			const CaptureFormat& format = formats[i];
+			if (format.framesPerSecond < geometry.minFramesPerSecond - FRAME_RATE_TOLERANCE) continue;
+			if (FaceWidthPixels(format, geometry) < minFacePixels) continue;
+
+			double pixels = static_cast<double>(format.width) * format.height;
+			double cost = pixels * format.framesPerSecond * SubtypeCost(format.subtype);
+			if (best != formats.size())
+			{
+				const CaptureFormat& chosen = formats[best];
+				double chosenPixels = static_cast<double>(chosen.width) * chosen.height;
+				if (cost > bestCost) continue;
+				if (cost == bestCost && (pixels > chosenPixels || (pixels == chosenPixels && format.framesPerSecond >= chosen.framesPerSecond))) continue;
+			}
+			best = i;
+			bestCost = cost;
+		}
+		return best;
+	}
+
+	std::string DescribeCaptureFormat(const CaptureFormat& format)
+	{
+		std::ostringstream text;
+		text << format.width << "x" << format.height << " " << std::round(format.framesPerSecond * 100) / 100 << "fps " << format.subtype;
+		return text.str();
+	}
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace PetDoor
+{
+	// One way a camera can deliver its preview
+	struct CaptureFormat
+	{
+		unsigned int width;
+		unsigned int height;
+		double framesPerSecond;
+		// The Media Foundation subtype, e.g. "NV12", "YUY2" or "MJPG"
+		std::string subtype;
+	};
+
+	// What the camera sees of a cat waiting at the door, to tell how large its face comes out
+	struct CameraGeometry
+	{
+		// A cat face, across
+		double faceWidthMillimeters = 80;
+		// The farthest a waiting cat's face is from the camera
+		double doorDistanceMillimeters = 400;
+		// Across the frame. Taken to be the same for every format, as cameras crop the
+		// height rather than the width for other aspect ratios.
+		double horizontalFieldOfViewDegrees = 60;
+		// Slower previews hold up every capture by up to a frame
+		double minFramesPerSecond = 15;
+	};
+
+	// How wide, in pixels, a cat face at the door distance comes out in this format
+	double FaceWidthPixels(const CaptureFormat& format, const CameraGeometry& geometry);
+
+	// Work per pixel of turning a frame of this subtype into Rgba8, relative to the bytes of an
+	// RGB32 pixel; compressed and unknown subtypes cost the most
+	double SubtypeCost(const std::string& subtype);
+
+	// The cheapest format in which a cat face at the door distance is still at least minFacePixels
+	// across (the detector's minimum size) and that runs at minFramesPerSecond or more. The preview
+	// converts every frame, so a format costs its pixels times its frame rate times SubtypeCost;
+	// ties go to fewer pixels, then the lower frame rate. Returns formats.size() if none qualifies,
+	// e.g. the door is too far away for the camera.
+	size_t ChooseCaptureFormat(const std::vector<CaptureFormat>& formats, const CameraGeometry& geometry, int minFacePixels);
+
+	// "640x480 30fps NV12", for the log
+	std::string DescribeCaptureFormat(const CaptureFormat& format);
+}
@@ -0,0 +1,370 @@
+#include "pch.h"
+#include "CaptureStore.h"
+#include "TimeSpanHelper.h"
+
+#include <sstream>
+
+using namespace Concurrency;
+using namespace Platform;
+using namespace Platform::Collections;
+using namespace Windows::Foundation;
+using namespace Windows::Foundation::Collections;
+using namespace Windows::Storage;
+using namespace Windows::Storage::FileProperties;
+using namespace Windows::Storage::Search;
+using namespace Windows::System::Threading;
+
+#define COMPACT_INTERVAL 15 // In seconds
+#define MAX_DELETES_PER_STEP 16
+
+namespace PetDoor
+{
+	namespace
+	{
+		const wchar_t* KindName(CaptureKind kind)
+		{
+			return kind == CaptureKind::Blocked ? L"Blocked" : L"Entry";
+		}
+	}
+
+	// folder: where the captures are written
+	// policy: budget and retention tiers enforced by the compactor
+	CaptureStore::CaptureStore(StorageFolder^ folder, CaptureRetentionPolicy policy)
+		: _folder(folder)
+		, _policy(policy)
+		, _totalBytes(0)
+		, _indexLoaded(false)
+		, _compacting(false)
+		, _work(0)
+		, _closing(false)
+	{
+		LoadIndexAsync();
+
+		Windows::Foundation::TimeSpan interval = { TimeSpanHelper::FromSeconds(COMPACT_INTERVAL).get_Ticks() };
+		_compactTimer = ThreadPoolTimer::CreatePeriodicTimer(ref new TimerElapsedHandler([this](ThreadPoolTimer^)
+		{
+			if (!BeginWork()) return;
+			CompactStep();
+			EndWork();
+		}), interval);
+	}
+
+	// The continuations run on the thread pool, never on the thread the store was made on, so this
+	// wait cannot hold up the work it waits for
+	CaptureStore::~CaptureStore()
+	{
+		// Cancel does not wait for a tick already running, nor for its deletions
+		_compactTimer->Cancel();
+		std::unique_lock<std::mutex> lock(_workLock);
+		_closing = true;
+		_workDone.wait(lock, [this]() { return _work == 0; });
+	}
+
+	bool CaptureStore::BeginWork()
+	{
+		std::lock_guard<std::mutex> lock(_workLock);
+		if (_closing) return false;
+		_work++;
+		return true;
+	}
+
+	void CaptureStore::EndWork()
+	{
+		std::lock_guard<std::mutex> lock(_workLock);
+		if (--_work == 0) _workDone.notify_all();
+	}
+
+	String^ CaptureStore::FileName(uint32_t imageId, CaptureKind kind, const std::string& part)
+	{
+		std::wstringstream name;
+		name << L"Event" << imageId << L"_" << KindName(kind) << L"_" << part.c_str();
+		return ref new String(name.str().c_str());
+	}
+
+	// Recovers the id and kind from a name made by FileName: "Event<id>_<Entry|Blocked>_<part>.<ext>",
+	// with a letters-and-digits part and extension. Anything else is not ours and is never deleted.
+	bool CaptureStore::ParseFileName(const std::wstring& name, uint32_t& imageId, CaptureKind& kind)
+	{
+		const std::wstring prefix = L"Event";
+		if (name.compare(0, prefix.size(), prefix) != 0) return false;
+
+		size_t at = prefix.size();
+		uint64_t id = 0;
+		while (at < name.size() && name[at] >= L'0' && name[at] <= L'9' && id <= UINT32_MAX)
+		{
+			id = id * 10 + (name[at] - L'0');
+			at++;
+		}
+		if (at == prefix.size() || id > UINT32_MAX) return false;
+
+		const std::wstring entry = L"_Entry_";
+		const std::wstring blocked = L"_Blocked_";
+		if (name.compare(at, entry.size(), entry) == 0)
+		{
+			kind = CaptureKind::Entry;
+			at += entry.size();
+		}
+		else if (name.compare(at, blocked.size(), blocked) == 0)
+		{
+			kind = CaptureKind::Blocked;
+			at += blocked.size();
+		}
+		else
+		{
+			return false;
+		}
+
+		size_t dot = name.find(L'.', at);
+		if (dot == std::wstring::npos || dot == at || dot + 1 == name.size()) return false;
+		for (size_t i = at; i < name.size(); i++)
+		{
+			if (i != dot && !iswalnum(name[i])) return false;
+		}
+
+		imageId = static_cast<uint32_t>(id);
+		return true;
+	}
+
+	task<StorageFile^> CaptureStore::CreateFileAsync(uint32_t imageId, CaptureKind kind, const std::string& part)
+	{
+		return create_task(_folder->CreateFileAsync(FileName(imageId, kind, part), CreationCollisionOption::ReplaceExisting));
+	}
+
+	void CaptureStore::Track(uint32_t imageId, CaptureKind kind, String^ fileName, uint64_t bytes)
+	{
+		CaptureFile file = { fileName->Data(), imageId, kind, bytes };
+
+		std::lock_guard<std::mutex> lock(_lock);
+		auto found = _byName.find(file.name);
+		if (found != _byName.end())
+		{
+			_totalBytes += bytes - found->second->second.bytes;
+			found->second->second.bytes = bytes;
+			return;
+		}
+
+		auto added = _index.emplace(CurrentTimestamp(), file);
+		_byName.emplace(file.name, added);
+		_totalBytes += bytes;
+	}
+
+	uint64_t CaptureStore::TotalBytes()
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		return _totalBytes;
+	}
+
+	size_t CaptureStore::TotalFiles()
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		return _index.size();
+	}
+
+	// Indexes the captures left by earlier runs. Runs once in the background;
+	// the compactor waits for it, saving does not.
+	task<void> CaptureStore::LoadIndexAsync()
+	{
+		auto options = ref new QueryOptions();
+		options->FolderDepth = FolderDepth::Shallow;
+		options->SetPropertyPrefetch(PropertyPrefetchOptions::BasicProperties, ref new Vector<String^>());
+		auto query = _folder->CreateFileQueryWithOptions(options);
+
+		// Ended by the last continuation, whether the load worked or not
+		BeginWork();
+		return create_task(query->GetFilesAsync())
+			.then([this](IVectorView<StorageFile^>^ files)
+		{
+			auto loaded = std::make_shared<CaptureIndex>();
+			std::vector<task<void>> propertyTasks;
+
+			for (auto file : files)
+			{
+				uint32_t imageId;
+				CaptureKind kind;
+				if (!ParseFileName(file->Name->Data(), imageId, kind)) continue;
+
+				propertyTasks.push_back(create_task(file->GetBasicPropertiesAsync())
+					.then([loaded, file, imageId, kind](BasicProperties^ properties)
+				{
+					CaptureFile capture = { file->Name->Data(), imageId, kind, properties->Size };
+					// The property lookups complete on arbitrary thread pool threads
+					static std::mutex loadLock;
+					std::lock_guard<std::mutex> lock(loadLock);
+					loaded->emplace(file->DateCreated.UniversalTime, std::move(capture));
+				}, task_continuation_context::use_arbitrary()));
+			}
+
+			return when_all(propertyTasks.begin(), propertyTasks.end())
+				.then([this, loaded]()
+			{
+				std::lock_guard<std::mutex> lock(_lock);
+				for (auto& entry : *loaded)
+				{
+					// Written and tracked while the folder was being scanned
+					if (_byName.count(entry.second.name) != 0) continue;
+
+					_totalBytes += entry.second.bytes;
+					_byName.emplace(entry.second.name, _index.insert(entry));
+				}
+				_indexLoaded = true;
+			}, task_continuation_context::use_arbitrary());
+		}, task_continuation_context::use_arbitrary()).then([this](task<void> previousTask)
+		{
+			try
+			{
+				previousTask.get();
+			}
+			catch (Exception^ ex)
+			{
+				std::wstringstream error;
+				error << "Capture index load failed: 0x" << std::hex << ex->HResult << " " << ex->Message->Data() << "\n";
+				OutputDebugString(error.str().c_str());
+
+				// Manage what gets saved from now on
+				std::lock_guard<std::mutex> lock(_lock);
+				_indexLoaded = true;
+			}
+			EndWork();
+		}, task_continuation_context::use_arbitrary());
+	}
+
+	// Picks at most MAX_DELETES_PER_STEP files, oldest first, and removes them from the index:
+	// expired entries and blocked attempts, entries past their full retention that are not the
+	// first event of their hour, then as many entries (and if need be blocked attempts) as it
+	// takes to get under budget. Must be called with _lock held.
+	void CaptureStore::SelectVictims(int64_t now, std::vector<IndexedFile>& victims)
+	{
+		const int64_t fullCutoff = now - TimeSpanHelper::FromDays(_policy.entryFullRetentionDays).get_Ticks();
+		const int64_t thinnedCutoff = now - TimeSpanHelper::FromDays(_policy.entryThinnedRetentionDays).get_Ticks();
+		const int64_t blockedCutoff = now - TimeSpanHelper::FromDays(_policy.blockedRetentionDays).get_Ticks();
+
+		uint64_t bytes = _totalBytes;
+		size_t files = _index.size();
+		auto overBudget = [&]() { return bytes > _policy.maxBytes || files > _policy.maxFiles; };
+
+		int64_t currentHour = -1;
+		uint32_t keptImageId = 0;
+
+		for (auto it = _index.begin(); it != _index.end() && victims.size() < MAX_DELETES_PER_STEP;)
+		{
+			const CaptureFile& file = it->second;
+
+			// Everything from here on is within its full retention
+			if (it->first >= fullCutoff && !overBudget()) break;
+
+			bool remove = false;
+			if (file.kind == CaptureKind::Blocked)
+			{
+				remove = it->first < blockedCutoff;
+			}
+			else if (it->first < thinnedCutoff || overBudget())
+			{
+				remove = true;
+			}
+			else if (it->first < fullCutoff)
+			{
+				// Thinned tier: keep the files of the first event in each hour
+				int64_t hour = it->first / TimeSpanHelper::TicksPerHour;
+				if (hour != currentHour)
+				{
+					currentHour = hour;
+					keptImageId = file.imageId;
+				}
+				else
+				{
+					remove = file.imageId != keptImageId;
+				}
+			}
+
+			if (remove)
+			{
+				bytes -= file.bytes;
+				files--;
+				victims.push_back(*it);
+				_byName.erase(file.name);
+				it = _index.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+
+		// Only blocked attempts left and still over budget: the oldest of them go too
+		for (auto it = _index.begin(); it != _index.end() && victims.size() < MAX_DELETES_PER_STEP && overBudget();)
+		{
+			bytes -= it->second.bytes;
+			files--;
+			victims.push_back(*it);
+			_byName.erase(it->second.name);
+			it = _index.erase(it);
+		}
+
+		_totalBytes = bytes;
+	}
+
+	void CaptureStore::CompactStep()
+	{
+		// The previous step is still deleting
+		if (_compacting.exchange(true)) return;
+
+		std::vector<IndexedFile> victims;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			if (_indexLoaded)
+			{
+				SelectVictims(CurrentTimestamp(), victims);
+			}
+		}
+
+		// Held until the last deletion is done; a store that is closing deletes nothing more
+		if (victims.empty() || !BeginWork())
+		{
+			_compacting = false;
+			return;
+		}
+
+		std::vector<task<void>> deleteTasks;
+		for (auto& victim : victims)
+		{
+			// Deleted for good, so never anything but a name FileName made
+			uint32_t imageId;
+			CaptureKind kind;
+			if (!ParseFileName(victim.second.name, imageId, kind)) continue;
+
+			deleteTasks.push_back(create_task(_folder->GetFileAsync(ref new String(victim.second.name.c_str())))
+				.then([](StorageFile^ file)
+			{
+				return create_task(file->DeleteAsync(StorageDeleteOption::PermanentDelete));
+			}, task_continuation_context::use_arbitrary()).then([this, victim](task<void> previousTask)
+			{
+				try
+				{
+					previousTask.get();
+				}
+				catch (Exception^ ex)
+				{
+					// Already gone is as good as deleted; anything else, e.g. in use, is tried again next step
+					if (ex->HResult != HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND)) Restore(victim);
+				}
+			}, task_continuation_context::use_arbitrary()));
+		}
+
+		when_all(deleteTasks.begin(), deleteTasks.end())
+			.then([this]()
+		{
+			_compacting = false;
+			EndWork();
+		}, task_continuation_context::use_arbitrary());
+	}
+
+	void CaptureStore::Restore(const IndexedFile& file)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		// Saved again under the same name meanwhile, and tracked as such
+		if (_byName.count(file.second.name) != 0) return;
+
+		_totalBytes += file.second.bytes;
+		_byName.emplace(file.second.name, _index.insert(file));
+	}
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "CaptureEncoder.h"
+#include "DoorEvent.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace PetDoor
+{
+	// Why a capture was taken; decides how long it is kept
+	enum class CaptureKind
+	{
+		// A cat was let in
+		Entry,
+		// Outdoor motion without a cat; kept longer, these are the ones worth looking at
+		Blocked
+	};
+
+	// Everything needed to persist the captures of one outdoor trigger
+	struct PendingCapture
+	{
+		uint32_t imageId = 0;
+		CaptureKind kind = CaptureKind::Entry;
+		PersistenceMode mode = PersistenceMode::FullFrame;
+		// Encoded crops and thumbnail; empty when the full frame is saved instead
+		std::vector<EncodedCapture> captures;
+		// Compressing the captures into memory, whichever encoder does it; writing them is not included
+		double encodeMilliseconds = 0;
+		// When the door decided, in Instrumentation::Now() time
+		int64_t decidedMicroseconds = 0;
+	};
+
+	struct CaptureRetentionPolicy
+	{
+		// Budget for the whole store; the oldest entries go first, then the oldest blocked attempts
+		uint64_t maxBytes = 512ULL * 1024 * 1024;
+		uint32_t maxFiles = 5000;
+		// Blocked attempts are kept this long
+		int blockedRetentionDays = 90;
+		// Entries are kept in full this long...
+		int entryFullRetentionDays = 2;
+		// ...then thinned to the first event of every hour, and dropped after this
+		int entryThinnedRetentionDays = 14;
+	};
+
+	// The captures in a folder of their own, under a byte and file budget with time
+	// based retention. Saving only adds to an in-memory index; a background compactor
+	// deletes a bounded number of files per step, so cleanup never waits on, or holds
+	// up, the detection path. Only files named exactly as FileName names them are
+	// managed; the compactor deletes them permanently, so nothing else is touched.
+	class CaptureStore
+	{
+	public:
+		// folder: used for the captures alone, e.g. a subfolder of the Pictures library
+		CaptureStore(Windows::Storage::StorageFolder^ folder, CaptureRetentionPolicy policy = CaptureRetentionPolicy());
+		// Waits for the index load and any compaction step still running
+		~CaptureStore();
+
+		Windows::Storage::StorageFolder^ Folder() const { return _folder; }
+
+		// "Event<id>_<Kind>_<part>"; ids are unique, so no collision search is needed
+		static Platform::String^ FileName(uint32_t imageId, CaptureKind kind, const std::string& part);
+
+		// Creates (or replaces) the file for one part of a capture
+		Concurrency::task<Windows::Storage::StorageFile^> CreateFileAsync(uint32_t imageId, CaptureKind kind, const std::string& part);
+
+		// Adds a written file to the index so it is counted against the budget. A file already
+		// indexed, e.g. found by the scan of the folder while it was being written, is updated.
+		void Track(uint32_t imageId, CaptureKind kind, Platform::String^ fileName, uint64_t bytes);
+
+		uint64_t TotalBytes();
+		size_t TotalFiles();
+
+	private:
+		struct CaptureFile
+		{
+			std::wstring name;
+			uint32_t imageId;
+			CaptureKind kind;
+			uint64_t bytes;
+		};
+
+		typedef std::multimap<int64_t, CaptureFile> CaptureIndex;
+		// A file and when it was written, as taken out of the index
+		typedef std::pair<int64_t, CaptureFile> IndexedFile;
+
+		static bool ParseFileName(const std::wstring& name, uint32_t& imageId, CaptureKind& kind);
+		Concurrency::task<void> LoadIndexAsync();
+		void SelectVictims(int64_t now, std::vector<IndexedFile>& victims);
+		void CompactStep();
+		// Puts back a file that could not be deleted, so it still counts and is tried again
+		void Restore(const IndexedFile& file);
+		// Bracket background work that uses the store; BeginWork returns false once it is closing
+		bool BeginWork();
+		void EndWork();
+
+		Windows::Storage::StorageFolder^ _folder;
+		CaptureRetentionPolicy _policy;
+		Windows::System::Threading::ThreadPoolTimer^ _compactTimer;
+
+		std::mutex _lock;
+		// Oldest first
+		CaptureIndex _index;
+		// Where each indexed file is in _index, so no file is indexed twice
+		std::unordered_map<std::wstring, CaptureIndex::iterator> _byName;
+		uint64_t _totalBytes;
+		bool _indexLoaded;
+
+		// Set while a step's deletions are in flight, so steps never overlap
+		std::atomic<bool> _compacting;
+
+		// The index load, timer ticks and deletions still running; the destructor waits for them
+		std::mutex _workLock;
+		std::condition_variable _workDone;
+		int _work;
+		bool _closing;
+	};
+}
@@ -0,0 +1,303 @@
+#include "ClipRecorder.h"
+#include "Instrumentation.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Frames that arrive later than this after a clip's end can no longer make it into the clip
+#define CLIP_FINISH_SLACK_MS 500
+
+namespace PetDoor
+{
+	namespace
+	{
+		// A minimal AVI of one MJPEG video stream, written front to back into one buffer
+		class AviWriter
+		{
+		public:
+			explicit AviWriter(std::vector<unsigned char>& out) : _out(out) {}
+
+			void FourCC(const char* code) { _out.insert(_out.end(), code, code + 4); }
+
+			void U16(uint16_t value)
+			{
+				_out.push_back(value & 0xff);
+				_out.push_back(value >> 8);
+			}
+
+			void U32(uint32_t value)
+			{
+				U16(value & 0xffff);
+				U16(value >> 16);
+			}
+
+			// Starts a chunk or list and returns where its size goes
+			size_t Begin(const char* code)
+			{
+				FourCC(code);
+				size_t size = _out.size();
+				U32(0);
+				return size;
+			}
+
+			void End(size_t sizeAt)
+			{
+				uint32_t size = static_cast<uint32_t>(_out.size() - sizeAt - 4);
+				for (int i = 0; i < 4; i++) _out[sizeAt + i] = (size >> (8 * i)) & 0xff;
+				if (size & 1) _out.push_back(0);
+			}
+
+		private:
+			std::vector<unsigned char>& _out;
+		};
+
+		const uint32_t AvifHasIndex = 0x10;
+		const uint32_t AviifKeyframe = 0x10;
+	}
+
+	ClipRecorder::ClipRecorder(IScheduler& scheduler, ClipRecorderOptions options)
+		: _scheduler(scheduler)
+		, _options(options)
+		, _encoder(scheduler, options.frameWidth, options.jpegQuality, [this](const EncodedFrame& frame) { OnEncoded(frame); })
+		, _ring(options.ringBytes)
+		, _ringHead(0)
+		, _frames(std::max<size_t>(options.ringFrames, 1))
+		, _oldest(0)
+		, _count(0)
+		, _firstEncoded(0)
+		, _pending()
+		, _stats()
+	{
+	}
+
+	void ClipRecorder::SetClipHandler(ClipHandler handler)
+	{
+		auto shared = std::make_shared<ClipHandler>(handler);
+		std::lock_guard<std::mutex> lock(_lock);
+		_handler = shared;
+	}
+
+	void ClipRecorder::Submit(const cv::Mat& rgba, int64_t timestampMicroseconds)
+	{
+		if (rgba.empty()) return;
+
+		bool kept = _encoder.Submit(rgba, timestampMicroseconds);
+
+		std::lock_guard<std::mutex> lock(_lock);
+		_stats.framesSubmitted++;
+		if (!kept) _stats.framesDropped++;
+	}
+
+	void ClipRecorder::OnEncoded(const EncodedFrame& frame)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		_stats.encodeMicroseconds += frame.encodeMicroseconds;
+		_stats.framesEncoded++;
+		Append(frame.jpeg, frame.timestampMicroseconds);
+		_frameSize = frame.size;
+	}
+
+	void ClipRecorder::Append(const std::vector<unsigned char>& jpeg, int64_t timestampMicroseconds)
+	{
+		size_t size = jpeg.size();
+		if (size == 0 || size > _ring.size()) return;
+
+		// Frames are never split across the end of the ring
+		if (_ringHead + size > _ring.size()) _ringHead = 0;
+
+		// Overwrite the oldest frames in the way
+		while (_count > 0)
+		{
+			const RingFrame& oldest = _frames[_oldest];
+			bool overlaps = oldest.offset < _ringHead + size && _ringHead < oldest.offset + oldest.size;
+			if (!overlaps && _count < _frames.size()) break;
+			_stats.ringBytesHeld -= oldest.size;
+			_oldest = (_oldest + 1) % _frames.size();
+			_count--;
+		}
+
+		memcpy(&_ring[_ringHead], jpeg.data(), size);
+		RingFrame& frame = _frames[(_oldest + _count) % _frames.size()];
+		frame.offset = _ringHead;
+		frame.size = size;
+		frame.timestampMicroseconds = timestampMicroseconds;
+		_count++;
+		_ringHead += size;
+
+		if (_stats.framesEncoded == 1) _firstEncoded = timestampMicroseconds;
+		_stats.recordedMicroseconds = timestampMicroseconds - _firstEncoded;
+		_stats.ringFramesHeld = _count;
+		_stats.ringBytesHeld += size;
+	}
+
+	void ClipRecorder::Trigger(uint32_t id, int64_t eventMicroseconds)
+	{
+		int64_t start = eventMicroseconds - _options.preRollMicroseconds;
+		int64_t end = eventMicroseconds + _options.postRollMicroseconds;
+
+		size_t slot = CLIP_MAX_PENDING;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			for (size_t i = 0; i < CLIP_MAX_PENDING; i++)
+			{
+				PendingClip& pending = _pending[i];
+				if (pending.active && start <= pending.endMicroseconds)
+				{
+					// Finish reschedules itself for the later end
+					pending.endMicroseconds = std::max(pending.endMicroseconds, end);
+					return;
+				}
+				if (!pending.active && slot == CLIP_MAX_PENDING) slot = i;
+			}
+			// Too many clips in flight; the event still has its still captures
+			if (slot == CLIP_MAX_PENDING) return;
+
+			PendingClip clip = { true, id, start, end };
+			_pending[slot] = clip;
+		}
+
+		_scheduler.Schedule(end - _scheduler.Now() + CLIP_FINISH_SLACK_MS * 1000, [this, slot]() { Finish(slot); });
+	}
+
+	// Puts the clip in the given slot together from the ring, once its post-roll is in
+	void ClipRecorder::Finish(size_t slot)
+	{
+		auto clip = std::make_shared<std::vector<unsigned char>>();
+		ClipInfo info = {};
+		std::shared_ptr<ClipHandler> handler;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			PendingClip& pending = _pending[slot];
+			int64_t remaining = pending.endMicroseconds + CLIP_FINISH_SLACK_MS * 1000 - _scheduler.Now();
+			if (remaining > 0)
+			{
+				_scheduler.Schedule(remaining, [this, slot]() { Finish(slot); });
+				return;
+			}
+			pending.active = false;
+
+			int64_t start = Instrumentation::Now();
+			info.id = pending.id;
+			info.startMicroseconds = pending.startMicroseconds;
+			info.endMicroseconds = pending.endMicroseconds;
+
+			size_t first = 0;
+			while (first < _count && _frames[(_oldest + first) % _frames.size()].timestampMicroseconds < pending.startMicroseconds) first++;
+			size_t last = first;
+			while (last < _count && _frames[(_oldest + last) % _frames.size()].timestampMicroseconds <= pending.endMicroseconds) last++;
+			info.frames = last - first;
+			info.truncated = _count == 0 || _frames[_oldest].timestampMicroseconds > pending.startMicroseconds;
+			if (info.frames == 0) return;
+
+			size_t payload = 0;
+			for (size_t i = first; i < last; i++) payload += _frames[(_oldest + i) % _frames.size()].size + 1;
+			clip->reserve(payload + info.frames * 24 + 512);
+
+			const RingFrame& firstFrame = _frames[(_oldest + first) % _frames.size()];
+			const RingFrame& lastFrame = _frames[(_oldest + last - 1) % _frames.size()];
+			uint32_t frameMicroseconds = info.frames > 1
+				? static_cast<uint32_t>((lastFrame.timestampMicroseconds - firstFrame.timestampMicroseconds) / (info.frames - 1))
+				: 200000;
+			frameMicroseconds = std::max<uint32_t>(frameMicroseconds, 1);
+			uint32_t frameCount = static_cast<uint32_t>(info.frames);
+			uint32_t width = static_cast<uint32_t>(_frameSize.width);
+			uint32_t height = static_cast<uint32_t>(_frameSize.height);
+
+			AviWriter avi(*clip);
+			size_t riff = avi.Begin("RIFF");
+			avi.FourCC("AVI ");
+
+			size_t hdrl = avi.Begin("LIST");
+			avi.FourCC("hdrl");
+			size_t avih = avi.Begin("avih");
+			avi.U32(frameMicroseconds);
+			avi.U32(0);
+			avi.U32(0);
+			avi.U32(AvifHasIndex);
+			avi.U32(frameCount);
+			avi.U32(0);
+			avi.U32(1);
+			avi.U32(0);
+			avi.U32(width);
+			avi.U32(height);
+			for (int i = 0; i < 4; i++) avi.U32(0);
+			avi.End(avih);
+
+			size_t strl = avi.Begin("LIST");
+			avi.FourCC("strl");
+			size_t strh = avi.Begin("strh");
+			avi.FourCC("vids");
+			avi.FourCC("MJPG");
+			avi.U32(0);
+			avi.U16(0);
+			avi.U16(0);
+			avi.U32(0);
+			// Rate over scale is frames per second
+			avi.U32(frameMicroseconds);
+			avi.U32(1000000);
+			avi.U32(0);
+			avi.U32(frameCount);
+			avi.U32(0);
+			avi.U32(0xffffffff);
+			avi.U32(0);
+			avi.U16(0);
+			avi.U16(0);
+			avi.U16(static_cast<uint16_t>(width));
+			avi.U16(static_cast<uint16_t>(height));
+			avi.End(strh);
+			size_t strf = avi.Begin("strf");
+			avi.U32(40);
+			avi.U32(width);
+			avi.U32(height);
+			avi.U16(1);
+			avi.U16(24);
+			avi.FourCC("MJPG");
+			avi.U32(width * height * 3);
+			for (int i = 0; i < 4; i++) avi.U32(0);
+			avi.End(strf);
+			avi.End(strl);
+			avi.End(hdrl);
+
+			size_t movi = avi.Begin("LIST");
+			size_t moviStart = clip->size();
+			avi.FourCC("movi");
+			std::vector<uint32_t> offsets(info.frames);
+			for (size_t i = first; i < last; i++)
+			{
+				const RingFrame& frame = _frames[(_oldest + i) % _frames.size()];
+				offsets[i - first] = static_cast<uint32_t>(clip->size() - moviStart);
+				size_t chunk = avi.Begin("00dc");
+				clip->insert(clip->end(), _ring.begin() + frame.offset, _ring.begin() + frame.offset + frame.size);
+				avi.End(chunk);
+			}
+			avi.End(movi);
+
+			size_t idx1 = avi.Begin("idx1");
+			for (size_t i = first; i < last; i++)
+			{
+				avi.FourCC("00dc");
+				avi.U32(AviifKeyframe);
+				avi.U32(offsets[i - first]);
+				avi.U32(static_cast<uint32_t>(_frames[(_oldest + i) % _frames.size()].size));
+			}
+			avi.End(idx1);
+			avi.End(riff);
+
+			_stats.clips++;
+			_stats.clipBytes += clip->size();
+			_stats.clipMicroseconds += Instrumentation::Now() - start;
+			handler = _handler;
+		}
+
+		if (handler) (*handler)(info, clip);
+	}
+
+	ClipRecorderStats ClipRecorder::Stats()
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		ClipRecorderStats stats = _stats;
+		stats.memoryBytes = _ring.size() + _frames.size() * sizeof(RingFrame)
+			+ _encoder.MemoryBytes();
+		return stats;
+	}
+}
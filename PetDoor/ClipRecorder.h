@@ -0,0 +1,129 @@
+#pragma once
+
+#include "Hal.h"
+#include "JpegFrameEncoder.h"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+// Compressed frames kept in memory; older frames are overwritten
+#define CLIP_RING_BYTES (4 * 1024 * 1024)
+#define CLIP_RING_FRAMES 256
+// Recorded before and after the event that triggers a clip
+#define CLIP_PRE_ROLL_MS 3000
+#define CLIP_POST_ROLL_MS 3000
+// Frames are scaled down to this width before they are compressed
+#define CLIP_FRAME_WIDTH 480
+#define CLIP_JPEG_QUALITY 70
+// Clips waiting for their post-roll; an event during another's post-roll extends that clip instead
+#define CLIP_MAX_PENDING 4
+
+namespace PetDoor
+{
+	struct ClipRecorderOptions
+	{
+		size_t ringBytes = CLIP_RING_BYTES;
+		size_t ringFrames = CLIP_RING_FRAMES;
+		int64_t preRollMicroseconds = CLIP_PRE_ROLL_MS * 1000;
+		int64_t postRollMicroseconds = CLIP_POST_ROLL_MS * 1000;
+		int frameWidth = CLIP_FRAME_WIDTH;
+		int jpegQuality = CLIP_JPEG_QUALITY;
+	};
+
+	// One finished clip
+	struct ClipInfo
+	{
+		uint32_t id;
+		int64_t startMicroseconds;
+		int64_t endMicroseconds;
+		size_t frames;
+		// The ring had already overwritten part of the pre-roll
+		bool truncated;
+	};
+
+	// What recording has cost so far
+	struct ClipRecorderStats
+	{
+		uint64_t framesSubmitted;
+		uint64_t framesEncoded;
+		// Replaced by a newer frame before the encoder got to them
+		uint64_t framesDropped;
+		uint64_t clips;
+		uint64_t clipBytes;
+		// Spent on the scheduler's threads, compressing frames and putting clips together
+		int64_t encodeMicroseconds;
+		int64_t clipMicroseconds;
+		// Between the first and the last frame encoded, to put the time above in proportion
+		int64_t recordedMicroseconds;
+		size_t ringFramesHeld;
+		size_t ringBytesHeld;
+		// Everything the recorder holds: the ring, its index and the frame buffers
+		size_t memoryBytes;
+	};
+
+	// Keeps the last few seconds of frames as JPEGs in a fixed-size memory ring, and on an
+	// event writes the frames from CLIP_PRE_ROLL_MS before it to CLIP_POST_ROLL_MS after it
+	// as one MJPEG AVI. Frames are compressed by a JpegFrameEncoder, and clips put together
+	// as work on the scheduler, away from the caller's thread.
+	class ClipRecorder
+	{
+	public:
+		// Called on a scheduler thread with the whole file, so it can be written in one go
+		typedef std::function<void(const ClipInfo& info, std::shared_ptr<std::vector<unsigned char>> clip)> ClipHandler;
+
+		// The recorder must outlive the work it schedules
+		ClipRecorder(IScheduler& scheduler, ClipRecorderOptions options = ClipRecorderOptions());
+
+		void SetClipHandler(ClipHandler handler);
+
+		// Queues an RGBA frame taken at timestampMicroseconds (IScheduler time) for the ring
+		void Submit(const cv::Mat& rgba, int64_t timestampMicroseconds);
+
+		// Records a clip around an event at eventMicroseconds; the handler gets it once the post-roll is in
+		void Trigger(uint32_t id, int64_t eventMicroseconds);
+
+		ClipRecorderStats Stats();
+
+	private:
+		struct RingFrame
+		{
+			size_t offset;
+			size_t size;
+			int64_t timestampMicroseconds;
+		};
+
+		struct PendingClip
+		{
+			bool active;
+			uint32_t id;
+			int64_t startMicroseconds;
+			int64_t endMicroseconds;
+		};
+
+		void OnEncoded(const EncodedFrame& frame);
+		// Must be called with _lock held
+		void Append(const std::vector<unsigned char>& jpeg, int64_t timestampMicroseconds);
+		void Finish(size_t pending);
+
+		IScheduler& _scheduler;
+		ClipRecorderOptions _options;
+		std::shared_ptr<ClipHandler> _handler;
+
+		JpegFrameEncoder _encoder;
+
+		std::mutex _lock;
+		std::vector<unsigned char> _ring;
+		size_t _ringHead;
+		// Circular, oldest at _oldest
+		std::vector<RingFrame> _frames;
+		size_t _oldest;
+		size_t _count;
+		int64_t _firstEncoded;
+		cv::Size _frameSize;
+
+		PendingClip _pending[CLIP_MAX_PENDING];
+		ClipRecorderStats _stats;
+	};
+}
@@ -0,0 +1,243 @@
+#include "DetectorPool.h"
+
+#include <algorithm>
+
+// A camera's pass grows by this over its weight with every detection it gets
+#define DETECTOR_POOL_STRIDE 1000000
+
+namespace PetDoor
+{
+	namespace
+	{
+		const size_t NoWorker = static_cast<size_t>(-1);
+
+		int Index(DetectionPriority priority)
+		{
+			return static_cast<int>(priority);
+		}
+	}
+
+	DetectorPool::DetectorPool(IScheduler& scheduler, size_t workers, Detector detector)
+		: _scheduler(scheduler)
+		, _detector(detector)
+		, _workerCount(std::max<size_t>(workers, 1))
+		, _workers(new Worker[std::max<size_t>(workers, 1)])
+		, _passFloor(0)
+		, _stats()
+	{
+		for (size_t i = 0; i < _workerCount; i++)
+		{
+			Worker& worker = _workers[i];
+			worker.busy = false;
+			worker.source = 0;
+			worker.priority = DetectionPriority::Background;
+			worker.requestedMicroseconds = 0;
+			worker.startedMicroseconds = 0;
+			worker.preemptions = 0;
+			worker.cancel = false;
+		}
+	}
+
+	size_t DetectorPool::AddSource(IFrameSource& camera, int weight)
+	{
+		Source source = {};
+		source.camera = &camera;
+		source.stride = DETECTOR_POOL_STRIDE / std::max(weight, 1);
+
+		std::lock_guard<std::mutex> lock(_lock);
+		_sources.push_back(source);
+		return _sources.size() - 1;
+	}
+
+	void DetectorPool::SetResultHandler(DetectionPriority priority, ResultHandler handler)
+	{
+		_handlers[Index(priority)] = std::make_shared<ResultHandler>(handler);
+	}
+
+	DetectorPoolStats DetectorPool::Stats()
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		return _stats;
+	}
+
+	bool DetectorPool::Request(size_t source, DetectionPriority priority, int64_t requestedMicroseconds)
+	{
+		if (source >= _sources.size() || !_sources[source].camera->IsReady()) return false;
+
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			Source& camera = _sources[source];
+			Waiting& waiting = camera.waiting[Index(priority)];
+			if (waiting.waiting)
+			{
+				// The first waiting request is kept for the latency
+				_stats.coalesced[Index(priority)]++;
+				return true;
+			}
+
+			bool idle = !camera.running && !camera.waiting[0].waiting && !camera.waiting[1].waiting;
+			if (idle) camera.pass = std::max(camera.pass, _passFloor);
+			waiting.waiting = true;
+			waiting.requestedMicroseconds = requestedMicroseconds;
+			waiting.preemptions = 0;
+
+			if (priority == DetectionPriority::Entry) PreemptFor(source);
+		}
+
+		StartWaiting();
+		return true;
+	}
+
+	// Cancels a background detection if the entry request on source would otherwise have to wait for one
+	void DetectorPool::PreemptFor(size_t source)
+	{
+		Worker* victim = nullptr;
+		size_t freeWorkers = 0;
+		size_t cancelled = 0;
+		for (size_t i = 0; i < _workerCount; i++)
+		{
+			Worker& worker = _workers[i];
+			if (!worker.busy)
+			{
+				freeWorkers++;
+				continue;
+			}
+			if (worker.priority != DetectionPriority::Background) continue;
+			if (worker.cancel)
+			{
+				cancelled++;
+				continue;
+			}
+
+			// The camera's own background scan always goes; otherwise the one started last has lost the least
+			if (worker.source == source)
+			{
+				worker.cancel = true;
+				_stats.preempted++;
+				return;
+			}
+			if (!victim || worker.startedMicroseconds > victim->startedMicroseconds) victim = &worker;
+		}
+
+		size_t entriesWaiting = 0;
+		for (auto& camera : _sources)
+		{
+			if (camera.waiting[Index(DetectionPriority::Entry)].waiting && !camera.running) entriesWaiting++;
+		}
+
+		if (victim && entriesWaiting > freeWorkers + cancelled)
+		{
+			victim->cancel = true;
+			_stats.preempted++;
+		}
+	}
+
+	// Hands the next request to a free worker and returns the worker, or NoWorker if there is no free worker or no runnable request
+	size_t DetectorPool::TakeRequest()
+	{
+		size_t free = NoWorker;
+		for (size_t i = 0; i < _workerCount && free == NoWorker; i++)
+		{
+			if (!_workers[i].busy) free = i;
+		}
+		if (free == NoWorker) return NoWorker;
+
+		for (int priority = Index(DetectionPriority::Entry); priority >= 0; priority--)
+		{
+			Source* next = nullptr;
+			for (auto& camera : _sources)
+			{
+				if (camera.running || !camera.waiting[priority].waiting) continue;
+				if (!next || camera.pass < next->pass) next = &camera;
+			}
+			if (!next) continue;
+
+			Worker& worker = _workers[free];
+			Waiting& waiting = next->waiting[priority];
+			worker.busy = true;
+			worker.source = next - _sources.data();
+			worker.priority = static_cast<DetectionPriority>(priority);
+			worker.requestedMicroseconds = waiting.requestedMicroseconds;
+			worker.startedMicroseconds = _scheduler.Now();
+			worker.preemptions = waiting.preemptions;
+			worker.cancel = false;
+
+			waiting.waiting = false;
+			next->running = true;
+			_passFloor = next->pass;
+			next->pass += next->stride;
+			return free;
+		}
+		return NoWorker;
+	}
+
+	// Starts every request a worker is free for. Captures start without the lock, as the camera may call back right away.
+	void DetectorPool::StartWaiting()
+	{
+		for (;;)
+		{
+			size_t worker;
+			{
+				std::lock_guard<std::mutex> lock(_lock);
+				worker = TakeRequest();
+			}
+			if (worker == NoWorker) return;
+
+			// Small enough for std::function to store inline, so a capture does not allocate
+			_sources[_workers[worker].source].camera->CaptureAsync([this, worker](cv::Mat& frame)
+			{
+				OnFrame(worker, frame);
+			});
+		}
+	}
+
+	void DetectorPool::OnFrame(size_t index, cv::Mat& frame)
+	{
+		Worker& worker = _workers[index];
+		worker.objects.clear();
+		bool finished = !frame.empty() && _detector(index, worker.source, frame, worker.objects, worker.cancel);
+
+		PooledDetection detection = { worker.source, worker.priority, worker.requestedMicroseconds, worker.startedMicroseconds,
+			_scheduler.Now(), worker.preemptions };
+
+		// The worker stays busy while the handler has its frame and objects
+		if (finished)
+		{
+			std::shared_ptr<ResultHandler> handler = _handlers[Index(worker.priority)];
+			if (handler) (*handler)(detection, frame, worker.objects);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			Source& camera = _sources[worker.source];
+			_stats.busyMicroseconds += detection.finishedMicroseconds - detection.startedMicroseconds;
+			if (finished)
+			{
+				_stats.completed[Index(worker.priority)]++;
+			}
+			else if (frame.empty() || !worker.cancel)
+			{
+				_stats.failedCaptures++;
+			}
+			else
+			{
+				// Preempted: wait again, merged with any request made since
+				Waiting& waiting = camera.waiting[Index(worker.priority)];
+				if (waiting.waiting)
+				{
+					waiting.requestedMicroseconds = std::min(waiting.requestedMicroseconds, worker.requestedMicroseconds);
+				}
+				else
+				{
+					waiting.waiting = true;
+					waiting.requestedMicroseconds = worker.requestedMicroseconds;
+				}
+				waiting.preemptions = worker.preemptions + 1;
+			}
+			camera.running = false;
+			worker.busy = false;
+		}
+
+		StartWaiting();
+	}
+}
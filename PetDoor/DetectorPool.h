@@ -0,0 +1,137 @@
+#pragma once
+
+#include "Hal.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace PetDoor
+{
+	// Entry detections decide whether the door opens for a cat waiting outside.
+	// Background ones, such as scans of a camera on the indoor side, can wait.
+	enum class DetectionPriority
+	{
+		Background = 0,
+		Entry = 1
+	};
+
+	// One finished detection and when (IScheduler time) it went through each step
+	struct PooledDetection
+	{
+		size_t source;
+		DetectionPriority priority;
+		// The first request it answers; requests made while it waited were coalesced into it
+		int64_t requestedMicroseconds;
+		// A worker took it and asked the camera for a frame
+		int64_t startedMicroseconds;
+		int64_t finishedMicroseconds;
+		// How often it was preempted by entry detections and started over
+		int preemptions;
+	};
+
+	// Counts since the pool was created, by DetectionPriority
+	struct DetectorPoolStats
+	{
+		uint64_t completed[2];
+		uint64_t coalesced[2];
+		// Background detections cancelled to make room for an entry detection
+		uint64_t preempted;
+		// Captures that gave no frame, or that the detector gave up on uncancelled; nothing was decided on them
+		uint64_t failedCaptures;
+		// Summed over the workers, from taking a request to finishing it
+		int64_t busyMicroseconds;
+	};
+
+	// A fixed number of workers running detections for several cameras. Each camera
+	// has at most one request waiting per priority, and requests made while one waits
+	// are coalesced into it, so the queue is bounded by the number of cameras. A camera
+	// runs one detection at a time, on a frame captured when a worker takes the request.
+	//
+	// Free workers take entry requests first. Among the cameras waiting at the same
+	// priority they go to the one with the lowest pass, which grows by the inverse of
+	// the camera's weight with every detection (stride scheduling), so each camera
+	// gets its share and a busy camera cannot starve a quiet one. An entry request
+	// that finds no worker preempts a background detection: its cancel flag is set,
+	// the detector gives up at its next check, and the request waits again.
+	class DetectorPool
+	{
+	public:
+		// Runs on the worker's thread; returns false if it stopped because cancel was set.
+		// worker is below WorkerCount(), so each worker can keep its own detector and scratch.
+		typedef std::function<bool(size_t worker, size_t source, cv::Mat& rgba, std::vector<cv::Rect>& objects, const std::atomic<bool>& cancel)> Detector;
+
+		// Called after every detection that ran to the end, outside the pool's lock. The
+		// frame and objects belong to the worker and are only valid for the call.
+		typedef std::function<void(const PooledDetection& detection, cv::Mat& frame, std::vector<cv::Rect>& objects)> ResultHandler;
+
+		// The pool must outlive every capture it has started
+		DetectorPool(IScheduler& scheduler, size_t workers, Detector detector);
+
+		// Add cameras, and set the handlers, before the first request; cameras must outlive
+		// the pool. A camera of weight 2 gets twice the share of one of weight 1 when both
+		// are waiting. Returns the camera's index for Request.
+		size_t AddSource(IFrameSource& camera, int weight = 1);
+		void SetResultHandler(DetectionPriority priority, ResultHandler handler);
+
+		size_t SourceCount() const { return _sources.size(); }
+		size_t WorkerCount() const { return _workerCount; }
+
+		// Asks for a detection on a fresh frame from a camera. Returns false if the camera
+		// is not ready, in which case nothing is queued.
+		bool Request(size_t source, DetectionPriority priority, int64_t requestedMicroseconds);
+
+		DetectorPoolStats Stats();
+
+	private:
+		struct Waiting
+		{
+			bool waiting;
+			int64_t requestedMicroseconds;
+			int preemptions;
+		};
+
+		struct Source
+		{
+			IFrameSource* camera;
+			int64_t stride;
+			int64_t pass;
+			bool running;
+			// By DetectionPriority
+			Waiting waiting[2];
+		};
+
+		struct Worker
+		{
+			bool busy;
+			size_t source;
+			DetectionPriority priority;
+			int64_t requestedMicroseconds;
+			int64_t startedMicroseconds;
+			int preemptions;
+			std::atomic<bool> cancel;
+			std::vector<cv::Rect> objects;
+		};
+
+		// Must be called with _lock held
+		void PreemptFor(size_t source);
+		size_t TakeRequest();
+
+		void StartWaiting();
+		void OnFrame(size_t worker, cv::Mat& frame);
+
+		IScheduler& _scheduler;
+		Detector _detector;
+		std::shared_ptr<ResultHandler> _handlers[2];
+		size_t _workerCount;
+		std::unique_ptr<Worker[]> _workers;
+
+		std::mutex _lock;
+		std::vector<Source> _sources;
+		// The pass of the last camera served; one that starts waiting after a quiet
+		// spell starts from here rather than from where it left off
+		int64_t _passFloor;
+		DetectorPoolStats _stats;
+	};
+}
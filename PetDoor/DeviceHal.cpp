@@ -0,0 +1,300 @@
+#include "pch.h"
+#include "DeviceHal.h"
+#include "Instrumentation.h"
+
+#include <sstream>
+#include <MemoryBuffer.h>   // IMemoryBufferByteAccess
+#include <wrl/client.h>
+
+using namespace Concurrency;
+using namespace Microsoft::WRL;
+using namespace Platform;
+using namespace Windows::Foundation;
+using namespace Windows::Graphics::Imaging;
+using namespace Windows::Media;
+using namespace Windows::Media::Capture;
+using namespace Windows::System::Threading;
+
+namespace PetDoor
+{
+	namespace
+	{
+		inline void ThrowIfFailed(HRESULT hr)
+		{
+			if (FAILED(hr))
+			{
+				throw Platform::Exception::CreateException(hr);
+			}
+		}
+
+		// Copies an Rgba8 SoftwareBitmap into frame straight from the bitmap's own
+		// buffer, row by row as the stride may be padded
+		void SoftwareBitmapToMat(SoftwareBitmap^ image, cv::Mat& frame)
+		{
+			frame.create(image->PixelHeight, image->PixelWidth, CV_8UC4);
+
+			BitmapBuffer^ buffer = image->LockBuffer(BitmapBufferAccessMode::Read);
+			IMemoryBufferReference^ reference = buffer->CreateReference();
+
+			ComPtr<IMemoryBufferByteAccess> byteAccess;
+			ThrowIfFailed(reinterpret_cast<IInspectable*>(reference)->QueryInterface(IID_PPV_ARGS(&byteAccess)));
+
+			BYTE* pixels = nullptr;
+			UINT32 capacity = 0;
+			ThrowIfFailed(byteAccess->GetBuffer(&pixels, &capacity));
+
+			BitmapPlaneDescription plane = buffer->GetPlaneDescription(0);
+			size_t rowBytes = frame.cols * frame.elemSize();
+			for (int row = 0; row < frame.rows; row++)
+			{
+				memcpy(frame.ptr(row), pixels + plane.StartIndex + row * plane.Stride, rowBytes);
+			}
+
+			// IClosable.Close projects into CX as operator delete; this unlocks the bitmap
+			delete reference;
+			delete buffer;
+		}
+	}
+
+	MotionSensorInput::MotionSensorInput(int pin)
+		: _sensor(ref new MotionSensor(pin))
+	{
+		_motionDetectedToken = _sensor->MotionDetected += ref new MotionDetectedEventHandler([this](Object^, String^)
+		{
+			EdgeHandler handler;
+			{
+				std::lock_guard<std::mutex> lock(_handlerLock);
+				handler = _handler;
+			}
+			if (handler) handler(_sensor->LastEdgeMicroseconds);
+		});
+	}
+
+	MotionSensorInput::~MotionSensorInput()
+	{
+		_sensor->MotionDetected -= _motionDetectedToken;
+	}
+
+	bool MotionSensorInput::Read()
+	{
+		return _sensor->GetPinValue() == Windows::Devices::Gpio::GpioPinValue::High;
+	}
+
+	void MotionSensorInput::SetRisingEdgeHandler(EdgeHandler handler)
+	{
+		std::lock_guard<std::mutex> lock(_handlerLock);
+		_handler = handler;
+	}
+
+	MediaCaptureFrameSource::MediaCaptureFrameSource()
+		: _previewing(false)
+	{
+	}
+
+	void MediaCaptureFrameSource::Attach(MediaCapture^ mediaCapture)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		_mediaCapture = mediaCapture;
+		_previewing = true;
+	}
+
+	void MediaCaptureFrameSource::Detach()
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		_previewing = false;
+		_mediaCapture = nullptr;
+	}
+
+	std::shared_ptr<MediaCaptureFrameSource::CaptureBuffers> MediaCaptureFrameSource::TakeBuffers(unsigned int width, unsigned int height)
+	{
+		std::shared_ptr<CaptureBuffers> buffers;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			buffers.swap(_spareBuffers);
+		}
+
+		// A new preview resolution needs a new frame; the Mat is resized when it is filled
+		if (!buffers)
+		{
+			buffers = std::make_shared<CaptureBuffers>();
+		}
+		SoftwareBitmap^ bitmap = buffers->videoFrame != nullptr ? buffers->videoFrame->SoftwareBitmap : nullptr;
+		if (bitmap == nullptr || bitmap->PixelWidth != static_cast<int>(width) || bitmap->PixelHeight != static_cast<int>(height))
+		{
+			buffers->videoFrame = ref new VideoFrame(BitmapPixelFormat::Rgba8, width, height);
+		}
+		return buffers;
+	}
+
+	void MediaCaptureFrameSource::ReturnBuffers(std::shared_ptr<CaptureBuffers> buffers)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		if (!_spareBuffers) _spareBuffers = buffers;
+	}
+
+	void MediaCaptureFrameSource::CaptureAsync(FrameHandler handler)
+	{
+		MediaCapture^ mediaCapture;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			mediaCapture = _mediaCapture.Get();
+		}
+
+		if (mediaCapture == nullptr)
+		{
+			cv::Mat noFrame;
+			handler(noFrame);
+			return;
+		}
+
+		// Get information about the preview
+		auto previewProperties = static_cast<MediaProperties::VideoEncodingProperties^>(mediaCapture->VideoDeviceController->GetMediaStreamProperties(MediaStreamType::VideoPreview));
+
+		// The video frame to request a SoftwareBitmap preview frame into
+		auto buffers = TakeBuffers(previewProperties->Width, previewProperties->Height);
+
+		// Capture the preview frame
+		int64_t frameRequested = Instrumentation::Now();
+		create_task(mediaCapture->GetPreviewFrameAsync(buffers->videoFrame))
+			.then([this, handler, buffers, frameRequested](task<VideoFrame^> previousTask)
+		{
+			cv::Mat& frame = buffers->frame;
+			try
+			{
+				VideoFrame^ currentFrame = previousTask.get();
+				PETDOOR_RECORD_SPAN(Stage::GetPreviewFrame, frameRequested);
+				PETDOOR_TIME_STAGE(Stage::SoftwareBitmapToMat);
+				SoftwareBitmapToMat(currentFrame->SoftwareBitmap, frame);
+			}
+			catch (Platform::Exception^ ex)
+			{
+				std::wstringstream error;
+				error << "Preview frame capture failed: 0x" << std::hex << ex->HResult << " " << ex->Message->Data() << "\n";
+				OutputDebugString(error.str().c_str());
+
+				// The frame may be half written; the next capture starts from fresh buffers
+				cv::Mat noFrame;
+				handler(noFrame);
+				return;
+			}
+
+			// The handler is done with the frame when it returns, so both buffers can go to the next capture
+			handler(frame);
+			ReturnBuffers(buffers);
+		});
+	}
+
+	MediaCapturePreviewFormats::MediaCapturePreviewFormats(MediaCapture^ mediaCapture)
+		: _mediaCapture(mediaCapture)
+	{
+		// Cameras may list photo or compressed-only types among them; only video types have a frame size and rate
+		auto available = mediaCapture->VideoDeviceController->GetAvailableMediaStreamProperties(MediaStreamType::VideoPreview);
+		for (auto properties : available)
+		{
+			auto video = dynamic_cast<MediaProperties::VideoEncodingProperties^>(properties);
+			if (video == nullptr || video->Width == 0 || video->Height == 0) continue;
+			_formats.push_back(ToCaptureFormat(video));
+			_properties.push_back(video);
+		}
+	}
+
+	CaptureFormat MediaCapturePreviewFormats::ToCaptureFormat(MediaProperties::VideoEncodingProperties^ properties)
+	{
+		CaptureFormat format;
+		format.width = properties->Width;
+		format.height = properties->Height;
+		unsigned int denominator = properties->FrameRate->Denominator;
+		format.framesPerSecond = denominator != 0 ? static_cast<double>(properties->FrameRate->Numerator) / denominator : 0;
+		std::wstring subtype(properties->Subtype->Data());
+		format.subtype = std::string(subtype.begin(), subtype.end());
+		return format;
+	}
+
+	CaptureFormat MediaCapturePreviewFormats::Current() const
+	{
+		auto properties = static_cast<MediaProperties::VideoEncodingProperties^>(_mediaCapture->VideoDeviceController->GetMediaStreamProperties(MediaStreamType::VideoPreview));
+		return ToCaptureFormat(properties);
+	}
+
+	task<void> MediaCapturePreviewFormats::SelectAsync(size_t index)
+	{
+		return create_task(_mediaCapture->VideoDeviceController->SetMediaStreamPropertiesAsync(MediaStreamType::VideoPreview, _properties[index]));
+	}
+
+	ThreadPoolScheduler::ThreadPoolScheduler()
+		: _state(std::make_shared<State>())
+	{
+	}
+
+	ThreadPoolScheduler::~ThreadPoolScheduler()
+	{
+		Close();
+	}
+
+	int64_t ThreadPoolScheduler::Now()
+	{
+		return Instrumentation::Now();
+	}
+
+	void ThreadPoolScheduler::Schedule(int64_t delayMicroseconds, Work work)
+	{
+		std::shared_ptr<State> state = _state;
+		if (delayMicroseconds <= 0)
+		{
+			ThreadPool::RunAsync(ref new WorkItemHandler([state, work](IAsyncAction^)
+			{
+				Run(state, work);
+			}));
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(state->lock);
+		if (state->closing) return;
+		uint64_t id = state->nextTimer++;
+
+		// TimeSpan is in 100ns ticks
+		Windows::Foundation::TimeSpan delay = { delayMicroseconds * 10 };
+		state->timers[id] = ThreadPoolTimer::CreateTimer(ref new TimerElapsedHandler([state, work, id](ThreadPoolTimer^)
+		{
+			{
+				std::lock_guard<std::mutex> lock(state->lock);
+				state->timers.erase(id);
+			}
+			Run(state, work);
+		}), delay);
+	}
+
+	void ThreadPoolScheduler::SchedulePeriodic(Windows::Foundation::TimeSpan period, Work work)
+	{
+		std::shared_ptr<State> state = _state;
+		std::lock_guard<std::mutex> lock(state->lock);
+		if (state->closing) return;
+		state->timers[state->nextTimer++] = ThreadPoolTimer::CreatePeriodicTimer(ref new TimerElapsedHandler([state, work](ThreadPoolTimer^)
+		{
+			Run(state, work);
+		}), period);
+	}
+
+	void ThreadPoolScheduler::Run(const std::shared_ptr<State>& state, const Work& work)
+	{
+		{
+			std::lock_guard<std::mutex> lock(state->lock);
+			if (state->closing) return;
+			state->running++;
+		}
+
+		work();
+
+		std::lock_guard<std::mutex> lock(state->lock);
+		if (--state->running == 0) state->idle.notify_all();
+	}
+
+	void ThreadPoolScheduler::Close()
+	{
+		std::unique_lock<std::mutex> lock(_state->lock);
+		_state->closing = true;
+		for (auto& timer : _state->timers) timer.second->Cancel();
+		_state->timers.clear();
+		_state->idle.wait(lock, [this]() { return _state->running == 0; });
+	}
+}
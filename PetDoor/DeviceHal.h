@@ -0,0 +1,139 @@
+#pragma once
+
+#include "CaptureFormat.h"
+#include "Hal.h"
+#include "MotionSensor.h"
+#include "Servo.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+
+// Hal.h back-ends for the device: Lightning GPIO and PWM, MediaCapture and the thread pool
+namespace PetDoor
+{
+	// A PIR sensor, through MotionSensor
+	class MotionSensorInput : public IDigitalInput
+	{
+	public:
+		// pin: GPIO pin connected to the motion sensor
+		explicit MotionSensorInput(int pin);
+		~MotionSensorInput();
+
+		bool Read() override;
+		void SetRisingEdgeHandler(EdgeHandler handler) override;
+
+	private:
+		MotionSensor^ _sensor;
+		Windows::Foundation::EventRegistrationToken _motionDetectedToken;
+		std::mutex _handlerLock;
+		EdgeHandler _handler;
+	};
+
+	// A servo on the PCA9685, through Servo
+	class ServoChannel : public IPwmChannel
+	{
+	public:
+		// pin: the channel on the PCA9685 connected to this servo
+		explicit ServoChannel(int pin) : _servo(ref new Servo(pin)) {}
+
+		void SetDutyCycle(double dutyCyclePercentage) override { _servo->Rotate(dutyCyclePercentage); }
+		void Stop() override { _servo->Stop(); }
+
+	private:
+		Servo^ _servo;
+	};
+
+	// Preview frames from MediaCapture. The page attaches the capture once the
+	// preview is running and detaches it before stopping it.
+	class MediaCaptureFrameSource : public IFrameSource
+	{
+	public:
+		MediaCaptureFrameSource();
+
+		void Attach(Windows::Media::Capture::MediaCapture^ mediaCapture);
+		void Detach();
+
+		bool IsReady() override { return _previewing; }
+		void CaptureAsync(FrameHandler handler) override;
+
+	private:
+		// The VideoFrame the preview is copied into and the Mat it is converted
+		// to. One set is kept between captures and reused while the preview size
+		// stays the same; overlapping captures get a set of their own.
+		struct CaptureBuffers
+		{
+			Windows::Media::VideoFrame^ videoFrame;
+			cv::Mat frame;
+		};
+
+		std::shared_ptr<CaptureBuffers> TakeBuffers(unsigned int width, unsigned int height);
+		void ReturnBuffers(std::shared_ptr<CaptureBuffers> buffers);
+
+		std::mutex _lock;
+		Platform::Agile<Windows::Media::Capture::MediaCapture^> _mediaCapture;
+		std::atomic<bool> _previewing;
+		std::shared_ptr<CaptureBuffers> _spareBuffers;
+	};
+
+	// The preview formats a MediaCapture offers, as CaptureFormats for ChooseCaptureFormat, and the
+	// stream properties behind each. Read once, after the capture is initialized.
+	class MediaCapturePreviewFormats
+	{
+	public:
+		explicit MediaCapturePreviewFormats(Windows::Media::Capture::MediaCapture^ mediaCapture);
+
+		const std::vector<CaptureFormat>& Available() const { return _formats; }
+
+		// The format the preview runs in now
+		CaptureFormat Current() const;
+
+		// Switches the preview to Available()[index]; done before the preview starts, so it starts in it
+		Concurrency::task<void> SelectAsync(size_t index);
+
+	private:
+		static CaptureFormat ToCaptureFormat(Windows::Media::MediaProperties::VideoEncodingProperties^ properties);
+
+		Platform::Agile<Windows::Media::Capture::MediaCapture^> _mediaCapture;
+		std::vector<CaptureFormat> _formats;
+		std::vector<Windows::Media::MediaProperties::VideoEncodingProperties^> _properties;
+	};
+
+	// Runs work on the thread pool, delayed work from a one-shot ThreadPoolTimer and periodic
+	// work from a periodic one
+	class ThreadPoolScheduler : public IScheduler
+	{
+	public:
+		ThreadPoolScheduler();
+		~ThreadPoolScheduler();
+
+		int64_t Now() override;
+		void Schedule(int64_t delayMicroseconds, Work work) override;
+
+		// Runs work every period until Close
+		void SchedulePeriodic(Windows::Foundation::TimeSpan period, Work work);
+
+		// Stops the periodic work, drops the work not yet started, delayed or not, and any scheduled
+		// from now on, then waits for the work already running. After it returns nothing scheduled
+		// here runs again.
+		void Close();
+
+	private:
+		// Outlives the scheduler in the work items and timers that have not run yet
+		struct State
+		{
+			std::mutex lock;
+			std::condition_variable idle;
+			int running = 0;
+			bool closing = false;
+			uint64_t nextTimer = 0;
+			std::map<uint64_t, Windows::System::Threading::ThreadPoolTimer^> timers;
+		};
+
+		static void Run(const std::shared_ptr<State>& state, const Work& work);
+
+		std::shared_ptr<State> _state;
+	};
+}
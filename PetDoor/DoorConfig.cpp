@@ -0,0 +1,237 @@
+#include "DoorConfig.h"
+
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+#include <sstream>
+
+namespace PetDoor
+{
+	namespace
+	{
+		// One setting in the file, read and written as a double. Integer settings must be whole.
+		struct Field
+		{
+			const char* name;
+			double min;
+			double max;
+			bool integer;
+			// "none" stands for -DBL_MAX, i.e. no limit
+			bool allowNone;
+			double(*get)(const DoorConfig& config);
+			void(*set)(DoorConfig& config, double value);
+		};
+
+		const Field Fields[] =
+		{
+			{ "detection.scaleFactor", 1.01, 2.0, false, false,
+				[](const DoorConfig& c) { return c.detection.scaleFactor; }, [](DoorConfig& c, double v) { c.detection.scaleFactor = v; } },
+			{ "detection.catMinNeighbors", 0, 50, true, false,
+				[](const DoorConfig& c) { return double(c.detection.cat.minNeighbors); }, [](DoorConfig& c, double v) { c.detection.cat.minNeighbors = int(v); } },
+			{ "detection.catMinSize", 20, 2000, true, false,
+				[](const DoorConfig& c) { return double(c.detection.cat.minSize.width); }, [](DoorConfig& c, double v) { c.detection.cat.minSize = cv::Size(int(v), int(v)); } },
+			// 0 looks for cats up to the whole frame
+			{ "detection.catMaxSize", 0, 4000, true, false,
+				[](const DoorConfig& c) { return double(c.detection.cat.maxSize.width); }, [](DoorConfig& c, double v) { c.detection.cat.maxSize = cv::Size(int(v), int(v)); } },
+			{ "detection.humanMinNeighbors", 0, 50, true, false,
+				[](const DoorConfig& c) { return double(c.detection.human.minNeighbors); }, [](DoorConfig& c, double v) { c.detection.human.minNeighbors = int(v); } },
+			{ "detection.humanMinSize", 20, 2000, true, false,
+				[](const DoorConfig& c) { return double(c.detection.human.minSize.width); }, [](DoorConfig& c, double v) { c.detection.human.minSize = cv::Size(int(v), int(v)); } },
+			{ "detection.minConfidence", -1000, 1000, false, true,
+				[](const DoorConfig& c) { return c.detection.minConfidence; }, [](DoorConfig& c, double v) { c.detection.minConfidence = v; } },
+			{ "door.servoTravelMs", 100, 5000, true, false,
+				[](const DoorConfig& c) { return double(c.timing.servoTravelMicroseconds / 1000); }, [](DoorConfig& c, double v) { c.timing.servoTravelMicroseconds = int64_t(v) * 1000; } },
+			{ "door.stayOpenMs", 500, 60000, true, false,
+				[](const DoorConfig& c) { return double(c.timing.stayOpenMicroseconds / 1000); }, [](DoorConfig& c, double v) { c.timing.stayOpenMicroseconds = int64_t(v) * 1000; } },
+			// Duty cycles; a servo on 50 Hz PWM moves between about 0.01 and 0.15, and Servo::Rotate throws above 0.15
+			{ "servo.leftOpen", 0.005, 0.15, false, false,
+				[](const DoorConfig& c) { return c.positions.leftOpen; }, [](DoorConfig& c, double v) { c.positions.leftOpen = v; } },
+			{ "servo.rightOpen", 0.005, 0.15, false, false,
+				[](const DoorConfig& c) { return c.positions.rightOpen; }, [](DoorConfig& c, double v) { c.positions.rightOpen = v; } },
+			{ "servo.leftClosed", 0.005, 0.15, false, false,
+				[](const DoorConfig& c) { return c.positions.leftClosed; }, [](DoorConfig& c, double v) { c.positions.leftClosed = v; } },
+			{ "servo.rightClosed", 0.005, 0.15, false, false,
+				[](const DoorConfig& c) { return c.positions.rightClosed; }, [](DoorConfig& c, double v) { c.positions.rightClosed = v; } },
+			{ "pins.outdoorSensor", 0, 40, true, false,
+				[](const DoorConfig& c) { return double(c.pins.outdoorSensor); }, [](DoorConfig& c, double v) { c.pins.outdoorSensor = int(v); } },
+			{ "pins.indoorSensor", 0, 40, true, false,
+				[](const DoorConfig& c) { return double(c.pins.indoorSensor); }, [](DoorConfig& c, double v) { c.pins.indoorSensor = int(v); } },
+			// Channels of the PCA9685
+			{ "pins.leftServo", 0, 15, true, false,
+				[](const DoorConfig& c) { return double(c.pins.leftServo); }, [](DoorConfig& c, double v) { c.pins.leftServo = int(v); } },
+			{ "pins.rightServo", 0, 15, true, false,
+				[](const DoorConfig& c) { return double(c.pins.rightServo); }, [](DoorConfig& c, double v) { c.pins.rightServo = int(v); } },
+			// 1 serves the stream, 0 does not
+			{ "stream.enabled", 0, 1, true, false,
+				[](const DoorConfig& c) { return double(c.stream.enabled); }, [](DoorConfig& c, double v) { c.stream.enabled = v != 0; } },
+			{ "camera.faceWidthMm", 20, 300, false, false,
+				[](const DoorConfig& c) { return c.camera.faceWidthMillimeters; }, [](DoorConfig& c, double v) { c.camera.faceWidthMillimeters = v; } },
+			{ "camera.doorDistanceMm", 50, 5000, false, false,
+				[](const DoorConfig& c) { return c.camera.doorDistanceMillimeters; }, [](DoorConfig& c, double v) { c.camera.doorDistanceMillimeters = v; } },
+			{ "camera.fieldOfViewDegrees", 10, 170, false, false,
+				[](const DoorConfig& c) { return c.camera.horizontalFieldOfViewDegrees; }, [](DoorConfig& c, double v) { c.camera.horizontalFieldOfViewDegrees = v; } },
+			{ "camera.minFramesPerSecond", 1, 120, false, false,
+				[](const DoorConfig& c) { return c.camera.minFramesPerSecond; }, [](DoorConfig& c, double v) { c.camera.minFramesPerSecond = v; } },
+		};
+
+		std::string Trim(const std::string& text)
+		{
+			size_t first = text.find_first_not_of(" \t\r");
+			if (first == std::string::npos) return std::string();
+			return text.substr(first, text.find_last_not_of(" \t\r") - first + 1);
+		}
+
+		// Settings that are each in range but do not work together
+		bool CheckTogether(const DoorConfig& config, std::string& error)
+		{
+			const DetectionSettings& detection = config.detection;
+			if (detection.cat.maxSize.width != 0 && detection.cat.maxSize.width < detection.cat.minSize.width)
+			{
+				error = "detection.catMaxSize is below detection.catMinSize";
+				return false;
+			}
+			if (config.pins.outdoorSensor == config.pins.indoorSensor)
+			{
+				error = "pins.outdoorSensor and pins.indoorSensor are the same pin";
+				return false;
+			}
+			if (config.pins.leftServo == config.pins.rightServo)
+			{
+				error = "pins.leftServo and pins.rightServo are the same channel";
+				return false;
+			}
+			return true;
+		}
+	}
+
+	bool ParseDoorConfig(const std::string& text, DoorConfig& config, std::string& error)
+	{
+		DoorConfig parsed;
+		std::istringstream lines(text);
+		std::string line;
+		for (int number = 1; std::getline(lines, line); number++)
+		{
+			line = Trim(line.substr(0, line.find('#')));
+			if (line.empty()) continue;
+
+			std::ostringstream where;
+			where << "line " << number << ": ";
+			size_t equals = line.find('=');
+			if (equals == std::string::npos)
+			{
+				error = where.str() + "expected name = value";
+				return false;
+			}
+			std::string name = Trim(line.substr(0, equals));
+			std::string value = Trim(line.substr(equals + 1));
+
+			const Field* field = nullptr;
+			for (auto& candidate : Fields)
+			{
+				if (name == candidate.name) field = &candidate;
+			}
+			if (!field)
+			{
+				error = where.str() + "unknown setting '" + name + "'";
+				return false;
+			}
+
+			if (field->allowNone && value == "none")
+			{
+				field->set(parsed, -DBL_MAX);
+				continue;
+			}
+			char* end = nullptr;
+			double parsedValue = strtod(value.c_str(), &end);
+			if (value.empty() || *end != '\0' || !std::isfinite(parsedValue) || (field->integer && parsedValue != std::floor(parsedValue)))
+			{
+				error = where.str() + name + ": '" + value + "' is not " + (field->integer ? "a whole number" : "a number");
+				return false;
+			}
+			if (parsedValue < field->min || parsedValue > field->max)
+			{
+				std::ostringstream range;
+				range << name << ": " << value << " is outside " << field->min << " to " << field->max;
+				error = where.str() + range.str();
+				return false;
+			}
+			field->set(parsed, parsedValue);
+		}
+
+		if (!CheckTogether(parsed, error)) return false;
+		config = parsed;
+		return true;
+	}
+
+	std::string FormatDoorConfig(const DoorConfig& config)
+	{
+		std::ostringstream text;
+		text.precision(9);
+		for (auto& field : Fields)
+		{
+			double value = field.get(config);
+			text << field.name << " = ";
+			if (field.allowNone && value == -DBL_MAX) text << "none";
+			else text << value;
+			text << "\n";
+		}
+		return text.str();
+	}
+
+	DoorConfigStore::DoorConfigStore()
+	{
+		Publish(DoorConfig(), false);
+	}
+
+	std::shared_ptr<const DoorConfigSnapshot> DoorConfigStore::Current() const
+	{
+		return std::atomic_load(&_current);
+	}
+
+	void DoorConfigStore::SetListener(Listener listener)
+	{
+		auto shared = std::make_shared<Listener>(listener);
+		std::lock_guard<std::mutex> lock(_lock);
+		_listener = shared;
+	}
+
+	bool DoorConfigStore::Load(const std::string& text, std::string& error)
+	{
+		DoorConfig config;
+		if (!ParseDoorConfig(text, config, error)) return false;
+		Publish(config, true);
+		return true;
+	}
+
+	bool DoorConfigStore::Rollback(uint64_t badVersion)
+	{
+		DoorConfig config;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			if (!_previous || _current->version != badVersion) return false;
+			config = _previous->config;
+		}
+		Publish(config, false);
+		return true;
+	}
+
+	void DoorConfigStore::Publish(const DoorConfig& config, bool keepPrevious)
+	{
+		std::shared_ptr<const DoorConfigSnapshot> snapshot;
+		std::shared_ptr<Listener> listener;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			auto next = std::make_shared<DoorConfigSnapshot>();
+			next->config = config;
+			next->version = _current ? _current->version + 1 : 1;
+			snapshot = next;
+
+			// After a rollback there is no good snapshot before the current one
+			_previous = keepPrevious ? _current : nullptr;
+			std::atomic_store(&_current, snapshot);
+			listener = _listener;
+		}
+
+		if (listener) (*listener)(snapshot);
+	}
+}
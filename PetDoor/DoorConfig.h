@@ -0,0 +1,107 @@
+﻿#pragma once
+
+#include "CaptureFormat.h"
+#include "DoorController.h"
+#include "VisionCore.h"
+
+#include <cfloat>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// Read from LocalState; without it the door runs on the defaults below
+#define DOOR_CONFIG_FILE L"DoorConfig.txt"
+
+// Where the hardware is wired, by default
+#define LEFT_SERVO 2 // 2nd channel on PC9685
+#define RIGHT_SERVO 3 // 3rd channel on PCA9685
+#define MOTION_SENSOR_PIN_OUTDOOR 26
+#define MOTION_SENSOR_PIN_INDOOR 19
+
+// Cats scored below this by the cascade do not open the door; pick it with tools/ThresholdCalibrator
+#define CAT_MIN_CONFIDENCE -DBL_MAX
+
+namespace PetDoor
+{
+	// GPIO pins and PCA9685 channels. Only read at startup; a change takes a restart.
+	struct DoorPins
+	{
+		int outdoorSensor = MOTION_SENSOR_PIN_OUTDOOR;
+		int indoorSensor = MOTION_SENSOR_PIN_INDOOR;
+		int leftServo = LEFT_SERVO;
+		int rightServo = RIGHT_SERVO;
+	};
+
+	// The MJPEG stream of detection frames on STREAM_PORT. Only read at startup; a change takes a restart.
+	struct StreamSettings
+	{
+		// Off unless asked for, as anyone on the network can watch the door while it is on
+		bool enabled = false;
+	};
+
+	// Everything about the door that can be tuned without a rebuild
+	struct DoorConfig
+	{
+		DoorConfig() { detection.minConfidence = CAT_MIN_CONFIDENCE; }
+
+		DetectionSettings detection;
+		DoorTiming timing;
+		DoorServoPositions positions;
+		DoorPins pins;
+		StreamSettings stream;
+		// Picks the cameras' preview format; only read when they start
+		CameraGeometry camera;
+	};
+
+	// Reads "name = value" lines over the defaults; # starts a comment and names not given keep
+	// their default. Returns false, with the line and the reason in error, on an unknown name,
+	// an unreadable value, a value outside its range, or values that do not fit together.
+	bool ParseDoorConfig(const std::string& text, DoorConfig& config, std::string& error);
+
+	// Every setting, in the format ParseDoorConfig reads
+	std::string FormatDoorConfig(const DoorConfig& config);
+
+	// One published configuration; never changed once published
+	struct DoorConfigSnapshot
+	{
+		DoorConfig config;
+		// Grows with every publish, so a consumer can tell whether it is up to date
+		uint64_t version;
+	};
+
+	// The live configuration, read-copy-update style. Readers take the current snapshot with one
+	// atomic load and may keep using it as long as they hold it; a reload publishes a whole new
+	// snapshot, so nobody sees half of one and nobody waits for a reload. A snapshot is freed
+	// when its last reader lets go. Text that does not parse is never published, and a snapshot
+	// a consumer cannot apply can be rolled back to the last good one.
+	class DoorConfigStore
+	{
+	public:
+		// Called after every publish, outside the store's lock
+		typedef std::function<void(std::shared_ptr<const DoorConfigSnapshot> snapshot)> Listener;
+
+		// Starts with the defaults as version 1
+		DoorConfigStore();
+
+		std::shared_ptr<const DoorConfigSnapshot> Current() const;
+
+		void SetListener(Listener listener);
+
+		// Parses text and publishes it. Returns false, keeping the current snapshot, if it does not parse.
+		bool Load(const std::string& text, std::string& error);
+
+		// Republishes the snapshot before badVersion under a new version, so consumers apply it again.
+		// Returns false if badVersion is no longer current or there is nothing to go back to.
+		bool Rollback(uint64_t badVersion);
+
+	private:
+		void Publish(const DoorConfig& config, bool keepPrevious);
+
+		// Writers only; readers never take it
+		std::mutex _lock;
+		std::shared_ptr<const DoorConfigSnapshot> _current;
+		std::shared_ptr<const DoorConfigSnapshot> _previous;
+		std::shared_ptr<Listener> _listener;
+	};
+}
@@ -0,0 +1,182 @@
+#include "DoorController.h"
+#include "Instrumentation.h"
+
+#include <algorithm>
+
+namespace PetDoor
+{
+	DoorController::DoorController(IDigitalInput& indoorSensor, IDigitalInput& outdoorSensor,
+		IPwmChannel& leftServo, IPwmChannel& rightServo,
+		DetectorPool& detectors, IScheduler& scheduler,
+		DoorTiming timing, DoorServoPositions positions)
+		: _leftServo(leftServo)
+		, _rightServo(rightServo)
+		, _detectors(detectors)
+		, _scheduler(scheduler)
+		, _settings(std::make_shared<Settings>(Settings{ timing, positions }))
+		, _state(DoorState::Closed)
+		, _closeAt(0)
+		, _generation(0)
+	{
+		_detectors.SetResultHandler(DetectionPriority::Entry, [this](const PooledDetection& detection, cv::Mat& frame, std::vector<cv::Rect>& objects)
+		{
+			OnDetection(detection, frame, objects);
+		});
+		indoorSensor.SetRisingEdgeHandler([this](int64_t edge) { OnIndoorEdge(edge); });
+		outdoorSensor.SetRisingEdgeHandler([this](int64_t edge) { OnOutdoorEdge(edge); });
+	}
+
+	void DoorController::AddEntryCamera(size_t camera)
+	{
+		_entryCameras.push_back(camera);
+	}
+
+	void DoorController::Configure(DoorTiming timing, DoorServoPositions positions)
+	{
+		std::atomic_store(&_settings, std::shared_ptr<const Settings>(std::make_shared<Settings>(Settings{ timing, positions })));
+	}
+
+	void DoorController::SetDecisionHandler(DecisionHandler handler)
+	{
+		auto shared = std::make_shared<DecisionHandler>(handler);
+		std::lock_guard<std::mutex> lock(_lock);
+		_decisionHandler = shared;
+	}
+
+	bool DoorController::IsClosed()
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		return _state == DoorState::Closed;
+	}
+
+	// Let the cat out
+	void DoorController::OnIndoorEdge(int64_t edgeMicroseconds)
+	{
+		DoorOutcome outcome = { DoorSensor::Indoor, DoorDecision::Exited, 0, edgeMicroseconds, edgeMicroseconds, 0, 0 };
+		std::shared_ptr<DecisionHandler> handler;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			outcome.decidedMicroseconds = _scheduler.Now();
+			OpenDoorLocked(std::atomic_load(&_settings)->timing.stayOpenMicroseconds);
+			handler = _decisionHandler;
+		}
+
+		std::vector<cv::Rect> noObjects;
+		if (handler) (*handler)(outcome, nullptr, noObjects);
+	}
+
+	void DoorController::OnOutdoorEdge(int64_t edgeMicroseconds)
+	{
+#if PETDOOR_PROFILING
+		Instrumentation::Record(Stage::EdgeToHandler, _scheduler.Now() - edgeMicroseconds);
+#endif
+		// Cameras that are not previewing cannot give a frame, and the pool skips them
+		for (size_t camera : _entryCameras)
+		{
+			_detectors.Request(camera, DetectionPriority::Entry, edgeMicroseconds);
+		}
+	}
+
+	// Called by the pool on the worker that ran the detection
+	void DoorController::OnDetection(const PooledDetection& detection, cv::Mat& frame, std::vector<cv::Rect>& objects)
+	{
+		DoorOutcome outcome = { DoorSensor::Outdoor, objects.empty() ? DoorDecision::Blocked : DoorDecision::Entered,
+			static_cast<int>(objects.size()), detection.requestedMicroseconds, detection.startedMicroseconds, 0, detection.source };
+		std::shared_ptr<DecisionHandler> handler;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			outcome.decidedMicroseconds = _scheduler.Now();
+
+			// open the door if your cats are there (according to the model)
+			if (!objects.empty())
+			{
+				OpenDoorLocked(std::atomic_load(&_settings)->timing.stayOpenMicroseconds);
+#if PETDOOR_PROFILING
+				Instrumentation::Record(Stage::EdgeToServo, outcome.decidedMicroseconds - outcome.edgeMicroseconds);
+#endif
+			}
+
+			handler = _decisionHandler;
+		}
+
+		if (handler) (*handler)(outcome, &frame, objects);
+	}
+
+	void DoorController::OpenDoor(int64_t stayOpenMicroseconds)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		OpenDoorLocked(stayOpenMicroseconds);
+	}
+
+	void DoorController::OpenDoorLocked(int64_t stayOpenMicroseconds)
+	{
+		int64_t now = _scheduler.Now();
+		std::shared_ptr<const Settings> settings = std::atomic_load(&_settings);
+
+		switch (_state)
+		{
+		case DoorState::Closed:
+		case DoorState::Closing:
+			// Turns the servos so the pet door can be opened
+			_rightServo.SetDutyCycle(settings->positions.rightOpen);
+			_leftServo.SetDutyCycle(settings->positions.leftOpen);
+			_state = DoorState::Opening;
+			_closeAt = now + settings->timing.servoTravelMicroseconds + stayOpenMicroseconds;
+			ScheduleStep(settings->timing.servoTravelMicroseconds);
+			break;
+
+		case DoorState::Opening:
+		case DoorState::Open:
+			// The step already scheduled notices the later close time and waits for it
+			_closeAt = std::max(_closeAt, now + stayOpenMicroseconds);
+			break;
+		}
+	}
+
+	void DoorController::ScheduleStep(int64_t delayMicroseconds)
+	{
+		uint64_t generation = ++_generation;
+		_scheduler.Schedule(delayMicroseconds, [this, generation]()
+		{
+			Step(generation);
+		});
+	}
+
+	void DoorController::Step(uint64_t generation)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		if (generation != _generation) return;
+
+		int64_t now = _scheduler.Now();
+		std::shared_ptr<const Settings> settings = std::atomic_load(&_settings);
+
+		switch (_state)
+		{
+		case DoorState::Opening:
+			_state = DoorState::Open;
+			ScheduleStep(std::max<int64_t>(0, _closeAt - now));
+			break;
+
+		case DoorState::Open:
+			if (now < _closeAt)
+			{
+				ScheduleStep(_closeAt - now);
+				break;
+			}
+			_leftServo.SetDutyCycle(settings->positions.leftClosed);
+			_rightServo.SetDutyCycle(settings->positions.rightClosed);
+			_state = DoorState::Closing;
+			ScheduleStep(settings->timing.servoTravelMicroseconds);
+			break;
+
+		case DoorState::Closing:
+			_leftServo.Stop();
+			_rightServo.Stop();
+			_state = DoorState::Closed;
+			break;
+
+		case DoorState::Closed:
+			break;
+		}
+	}
+}
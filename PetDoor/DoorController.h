@@ -0,0 +1,123 @@
+#pragma once
+
+#include "DetectorPool.h"
+#include "DoorEvent.h"
+#include "Hal.h"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace PetDoor
+{
+	// Servo duty cycles for the two door positions
+	struct DoorServoPositions
+	{
+		double leftOpen = 0.0188;
+		double rightOpen = 0.1300;
+		double leftClosed = 0.0765;
+		double rightClosed = 0.0785;
+	};
+
+	struct DoorTiming
+	{
+		// Time the servos are given to reach a position before the next step
+		int64_t servoTravelMicroseconds = 700000;
+		// How long the door stays open after an entry or an exit
+		int64_t stayOpenMicroseconds = 3000000;
+	};
+
+	// One door decision and when (IScheduler time) it went through each step
+	struct DoorOutcome
+	{
+		DoorSensor sensor;
+		DoorDecision decision;
+		int catCount;
+		// The PIR edge that caused it
+		int64_t edgeMicroseconds;
+		// Frame requested; later than the edge if the camera or every worker was busy
+		int64_t detectionStartMicroseconds;
+		int64_t decidedMicroseconds;
+		// The pool's index of the camera the outdoor frame came from
+		size_t camera;
+	};
+
+	// The door logic: PIR edges in, servo commands out. Outdoor edges ask the
+	// detector pool for an entry detection on every entry camera, and any frame
+	// with a cat opens the door; indoor edges open it right away. Each camera's
+	// frame is its own decision. The pool coalesces edges that arrive while a
+	// camera's detection waits. The door is a state machine driven by the
+	// scheduler, so an open request while it is open extends it and one while
+	// it is closing reopens it; no thread ever sleeps and servo commands never
+	// overlap.
+	class DoorController
+	{
+	public:
+		// Called after every decision, outside the controller's lock. frame is the
+		// unannotated outdoor frame the decision was made on, null for indoor edges.
+		typedef std::function<void(const DoorOutcome& outcome, cv::Mat* frame, std::vector<cv::Rect>& objects)> DecisionHandler;
+
+		// All references must outlive the controller, and the controller must
+		// outlive any work it has scheduled. The controller takes the pool's
+		// entry results.
+		DoorController(IDigitalInput& indoorSensor, IDigitalInput& outdoorSensor,
+			IPwmChannel& leftServo, IPwmChannel& rightServo,
+			DetectorPool& detectors, IScheduler& scheduler,
+			DoorTiming timing = DoorTiming(), DoorServoPositions positions = DoorServoPositions());
+
+		// Outdoor edges ask this camera of the pool whether a cat is waiting. Add
+		// entry cameras before the sensors start firing.
+		void AddEntryCamera(size_t camera);
+
+		void SetDecisionHandler(DecisionHandler handler);
+
+		// Takes effect from the next servo command or timing decision on, without waiting for the
+		// door to close. Safe to call from any thread while the door is running.
+		void Configure(DoorTiming timing, DoorServoPositions positions);
+
+		// Opens the door, or keeps it open, until stayOpenMicroseconds from now
+		void OpenDoor(int64_t stayOpenMicroseconds);
+
+		bool IsClosed();
+
+	private:
+		struct Settings
+		{
+			DoorTiming timing;
+			DoorServoPositions positions;
+		};
+
+		enum class DoorState
+		{
+			Closed,
+			Opening,
+			Open,
+			Closing
+		};
+
+		void OnIndoorEdge(int64_t edgeMicroseconds);
+		void OnOutdoorEdge(int64_t edgeMicroseconds);
+		void OnDetection(const PooledDetection& detection, cv::Mat& frame, std::vector<cv::Rect>& objects);
+
+		// Must be called with _lock held
+		void OpenDoorLocked(int64_t stayOpenMicroseconds);
+		void ScheduleStep(int64_t delayMicroseconds);
+		void Step(uint64_t generation);
+
+		IPwmChannel& _leftServo;
+		IPwmChannel& _rightServo;
+		DetectorPool& _detectors;
+		IScheduler& _scheduler;
+		std::vector<size_t> _entryCameras;
+		// Replaced whole by Configure and read with an atomic load, so a change never waits for the lock
+		std::shared_ptr<const Settings> _settings;
+		// Shared so it can be taken out of the lock without copying the function
+		std::shared_ptr<DecisionHandler> _decisionHandler;
+
+		std::mutex _lock;
+		DoorState _state;
+		int64_t _closeAt;
+		// Scheduled steps from an earlier generation are stale and ignored
+		uint64_t _generation;
+	};
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+namespace PetDoor
+{
+	// Which motion sensor started the event
+	enum class DoorSensor : uint8_t
+	{
+		Indoor = 0,
+		Outdoor = 1
+	};
+
+	// What the door did about it
+	enum class DoorDecision : uint8_t
+	{
+		// Indoor motion, the door was opened to let the cat out
+		Exited = 0,
+		// Outdoor motion with a cat in view, the door was opened
+		Entered = 1,
+		// Outdoor motion without a cat in view, the door stayed shut
+		Blocked = 2
+	};
+
+	// One door event as stored in the event journal. Fixed size so a journal
+	// file can be mapped and indexed directly.
+#pragma pack(push, 1)
+	struct DoorEventRecord
+	{
+		// UTC in 100ns ticks since 1601-01-01, the same base as Windows::Foundation::DateTime
+		int64_t timestamp;
+		DoorSensor sensor;
+		DoorDecision decision;
+		uint16_t catCount;
+		// From the PIR edge being handled to the door decision
+		uint32_t detectionLatencyMicroseconds;
+		// Id in the names of the captures saved for this event, 0 if none were saved
+		uint32_t imageId;
+		uint32_t reserved;
+	};
+#pragma pack(pop)
+
+	static_assert(sizeof(DoorEventRecord) == 24, "DoorEventRecord is a fixed on-disk layout");
+
+	// Ticks between 1601-01-01 and the Unix epoch
+	const int64_t UnixEpochTicks = 116444736000000000LL;
+
+	// Current UTC time in DoorEventRecord::timestamp units
+	inline int64_t CurrentTimestamp()
+	{
+		typedef std::chrono::duration<int64_t, std::ratio<1, 10000000>> ticks;
+		return std::chrono::duration_cast<ticks>(std::chrono::system_clock::now().time_since_epoch()).count() + UnixEpochTicks;
+	}
+}
@@ -0,0 +1,347 @@
+#include "pch.h"
+#include "EventJournal.h"
+#include "TimeSpanHelper.h"
+
+#include <algorithm>
+#include <sstream>
+
+using namespace Windows::Foundation;
+using namespace Windows::System::Threading;
+
+namespace PetDoor
+{
+	namespace
+	{
+		const uint32_t JournalMagic = 0x4A454450; // "PDEJ"
+		const uint32_t JournalVersion = 1;
+
+		// Highest image id is looked for in this many records at the end of an existing journal
+		const size_t ImageIdScanRecords = 256;
+
+		struct JournalHeader
+		{
+			uint32_t magic;
+			uint32_t version;
+			uint32_t recordSize;
+			uint32_t reserved;
+		};
+
+		inline void ThrowLastError()
+		{
+			throw Platform::Exception::CreateException(HRESULT_FROM_WIN32(GetLastError()));
+		}
+
+		bool IsValidHeader(const JournalHeader& header)
+		{
+			return header.magic == JournalMagic && header.version == JournalVersion && header.recordSize == sizeof(DoorEventRecord);
+		}
+	}
+
+	// path: journal file, created if it does not exist
+	// flushRecords: number of buffered records that triggers a flush
+	// flushIntervalMs: longest time a record stays in the buffer
+	EventJournal::EventJournal(const std::wstring& path, size_t flushRecords, int flushIntervalMs)
+		: _path(path)
+		, _file(INVALID_HANDLE_VALUE)
+		, _flushRecords(flushRecords)
+		, _lastTimestamp(0)
+		, _flushQueued(false)
+		, _fileEnd(0)
+		, _nextImageId(1)
+		, _work(0)
+		, _closing(false)
+	{
+		// Readers may map the file while we append to it
+		_file = CreateFile2(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, OPEN_ALWAYS, nullptr);
+		if (_file == INVALID_HANDLE_VALUE)
+		{
+			ThrowLastError();
+		}
+
+		try
+		{
+			LARGE_INTEGER size;
+			if (!GetFileSizeEx(_file, &size))
+			{
+				ThrowLastError();
+			}
+
+			JournalHeader header = { JournalMagic, JournalVersion, sizeof(DoorEventRecord), 0 };
+			DWORD transferred = 0;
+			uint64_t records = 0;
+
+			if (static_cast<uint64_t>(size.QuadPart) < sizeof(JournalHeader))
+			{
+				// New file, or one that never got its header written
+				if (!WriteFile(_file, &header, sizeof(header), &transferred, nullptr) || !FlushFileBuffers(_file))
+				{
+					ThrowLastError();
+				}
+			}
+			else
+			{
+				if (!ReadFile(_file, &header, sizeof(header), &transferred, nullptr) || transferred != sizeof(header))
+				{
+					ThrowLastError();
+				}
+				if (!IsValidHeader(header))
+				{
+					throw ref new Platform::Exception(E_FAIL, "The file is not a door event journal.");
+				}
+
+				records = (size.QuadPart - sizeof(JournalHeader)) / sizeof(DoorEventRecord);
+
+				// Pick up the clock and the image ids where the last run left off
+				uint64_t tail = std::min<uint64_t>(records, ImageIdScanRecords);
+				if (tail > 0)
+				{
+					std::vector<DoorEventRecord> last(static_cast<size_t>(tail));
+					LARGE_INTEGER offset;
+					offset.QuadPart = sizeof(JournalHeader) + (records - tail) * sizeof(DoorEventRecord);
+					DWORD bytes = static_cast<DWORD>(tail * sizeof(DoorEventRecord));
+					if (!SetFilePointerEx(_file, offset, nullptr, FILE_BEGIN) || !ReadFile(_file, last.data(), bytes, &transferred, nullptr) || transferred != bytes)
+					{
+						ThrowLastError();
+					}
+
+					_lastTimestamp = last.back().timestamp;
+					uint32_t highestImageId = 0;
+					for (auto& record : last)
+					{
+						highestImageId = std::max(highestImageId, record.imageId);
+					}
+					_nextImageId = highestImageId + 1;
+				}
+			}
+
+			// Append after the last whole record, dropping one torn by a crash mid-write
+			LARGE_INTEGER end;
+			end.QuadPart = sizeof(JournalHeader) + records * sizeof(DoorEventRecord);
+			if (!SetFilePointerEx(_file, end, nullptr, FILE_BEGIN) || !SetEndOfFile(_file))
+			{
+				ThrowLastError();
+			}
+			_fileEnd = end.QuadPart;
+		}
+		catch (...)
+		{
+			CloseHandle(_file);
+			throw;
+		}
+
+		// Swapped back and forth by Flush, so appending does not allocate in steady state
+		_buffer.reserve(_flushRecords * 2);
+		_writing.reserve(_flushRecords * 2);
+
+		Windows::Foundation::TimeSpan interval = { TimeSpanHelper::FromMilliseconds(flushIntervalMs).get_Ticks() };
+		_flushTimer = ThreadPoolTimer::CreatePeriodicTimer(ref new TimerElapsedHandler([this](ThreadPoolTimer^)
+		{
+			if (!BeginWork()) return;
+			Flush();
+			EndWork();
+		}), interval);
+	}
+
+	EventJournal::~EventJournal()
+	{
+		// Cancel does not wait for a tick already running, nor for a queued flush
+		_flushTimer->Cancel();
+		{
+			std::unique_lock<std::mutex> lock(_workLock);
+			_closing = true;
+			_workDone.wait(lock, [this]() { return _work == 0; });
+		}
+		Flush();
+		CloseHandle(_file);
+	}
+
+	bool EventJournal::BeginWork()
+	{
+		std::lock_guard<std::mutex> lock(_workLock);
+		if (_closing) return false;
+		_work++;
+		return true;
+	}
+
+	void EventJournal::EndWork()
+	{
+		std::lock_guard<std::mutex> lock(_workLock);
+		if (--_work == 0) _workDone.notify_all();
+	}
+
+	uint32_t EventJournal::ReserveImageId()
+	{
+		return _nextImageId++;
+	}
+
+	void EventJournal::Append(DoorEventRecord record)
+	{
+		bool queueFlush = false;
+		{
+			std::lock_guard<std::mutex> lock(_bufferLock);
+
+			// Keep the file in timestamp order for readers even if the clock is set back
+			record.timestamp = std::max(record.timestamp, _lastTimestamp);
+			_lastTimestamp = record.timestamp;
+			_buffer.push_back(record);
+
+			if (_buffer.size() >= _flushRecords && !_flushQueued)
+			{
+				_flushQueued = true;
+				queueFlush = true;
+			}
+		}
+
+		// Size threshold reached; write on the thread pool rather than the caller's thread. Counted
+		// before it is queued, so the destructor waits for it.
+		if (queueFlush && BeginWork())
+		{
+			ThreadPool::RunAsync(ref new WorkItemHandler([this](IAsyncAction^)
+			{
+				Flush();
+				EndWork();
+			}));
+		}
+	}
+
+	void EventJournal::Flush()
+	{
+		std::lock_guard<std::mutex> fileLock(_fileLock);
+		{
+			std::lock_guard<std::mutex> lock(_bufferLock);
+			// Records left over from a failed write go first
+			if (_writing.empty())
+			{
+				_writing.swap(_buffer);
+			}
+			else
+			{
+				_writing.insert(_writing.end(), _buffer.begin(), _buffer.end());
+				_buffer.clear();
+			}
+			_flushQueued = false;
+		}
+
+		if (_writing.empty()) return;
+
+		DWORD bytes = static_cast<DWORD>(_writing.size() * sizeof(DoorEventRecord));
+		DWORD written = 0;
+		bool ok = WriteFile(_file, _writing.data(), bytes, &written, nullptr) && written == bytes;
+		DWORD lastError = GetLastError();
+
+		// Whatever whole records made it stay; a torn one is cut off so the next write starts on a record boundary
+		size_t whole = written / sizeof(DoorEventRecord);
+		_fileEnd += static_cast<int64_t>(whole * sizeof(DoorEventRecord));
+		if (!ok)
+		{
+			LARGE_INTEGER end;
+			end.QuadPart = _fileEnd;
+			if (!SetFilePointerEx(_file, end, nullptr, FILE_BEGIN) || !SetEndOfFile(_file))
+			{
+				lastError = GetLastError();
+			}
+		}
+		_writing.erase(_writing.begin(), _writing.begin() + whole);
+
+		if (ok && !FlushFileBuffers(_file))
+		{
+			ok = false;
+			lastError = GetLastError();
+		}
+		if (!ok)
+		{
+			// Called from timers and the thread pool, so report instead of throwing
+			std::wstringstream error;
+			error << "Door event journal write failed: 0x" << std::hex << HRESULT_FROM_WIN32(lastError) << ", "
+				<< std::dec << _writing.size() << " records kept for the next flush\n";
+			OutputDebugString(error.str().c_str());
+		}
+	}
+
+	EventJournalReader::EventJournalReader(const std::wstring& path)
+		: _path(path)
+		, _mapping(nullptr)
+		, _view(nullptr)
+		, _records(nullptr)
+		, _count(0)
+	{
+		Refresh();
+	}
+
+	EventJournalReader::~EventJournalReader()
+	{
+		Unmap();
+	}
+
+	bool EventJournalReader::Refresh()
+	{
+		HANDLE file = CreateFile2(_path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, OPEN_EXISTING, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			return false;
+		}
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size) || static_cast<uint64_t>(size.QuadPart) < sizeof(JournalHeader))
+		{
+			CloseHandle(file);
+			return false;
+		}
+
+		// Only whole records are mapped; the writer may be in the middle of the next one
+		size_t count = static_cast<size_t>((size.QuadPart - sizeof(JournalHeader)) / sizeof(DoorEventRecord));
+		if (_view != nullptr && count == _count)
+		{
+			CloseHandle(file);
+			return true;
+		}
+
+		uint64_t mappedBytes = sizeof(JournalHeader) + static_cast<uint64_t>(count) * sizeof(DoorEventRecord);
+		HANDLE mapping = CreateFileMappingFromApp(file, nullptr, PAGE_READONLY, mappedBytes, nullptr);
+		// The mapping keeps its own reference to the file
+		CloseHandle(file);
+		if (mapping == nullptr)
+		{
+			return false;
+		}
+
+		const void* view = MapViewOfFileFromApp(mapping, FILE_MAP_READ, 0, static_cast<SIZE_T>(mappedBytes));
+		if (view == nullptr || !IsValidHeader(*static_cast<const JournalHeader*>(view)))
+		{
+			if (view != nullptr) UnmapViewOfFile(view);
+			CloseHandle(mapping);
+			return false;
+		}
+
+		Unmap();
+		_mapping = mapping;
+		_view = view;
+		_records = reinterpret_cast<const DoorEventRecord*>(static_cast<const char*>(view) + sizeof(JournalHeader));
+		_count = count;
+		return true;
+	}
+
+	std::pair<const DoorEventRecord*, const DoorEventRecord*> EventJournalReader::Range(int64_t from, int64_t to) const
+	{
+		auto before = [](const DoorEventRecord& record, int64_t timestamp) { return record.timestamp < timestamp; };
+		auto first = std::lower_bound(begin(), end(), from, before);
+		auto last = std::lower_bound(first, end(), std::max(from, to), before);
+		return std::make_pair(first, last);
+	}
+
+	void EventJournalReader::Unmap()
+	{
+		if (_view != nullptr)
+		{
+			UnmapViewOfFile(_view);
+			_view = nullptr;
+		}
+		if (_mapping != nullptr)
+		{
+			CloseHandle(_mapping);
+			_mapping = nullptr;
+		}
+		_records = nullptr;
+		_count = 0;
+	}
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "DoorEvent.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace PetDoor
+{
+	// Append-only file of fixed size DoorEventRecords behind a small header.
+	// Appends go to an in-memory write-ahead buffer which is written and
+	// flushed to disk once it holds flushRecords records or every
+	// flushIntervalMs, whichever comes first. Appending never does I/O.
+	// A write that fails partway is cut back to its last whole record and
+	// the rest is retried on the next flush.
+	class EventJournal
+	{
+	public:
+		EventJournal(const std::wstring& path, size_t flushRecords = 64, int flushIntervalMs = 5000);
+		~EventJournal();
+
+		// Hands out the id used to name the captures of an event that is about to be appended
+		uint32_t ReserveImageId();
+
+		// Queues the record. A timestamp older than the last appended one is
+		// raised to it so the file stays in time order.
+		void Append(DoorEventRecord record);
+
+		// Writes the buffered records and waits for them to reach the disk
+		void Flush();
+
+		const std::wstring& Path() const { return _path; }
+
+	private:
+		// Bracket a timer or thread pool flush; BeginWork returns false once the journal is closing
+		bool BeginWork();
+		void EndWork();
+
+		std::wstring _path;
+		HANDLE _file;
+		size_t _flushRecords;
+		Windows::System::Threading::ThreadPoolTimer^ _flushTimer;
+
+		std::mutex _bufferLock;
+		std::vector<DoorEventRecord> _buffer;
+		int64_t _lastTimestamp;
+		bool _flushQueued;
+
+		// Serializes writers, held while the file is written and flushed
+		std::mutex _fileLock;
+		// Records not yet in the file, including any a failed write left over
+		std::vector<DoorEventRecord> _writing;
+		// Where the last whole record ends
+		int64_t _fileEnd;
+
+		// Flushes running or queued on other threads; the destructor waits for them
+		std::mutex _workLock;
+		std::condition_variable _workDone;
+		int _work;
+		bool _closing;
+
+		std::atomic<uint32_t> _nextImageId;
+	};
+
+	// Read-only view of a journal file, mapped into memory. Records are in
+	// timestamp order so ranges are found with a binary search.
+	class EventJournalReader
+	{
+	public:
+		EventJournalReader(const std::wstring& path);
+		~EventJournalReader();
+
+		// Maps records appended since the last call. Returns false if the file is unreadable.
+		bool Refresh();
+
+		size_t Count() const { return _count; }
+		const DoorEventRecord* begin() const { return _records; }
+		const DoorEventRecord* end() const { return _records + _count; }
+
+		// Records with from <= timestamp < to
+		std::pair<const DoorEventRecord*, const DoorEventRecord*> Range(int64_t from, int64_t to) const;
+
+	private:
+		void Unmap();
+
+		std::wstring _path;
+		HANDLE _mapping;
+		const void* _view;
+		const DoorEventRecord* _records;
+		size_t _count;
+	};
+}
@@ -0,0 +1,129 @@
+#include "HaarCascade.h"
+
+#include <algorithm>
+
+namespace PetDoor
+{
+	bool HaarCascade::HasTilted() const
+	{
+		return std::any_of(features.begin(), features.end(), [](const HaarFeature& feature) { return feature.tilted; });
+	}
+
+	bool HaarCascade::Load(const std::string& path)
+	{
+		cv::FileStorage storage(path, cv::FileStorage::READ);
+		if (!storage.isOpened()) return false;
+
+		cv::FileNode root = storage.getFirstTopLevelNode();
+		if ((std::string)root["stageType"] != "BOOST" || (std::string)root["featureType"] != "HAAR") return false;
+
+		*this = HaarCascade();
+		window = cv::Size((int)root["width"], (int)root["height"]);
+
+		cv::FileNode stageNodes = root["stages"];
+		for (cv::FileNodeIterator stageIt = stageNodes.begin(); stageIt != stageNodes.end(); ++stageIt)
+		{
+			cv::FileNode stageNode = *stageIt;
+			HaarStage stage = { static_cast<int>(trees.size()), 0, (float)stageNode["stageThreshold"] };
+
+			cv::FileNode weakClassifiers = stageNode["weakClassifiers"];
+			for (cv::FileNodeIterator weakIt = weakClassifiers.begin(); weakIt != weakClassifiers.end(); ++weakIt)
+			{
+				cv::FileNode internalNodes = (*weakIt)["internalNodes"];
+				cv::FileNode leafValues = (*weakIt)["leafValues"];
+				HaarTree tree = { static_cast<int>(nodes.size()), static_cast<int>(leaves.size()) };
+
+				// left, right, feature, threshold per node; categorical features are not supported
+				for (int i = 0; i + 3 < static_cast<int>(internalNodes.size()); i += 4)
+				{
+					HaarNode node = { (int)internalNodes[i], (int)internalNodes[i + 1], (int)internalNodes[i + 2], (float)internalNodes[i + 3] };
+					nodes.push_back(node);
+				}
+				for (int i = 0; i < static_cast<int>(leafValues.size()); i++)
+				{
+					leaves.push_back((float)leafValues[i]);
+				}
+
+				trees.push_back(tree);
+				stage.treeCount++;
+			}
+			stages.push_back(stage);
+		}
+
+		cv::FileNode featureNodes = root["features"];
+		for (cv::FileNodeIterator featureIt = featureNodes.begin(); featureIt != featureNodes.end(); ++featureIt)
+		{
+			HaarFeature feature = {};
+			cv::FileNode rects = (*featureIt)["rects"];
+			for (cv::FileNodeIterator rectIt = rects.begin(); rectIt != rects.end() && feature.rectCount < 3; ++rectIt)
+			{
+				cv::FileNode values = *rectIt;
+				HaarRect& rect = feature.rects[feature.rectCount++];
+				rect.rect = cv::Rect((int)values[0], (int)values[1], (int)values[2], (int)values[3]);
+				rect.weight = (float)values[4];
+			}
+			feature.tilted = (int)(*featureIt)["tilted"] != 0;
+			features.push_back(feature);
+		}
+
+		return !stages.empty() && window.area() > 0;
+	}
+
+	bool HaarCascade::Save(const std::string& path) const
+	{
+		cv::FileStorage storage(path, cv::FileStorage::WRITE);
+		if (!storage.isOpened()) return false;
+
+		int maxWeakCount = 0;
+		for (auto& stage : stages) maxWeakCount = std::max(maxWeakCount, stage.treeCount);
+
+		// The parameters CascadeClassifier expects to find; only the layout of the stages matters to it
+		storage << "cascade" << "{"
+			<< "stageType" << "BOOST"
+			<< "featureType" << "HAAR"
+			<< "height" << window.height
+			<< "width" << window.width
+			<< "stageParams" << "{" << "boostType" << "GAB" << "maxWeakCount" << maxWeakCount << "}"
+			<< "featureParams" << "{" << "maxCatCount" << 0 << "featSize" << 1 << "mode" << (HasTilted() ? "ALL" : "BASIC") << "}"
+			<< "stageNum" << static_cast<int>(stages.size())
+			<< "stages" << "[";
+
+		for (auto& stage : stages)
+		{
+			storage << "{" << "maxWeakCount" << stage.treeCount << "stageThreshold" << stage.threshold << "weakClassifiers" << "[";
+			for (int t = stage.firstTree; t < stage.firstTree + stage.treeCount; t++)
+			{
+				// A tree's nodes and leaves run up to the next tree's
+				int endNode = t + 1 < static_cast<int>(trees.size()) ? trees[t + 1].firstNode : static_cast<int>(nodes.size());
+				int endLeaf = t + 1 < static_cast<int>(trees.size()) ? trees[t + 1].firstLeaf : static_cast<int>(leaves.size());
+
+				storage << "{" << "internalNodes" << "[:";
+				for (int n = trees[t].firstNode; n < endNode; n++)
+				{
+					storage << nodes[n].left << nodes[n].right << nodes[n].feature << nodes[n].threshold;
+				}
+				storage << "]" << "leafValues" << "[:";
+				for (int l = trees[t].firstLeaf; l < endLeaf; l++)
+				{
+					storage << leaves[l];
+				}
+				storage << "]" << "}";
+			}
+			storage << "]" << "}";
+		}
+
+		storage << "]" << "features" << "[";
+		for (auto& feature : features)
+		{
+			storage << "{" << "rects" << "[";
+			for (int r = 0; r < feature.rectCount; r++)
+			{
+				const cv::Rect& rect = feature.rects[r].rect;
+				storage << "[:" << rect.x << rect.y << rect.width << rect.height << feature.rects[r].weight << "]";
+			}
+			storage << "]" << "tilted" << (feature.tilted ? 1 : 0) << "}";
+		}
+		storage << "]" << "}";
+		return true;
+	}
+}
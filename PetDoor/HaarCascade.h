@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+// A boosted Haar cascade as opencv_traincascade writes it (stageType BOOST,
+// featureType HAAR). MultiCascadeDetector evaluates these, and CascadeTrainer
+// reads, extends and writes them; CascadeClassifier reads what Save writes.
+namespace PetDoor
+{
+	struct HaarRect
+	{
+		cv::Rect rect;
+		float weight;
+	};
+
+	struct HaarFeature
+	{
+		HaarRect rects[3];
+		int rectCount;
+		// Rectangles rotated by 45 degrees, read from the tilted integral image
+		bool tilted;
+	};
+
+	// Leaves are stored as -index in left/right, as in the XML. A value below the threshold goes left.
+	struct HaarNode
+	{
+		int left;
+		int right;
+		int feature;
+		float threshold;
+	};
+
+	struct HaarTree
+	{
+		int firstNode;
+		int firstLeaf;
+	};
+
+	// A window passes the stage if its trees' leaf values add up to at least the threshold
+	struct HaarStage
+	{
+		int firstTree;
+		int treeCount;
+		float threshold;
+	};
+
+	struct HaarCascade
+	{
+		cv::Size window;
+		std::vector<HaarFeature> features;
+		std::vector<HaarNode> nodes;
+		std::vector<float> leaves;
+		std::vector<HaarTree> trees;
+		std::vector<HaarStage> stages;
+
+		bool HasTilted() const;
+
+		// Returns false if the file cannot be read or is not a BOOST/HAAR cascade
+		bool Load(const std::string& path);
+		bool Save(const std::string& path) const;
+	};
+}
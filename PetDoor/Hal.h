@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <opencv2/core/core.hpp>
+
+// Thin interfaces between the door logic and the hardware it drives. The
+// device back-ends (DeviceHal.h) wrap Lightning and MediaCapture; the
+// simulated ones (SimulatedHal.h) replay recorded traces and image
+// sequences on a virtual clock, so DoorController runs off the device.
+namespace PetDoor
+{
+	// A GPIO input such as a PIR motion sensor
+	class IDigitalInput
+	{
+	public:
+		// edgeMicroseconds: IScheduler::Now() at the edge
+		typedef std::function<void(int64_t edgeMicroseconds)> EdgeHandler;
+
+		virtual ~IDigitalInput() {}
+
+		virtual bool Read() = 0;
+
+		// Called on every rising edge, on whatever thread the back-end delivers it
+		virtual void SetRisingEdgeHandler(EdgeHandler handler) = 0;
+	};
+
+	// One PWM output driving a servo
+	class IPwmChannel
+	{
+	public:
+		virtual ~IPwmChannel() {}
+
+		// Sets the duty cycle (0 to 1) and starts the output
+		virtual void SetDutyCycle(double dutyCyclePercentage) = 0;
+		virtual void Stop() = 0;
+	};
+
+	// The camera
+	class IFrameSource
+	{
+	public:
+		// rgba: CV_8UC4, empty if no frame could be captured
+		typedef std::function<void(cv::Mat& rgba)> FrameHandler;
+
+		virtual ~IFrameSource() {}
+
+		// False while no frames can be captured, e.g. the preview is stopped
+		virtual bool IsReady() = 0;
+
+		// Captures one frame and hands it to handler, which may run on another
+		// thread. The frame is only valid for the duration of the call.
+		virtual void CaptureAsync(FrameHandler handler) = 0;
+	};
+
+	// Time and deferred work, so the door logic never blocks a thread to wait
+	class IScheduler
+	{
+	public:
+		typedef std::function<void()> Work;
+
+		virtual ~IScheduler() {}
+
+		// Monotonic microseconds
+		virtual int64_t Now() = 0;
+
+		// Runs work once delayMicroseconds have passed, on whatever thread the back-end uses
+		virtual void Schedule(int64_t delayMicroseconds, Work work) = 0;
+	};
+}
@@ -0,0 +1,253 @@
+#include "IdlePreview.h"
+#include "Instrumentation.h"
+
+#include <algorithm>
+
+// Captures that can wait for one wake without the list growing; the pool asks for one per camera at a time
+#define IDLE_PREVIEW_WAITING 8
+// An idle check never comes sooner than this after the last one
+#define IDLE_PREVIEW_MIN_CHECK_MICROSECONDS 1000000
+
+namespace PetDoor
+{
+	IdlePreviewSource::IdlePreviewSource(IFrameSource& camera, IScheduler& scheduler, int64_t idleMicroseconds, Transition sleep, Transition wake)
+		: _camera(camera)
+		, _scheduler(scheduler)
+		, _idleMicroseconds(idleMicroseconds)
+		, _sleep(sleep)
+		, _wake(wake)
+		, _state(State::Awake)
+		, _lastActivity(scheduler.Now())
+		, _asleepSince(0)
+		, _wakePending(false)
+		, _wakeStart(0)
+		, _stats()
+	{
+		_waiting.reserve(IDLE_PREVIEW_WAITING);
+		if (_idleMicroseconds > 0) ScheduleCheck(_idleMicroseconds);
+	}
+
+	bool IdlePreviewSource::IsAwake()
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		return _state == State::Awake;
+	}
+
+	bool IdlePreviewSource::IsReady()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			if (_state != State::Awake) return true;
+		}
+		return _camera.IsReady();
+	}
+
+	void IdlePreviewSource::Wake(int64_t edgeMicroseconds)
+	{
+		bool startWake;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			_lastActivity = _scheduler.Now();
+			startWake = WakeLocked(edgeMicroseconds);
+		}
+		if (startWake) StartWake();
+	}
+
+	bool IdlePreviewSource::WakeLocked(int64_t startMicroseconds)
+	{
+		if (_state == State::FallingAsleep)
+		{
+			// Woken again as soon as the preview has stopped
+			if (!_wakePending) _wakeStart = startMicroseconds;
+			_wakePending = true;
+			return false;
+		}
+		if (_state != State::Asleep) return false;
+
+		_state = State::Waking;
+		_wakeStart = startMicroseconds;
+		_stats.wakes++;
+		_stats.asleepMicroseconds += _scheduler.Now() - _asleepSince;
+		return true;
+	}
+
+	void IdlePreviewSource::CaptureAsync(FrameHandler handler)
+	{
+		bool queued = false;
+		bool startWake = false;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			int64_t now = _scheduler.Now();
+			_lastActivity = now;
+
+			// The preview was started again from outside, e.g. when the app resumed
+			if (_state == State::Asleep && _camera.IsReady())
+			{
+				_state = State::Awake;
+				_stats.asleepMicroseconds += now - _asleepSince;
+				if (_idleMicroseconds > 0) ScheduleCheck(_idleMicroseconds);
+			}
+
+			if (_state != State::Awake)
+			{
+				_waiting.push_back(std::move(handler));
+				queued = true;
+				startWake = WakeLocked(now);
+			}
+		}
+
+		if (startWake) StartWake();
+		else if (!queued) _camera.CaptureAsync(handler);
+	}
+
+	void IdlePreviewSource::StartWake()
+	{
+		_wake([this](bool ok) { OnAwake(ok); });
+	}
+
+	void IdlePreviewSource::OnAwake(bool ok)
+	{
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			ok = ok || _camera.IsReady();
+			if (ok)
+			{
+				_state = State::Awake;
+				if (_idleMicroseconds > 0) ScheduleCheck(_idleMicroseconds);
+			}
+			else
+			{
+				_state = State::Asleep;
+				_asleepSince = _scheduler.Now();
+				_stats.failedWakes++;
+			}
+		}
+
+		// The first capture that waited is timed from the wake to its frame
+		PassWaiting(ok, ok);
+	}
+
+	// One at a time, without the lock, as the camera may call back right away. Stops if the
+	// preview changes state meanwhile; whatever is left waits for the next change.
+	void IdlePreviewSource::PassWaiting(bool ok, bool timeFirst)
+	{
+		bool first = timeFirst;
+		for (;;)
+		{
+			FrameHandler handler;
+			bool timed = false;
+			{
+				std::lock_guard<std::mutex> lock(_lock);
+				if (_waiting.empty() || _state != (ok ? State::Awake : State::Asleep)) break;
+				handler.swap(_waiting.back());
+				_waiting.pop_back();
+				if (first && !_firstFrame)
+				{
+					_firstFrame.swap(handler);
+					timed = true;
+				}
+			}
+			first = false;
+
+			if (!ok)
+			{
+				cv::Mat noFrame;
+				handler(noFrame);
+			}
+			else if (timed)
+			{
+				_camera.CaptureAsync([this](cv::Mat& frame) { OnFirstFrame(frame); });
+			}
+			else
+			{
+				_camera.CaptureAsync(handler);
+			}
+		}
+	}
+
+	void IdlePreviewSource::OnFirstFrame(cv::Mat& frame)
+	{
+		FrameHandler handler;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			handler.swap(_firstFrame);
+			if (!frame.empty())
+			{
+				int64_t wakeToFrame = _scheduler.Now() - _wakeStart;
+				_stats.timedWakes++;
+				_stats.wakeToFrameMicroseconds += wakeToFrame;
+				_stats.maxWakeToFrameMicroseconds = std::max(_stats.maxWakeToFrameMicroseconds, wakeToFrame);
+#if PETDOOR_PROFILING
+				Instrumentation::Record(Stage::WakeToFrame, wakeToFrame);
+#endif
+			}
+		}
+		handler(frame);
+	}
+
+	void IdlePreviewSource::OnAsleep(bool ok)
+	{
+		bool startWake = false;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			bool wakePending = _wakePending;
+			_wakePending = false;
+			if (ok)
+			{
+				_state = State::Asleep;
+				_asleepSince = _scheduler.Now();
+				_stats.sleeps++;
+				// Woken or asked for a frame while it stopped
+				if (wakePending) startWake = WakeLocked(_wakeStart);
+			}
+			else
+			{
+				// Still previewing
+				_state = State::Awake;
+				if (_idleMicroseconds > 0) ScheduleCheck(_idleMicroseconds);
+			}
+		}
+
+		if (startWake) StartWake();
+		else if (!ok) PassWaiting(true, false);
+	}
+
+	void IdlePreviewSource::ScheduleCheck(int64_t delayMicroseconds)
+	{
+		_scheduler.Schedule(std::max<int64_t>(delayMicroseconds, IDLE_PREVIEW_MIN_CHECK_MICROSECONDS), [this]() { CheckIdle(); });
+	}
+
+	// One check is scheduled at a time, and only while awake; going to sleep ends the chain and waking starts it again
+	void IdlePreviewSource::CheckIdle()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			if (_state != State::Awake) return;
+
+			int64_t idleFor = _scheduler.Now() - _lastActivity;
+			if (idleFor < _idleMicroseconds)
+			{
+				ScheduleCheck(_idleMicroseconds - idleFor);
+				return;
+			}
+
+			// A preview that is not running, e.g. while the app is suspended, has nothing to stop
+			if (!_camera.IsReady() || _firstFrame)
+			{
+				ScheduleCheck(_idleMicroseconds);
+				return;
+			}
+			_state = State::FallingAsleep;
+		}
+
+		_sleep([this](bool ok) { OnAsleep(ok); });
+	}
+
+	IdlePreviewStats IdlePreviewSource::Stats()
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		IdlePreviewStats stats = _stats;
+		if (_state == State::Asleep) stats.asleepMicroseconds += _scheduler.Now() - _asleepSince;
+		return stats;
+	}
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "Hal.h"
+
+#include <mutex>
+#include <vector>
+
+namespace PetDoor
+{
+	// Counts since the source was created
+	struct IdlePreviewStats
+	{
+		uint64_t sleeps;
+		uint64_t wakes;
+		// Including the current sleep, if asleep
+		int64_t asleepMicroseconds;
+		// Wakes that failed; the captures waiting for them got no frame
+		uint64_t failedWakes;
+		// Wake to the first frame of a capture that waited for it, over the wakes that had one
+		uint64_t timedWakes;
+		int64_t wakeToFrameMicroseconds;
+		int64_t maxWakeToFrameMicroseconds;
+	};
+
+	// A camera whose preview is stopped while the door is idle. After idleMicroseconds without a
+	// capture or a Wake, the preview is put to sleep; the camera itself stays initialized, so the
+	// next capture or Wake only has to restart the stream. Captures asked for meanwhile wait for
+	// the wake and are then passed on, so an outdoor edge that finds the camera asleep still gets
+	// its frame. Captures made straight on the wrapped camera, such as clip frames, neither count
+	// as activity nor wake it.
+	class IdlePreviewSource : public IFrameSource
+	{
+	public:
+		// ok: whether the preview stopped or started. May be called on any thread, also from within the transition.
+		typedef std::function<void(bool ok)> Done;
+		typedef std::function<void(Done done)> Transition;
+
+		// The camera and the scheduler must outlive the source, and the source any work it has
+		// scheduled. An idleMicroseconds of 0 never puts the preview to sleep.
+		IdlePreviewSource(IFrameSource& camera, IScheduler& scheduler, int64_t idleMicroseconds, Transition sleep, Transition wake);
+
+		// Wakes the preview, e.g. on a PIR edge, and keeps it awake for another idle period
+		void Wake(int64_t edgeMicroseconds);
+
+		bool IsAwake();
+
+		// Also ready while asleep, as a capture wakes the preview
+		bool IsReady() override;
+		void CaptureAsync(FrameHandler handler) override;
+
+		IdlePreviewStats Stats();
+
+	private:
+		enum class State
+		{
+			Awake,
+			FallingAsleep,
+			Asleep,
+			Waking
+		};
+
+		// Must be called with _lock held; returns true if the caller has to start the wake
+		bool WakeLocked(int64_t startMicroseconds);
+		void StartWake();
+		void OnAwake(bool ok);
+		void PassWaiting(bool ok, bool timeFirst);
+		void OnAsleep(bool ok);
+		void OnFirstFrame(cv::Mat& frame);
+		void ScheduleCheck(int64_t delayMicroseconds);
+		void CheckIdle();
+
+		IFrameSource& _camera;
+		IScheduler& _scheduler;
+		int64_t _idleMicroseconds;
+		Transition _sleep;
+		Transition _wake;
+
+		std::mutex _lock;
+		State _state;
+		int64_t _lastActivity;
+		int64_t _asleepSince;
+		// Woken while falling asleep, so it wakes as soon as the preview has stopped
+		bool _wakePending;
+		// The edge or capture that started the last wake, and the capture it is being timed with
+		int64_t _wakeStart;
+		FrameHandler _firstFrame;
+		// Captures asked for while the preview was asleep or on its way, reserved up front
+		std::vector<FrameHandler> _waiting;
+		IdlePreviewStats _stats;
+	};
+}
@@ -0,0 +1,170 @@
+#include "Instrumentation.h"
+#include "LatencyBuckets.h"
+
+#include <atomic>
+#include <mutex>
+#include <sstream>
+
+namespace PetDoor
+{
+	const char* StageName(Stage stage)
+	{
+		switch (stage)
+		{
+		case Stage::EdgeToHandler: return "EdgeToHandler";
+		case Stage::GetPreviewFrame: return "GetPreviewFrame";
+		case Stage::SoftwareBitmapToMat: return "SoftwareBitmapToMat";
+		case Stage::Preprocess: return "Preprocess";
+		case Stage::Detect: return "Detect";
+		case Stage::RotationSweep: return "RotationSweep";
+		case Stage::Identify: return "Identify";
+		case Stage::Annotate: return "Annotate";
+		case Stage::Dispatch: return "Dispatch";
+		case Stage::ShowFrame: return "ShowFrame";
+		case Stage::DecisionToSave: return "DecisionToSave";
+		case Stage::EdgeToServo: return "EdgeToServo";
+		case Stage::WakeToFrame: return "WakeToFrame";
+		default: return "Unknown";
+		}
+	}
+
+#if PETDOOR_PROFILING
+	namespace Instrumentation
+	{
+		namespace
+		{
+			const int StageCount = static_cast<int>(Stage::Count);
+
+			// Written only by its owning thread, read by Snapshot from any thread
+			struct ThreadHistograms
+			{
+				std::atomic<uint32_t> counts[StageCount][LatencyBuckets::Count];
+				std::atomic<uint64_t> totalMicroseconds[StageCount];
+
+				ThreadHistograms()
+				{
+					for (int stage = 0; stage < StageCount; stage++)
+					{
+						for (int bucket = 0; bucket < LatencyBuckets::Count; bucket++)
+						{
+							counts[stage][bucket].store(0, std::memory_order_relaxed);
+						}
+						totalMicroseconds[stage].store(0, std::memory_order_relaxed);
+					}
+				}
+			};
+
+			// Every thread that has recorded a sample. Histograms are never freed: the
+			// samples of a thread pool thread that exits still count, and the number of
+			// threads that ever run the detection path is small.
+			std::mutex registryLock;
+			std::vector<ThreadHistograms*>& Registry()
+			{
+				static std::vector<ThreadHistograms*> registry;
+				return registry;
+			}
+
+			ThreadHistograms& CurrentThreadHistograms()
+			{
+				thread_local ThreadHistograms* histograms = nullptr;
+				if (histograms == nullptr)
+				{
+					histograms = new ThreadHistograms();
+					std::lock_guard<std::mutex> lock(registryLock);
+					Registry().push_back(histograms);
+				}
+				return *histograms;
+			}
+
+			// Single writer, so a relaxed load and store is enough
+			template <typename T>
+			void Increment(std::atomic<T>& counter, T amount)
+			{
+				counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+			}
+		}
+
+		void Record(Stage stage, int64_t microseconds)
+		{
+			uint64_t elapsed = microseconds > 0 ? static_cast<uint64_t>(microseconds) : 0;
+			int index = static_cast<int>(stage);
+
+			ThreadHistograms& histograms = CurrentThreadHistograms();
+			Increment<uint32_t>(histograms.counts[index][LatencyBuckets::Index(elapsed)], 1);
+			Increment<uint64_t>(histograms.totalMicroseconds[index], elapsed);
+		}
+
+		std::vector<StageSummary> Snapshot()
+		{
+			uint64_t counts[StageCount][LatencyBuckets::Count] = {};
+			uint64_t totals[StageCount] = {};
+			{
+				std::lock_guard<std::mutex> lock(registryLock);
+				for (ThreadHistograms* histograms : Registry())
+				{
+					for (int stage = 0; stage < StageCount; stage++)
+					{
+						for (int bucket = 0; bucket < LatencyBuckets::Count; bucket++)
+						{
+							counts[stage][bucket] += histograms->counts[stage][bucket].load(std::memory_order_relaxed);
+						}
+						totals[stage] += histograms->totalMicroseconds[stage].load(std::memory_order_relaxed);
+					}
+				}
+			}
+
+			std::vector<StageSummary> summaries;
+			summaries.reserve(StageCount);
+			for (int stage = 0; stage < StageCount; stage++)
+			{
+				StageSummary summary = {};
+				summary.stage = static_cast<Stage>(stage);
+				for (int bucket = 0; bucket < LatencyBuckets::Count; bucket++)
+				{
+					summary.count += counts[stage][bucket];
+				}
+				if (summary.count > 0)
+				{
+					summary.meanMicroseconds = totals[stage] / summary.count;
+					summary.p50Microseconds = LatencyBuckets::Percentile(counts[stage], 0.50);
+					summary.p95Microseconds = LatencyBuckets::Percentile(counts[stage], 0.95);
+					summary.p99Microseconds = LatencyBuckets::Percentile(counts[stage], 0.99);
+				}
+				summaries.push_back(summary);
+			}
+			return summaries;
+		}
+
+		void Reset()
+		{
+			std::lock_guard<std::mutex> lock(registryLock);
+			for (ThreadHistograms* histograms : Registry())
+			{
+				for (int stage = 0; stage < StageCount; stage++)
+				{
+					for (int bucket = 0; bucket < LatencyBuckets::Count; bucket++)
+					{
+						histograms->counts[stage][bucket].store(0, std::memory_order_relaxed);
+					}
+					histograms->totalMicroseconds[stage].store(0, std::memory_order_relaxed);
+				}
+			}
+		}
+
+		std::string FormatSummary()
+		{
+			std::ostringstream summary;
+			for (auto& stage : Snapshot())
+			{
+				if (stage.count == 0) continue;
+				summary << StageName(stage.stage) << ": n=" << stage.count
+					<< " mean=" << stage.meanMicroseconds << "us"
+					<< " p50=" << stage.p50Microseconds << "us"
+					<< " p95=" << stage.p95Microseconds << "us"
+					<< " p99=" << stage.p99Microseconds << "us\n";
+			}
+			return summary.str();
+		}
+	}
+#endif
+}
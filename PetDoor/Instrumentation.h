@@ -0,0 +1,111 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Set to 0 to compile the stage timers out entirely
+#ifndef PETDOOR_PROFILING
+#define PETDOOR_PROFILING 1
+#endif
+
+namespace PetDoor
+{
+	// Where time goes between the outdoor PIR edge and the servo command
+	enum class Stage
+	{
+		// PIR edge to the outdoor handler starting
+		EdgeToHandler,
+		// MediaCapture::GetPreviewFrameAsync request to its continuation
+		GetPreviewFrame,
+		SoftwareBitmapToMat,
+		// cvtColor and equalizeHist
+		Preprocess,
+		// detectMultiScale
+		Detect,
+		// Rotated scans after the upright one found no cat
+		RotationSweep,
+		// Detected faces matched against the enrolled pets
+		Identify,
+		// Rectangles and labels drawn over the detected faces
+		Annotate,
+		// Annotated frame handed to the UI thread to its handler running
+		Dispatch,
+		// Annotated frame converted for PreviewFrameImage, dispatched and shown; not run headless
+		ShowFrame,
+		// Door decision to its captures being handed to the capture store
+		DecisionToSave,
+		// PIR edge to rightServo->Rotate
+		EdgeToServo,
+		// Idle preview woken, by a PIR edge or a capture, to the first frame of a capture that waited for it
+		WakeToFrame,
+		Count
+	};
+
+	const char* StageName(Stage stage);
+
+	namespace Instrumentation
+	{
+		// Monotonic microseconds, for stamping the start of spans that cross threads or tasks
+		inline int64_t Now()
+		{
+			return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+		struct StageSummary
+		{
+			Stage stage;
+			uint64_t count;
+			uint64_t meanMicroseconds;
+			uint64_t p50Microseconds;
+			uint64_t p95Microseconds;
+			uint64_t p99Microseconds;
+		};
+
+#if PETDOOR_PROFILING
+		// Counts one sample into the calling thread's histogram. Each thread only
+		// ever writes its own histograms, so this takes no lock and no interlocked
+		// operation; two clock reads and a couple of stores per stage is far below
+		// 1% of a detection pass.
+		void Record(Stage stage, int64_t microseconds);
+
+		// Merges every thread's histograms; samples recorded meanwhile may or may not be included
+		std::vector<StageSummary> Snapshot();
+
+		// Zeroes every histogram, e.g. after warming up. Only exact while no other thread is recording.
+		void Reset();
+
+		// One line per stage that has samples, for the debug output
+		std::string FormatSummary();
+
+		// Times the enclosing scope
+		class ScopedStageTimer
+		{
+		public:
+			explicit ScopedStageTimer(Stage stage) : _stage(stage), _start(Now()) {}
+			~ScopedStageTimer() { Record(_stage, Now() - _start); }
+
+		private:
+			ScopedStageTimer(const ScopedStageTimer&);
+			ScopedStageTimer& operator=(const ScopedStageTimer&);
+
+			Stage _stage;
+			int64_t _start;
+		};
+#endif
+	}
+}
+
+#define PETDOOR_CONCAT_INNER(a, b) a##b
+#define PETDOOR_CONCAT(a, b) PETDOOR_CONCAT_INNER(a, b)
+
+#if PETDOOR_PROFILING
+// Times the rest of the enclosing scope as the given stage
+#define PETDOOR_TIME_STAGE(stage) ::PetDoor::Instrumentation::ScopedStageTimer PETDOOR_CONCAT(_stageTimer, __LINE__)(stage)
+// Records a span that started at startMicroseconds (from Instrumentation::Now) and ends now
+#define PETDOOR_RECORD_SPAN(stage, startMicroseconds) ::PetDoor::Instrumentation::Record(stage, ::PetDoor::Instrumentation::Now() - (startMicroseconds))
+#else
+#define PETDOOR_TIME_STAGE(stage)
+#define PETDOOR_RECORD_SPAN(stage, startMicroseconds)
+#endif
@@ -0,0 +1,89 @@
+#include "JpegFrameEncoder.h"
+#include "Instrumentation.h"
+#include "VisionCore.h"
+
+#include <algorithm>
+#include <opencv2/imgcodecs/imgcodecs.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+namespace PetDoor
+{
+	JpegFrameEncoder::JpegFrameEncoder(IScheduler& scheduler, int frameWidth, int jpegQuality, FrameHandler handler)
+		: _scheduler(scheduler)
+		, _frameWidth(frameWidth)
+		, _jpegParams({ cv::IMWRITE_JPEG_QUALITY, jpegQuality })
+		, _handler(handler)
+		, _waitingTimestamp(0)
+		, _hasWaiting(false)
+		, _encoding(false)
+		, _encoderBytes(0)
+	{
+	}
+
+	bool JpegFrameEncoder::Submit(const cv::Mat& rgba, int64_t timestampMicroseconds, const std::vector<cv::Rect>& objects)
+	{
+		bool replaced;
+		bool startEncoding;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			replaced = _hasWaiting;
+			rgba.copyTo(_waiting);
+			_waitingObjects.assign(objects.begin(), objects.end());
+			_waitingTimestamp = timestampMicroseconds;
+			_hasWaiting = true;
+			startEncoding = !_encoding;
+			_encoding = true;
+		}
+
+		if (startEncoding)
+		{
+			_scheduler.Schedule(0, [this]() { EncodeWaiting(); });
+		}
+		return !replaced;
+	}
+
+	// Encodes waiting frames until there are none
+	void JpegFrameEncoder::EncodeWaiting()
+	{
+		for (;;)
+		{
+			int64_t timestamp;
+			{
+				std::lock_guard<std::mutex> lock(_lock);
+				if (!_hasWaiting)
+				{
+					_encoding = false;
+					return;
+				}
+				cv::swap(_waiting, _frame);
+				_objects.swap(_waitingObjects);
+				timestamp = _waitingTimestamp;
+				_hasWaiting = false;
+			}
+
+			int64_t start = Instrumentation::Now();
+			int width = std::min(_frameWidth, _frame.cols);
+			int height = std::max(1, _frame.rows * width / _frame.cols);
+			cv::resize(_frame, _scaled, cv::Size(width, height), 0, 0, cv::INTER_AREA);
+			drawRectOverObjects(_scaled, _objects, static_cast<double>(width) / _frame.cols);
+			cv::cvtColor(_scaled, _bgr, cv::COLOR_RGBA2BGR);
+			cv::imencode(".jpg", _bgr, _jpeg, _jpegParams);
+
+			EncodedFrame encoded = { _jpeg, _bgr.size(), timestamp, Instrumentation::Now() - start };
+			size_t encoderBytes = _frame.total() * _frame.elemSize() + _scaled.total() * _scaled.elemSize()
+				+ _bgr.total() * _bgr.elemSize() + _jpeg.capacity() + _objects.capacity() * sizeof(cv::Rect);
+			{
+				std::lock_guard<std::mutex> lock(_lock);
+				_encoderBytes = encoderBytes;
+			}
+
+			_handler(encoded);
+		}
+	}
+
+	size_t JpegFrameEncoder::MemoryBytes()
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		return _waiting.total() * _waiting.elemSize() + _encoderBytes;
+	}
+}
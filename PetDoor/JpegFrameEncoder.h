@@ -0,0 +1,69 @@
+#pragma once
+
+#include "Hal.h"
+
+#include <functional>
+#include <mutex>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+namespace PetDoor
+{
+	// One frame as it comes out of the encoder
+	struct EncodedFrame
+	{
+		// Only valid for the duration of the handler; the buffer is reused for the next frame
+		const std::vector<unsigned char>& jpeg;
+		cv::Size size;
+		// As given to Submit
+		int64_t timestampMicroseconds;
+		// Scaling, annotating, converting and compressing it
+		int64_t encodeMicroseconds;
+	};
+
+	// Scales RGBA frames down to a width and compresses them to JPEG as work on the
+	// scheduler, away from the caller's thread. Submit only copies the frame; if the
+	// encoder is still busy when the next frame arrives, the waiting frame is replaced,
+	// so frames never queue up behind a slow encode.
+	class JpegFrameEncoder
+	{
+	public:
+		// Called on a scheduler thread for each frame encoded, one at a time
+		typedef std::function<void(const EncodedFrame& frame)> FrameHandler;
+
+		// The encoder must outlive the work it schedules
+		JpegFrameEncoder(IScheduler& scheduler, int frameWidth, int jpegQuality, FrameHandler handler);
+
+		// Queues an RGBA frame. objects, in frame coordinates, are drawn over the scaled copy
+		// that is encoded. Returns false if it replaced a frame still waiting for the encoder.
+		bool Submit(const cv::Mat& rgba, int64_t timestampMicroseconds, const std::vector<cv::Rect>& objects = std::vector<cv::Rect>());
+
+		// What the waiting frame and the encoding buffers hold
+		size_t MemoryBytes();
+
+	private:
+		void EncodeWaiting();
+
+		IScheduler& _scheduler;
+		int _frameWidth;
+		std::vector<int> _jpegParams;
+		FrameHandler _handler;
+
+		std::mutex _lock;
+		// The newest frame not yet encoded, and whether there is one
+		cv::Mat _waiting;
+		std::vector<cv::Rect> _waitingObjects;
+		int64_t _waitingTimestamp;
+		bool _hasWaiting;
+		bool _encoding;
+		// What the buffers below hold, updated under _lock by the encoding work
+		size_t _encoderBytes;
+
+		// Only touched by the encoding work, one at a time
+		cv::Mat _frame;
+		std::vector<cv::Rect> _objects;
+		cv::Mat _scaled;
+		cv::Mat _bgr;
+		std::vector<unsigned char> _jpeg;
+	};
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+
+namespace PetDoor
+{
+	// Log-linear latency histogram buckets in microseconds: every power of two
+	// is split into four equal buckets, so a percentile read back from the
+	// buckets is at most 25% above the true value. 100 buckets cover up to
+	// about a minute; anything slower lands in the last bucket.
+	namespace LatencyBuckets
+	{
+		const int Count = 100;
+
+		inline int Index(uint64_t microseconds)
+		{
+			if (microseconds < 4) return static_cast<int>(microseconds);
+
+			int msb = 0;
+			for (uint64_t v = microseconds; v > 1; v >>= 1) msb++;
+
+			// The two bits below the most significant one pick the quarter of the octave
+			int quarter = static_cast<int>((microseconds >> (msb - 2)) & 3);
+			int index = (msb - 1) * 4 + quarter;
+			return index < Count ? index : Count - 1;
+		}
+
+		// Smallest latency that no longer falls into the bucket
+		inline uint64_t UpperBound(int index)
+		{
+			if (index < 4) return static_cast<uint64_t>(index) + 1;
+
+			int msb = index / 4 + 1;
+			int quarter = index % 4;
+			return static_cast<uint64_t>(5 + quarter) << (msb - 2);
+		}
+
+		// Latency below which the given fraction (0..1) of the counted samples fall.
+		// Counter is any integral type, or an atomic read through its conversion.
+		template <typename Counter>
+		uint64_t Percentile(const Counter* counts, double fraction)
+		{
+			uint64_t total = 0;
+			for (int i = 0; i < Count; i++) total += static_cast<uint64_t>(counts[i]);
+			if (total == 0) return 0;
+
+			uint64_t rank = static_cast<uint64_t>(fraction * total);
+			if (rank >= total) rank = total - 1;
+
+			uint64_t seen = 0;
+			for (int i = 0; i < Count; i++)
+			{
+				seen += static_cast<uint64_t>(counts[i]);
+				if (seen > rank) return UpperBound(i);
+			}
+			return UpperBound(Count - 1);
+		}
+	}
+}
@@ -8,6 +8,10 @@
 #include <ppltasks.h>
 #include "MotionSensor.h"
 #include "Servo.h"
+#include "TimeSpanHelper.h"
+#include "VisionCore.h"
+#include <cfloat>
+#include <chrono>
 
 
 
@@ -57,13 +61,41 @@ using namespace Windows::UI::Xaml::Navigation;
 // The Blank Page item template is documented at https://go.microsoft.com/fwlink/?LinkId=402352&clcid=0x409
 
 
-#define LEFT_SERVO 2 // 2nd channel on PC9685
-#define RIGHT_SERVO 3 // 3rd channel on PCA9685
-#define MOTION_SENSOR_PIN_OUTDOOR 26
-#define MOTION_SENSOR_PIN_INDOOR 19
 #define MOTION_SENSOR_TIMER_INTERVAL 1 // In seconds
+#define ROLLUP_FLUSH_INTERVAL 10 // In seconds
+#define INSTRUMENTATION_SUMMARY_INTERVAL 60 // In seconds
+#define PET_IDENTITY_BUDGET_MS 20 // Time allowed for matching the cat faces of a frame against the enrolled pets
+#define ROTATION_SWEEP_ANGLES { 15.0, -15.0, 30.0, -30.0 } // In degrees, tried when no upright cat face is found; {} turns the sweep off
+#define RETRAINED_CAT_CASCADE L"CatFaceCascade.xml" // In LocalState, written by tools/CascadeTrainer
+#define NEGATIVE_MINING_INTERVAL 10 // In seconds; at most one blocked capture is mined per interval
+#define NEGATIVE_MINING_QUIET_MS 5000 // No mining starts this soon after a detection
+#define NEGATIVE_MINING_QUEUE 64 // Blocked captures waiting to be mined; the oldest are dropped
+#define MAX_CAMERAS 3 // Cameras the door uses at most; the back panel camera, or the first found, is shown and decides entries
+#define EXTRA_CAMERAS_DECIDE_ENTRY false // true if the other cameras watch the outside from another angle; false if they watch the indoor side
+#define DETECTOR_WORKERS 2 // Detections run at once, across all cameras
+#define BACKGROUND_SCAN_INTERVAL 5 // In seconds, between scans of each camera that does not decide entries
+#define CLIP_FRAME_INTERVAL_MS 200 // Between the frames of the main camera kept for event clips
+#define STREAM_PORT 8080 // Of the MJPEG stream of detection frames, http://<device>:8080/, when stream.enabled is set in DoorConfig.txt
+#define CONFIG_POLL_INTERVAL 2 // In seconds, between checks of DoorConfig.txt for changes
+#define CAPTURE_FOLDER L"PetDoor" // In the Pictures library; the capture store manages, and deletes from, this folder only
+#define HEADLESS false // true for units without a display; outdoor frames are then not shown or dispatched to the UI thread
+#define UI_MAX_UPDATES_PER_SECOND 10 // Outdoor frames shown at most; a burst of triggers shows its latest frame
+#define PREVIEW_IDLE_TIMEOUT 120 // In seconds without an outdoor trigger or indoor motion before the main camera's preview stops; 0 keeps it running
 
 
+/// <summary>
+/// CPU time the app has used so far, all threads together
+/// </summary>
+uint64_t ProcessCpuMicroseconds()
+{
+	FILETIME creation, exited, kernel, user;
+	if (!GetProcessTimes(GetCurrentProcess(), &creation, &exited, &kernel, &user)) return 0;
+
+	// In 100 ns units
+	auto ticks = [](const FILETIME& time) { return (static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime; };
+	return (ticks(kernel) + ticks(user)) / 10;
+}
+
 MainPage::MainPage()
 	: _mediaCapture(nullptr)
 	, _isInitialized(false)
@@ -74,17 +106,262 @@ MainPage::MainPage()
 	, _displayRequest(ref new Windows::System::Display::DisplayRequest())
 	, RotationKey({ 0xC380465D, 0x2271, 0x428C,{ 0x9B, 0x83, 0xEC, 0xEA, 0x3B, 0x4A, 0x85, 0xC1 } })
 	, _captureFolder(nullptr)
+	, _persistenceMode(PersistenceMode::CropsAndThumbnail)
+	, _miningCancel(false)
+	, _mining(false)
+	, _lastDetection(0)
+	, _miningTimer(nullptr)
+	, _backgroundScanTimer(nullptr)
+	, _clipFrameTimer(nullptr)
+	, _configModified(0)
+	, _configTimer(nullptr)
+	, _headless(HEADLESS)
+#if PETDOOR_PROFILING
+	, _summaryCpuMicroseconds(0)
+	, _summaryMicroseconds(0)
+	, _summaryAsleepMicroseconds(0)
+	, _outdoorFrames(0)
+#endif
 {
 	InitializeComponent();
-	// load in the cat classifier
-	const cv::String cat_cascade_name = "Assets/haarcascade_frontalcatface_extended.xml";
+	// The camera previews stay, as preview frames are only delivered to a running preview
+	if (_headless) {
+		PreviewFrameImage->Visibility = Windows::UI::Xaml::Visibility::Collapsed;
+		FrameInfoTextBlock->Visibility = Windows::UI::Xaml::Visibility::Collapsed;
+	}
+	else {
+		// Outdoor frames reach the UI thread through the mailbox, newest first, so bursts do not queue up there
+		_uiMailbox.reset(new UiMailbox(_scheduler, static_cast<size_t>(UiSlot::Count), 1000000 / UI_MAX_UPDATES_PER_SECOND,
+			[](std::function<void()> render)
+		{
+			try
+			{
+				CoreApplication::MainView->CoreWindow->Dispatcher->RunAsync(CoreDispatcherPriority::High, ref new DispatchedHandler([render]()
+				{
+					render();
+				}));
+				return true;
+			}
+			catch (Platform::Exception^)
+			{
+				return false;
+			}
+		}));
+	}
+	// load in the cat classifier, and the human face classifier that vetoes cat faces on people
+	const std::string cat_cascade_name = "Assets/haarcascade_frontalcatface_extended.xml";
+	const std::string human_cascade_name = "Assets/haarcascade_frontalface_default.xml";
 	_displayInformation = DisplayInformation::GetForCurrentView();
 	_systemMediaControls = SystemMediaTransportControls::GetForCurrentView();
 
-	if (!cat_cascade.load(cat_cascade_name)) {
-		printf("Couldnt load cat detector '%s'\n", cat_cascade_name);
+	// A cascade retrained by CascadeTrainer on this door's captures and copied to LocalState wins over the
+	// shipped one; if it is missing or unreadable the shipped cascade is used
+	std::wstring localFolder(ApplicationData::Current->LocalFolder->Path->Data());
+	std::wstring retrainedCascade = localFolder + L"\\" + RETRAINED_CAT_CASCADE;
+	std::string active_cascade_name(retrainedCascade.begin(), retrainedCascade.end());
+	for (int i = 0; i < DETECTOR_WORKERS; i++) {
+		_catFaceDetectors.emplace_back(new CatFaceDetector());
+	}
+	CatFaceDetector& catFaceDetector = *_catFaceDetectors[0];
+	bool retrained = false;
+	try
+	{
+		retrained = catFaceDetector.Load(active_cascade_name, human_cascade_name);
+	}
+	catch (cv::Exception&)
+	{
+		// Not a cascade file
+	}
+	if (retrained) {
+		OutputDebugString(L"Using the retrained cat cascade\n");
+	}
+	else if (catFaceDetector.Load(cat_cascade_name, human_cascade_name)) {
+		active_cascade_name = cat_cascade_name;
+	}
+	else {
+		printf("Couldnt load cat detector '%s'\n", cat_cascade_name.c_str());
 		exit(1);
 	}
+	if (!catFaceDetector.HasHumanVeto()) {
+		OutputDebugString(L"Couldn't load the human face detector; cat faces will not be checked against human faces\n");
+	}
+	std::vector<double> sweepAngles = ROTATION_SWEEP_ANGLES;
+	std::shared_ptr<const DoorConfigSnapshot> config = _config.Current();
+	for (auto& detector : _catFaceDetectors) {
+		if (detector.get() != &catFaceDetector && !detector->Load(active_cascade_name, human_cascade_name)) {
+			printf("Couldnt load cat detector '%s'\n", active_cascade_name.c_str());
+			exit(1);
+		}
+		detector->Configure(config->config.detection);
+		_detectorConfigVersions.push_back(config->version);
+		if (!detector->SetRotationSweep(sweepAngles)) {
+			OutputDebugString(L"Couldn't set up the rotation sweep; only upright cat faces will be found\n");
+		}
+	}
+
+	// Every camera has a frame source from the start, so the pool knows them all; they are attached as the cameras start
+	for (int i = 0; i < MAX_CAMERAS; i++) {
+		_frameSources.emplace_back(new MediaCaptureFrameSource());
+	}
+
+	// The main camera stops previewing while the door is idle and starts again on the next trigger; MediaCapture
+	// stays initialized, so waking only restarts the stream
+	_idlePreview.reset(new IdlePreviewSource(*_frameSources[0], _scheduler, PREVIEW_IDLE_TIMEOUT * 1000000LL,
+		[this](IdlePreviewSource::Done done)
+	{
+		RunPreviewTransition(false, done);
+	},
+		[this](IdlePreviewSource::Done done)
+	{
+		RunPreviewTransition(true, done);
+	}));
+
+	// Door activity is journaled to local app storage; the door keeps working without it
+	try
+	{
+		_eventJournal.reset(new EventJournal(localFolder + L"\\DoorEvents.bin"));
+	}
+	catch (Platform::Exception^ ex)
+	{
+		WriteException(ex);
+	}
+
+	// Rollups are rebuilt from the journal if their file is missing, e.g. on the first run after an update
+	_activityRollups.reset(new ActivityRollups(localFolder + L"\\DoorActivity.bin"));
+	if (!_activityRollups->Loaded() && _eventJournal)
+	{
+		EventJournalReader journalReader(_eventJournal->Path());
+		for (auto& record : journalReader)
+		{
+			_activityRollups->Record(record);
+		}
+		_activityRollups->Flush();
+	}
+
+	// Pets are enrolled from saved crops copied to LocalState\Pets\<name>\; with no pets enrolled any cat is let in.
+	// The app's local folder path is plain ASCII, which OpenCV's narrow file APIs need.
+	std::wstring petsFolder = localFolder + L"\\Pets";
+	try
+	{
+		size_t enrolled = _petGallery.EnrollDirectory(std::string(petsFolder.begin(), petsFolder.end()), CAPTURE_CROP_PADDING);
+		wchar_t gallery[96];
+		swprintf_s(gallery, L"Enrolled %u faces of %u pets\n", static_cast<unsigned int>(enrolled), static_cast<unsigned int>(_petGallery.PetCount()));
+		OutputDebugString(gallery);
+	}
+	catch (cv::Exception&)
+	{
+		// No Pets folder
+	}
+
+	// Negatives are mined with the cascade the door uses, so they are the windows it gets wrong
+	if (_negativeMiner.Load(active_cascade_name, human_cascade_name))
+	{
+		create_task(ApplicationData::Current->LocalFolder->CreateFolderAsync(L"Negatives", CreationCollisionOption::OpenIfExists))
+			.then([this](StorageFolder^ folder)
+		{
+			std::wstring negativesFolder(folder->Path->Data());
+			_negativeStore.reset(new NegativeStore(std::string(negativesFolder.begin(), negativesFolder.end())));
+			_negativeStore->Load();
+
+			Windows::Foundation::TimeSpan miningInterval = { TimeSpanHelper::FromSeconds(NEGATIVE_MINING_INTERVAL).get_Ticks() };
+			_scheduler.SchedulePeriodic(miningInterval, [this]()
+			{
+				MineNextFrame();
+			});
+		}).then([this](task<void> previousTask)
+		{
+			try
+			{
+				previousTask.get();
+			}
+			catch (Platform::Exception^ ex)
+			{
+				WriteException(ex);
+			}
+		});
+	}
+
+	// Frames for the event clips are taken on a timer thread and only copied there; the recorder compresses them on the thread pool
+	_clipRecorder.reset(new ClipRecorder(_scheduler));
+	_clipRecorder->SetClipHandler([this](const ClipInfo& info, std::shared_ptr<std::vector<unsigned char>> clip)
+	{
+		SaveClipAsync(info, clip);
+	});
+	Windows::Foundation::TimeSpan clipFrameInterval = { TimeSpanHelper::FromMilliseconds(CLIP_FRAME_INTERVAL_MS).get_Ticks() };
+	_scheduler.SchedulePeriodic(clipFrameInterval, [this]()
+	{
+		if (!_frameSources[0]->IsReady()) return;
+		_frameSources[0]->CaptureAsync([this](cv::Mat& frame)
+		{
+			_clipRecorder->Submit(frame, _scheduler.Now());
+		});
+	});
+
+	// Viewers on the network get the frames the door decided on, compressed once for all of them.
+	// Nothing is compressed until the server, started once DoorConfig.txt is read, has a viewer.
+	_streamer.reset(new MjpegStreamer(_scheduler));
+
+	Windows::Foundation::TimeSpan rollupFlushInterval = { TimeSpanHelper::FromSeconds(ROLLUP_FLUSH_INTERVAL).get_Ticks() };
+	_scheduler.SchedulePeriodic(rollupFlushInterval, [this]()
+	{
+		_activityRollups->Flush();
+	});
+
+#if PETDOOR_PROFILING
+	_summaryCpuMicroseconds = ProcessCpuMicroseconds();
+	_summaryMicroseconds = Instrumentation::Now();
+	Windows::Foundation::TimeSpan instrumentationInterval = { TimeSpanHelper::FromSeconds(INSTRUMENTATION_SUMMARY_INTERVAL).get_Ticks() };
+	_scheduler.SchedulePeriodic(instrumentationInterval, [this]()
+	{
+		std::string summary = Instrumentation::FormatSummary();
+		if (!summary.empty())
+		{
+			OutputDebugStringA(("Stage latencies:\n" + summary).c_str());
+		}
+
+		// Run once with HEADLESS and once without to see what showing the frames costs
+		uint64_t cpuMicroseconds = ProcessCpuMicroseconds();
+		int64_t now = Instrumentation::Now();
+		// ...and compare summaries with the preview asleep and awake to see what idling saves
+		IdlePreviewStats idle = _idlePreview->Stats();
+		std::wstringstream cpu;
+		cpu << "CPU (" << (_headless ? "headless" : "UI") << "): " << 100.0 * (cpuMicroseconds - _summaryCpuMicroseconds) / std::max<int64_t>(now - _summaryMicroseconds, 1)
+			<< "% of a core over " << _outdoorFrames.exchange(0) << " outdoor frames, preview asleep "
+			<< 100.0 * (idle.asleepMicroseconds - _summaryAsleepMicroseconds) / std::max<int64_t>(now - _summaryMicroseconds, 1) << "% of the time\n";
+		OutputDebugString(cpu.str().c_str());
+		_summaryCpuMicroseconds = cpuMicroseconds;
+		_summaryMicroseconds = now;
+		_summaryAsleepMicroseconds = idle.asleepMicroseconds;
+
+		if (idle.wakes > 0)
+		{
+			std::wstringstream report;
+			report << "Preview: " << idle.sleeps << " sleeps, " << idle.wakes << " wakes (" << idle.failedWakes << " failed), wake to first frame "
+				<< (idle.timedWakes > 0 ? idle.wakeToFrameMicroseconds / static_cast<int64_t>(idle.timedWakes) / 1000 : 0) << " ms mean, "
+				<< idle.maxWakeToFrameMicroseconds / 1000 << " ms max\n";
+			OutputDebugString(report.str().c_str());
+		}
+
+		MjpegStreamStats stream = _streamer->Stats();
+		if (stream.clientsServed > 0 || stream.clientsRefused > 0)
+		{
+			std::wstringstream report;
+			report << "Stream: " << stream.clients << " viewers, " << stream.framesEncoded << " frames encoded in "
+				<< stream.encodeMicroseconds / 1000 << " ms, " << stream.framesSent << " sent, " << stream.framesSkipped << " skipped by slow viewers, "
+				<< stream.clientsRefused << " viewers refused, " << stream.clientsTimedOut << " closed as stalled\n";
+			OutputDebugString(report.str().c_str());
+		}
+
+		if (_uiMailbox)
+		{
+			UiMailboxStats ui = _uiMailbox->Stats();
+			std::wstringstream report;
+			report << "UI: " << ui.posted << " updates posted, " << ui.rendered << " rendered in " << ui.renders << " batches, "
+				<< ui.coalesced << " coalesced, " << ui.dropped << " dropped\n";
+			OutputDebugString(report.str().c_str());
+		}
+	});
+#endif
 
 	// Cache the UI to have the checkboxes retain their state, as the enabled/disabled state of the
 	// GetPreviewFrameButton is reset in code when suspending/navigating (see Start/StopPreviewAsync)
@@ -97,13 +374,34 @@ MainPage::MainPage()
 		Application::Current->Resuming += ref new EventHandler<Object^>(this, &MainPage::Application_Resuming);
 
 
-	InitServos().then([this] {
+	// The pins, the camera geometry and the stream setting are read from DoorConfig.txt before the
+	// hardware is set up; everything else in it is picked up while the door runs
+	_configLoaded = ReloadConfigAsync();
+	_configLoaded.then([this] {
+		if (_config.Current()->config.stream.enabled) {
+			StartStreamServer();
+		}
+		return InitServos();
+	}).then([this] {
 		InitMotionSensors();
+
+		Windows::Foundation::TimeSpan configPollInterval = { TimeSpanHelper::FromSeconds(CONFIG_POLL_INTERVAL).get_Ticks() };
+		_scheduler.SchedulePeriodic(configPollInterval, [this]()
+		{
+			ReloadConfigAsync();
+		});
 	});
 	
 }
 
 MainPage::~MainPage() {
+	if (_uiMailbox) {
+		_uiMailbox->Close();
+	}
+	// The periodic timers, the detector pool, the door controller, the clip recorder, the stream and the
+	// idle preview all run on the scheduler: stop them, and wait for what is running, before any is torn down
+	_scheduler.Close();
+	_activityRollups->Flush();
 	Application::Current->Suspending -= _applicationSuspendingEventToken;
 	Application::Current->Resuming -= _applicationResumingEventToken;
 	_systemMediaControls->PropertyChanged -= _mediaControlPropChangedEventToken;
@@ -111,63 +409,344 @@ MainPage::~MainPage() {
 
 void MainPage::InitMotionSensors()
 {
-	motionSensorOutdoor = ref new MotionSensor(MOTION_SENSOR_PIN_OUTDOOR);
-	motionSensorIndoor = ref new MotionSensor(MOTION_SENSOR_PIN_INDOOR);
+	const DoorPins& pins = _config.Current()->config.pins;
+	_outdoorSensor.reset(new MotionSensorInput(pins.outdoorSensor));
+	_indoorSensor.reset(new MotionSensorInput(pins.indoorSensor));
+
+	_detectorPool.reset(new DetectorPool(_scheduler, DETECTOR_WORKERS,
+		[this](size_t worker, size_t camera, cv::Mat& frame, std::vector<cv::Rect>& objects, const std::atomic<bool>& cancel)
+	{
+		return DetectCats(worker, camera, frame, objects, cancel);
+	}));
+	_detectorPool->AddSource(*_idlePreview);
+	for (size_t camera = 1; camera < _frameSources.size(); camera++) {
+		_detectorPool->AddSource(*_frameSources[camera]);
+	}
+
+	std::shared_ptr<const DoorConfigSnapshot> config = _config.Current();
+	_doorController.reset(new DoorController(*_indoorSensor, *_outdoorSensor, *_leftServo, *_rightServo, *_detectorPool, _scheduler,
+		config->config.timing, config->config.positions));
+	// Reloads reach the door from here on; one published before the listener was set is applied right after
+	_config.SetListener([this](std::shared_ptr<const DoorConfigSnapshot>)
+	{
+		std::shared_ptr<const DoorConfigSnapshot> current = _config.Current();
+		_doorController->Configure(current->config.timing, current->config.positions);
+	});
+	config = _config.Current();
+	_doorController->Configure(config->config.timing, config->config.positions);
+	_doorController->AddEntryCamera(0);
+	for (size_t camera = 1; camera < _frameSources.size() && EXTRA_CAMERAS_DECIDE_ENTRY; camera++) {
+		_doorController->AddEntryCamera(camera);
+	}
+
+	_doorController->SetDecisionHandler([this](const DoorOutcome& outcome, cv::Mat* frame, std::vector<cv::Rect>& objects)
+	{
+		OnDoorDecision(outcome, frame, objects);
+	});
+
+	// The cameras that do not decide entries are scanned now and then, and give way to entry detections
+	if (!EXTRA_CAMERAS_DECIDE_ENTRY && _frameSources.size() > 1) {
+		_detectorPool->SetResultHandler(DetectionPriority::Background, [](const PooledDetection& detection, cv::Mat&, std::vector<cv::Rect>& objects)
+		{
+			if (objects.empty()) return;
+			wchar_t seen[64];
+			swprintf_s(seen, L"Camera %u sees %u cats\n", static_cast<unsigned int>(detection.source), static_cast<unsigned int>(objects.size()));
+			OutputDebugString(seen);
+		});
+
+		Windows::Foundation::TimeSpan backgroundScanInterval = { TimeSpanHelper::FromSeconds(BACKGROUND_SCAN_INTERVAL).get_Ticks() };
+		_scheduler.SchedulePeriodic(backgroundScanInterval, [this]()
+		{
+			for (size_t camera = 1; camera < _frameSources.size(); camera++) {
+				_detectorPool->Request(camera, DetectionPriority::Background, _scheduler.Now());
+			}
+		});
+	}
+}
+
+// Runs on a worker of the detector pool, with that worker's own detector. Returns false if an
+// entry detection preempted it.
+bool MainPage::DetectCats(size_t worker, size_t camera, cv::Mat& frame, std::vector<cv::Rect>& objects, const std::atomic<bool>& cancel)
+{
+	// Live detection comes first: a mining scan in progress stops at its next pyramid level
+	_lastDetection = Instrumentation::Now();
+	_miningCancel = true;
+
+	CatFaceDetector& catFaceDetector = *_catFaceDetectors[worker];
+	std::shared_ptr<const DoorConfigSnapshot> config = _config.Current();
+	if (_detectorConfigVersions[worker] != config->version) {
+		_detectorConfigVersions[worker] = config->version;
+		if (!catFaceDetector.Configure(config->config.detection) && _config.Rollback(config->version)) {
+			OutputDebugString(L"Couldn't apply the detection settings; back to the last good configuration\n");
+		}
+	}
+	if (!catFaceDetector.Detect(frame, objects, &cancel)) {
+		return false;
+	}
+	for (size_t i = 0; i < objects.size(); i++) {
+		wchar_t confidence[64];
+		swprintf_s(confidence, L"Camera %u cat #%u confidence %.3f\n", static_cast<unsigned int>(camera), static_cast<unsigned int>(i + 1), catFaceDetector.Confidences()[i]);
+		OutputDebugString(confidence);
+	}
+	if (_petGallery.FaceCount() > 0 && !objects.empty()) {
+		IdentifyPets(catFaceDetector, objects);
+	}
+	if (catFaceDetector.RejectedCount() > 0) {
+		wchar_t rejected[64];
+		swprintf_s(rejected, L"Rejected %u cat faces on human faces\n", static_cast<unsigned int>(catFaceDetector.RejectedCount()));
+		OutputDebugString(rejected);
+	}
+	if (catFaceDetector.MatchedAngle() != 0) {
+		wchar_t rotated[64];
+		swprintf_s(rotated, L"Cat face found rotated by %.0f degrees\n", catFaceDetector.MatchedAngle());
+		OutputDebugString(rotated);
+	}
+	return true;
+}
+
+// Keeps only the cat faces of enrolled pets. Faces that could not be checked within the budget are not let in.
+void MainPage::IdentifyPets(const CatFaceDetector& detector, std::vector<cv::Rect>& objects)
+{
+	std::lock_guard<std::mutex> lock(_petGalleryLock);
+	_petGallery.Identify(detector.Gray(), objects, _petMatches, PET_IDENTITY_BUDGET_MS * 1000);
+
+	size_t kept = 0;
+	for (size_t i = 0; i < objects.size(); i++) {
+		const PetMatch& match = _petMatches[i];
+		wchar_t identity[128];
+		if (match.pet >= 0) {
+			swprintf_s(identity, L"Cat #%u is %S (distance %.3f)\n", static_cast<unsigned int>(i + 1), _petGallery.PetName(match.pet).c_str(), match.distance);
+			objects[kept++] = objects[i];
+		}
+		else {
+			swprintf_s(identity, L"Cat #%u is not an enrolled pet (distance %.3f)\n", static_cast<unsigned int>(i + 1), match.distance);
+		}
+		OutputDebugString(identity);
+	}
+	objects.resize(kept);
+}
+
+// Blocked full frames are mined later, one per NEGATIVE_MINING_INTERVAL
+void MainPage::QueueForMining(StorageFile^ file)
+{
+	std::lock_guard<std::mutex> lock(_miningLock);
+	if (_miningQueue.size() >= NEGATIVE_MINING_QUEUE) {
+		_miningQueue.pop_front();
+	}
+	_miningQueue.push_back(file);
+}
+
+// Reads the next queued capture back and mines it on a low priority work item. Only one frame is
+// mined at a time, on one core, and not while the door has recently been busy.
+void MainPage::MineNextFrame()
+{
+	if (_mining || _negativeStore->Full() || Instrumentation::Now() - _lastDetection < NEGATIVE_MINING_QUIET_MS * 1000) return;
+
+	StorageFile^ file;
+	{
+		std::lock_guard<std::mutex> lock(_miningLock);
+		if (_miningQueue.empty()) return;
+		file = _miningQueue.front();
+		_miningQueue.pop_front();
+	}
+	_mining = true;
+
+	create_task(FileIO::ReadBufferAsync(file)).then([this, file](IBuffer^ buffer)
+	{
+		auto bytes = std::make_shared<std::vector<unsigned char>>(buffer->Length);
+		if (!bytes->empty()) {
+			DataReader::FromBuffer(buffer)->ReadBytes(ArrayReference<unsigned char>(bytes->data(), buffer->Length));
+		}
+
+		ThreadPool::RunAsync(ref new WorkItemHandler([this, file, bytes](IAsyncAction^)
+		{
+			MiningResult result;
+			try
+			{
+				_miningCancel = false;
+				// A detection may have started while the file was read
+				if (Instrumentation::Now() - _lastDetection >= NEGATIVE_MINING_QUIET_MS * 1000) {
+					cv::Mat gray = cv::imdecode(*bytes, cv::IMREAD_GRAYSCALE);
+					if (!gray.empty()) {
+						cv::equalizeHist(gray, gray);
+						result = _negativeMiner.Mine(gray, *_negativeStore, &_miningCancel);
+					}
+				}
+				else {
+					result.cancelled = true;
+				}
+			}
+			catch (cv::Exception&)
+			{
+				// Unreadable capture or unwritable store; the frame is dropped
+			}
+
+			if (result.cancelled) {
+				std::lock_guard<std::mutex> lock(_miningLock);
+				_miningQueue.push_front(file);
+			}
+			else if (result.added > 0) {
+				wchar_t mined[96];
+				swprintf_s(mined, L"Mined %u hard negatives, %u stored\n", static_cast<unsigned int>(result.added), static_cast<unsigned int>(_negativeStore->Count()));
+				OutputDebugString(mined);
+			}
+			_mining = false;
+		}), WorkItemPriority::Low);
+	}).then([this](task<void> previousTask)
+	{
+		try
+		{
+			previousTask.get();
+		}
+		catch (Platform::Exception^ ex)
+		{
+			// The capture may have been compacted away before its turn came
+			_mining = false;
+			WriteException(ex);
+		}
+	});
+}
 
-	// Add event handlers
-	motionSensorOutdoor->MotionDetected += ref new PetDoor::MotionDetectedEventHandler(this,
-		&MainPage::OnOutdoorMotionDetected);
-	motionSensorIndoor->MotionDetected += ref new PetDoor::MotionDetectedEventHandler(this,
-		&MainPage::OnIndoorMotionDetected);
+/// <summary>
+/// Serves the MJPEG stream on STREAM_PORT; only called when stream.enabled is set in DoorConfig.txt.
+/// </summary>
+void MainPage::StartStreamServer()
+{
+	_streamServer.reset(new StreamServer(*_streamer));
+	_streamServer->StartAsync(STREAM_PORT).then([this](task<void> previousTask)
+	{
+		try
+		{
+			previousTask.get();
+		}
+		catch (Platform::Exception^ ex)
+		{
+			WriteException(ex);
+		}
+	});
 }
 
 task<void> MainPage::InitServos()
 {
 	return create_task([this] {
-		rightServo = ref new Servo(RIGHT_SERVO);
-		leftServo = ref new Servo(LEFT_SERVO);
+		const DoorPins& pins = _config.Current()->config.pins;
+		_rightServo.reset(new ServoChannel(pins.rightServo));
+		_leftServo.reset(new ServoChannel(pins.leftServo));
 	});
 }
 
-// Called when motion is detected outdoors
-void MainPage::OnOutdoorMotionDetected(Object^ sender, Platform::String^ s)
+/// <summary>
+/// Reads DoorConfig.txt from LocalState if it changed since the last read, and publishes it. A file
+/// that does not parse is reported and the door keeps the configuration it has.
+/// </summary>
+task<void> MainPage::ReloadConfigAsync()
 {
-	OutputDebugString(L"Outdoor motion detected\n");
-	// If preview is not running, no preview frames can be acquired
-	if (!_isPreviewing) return;
-	auto getFrameTask = GetPreviewFrameAsSoftwareBitmapAsync();
-	// open the door if your cats are there (according to the model)
-	getFrameTask.then([this](int cat_count) {
-		if (cat_count > 0) {
-			std::wstringstream catNo;
-			catNo << "Cats found: " << cat_count << "\n";
-			OutputDebugString(catNo.str().c_str());
-			OpenDoor(3000);
+	return create_task(ApplicationData::Current->LocalFolder->TryGetItemAsync(DOOR_CONFIG_FILE))
+		.then([this](IStorageItem^ item)
+	{
+		auto file = dynamic_cast<StorageFile^>(item);
+		if (file == nullptr) return create_task([]() {});
+
+		return create_task(file->GetBasicPropertiesAsync())
+			.then([this, file](FileProperties::BasicProperties^ properties)
+		{
+			int64_t modified = properties->DateModified.UniversalTime;
+			if (modified == _configModified) return create_task([]() {});
+			_configModified = modified;
+
+			return create_task(FileIO::ReadTextAsync(file))
+				.then([this](Platform::String^ text)
+			{
+				std::wstring wideText(text->Data());
+				std::string error;
+				std::wstringstream report;
+				if (_config.Load(std::string(wideText.begin(), wideText.end()), error)) {
+					report << "Loaded " << DOOR_CONFIG_FILE << " as configuration " << _config.Current()->version << "\n";
+				}
+				else {
+					std::wstring wideError(error.begin(), error.end());
+					report << DOOR_CONFIG_FILE << " rejected, " << wideError.c_str() << "; keeping configuration " << _config.Current()->version << "\n";
+				}
+				OutputDebugString(report.str().c_str());
+			});
+		});
+	}).then([this](task<void> previousTask)
+	{
+		try
+		{
+			previousTask.get();
+		}
+		catch (Platform::Exception^ ex)
+		{
+			WriteException(ex);
 		}
 	});
+}
+
+// Called by the door controller once it has let a cat in or out, or blocked an outdoor trigger
+void MainPage::OnDoorDecision(const DoorOutcome& outcome, cv::Mat* frame, std::vector<cv::Rect>& objects)
+{
+	if (outcome.sensor == DoorSensor::Indoor)
+	{
+		// A cat that just went out may be back soon; outdoor edges wake the camera themselves
+		_idlePreview->Wake(outcome.edgeMicroseconds);
+		RecordDoorEvent(DoorSensor::Indoor, DoorDecision::Exited, 0, 0, 0);
+		OutputDebugString(L"Indoor motion detected\n");
+		return;
+	}
+
+	OutputDebugString(L"Outdoor motion detected\n");
+	uint32_t imageId = ReserveImageId();
+	RecordDoorEvent(DoorSensor::Outdoor, outcome.decision, outcome.catCount,
+		static_cast<uint32_t>(outcome.decidedMicroseconds - outcome.edgeMicroseconds), imageId);
+
+	// Clips come from the main camera only
+	if (outcome.camera == 0) {
+		{
+			std::lock_guard<std::mutex> lock(_clipKindsLock);
+			_clipKinds[imageId] = outcome.decision == DoorDecision::Entered ? CaptureKind::Entry : CaptureKind::Blocked;
+		}
+		_clipRecorder->Trigger(imageId, outcome.edgeMicroseconds);
+	}
 
+	if (outcome.catCount > 0) {
+		wchar_t catNo[32];
+		swprintf_s(catNo, L"Cats found: %d\n", outcome.catCount);
+		OutputDebugString(catNo);
+	}
+
+	ShowAndSaveOutdoorFrame(*frame, objects, imageId, outcome.decidedMicroseconds);
 }
 
-// Turns the servo so the pet door can be opened
-// by default, the door stays open for 5 seconds; pass in a different parameter if you'd like to change that
-void MainPage::OpenDoor(int stayOpenMS = 5000)
+// Id for the captures of the next outdoor event; the journal keeps these unique across runs
+uint32_t MainPage::ReserveImageId()
 {
-	rightServo->Rotate(0.1300);
-	leftServo->Rotate(0.0188);
-	Sleep(700);
-	Sleep(stayOpenMS);
-	leftServo->Rotate(0.0765);
-	rightServo->Rotate(0.0785);
-	Sleep(700);
-	leftServo->Stop();
-	rightServo->Stop();
+	if (_eventJournal)
+	{
+		return _eventJournal->ReserveImageId();
+	}
+
+	// Without a journal, count up from the current time in seconds so ids do not repeat across runs
+	static std::atomic<uint32_t> fallbackImageId(static_cast<uint32_t>((CurrentTimestamp() - UnixEpochTicks) / TimeSpanHelper::TicksPerSecond));
+	return fallbackImageId++;
 }
 
-// Open the door when the cat wants to go out
-void MainPage::OnIndoorMotionDetected(Object^ sender, Platform::String^ s)
+// Appends a door event to the journal and counts it in the activity rollups
+void MainPage::RecordDoorEvent(DoorSensor sensor, DoorDecision decision, int catCount, uint32_t detectionLatencyMicroseconds, uint32_t imageId)
 {
-	OpenDoor(3000);
-	OutputDebugString(L"Indoor motion detected\n");
+	DoorEventRecord record = {};
+	record.timestamp = CurrentTimestamp();
+	record.sensor = sensor;
+	record.decision = decision;
+	record.catCount = static_cast<uint16_t>(catCount);
+	record.detectionLatencyMicroseconds = detectionLatencyMicroseconds;
+	record.imageId = imageId;
+
+	if (_eventJournal)
+	{
+		_eventJournal->Append(record);
+	}
+	_activityRollups->Record(record);
 }
 
 /// <summary>
@@ -210,14 +789,18 @@ task<void> MainPage::InitializeCameraAsync()
 		settings->VideoDeviceId = camera->Id;
 
 		// Initialize media capture and start the preview	
+		Platform::String^ cameraId = camera->Id;
 		create_task(_mediaCapture->InitializeAsync(settings)).then([this]()
 		{
 			_isInitialized = true;
 
+			return NegotiatePreviewFormatAsync(_mediaCapture.Get());
+		}).then([this]()
+		{
 			return StartPreviewAsync();
 			// Different return types, must do the error checking here since we cannot return and send
 			// execeptions back up the chain.
-		}).then([this](task<void> previousTask)
+		}).then([this, cameraId](task<void> previousTask)
 		{
 			try
 			{
@@ -226,18 +809,127 @@ task<void> MainPage::InitializeCameraAsync()
 			catch (AccessDeniedException^)
 			{
 				// Camera is denied access
+				return;
 			}
+			InitializeExtraCamerasAsync(cameraId);
 		});
 	}).then([this]()
 	{
 		create_task(StorageLibrary::GetLibraryAsync(KnownLibraryId::Pictures))
 			.then([this](StorageLibrary^ picturesLibrary)
 		{
-			_captureFolder = picturesLibrary->SaveFolder;
-			if (_captureFolder == nullptr)
+			StorageFolder^ parent = picturesLibrary->SaveFolder;
+			if (parent == nullptr)
 			{
 				// In this case fall back to the local app storage since the Pictures Library is not available
-				_captureFolder = ApplicationData::Current->LocalFolder;
+				parent = ApplicationData::Current->LocalFolder;
+			}
+
+			// A folder of their own, as the store deletes the captures it no longer keeps
+			return create_task(parent->CreateFolderAsync(CAPTURE_FOLDER, CreationCollisionOption::OpenIfExists));
+		}).then([this](StorageFolder^ captureFolder)
+		{
+			_captureFolder = captureFolder;
+			if (!_captureStore)
+			{
+				_captureStore.reset(new CaptureStore(_captureFolder));
+			}
+		});
+	});
+}
+
+/// <summary>
+/// Starts a preview on every other camera, up to MAX_CAMERAS in all, each into a small element of ExtraPreviewPanel, and
+/// attaches each to its frame source. A camera that fails to start is left out.
+/// </summary>
+/// <param name="primaryCameraId">The camera already shown in PreviewControl</param>
+/// <returns></returns>
+task<void> MainPage::InitializeExtraCamerasAsync(Platform::String^ primaryCameraId)
+{
+	return create_task(DeviceInformation::FindAllAsync(DeviceClass::VideoCapture))
+		.then([this, primaryCameraId](DeviceInformationCollection^ devices)
+	{
+		for (auto device : devices)
+		{
+			if (device->Id == primaryCameraId) continue;
+			if (_extraCaptures.size() + 1 >= _frameSources.size()) break;
+
+			size_t source = _extraCaptures.size() + 1;
+			auto mediaCapture = ref new Capture::MediaCapture();
+			_extraCaptures.push_back(mediaCapture);
+
+			auto previewElement = ref new CaptureElement();
+			previewElement->Height = 120;
+			previewElement->Stretch = Stretch::Uniform;
+			ExtraPreviewPanel->Children->Append(previewElement);
+
+			auto settings = ref new Capture::MediaCaptureInitializationSettings();
+			settings->VideoDeviceId = device->Id;
+			settings->StreamingCaptureMode = Capture::StreamingCaptureMode::Video;
+			create_task(mediaCapture->InitializeAsync(settings)).then([this, mediaCapture, previewElement]()
+			{
+				previewElement->Source = mediaCapture;
+				return NegotiatePreviewFormatAsync(mediaCapture);
+			}).then([mediaCapture]()
+			{
+				return create_task(mediaCapture->StartPreviewAsync());
+			}).then([this, mediaCapture, source](task<void> previousTask)
+			{
+				try
+				{
+					previousTask.get();
+					_frameSources[source]->Attach(mediaCapture);
+				}
+				catch (Platform::Exception^ ex)
+				{
+					WriteException(ex);
+				}
+			});
+		}
+	});
+}
+
+/// <summary>
+/// Switches a camera's preview, before it starts, to the cheapest format in which a cat face at the door is still
+/// as large as the detector's minimum size (see ChooseCaptureFormat). Fewer pixels make every preview frame, capture
+/// and detection cheaper. The camera keeps its default format if none qualifies or the switch fails.
+/// </summary>
+/// <param name="mediaCapture">An initialized capture whose preview has not started</param>
+/// <returns></returns>
+task<void> MainPage::NegotiatePreviewFormatAsync(Capture::MediaCapture^ mediaCapture)
+{
+	// The geometry comes from DoorConfig.txt
+	return _configLoaded.then([this, mediaCapture]()
+	{
+		std::shared_ptr<const DoorConfigSnapshot> config = _config.Current();
+		int minFacePixels = config->config.detection.cat.minSize.width;
+		auto formats = std::make_shared<MediaCapturePreviewFormats>(mediaCapture);
+		CaptureFormat current = formats->Current();
+		size_t chosen = ChooseCaptureFormat(formats->Available(), config->config.camera, minFacePixels);
+		if (chosen == formats->Available().size())
+		{
+			std::stringstream report;
+			report << "No preview format shows a cat face at the door at " << minFacePixels << " pixels and "
+				<< config->config.camera.minFramesPerSecond << "fps; keeping " << DescribeCaptureFormat(current) << "\n";
+			OutputDebugStringA(report.str().c_str());
+			return create_task([]() {});
+		}
+
+		CaptureFormat format = formats->Available()[chosen];
+		double facePixels = FaceWidthPixels(format, config->config.camera);
+		return formats->SelectAsync(chosen).then([this, formats, format, current, facePixels](task<void> previousTask)
+		{
+			try
+			{
+				previousTask.get();
+				std::stringstream report;
+				report << "Preview format " << DescribeCaptureFormat(format) << " of " << formats->Available().size() << " offered, was "
+					<< DescribeCaptureFormat(current) << "; a cat face at the door is " << static_cast<int>(facePixels) << " pixels across\n";
+				OutputDebugStringA(report.str().c_str());
+			}
+			catch (Platform::Exception^ ex)
+			{
+				WriteException(ex);
 			}
 		});
 	});
@@ -263,6 +955,30 @@ task<void> MainPage::CleanupCameraAsync()
 		_isInitialized = false;
 	}
 
+	// The other cameras stop with the main one; their frame sources are detached before their previews stop
+	for (size_t i = 0; i < _extraCaptures.size(); i++)
+	{
+		_frameSources[i + 1]->Detach();
+		auto mediaCapture = _extraCaptures[i].Get();
+		taskList.push_back(create_task(mediaCapture->StopPreviewAsync()).then([](task<void> previousTask)
+		{
+			try
+			{
+				previousTask.get();
+			}
+			catch (Platform::Exception^)
+			{
+				// The preview never started
+			}
+		}));
+	}
+	_extraCaptures.clear();
+	// Use the dispatcher because this method is sometimes called from non-UI threads
+	Dispatcher->RunAsync(Windows::UI::Core::CoreDispatcherPriority::Normal, ref new Windows::UI::Core::DispatchedHandler([this]()
+	{
+		ExtraPreviewPanel->Children->Clear();
+	}));
+
 	// When all our tasks complete, clean up MediaCapture
 	return when_all(taskList.begin(), taskList.end())
 		.then([this]()
@@ -271,10 +987,6 @@ task<void> MainPage::CleanupCameraAsync()
 		{
 			_mediaCapture->Failed -= _mediaCaptureFailedEventToken;
 			_mediaCapture = nullptr;
-			motionSensorOutdoor = nullptr;
-			motionSensorIndoor = nullptr;
-			leftServo = nullptr;
-			rightServo = nullptr;
 		}
 	});
 }
@@ -286,8 +998,11 @@ task<void> MainPage::CleanupCameraAsync()
 task<void> MainPage::StartPreviewAsync()
 {
 
-	// Prevent the device from sleeping while the preview is running
-	_displayRequest->RequestActive();
+	// Prevent the device from sleeping while the preview is running; without a display there is no screen to keep on
+	if (!_headless)
+	{
+		_displayRequest->RequestActive();
+	}
 
 	// Register to listen for media property changes
 	_mediaControlPropChangedEventToken =
@@ -302,6 +1017,7 @@ task<void> MainPage::StartPreviewAsync()
 		.then([this](task<void> previousTask)
 	{
 		_isPreviewing = true;
+		_frameSources[0]->Attach(_mediaCapture.Get());
 
 		// Only need to update the orientation if the camera is mounted on the device
 		if (!_externalCamera)
@@ -341,6 +1057,7 @@ task<void> MainPage::SetPreviewRotationAsync()
 task<void> MainPage::StopPreviewAsync()
 {
 	_isPreviewing = false;
+	_frameSources[0]->Detach();
 
 	return create_task(_mediaCapture->StopPreviewAsync())
 		.then([this]()
@@ -350,248 +1067,410 @@ task<void> MainPage::StopPreviewAsync()
 		{
 			PreviewControl->Source = nullptr;
 			// Allow the device screen to sleep now that the preview is stopped
-			_displayRequest->RequestRelease();
+			if (!_headless)
+			{
+				_displayRequest->RequestRelease();
+			}
 		}));
 	});
 }
 
-IBuffer^ IBufferFromArray(Array<unsigned char>^ data)
+/// <summary>
+/// Stops the main camera's preview while the door is idle. Unlike StopPreviewAsync it leaves MediaCapture and
+/// PreviewControl set up, so WakePreviewAsync only has to restart the stream.
+/// </summary>
+task<void> MainPage::SleepPreviewAsync()
 {
-	DataWriter^ dataWriter = ref new DataWriter();
-	dataWriter->WriteBytes(data);
-	return dataWriter->DetachBuffer();
-}
+	_isPreviewing = false;
+	_frameSources[0]->Detach();
 
-IBuffer^ IBufferFromPointer(LPBYTE pbData, DWORD cbData)
-{
-	auto byteArray = new ArrayReference<unsigned char>(pbData, cbData);
-	return IBufferFromArray(reinterpret_cast<Array<unsigned char>^>(byteArray));
+	return create_task(_mediaCapture->StopPreviewAsync())
+		.then([this]()
+	{
+		if (!_headless)
+		{
+			Dispatcher->RunAsync(Windows::UI::Core::CoreDispatcherPriority::Normal, ref new Windows::UI::Core::DispatchedHandler([this]()
+			{
+				_displayRequest->RequestRelease();
+			}));
+		}
+	});
 }
 
-inline void ThrowIfFailed(HRESULT hr)
+/// <summary>
+/// Restarts the main camera's preview after SleepPreviewAsync. The frame source is attached as soon as frames
+/// flow; the rotation, which may have changed meanwhile, is applied after that.
+/// </summary>
+task<void> MainPage::WakePreviewAsync()
 {
-	if (FAILED(hr))
+	if (!_headless)
 	{
-		throw Platform::Exception::CreateException(hr);
+		Dispatcher->RunAsync(Windows::UI::Core::CoreDispatcherPriority::High, ref new Windows::UI::Core::DispatchedHandler([this]()
+		{
+			_displayRequest->RequestActive();
+		}));
 	}
-}
-
-std::vector<unsigned char> getVectorFromBuffer(::Windows::Storage::Streams::IBuffer^ buf)
-{
-	auto reader = ::Windows::Storage::Streams::DataReader::FromBuffer(buf);
-
-	std::vector<unsigned char> data(reader->UnconsumedBufferLength);
 
-	if (!data.empty())
-		reader->ReadBytes(
-			::Platform::ArrayReference<unsigned char>(
-				&data[0], data.size()));
+	return create_task(_mediaCapture->StartPreviewAsync())
+		.then([this]()
+	{
+		_isPreviewing = true;
+		_frameSources[0]->Attach(_mediaCapture.Get());
 
-	return data;
+		if (!_externalCamera)
+		{
+			SetPreviewRotationAsync();
+		}
+	});
 }
 
-// Converts an image from a SoftwareBitmap to a Mat file. Mat files are used in OpenCV.
-Mat* SoftwareBitmapToMat(SoftwareBitmap^ image)
+/// <summary>
+/// Runs SleepPreviewAsync or WakePreviewAsync for the idle preview and tells it how it went. Nothing is
+/// tried while the camera is not initialized, e.g. while the app is suspended.
+/// </summary>
+void MainPage::RunPreviewTransition(bool wake, IdlePreviewSource::Done done)
 {
-	if (!image) return nullptr;
-	int height = image->PixelHeight;
-	int width = image->PixelWidth;
-	int size = image->PixelHeight * image->PixelWidth * 4;
-
-
-	byte* bytes = new byte[size];
-	IBuffer^ buffer = IBufferFromPointer(bytes, size);
-	image->CopyToBuffer(buffer);
-
-	std::vector<unsigned char> data = getVectorFromBuffer(buffer);
-	memcpy(bytes, data.data(), size);
-
-	Mat* result = new Mat(height, width, CV_8UC4, bytes, cv::Mat::AUTO_STEP);
+	if (!_isInitialized || _mediaCapture.Get() == nullptr)
+	{
+		done(false);
+		return;
+	}
 
-	return result;
+	(wake ? WakePreviewAsync() : SleepPreviewAsync()).then([this, done](task<void> previousTask)
+	{
+		try
+		{
+			previousTask.get();
+			done(true);
+		}
+		catch (Platform::Exception^ ex)
+		{
+			WriteException(ex);
+			done(false);
+		}
+	});
 }
 
-unsigned char* GetPointerToPixelData(IBuffer^ buffer)
+inline void ThrowIfFailed(HRESULT hr)
 {
-	ComPtr<IBufferByteAccess> bufferByteAccess;
-	ComPtr<IInspectable> insp((IInspectable*)buffer);
-	ThrowIfFailed(insp.As(&bufferByteAccess));
-
-	unsigned char* pixels = nullptr;
-	ThrowIfFailed(bufferByteAccess->Buffer(&pixels));
-
-	return pixels;
+	if (FAILED(hr))
+	{
+		throw Platform::Exception::CreateException(hr);
+	}
 }
 
 /// <summary>
-/// Converts an image from a Mat file to a Software Bitmap.
+/// Converts an Rgba8 Mat to a Bgra8 Software Bitmap, the format the Image control and the encoder take.
+/// The pixels are converted straight into the bitmap's own buffer, so this allocates nothing but the bitmap.
 /// </summary>
-SoftwareBitmap^ MatToSoftwareBitmap(cv::Mat image)
+SoftwareBitmap^ MatToBgra8SoftwareBitmap(const cv::Mat& image)
 {
 	if (!image.data) return nullptr;
 
-	// Create the WriteableBitmap
-	int height = image.rows;
-	int width = image.cols;
-	int size = height * width * image.step.buf[1];
+	SoftwareBitmap^ result = ref new SoftwareBitmap(BitmapPixelFormat::Bgra8, image.cols, image.rows, BitmapAlphaMode::Ignore);
 
-	SoftwareBitmap^ result = ref new SoftwareBitmap(BitmapPixelFormat::Rgba8, width, height, BitmapAlphaMode::Ignore);
+	BitmapBuffer^ buffer = result->LockBuffer(BitmapBufferAccessMode::Write);
+	IMemoryBufferReference^ reference = buffer->CreateReference();
 
-	byte* bytes = new byte[size];
-	IBuffer^ buffer = IBufferFromPointer(bytes, size);
+	ComPtr<IMemoryBufferByteAccess> byteAccess;
+	ThrowIfFailed(reinterpret_cast<IInspectable*>(reference)->QueryInterface(IID_PPV_ARGS(&byteAccess)));
 
-	unsigned char* dstPixels = GetPointerToPixelData(buffer);
-	memcpy(dstPixels, image.data, image.step.buf[1] * image.cols*image.rows);
+	BYTE* pixels = nullptr;
+	UINT32 capacity = 0;
+	ThrowIfFailed(byteAccess->GetBuffer(&pixels, &capacity));
 
-	result->CopyFromBuffer(buffer);
+	// A Mat header over the bitmap's buffer, with its stride, so cvtColor writes in place
+	BitmapPlaneDescription plane = buffer->GetPlaneDescription(0);
+	cv::Mat bgra(image.rows, image.cols, CV_8UC4, pixels + plane.StartIndex, plane.Stride);
+	cv::cvtColor(image, bgra, cv::COLOR_RGBA2BGRA);
+
+	// IClosable.Close projects into CX as operator delete; this unlocks the bitmap
+	delete reference;
+	delete buffer;
 
 	return result;
 }
 
 
 /// <summary>
-/// takes an image (inputImg), runs face and body classifiers on it, and stores the results in 
-/// objectVector and objectVectorBodies, respectively
+/// Displays the properties of an outdoor frame in a TextBlock, annotates it with the detected objects, and displays the image
+/// in the UI and saves it to disk. Headless, the frame is only annotated for the stream and saved.
 /// </summary>
-void DetectObjects(cv::Mat& inputImg, std::vector<cv::Rect> & objectVector, cv::CascadeClassifier& cat_cascade)
+void MainPage::ShowAndSaveOutdoorFrame(cv::Mat& previewMat, std::vector<cv::Rect>& objectVector, uint32_t imageId, int64_t decidedMicroseconds)
 {
-	// create a matrix of unsigned 8-bit int of size rows x cols
-	cv::Mat frame_gray = cv::Mat(inputImg.rows, inputImg.cols, CV_8UC4);
-
-	cvtColor(inputImg, frame_gray, CV_RGBA2GRAY);
-	cv::equalizeHist(frame_gray, frame_gray);
-
-	// Detect cat faces
-	cat_cascade.detectMultiScale(frame_gray, objectVector, 1.1, 5, 0 | CV_HAAR_SCALE_IMAGE, cv::Size(100, 100), cv::Size(300, 300));
-}
-
-void drawRectOverObjects(Mat& image, std::vector<cv::Rect>& objectVector)
-{
-	// Place a red rectangle around all detected objects in image
-	for (unsigned int x = 0; x < objectVector.size(); x++)
+#if PETDOOR_PROFILING
+	_outdoorFrames++;
+#endif
+	// Show the frame information; it only changes with the preview resolution
+	if (!_headless && previewMat.size() != _frameInfoSize)
 	{
-		cv::rectangle(image, objectVector[x], cv::Scalar(0, 0, 255, 255), 5);
-		std::ostringstream catNo;
-		catNo << "Cat #" << (x + 1);
-		cv::putText(image, catNo.str(), cv::Point(objectVector[x].x, objectVector[x].y - 10), cv::FONT_HERSHEY_SIMPLEX, 0.55, (0, 0, 255), 2);
+		_frameInfoSize = previewMat.size();
+		wchar_t info[32];
+		swprintf_s(info, L"%dx%d Rgba8", previewMat.cols, previewMat.rows);
+		auto str = ref new Platform::String(info);
+		_uiMailbox->Post(static_cast<size_t>(UiSlot::FrameInfo), [this, str]()
+		{
+			FrameInfoTextBlock->Text = str;
+		});
 	}
-}
 
+	// In crop mode only cats are cropped out of the frame; blocked entries keep the full frame.
+	// The detections are only drawn where a frame is looked at: over the full frame when it is shown
+	// or saved, otherwise over the stream's and the thumbnail's scaled copies. Crops stay clean.
+	auto pending = std::make_shared<PendingCapture>();
+	pending->imageId = imageId;
+	pending->kind = objectVector.empty() ? CaptureKind::Blocked : CaptureKind::Entry;
+	pending->mode = _persistenceMode;
+	pending->decidedMicroseconds = decidedMicroseconds;
+	bool saveCrops = pending->mode == PersistenceMode::CropsAndThumbnail && !objectVector.empty();
+	std::chrono::steady_clock::duration encodeTime(0);
+	std::unique_lock<std::mutex> encoding(_captureEncoderLock);
+
+	if (saveCrops)
+	{
+		auto encodeStart = std::chrono::steady_clock::now();
+		_captureEncoder.EncodeCrops(previewMat, objectVector, pending->captures);
+		encodeTime += std::chrono::steady_clock::now() - encodeStart;
+	}
 
-/// <summary>
-/// Gets the current preview frame as a SoftwareBitmap, displays its properties in a TextBlock, and can optionally display the image
-/// in the UI and/or save it to disk as a jpg
-/// </summary>
-/// <returns></returns>
-task<int> MainPage::GetPreviewFrameAsSoftwareBitmapAsync()
-{
-	// Get information about the preview
-	auto previewProperties = static_cast<MediaProperties::VideoEncodingProperties^>(_mediaCapture->VideoDeviceController->GetMediaStreamProperties(Capture::MediaStreamType::VideoPreview));
-	unsigned int videoFrameWidth = previewProperties->Width;
-	unsigned int videoFrameHeight = previewProperties->Height;
-
-	// Create the video frame to request a SoftwareBitmap preview frame
-	auto videoFrame = ref new VideoFrame(BitmapPixelFormat::Rgba8, videoFrameWidth, videoFrameHeight);
-
-	// Capture the preview frame
-	return create_task(_mediaCapture->GetPreviewFrameAsync(videoFrame))
-		.then([this](VideoFrame^ currentFrame)
-	{
-		// Collect the resulting frame
-		auto previewFrame = currentFrame->SoftwareBitmap;
-		BitmapPixelFormat framepPix = previewFrame->BitmapPixelFormat;
-		Mat previewMat = *(SoftwareBitmapToMat(previewFrame));
-		//SoftwareBitmap^ previewBitmap = previewFrame;
-		std::vector<cv::Rect> objectVector;
-		// Show the frame information
-		std::wstringstream ss;
-		ss << previewFrame->PixelWidth << "x" << previewFrame->PixelHeight << " " << previewFrame->BitmapPixelFormat.ToString()->Data();
-		auto str = ss.str().c_str();
-		// Update UI
-		CoreApplication::MainView->CoreWindow->Dispatcher->RunAsync(
-			CoreDispatcherPriority::High,
-			ref new DispatchedHandler([this, str]()
-			{
-				FrameInfoTextBlock->Text = ref new Platform::String(str);
-			}));
-
-		// Use openCV to draw rectangles over detected objects
-
-		DetectObjects(previewMat, objectVector, cat_cascade);
+	static const std::vector<cv::Rect> drawnAlready;
+	bool annotateFrame = !_headless || !saveCrops;
+	if (annotateFrame)
+	{
 		drawRectOverObjects(previewMat, objectVector);
-		previewFrame = SoftwareBitmap::Convert(MatToSoftwareBitmap(previewMat), BitmapPixelFormat::Bgra8);
-		framepPix = previewFrame->BitmapPixelFormat;
+	}
+	const std::vector<cv::Rect>& overlay = annotateFrame ? drawnAlready : objectVector;
+	_streamer->Publish(previewMat, overlay);
 
-		CoreApplication::MainView->CoreWindow->Dispatcher->RunAsync(
-			CoreDispatcherPriority::High,
-			ref new DispatchedHandler([this, previewFrame, currentFrame, objectVector]()
-			{
-				//taskList.push_back(UpdateAndSaveImage(previewFrame));
-				UpdateAndSaveImage(previewFrame).then([currentFrame]() {
-					// IClosable.Close projects into CX as operator delete.
-					delete currentFrame;
-				});
-			}));
+	// Headless there is no Bgra8 bitmap for BitmapEncoder, so the full frame is encoded here, on this thread
+	if (saveCrops || _headless)
+	{
+		auto encodeStart = std::chrono::steady_clock::now();
+		if (saveCrops) _captureEncoder.EncodeThumbnail(previewMat, pending->captures, overlay);
+		else _captureEncoder.EncodeFrame(previewMat, pending->captures);
+		encodeTime += std::chrono::steady_clock::now() - encodeStart;
+	}
+	encoding.unlock();
+	pending->encodeMilliseconds = std::chrono::duration<double, std::milli>(encodeTime).count();
 
-		// return the number of cats found
-		return static_cast<int>(objectVector.size());
+	if (_headless)
+	{
+		SaveCaptures(nullptr, pending);
+		return;
+	}
 
+	int64_t shown = Instrumentation::Now();
+	auto previewFrame = MatToBgra8SoftwareBitmap(previewMat);
 
+	// Saving does not wait for the UI thread, and a frame replaced before it is shown is still saved
+	SaveCaptures(previewFrame, pending);
 
+	int64_t dispatched = Instrumentation::Now();
+	_uiMailbox->Post(static_cast<size_t>(UiSlot::PreviewFrame), [this, previewFrame, dispatched, shown]()
+	{
+		PETDOOR_RECORD_SPAN(Stage::Dispatch, dispatched);
+		ShowPreviewFrameAsync(previewFrame, shown);
 	});
 }
 
-task<void> MainPage::UpdateAndSaveImage(SoftwareBitmap ^previewFrame)
+/// <summary>
+/// Displays an annotated outdoor frame in the Image control; runs on the UI thread
+/// </summary>
+task<void> MainPage::ShowPreviewFrameAsync(SoftwareBitmap ^previewFrame, int64_t shown)
 {
 	auto sbSource = ref new Media::Imaging::SoftwareBitmapSource();
 	return create_task(sbSource->SetBitmapAsync(previewFrame))
-		.then([this, sbSource]()
+		.then([this, sbSource, shown]()
 	{
 		// Display it in the Image control
 		PreviewFrameImage->Source = sbSource;
+		PETDOOR_RECORD_SPAN(Stage::ShowFrame, shown);
+	});
+}
+
+/// <summary>
+/// Hands the captures of one outdoor trigger to the capture store: the encoded JPEGs, or the frame itself for BitmapEncoder
+/// </summary>
+/// <param name="previewFrame">The annotated frame; only used, and only needed, when nothing was encoded</param>
+void MainPage::SaveCaptures(SoftwareBitmap^ previewFrame, std::shared_ptr<PendingCapture> pending)
+{
+	// The capture folder is resolved after the camera is initialized
+	if (!_captureStore) return;
 
-	}).then([this, previewFrame]() 
+	PETDOOR_RECORD_SPAN(Stage::DecisionToSave, pending->decidedMicroseconds);
+	if (pending->captures.empty())
 	{
-		SaveSoftwareBitmapAsync(previewFrame);
-	});
+		SaveSoftwareBitmapAsync(previewFrame, pending);
+	}
+	else
+	{
+		SaveEncodedCapturesAsync(pending);
+	}
 }
 
 /// <summary>
-/// Saves a SoftwareBitmap to the _captureFolder
+/// Saves a SoftwareBitmap to the capture store. It is compressed into memory and then written like the
+/// crops, so the encode time reported covers the same work in both persistence modes.
 /// </summary>
 /// <param name="bitmap"></param>
+/// <param name="pending">The door event the frame belongs to</param>
 /// <returns></returns>
-task<void> MainPage::SaveSoftwareBitmapAsync(SoftwareBitmap^ bitmap)
+task<void> MainPage::SaveSoftwareBitmapAsync(SoftwareBitmap^ bitmap, std::shared_ptr<PendingCapture> pending)
 {
-	return create_task(_captureFolder->CreateFileAsync("PreviewFrame.jpg", CreationCollisionOption::GenerateUniqueName))
-		.then([bitmap](StorageFile^ file)
+	auto encoded = ref new InMemoryRandomAccessStream();
+	auto encodeStart = std::chrono::steady_clock::now();
+	return create_task(BitmapEncoder::CreateAsync(BitmapEncoder::JpegEncoderId, encoded))
+		.then([bitmap](BitmapEncoder^ encoder)
+	{
+		// Grab the data from the SoftwareBitmap
+		encoder->SetSoftwareBitmap(bitmap);
+		return create_task(encoder->FlushAsync());
+	}).then([this, encoded, pending, encodeStart]()
+	{
+		pending->encodeMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - encodeStart).count();
+
+		unsigned int size = static_cast<unsigned int>(encoded->Size);
+		encoded->Seek(0);
+		return create_task(encoded->ReadAsync(ref new Buffer(size), size, InputStreamOptions::None));
+	}).then([this, encoded, pending](IBuffer^ buffer)
 	{
-		return create_task(file->OpenAsync(FileAccessMode::ReadWrite));
-	}).then([this, bitmap](Streams::IRandomAccessStream^ outputStream)
+		// IClosable.Close projects into CX as operator delete.
+		delete encoded;
+
+		EncodedCapture frame;
+		frame.name = "PreviewFrame.jpg";
+		frame.bytes.resize(buffer->Length);
+		if (!frame.bytes.empty()) {
+			DataReader::FromBuffer(buffer)->ReadBytes(ArrayReference<unsigned char>(frame.bytes.data(), buffer->Length));
+		}
+		pending->captures.push_back(std::move(frame));
+		return SaveEncodedCapturesAsync(pending);
+	}).then([this](task<void> previousTask)
 	{
-		return create_task(BitmapEncoder::CreateAsync(BitmapEncoder::JpegEncoderId, outputStream))
-			.then([bitmap](BitmapEncoder^ encoder)
+		try
 		{
-			// Grab the data from the SoftwareBitmap
-			encoder->SetSoftwareBitmap(bitmap);
-			return create_task(encoder->FlushAsync());
-		}).then([this, outputStream](task<void> previousTask)
+			previousTask.get();
+		}
+		catch (Platform::Exception^ ex)
 		{
-			// IClosable.Close projects into CX as operator delete.
-			delete outputStream;
-			try
-			{
-				previousTask.get();
-			}
-			catch (Platform::Exception^ ex)
+			WriteException(ex);
+		}
+	});
+}
+
+
+/// <summary>
+/// Writes already encoded JPEGs (crops and thumbnail) to the capture store
+/// </summary>
+/// <param name="pending">The encoded images, kept alive until every write has completed</param>
+/// <returns></returns>
+task<void> MainPage::SaveEncodedCapturesAsync(std::shared_ptr<PendingCapture> pending)
+{
+	std::vector<task<void>> writeTasks;
+
+	for (auto& capture : pending->captures)
+	{
+		auto bytes = &capture.bytes;
+		// The full frame of a blocked entry is mined, whether BitmapEncoder or the detection thread encoded it
+		bool mine = pending->kind == CaptureKind::Blocked && capture.name == "PreviewFrame.jpg";
+
+		writeTasks.push_back(_captureStore->CreateFileAsync(pending->imageId, pending->kind, capture.name)
+			.then([this, pending, bytes, mine](StorageFile^ file)
+		{
+			return create_task(FileIO::WriteBytesAsync(file, ArrayReference<unsigned char>(bytes->data(), static_cast<unsigned int>(bytes->size()))))
+				.then([this, pending, bytes, mine, file]()
 			{
-				// File I/O errors are reported as exceptions
-				WriteException(ex);
-			}
+				_captureStore->Track(pending->imageId, pending->kind, file->Name, bytes->size());
+				if (mine && _negativeStore) {
+					QueueForMining(file);
+				}
+			});
+		}));
+	}
+
+	return when_all(writeTasks.begin(), writeTasks.end())
+		.then([this, pending](task<void> previousTask)
+	{
+		try
+		{
+			previousTask.get();
+			ReportPersistence(pending->mode, CaptureEncoder::TotalBytes(pending->captures), pending->encodeMilliseconds);
+		}
+		catch (Platform::Exception^ ex)
+		{
+			// File I/O errors are reported as exceptions
+			WriteException(ex);
+		}
+	});
+}
+
+/// <summary>
+/// Writes an event clip to the capture folder in one write, and reports what recording clips costs
+/// </summary>
+task<void> MainPage::SaveClipAsync(const ClipInfo& info, std::shared_ptr<std::vector<unsigned char>> clip)
+{
+	// Events close together share the first one's clip; the others' entries are dropped here
+	CaptureKind kind = CaptureKind::Entry;
+	{
+		std::lock_guard<std::mutex> lock(_clipKindsLock);
+		auto found = _clipKinds.find(info.id);
+		if (found != _clipKinds.end()) kind = found->second;
+		_clipKinds.erase(_clipKinds.begin(), _clipKinds.upper_bound(info.id));
+	}
+	if (!_captureStore) return create_task([]() {});
+
+	uint32_t imageId = info.id;
+	size_t frames = info.frames;
+	bool truncated = info.truncated;
+	return _captureStore->CreateFileAsync(imageId, kind, "Clip.avi")
+		.then([this, clip, imageId, kind](StorageFile^ file)
+	{
+		return create_task(FileIO::WriteBytesAsync(file, ArrayReference<unsigned char>(clip->data(), static_cast<unsigned int>(clip->size()))))
+			.then([this, clip, imageId, kind, file]()
+		{
+			_captureStore->Track(imageId, kind, file->Name, clip->size());
 		});
+	}).then([this, clip, frames, truncated](task<void> previousTask)
+	{
+		try
+		{
+			previousTask.get();
+		}
+		catch (Platform::Exception^ ex)
+		{
+			WriteException(ex);
+			return;
+		}
+
+		ClipRecorderStats stats = _clipRecorder->Stats();
+		double encodeMilliseconds = stats.framesEncoded > 0 ? stats.encodeMicroseconds / 1000.0 / stats.framesEncoded : 0;
+		double corePercent = stats.recordedMicroseconds > 0 ? 100.0 * (stats.encodeMicroseconds + stats.clipMicroseconds) / stats.recordedMicroseconds : 0;
+		std::wstringstream report;
+		report << "Clip saved: " << frames << " frames, " << clip->size() << " bytes" << (truncated ? " (pre-roll cut short)" : "")
+			<< "; encode " << encodeMilliseconds << " ms per frame, " << corePercent << "% of a core, "
+			<< stats.framesDropped << " of " << stats.framesSubmitted << " frames dropped; "
+			<< stats.memoryBytes / 1024 << " KB held, " << stats.ringFramesHeld << " frames in the ring\n";
+		OutputDebugString(report.str().c_str());
 	});
 }
 
+/// <summary>
+/// Adds one saved trigger to the running totals of its persistence mode and writes the storage and encode cost to the output window
+/// </summary>
+void MainPage::ReportPersistence(PersistenceMode mode, unsigned long long bytes, double encodeMilliseconds)
+{
+	PersistenceStats stats;
+	{
+		std::lock_guard<std::mutex> lock(_persistenceStatsLock);
+		_persistenceStats[static_cast<int>(mode)].Add(bytes, encodeMilliseconds);
+		stats = _persistenceStats[static_cast<int>(mode)];
+	}
+
+	std::wstringstream report;
+	report << "Capture saved (" << PersistenceModeName(mode) << "): " << bytes << " bytes, encode " << encodeMilliseconds << " ms"
+		<< "; average " << stats.AverageBytes() << " bytes, " << stats.AverageEncodeMilliseconds() << " ms over " << stats.events << " events\n";
+	OutputDebugString(report.str().c_str());
+}
 
 /// <summary>
 /// Queries the available video capture devices to try and find one mounted on the desired panel
@@ -6,11 +6,30 @@
 #pragma once
 
 #include "MainPage.g.h"
-#include "MotionSensor.h"
-#include "Servo.h"
+#include "DetectorPool.h"
+#include "DeviceHal.h"
+#include "DoorConfig.h"
+#include "DoorController.h"
+#include "CaptureEncoder.h"
+#include "ClipRecorder.h"
+#include "StreamServer.h"
+#include "UiMailbox.h"
+#include "CaptureStore.h"
+#include "EventJournal.h"
+#include "ActivityRollups.h"
+#include "IdlePreview.h"
+#include "Instrumentation.h"
+#include "NegativeMiner.h"
+#include "PetIdentity.h"
+#include "VisionCore.h"
 
 #include <array>
+#include <atomic>
+#include <deque>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <MemoryBuffer.h>   // IMemoryBufferByteAccess
 #include <opencv2\imgproc\types_c.h>
 #include <opencv2\imgcodecs\imgcodecs.hpp>
@@ -34,11 +53,58 @@ namespace PetDoor
 	
 	private:
 		GpioPin^ ledPin;
-		MotionSensor^ motionSensorIndoor;
-		MotionSensor^ motionSensorOutdoor;
-		Servo^ leftServo;
-		Servo^ rightServo;
-		cv::CascadeClassifier cat_cascade;
+		// Runs the door's work and the page's periodic timers. Declared before everything that work
+		// touches, so it is torn down last; the destructor closes it first, so none of it is still running.
+		ThreadPoolScheduler _scheduler;
+		// One detector per worker of the detector pool, so workers never share scratch
+		std::vector<std::unique_ptr<CatFaceDetector>> _catFaceDetectors;
+		// DoorConfig.txt in LocalState, checked for changes every CONFIG_POLL_INTERVAL. Each worker
+		// applies a new snapshot to its own detector before its next detection, so nobody waits.
+		DoorConfigStore _config;
+		std::vector<uint64_t> _detectorConfigVersions;
+		int64_t _configModified;
+		// The first read of DoorConfig.txt; the cameras wait for it before picking their preview format
+		Concurrency::task<void> _configLoaded;
+		// Enrolled pets; only their faces open the door once any are enrolled. The gallery's
+		// scratch is shared, so one worker identifies at a time.
+		PetGallery _petGallery;
+		std::vector<PetMatch> _petMatches;
+		std::mutex _petGalleryLock;
+
+		// Blocked captures are scanned in the background for the windows the cat cascade nearly
+		// accepts, and the distinct ones kept in LocalState\Negatives for CascadeTrainer
+		NegativeMiner _negativeMiner;
+		std::unique_ptr<NegativeStore> _negativeStore;
+		std::deque<Windows::Storage::StorageFile^> _miningQueue;
+		std::mutex _miningLock;
+		// Set by every detection, so a mining scan in progress stops and leaves the cores to it
+		std::atomic<bool> _miningCancel;
+		std::atomic<bool> _mining;
+		std::atomic<int64_t> _lastDetection;
+
+		// Door hardware and the logic driving it; the controller only sees the Hal.h interfaces
+		std::unique_ptr<MotionSensorInput> _indoorSensor;
+		std::unique_ptr<MotionSensorInput> _outdoorSensor;
+		std::unique_ptr<ServoChannel> _leftServo;
+		std::unique_ptr<ServoChannel> _rightServo;
+		// One per camera the door can use; the first is the camera shown in PreviewControl
+		std::vector<std::unique_ptr<MediaCaptureFrameSource>> _frameSources;
+		// The main camera as the pool sees it: asleep after PREVIEW_IDLE_TIMEOUT without activity, woken by the next trigger
+		std::unique_ptr<IdlePreviewSource> _idlePreview;
+		std::unique_ptr<DetectorPool> _detectorPool;
+		std::unique_ptr<DoorController> _doorController;
+		// Frame size last shown in FrameInfoTextBlock
+		cv::Size _frameInfoSize;
+		// Kept so its conversion and thumbnail buffers are reused from one outdoor trigger to the
+		// next; the lock is for entry cameras on different workers deciding at the same time
+		CaptureEncoder _captureEncoder;
+		std::mutex _captureEncoderLock;
+		// Without a display nothing is shown: outdoor frames go only to the door, the stream and the
+		// capture store, and nothing is converted or dispatched to the UI thread for them
+		const bool _headless;
+		// What outdoor triggers show on the UI thread; null when headless
+		enum class UiSlot { FrameInfo, PreviewFrame, Count };
+		std::unique_ptr<UiMailbox> _uiMailbox;
 
 		// Receive notifications about rotation of the device and UI and apply any necessary rotation to the preview stream and UI controls  
 		Windows::Graphics::Display::DisplayInformation^ _displayInformation;
@@ -55,6 +121,9 @@ namespace PetDoor
 		bool _isInitialized;
 		bool _isPreviewing;
 
+		// The other cameras, each previewing into its own element of ExtraPreviewPanel; index i feeds _frameSources[i + 1]
+		std::vector<Platform::Agile<Windows::Media::Capture::MediaCapture^>> _extraCaptures;
+
 		// Information about the camera device
 		bool _externalCamera;
 		bool _mirroringPreview;
@@ -65,6 +134,38 @@ namespace PetDoor
 
 		// Folder in which the captures will be stored (availability check performed in InitializeCameraAsync)
 		Windows::Storage::StorageFolder^ _captureFolder;
+		// Budget and retention for the captures in _captureFolder
+		std::unique_ptr<CaptureStore> _captureStore;
+
+		// How outdoor triggers are persisted, and what each mode has cost so far
+		PersistenceMode _persistenceMode;
+		PersistenceStats _persistenceStats[2];
+		std::mutex _persistenceStatsLock;
+
+		// The last few seconds of the main camera, saved as a clip around every outdoor event. Clips are
+		// named after their event's still captures and kept as long as they are.
+		std::unique_ptr<ClipRecorder> _clipRecorder;
+		std::map<uint32_t, CaptureKind> _clipKinds;
+		std::mutex _clipKindsLock;
+
+		// The annotated frames outdoor triggers were decided on, as an MJPEG stream on STREAM_PORT for headless units;
+		// the server is only started, and the stream only ever served, with stream.enabled in DoorConfig.txt
+		std::unique_ptr<MjpegStreamer> _streamer;
+		std::unique_ptr<StreamServer> _streamServer;
+
+		// Every door event, in LocalFolder; null if the journal could not be opened
+		std::unique_ptr<EventJournal> _eventJournal;
+
+		// Hourly and daily activity counts for the dashboard, flushed by a timer
+		std::unique_ptr<ActivityRollups> _activityRollups;
+
+#if PETDOOR_PROFILING
+		// Writes the per-stage latency percentiles, and the app's CPU use since the last summary, to the output window
+		uint64_t _summaryCpuMicroseconds;
+		int64_t _summaryMicroseconds;
+		int64_t _summaryAsleepMicroseconds;
+		std::atomic<unsigned int> _outdoorFrames;
+#endif
 
 		// Event tokens
 		Windows::Foundation::EventRegistrationToken _applicationSuspendingEventToken;
@@ -73,24 +174,39 @@ namespace PetDoor
 		Windows::Foundation::EventRegistrationToken _mediaCaptureFailedEventToken;
 		Windows::Foundation::EventRegistrationToken _displayInformationEventToken;
 
-		void OnIndoorMotionDetected(Object^ sender, Platform::String^ s);
-		void OnOutdoorMotionDetected(Object^ sender, Platform::String^ s);
 		//void InitLED();
 		void InitMotionSensors();
+		bool DetectCats(size_t worker, size_t camera, cv::Mat& frame, std::vector<cv::Rect>& objects, const std::atomic<bool>& cancel);
+		void IdentifyPets(const CatFaceDetector& detector, std::vector<cv::Rect>& objects);
+		void QueueForMining(Windows::Storage::StorageFile^ file);
+		void MineNextFrame();
+		void StartStreamServer();
 		Concurrency::task<void> InitServos();
-		void OpenDoor(int milliseconds);
+		Concurrency::task<void> ReloadConfigAsync();
+		void OnDoorDecision(const DoorOutcome& outcome, cv::Mat* frame, std::vector<cv::Rect>& objects);
+		uint32_t ReserveImageId();
+		void RecordDoorEvent(DoorSensor sensor, DoorDecision decision, int catCount, uint32_t detectionLatencyMicroseconds, uint32_t imageId);
 
 		// MediaCapture methods
 		Concurrency::task<void> InitializeCameraAsync();
+		Concurrency::task<void> InitializeExtraCamerasAsync(Platform::String^ primaryCameraId);
+		Concurrency::task<void> NegotiatePreviewFormatAsync(Windows::Media::Capture::MediaCapture^ mediaCapture);
 		Concurrency::task<void> CleanupCameraAsync();
 		Concurrency::task<void> StartPreviewAsync();
 		Concurrency::task<void> SetPreviewRotationAsync();
 		Concurrency::task<void> StopPreviewAsync();
-		Concurrency::task<int> GetPreviewFrameAsSoftwareBitmapAsync();
-		Concurrency::task<void> UpdateAndSaveImage(Windows::Graphics::Imaging::SoftwareBitmap ^previewFrame);
+		Concurrency::task<void> SleepPreviewAsync();
+		Concurrency::task<void> WakePreviewAsync();
+		void RunPreviewTransition(bool wake, IdlePreviewSource::Done done);
+		void ShowAndSaveOutdoorFrame(cv::Mat& previewMat, std::vector<cv::Rect>& objectVector, uint32_t imageId, int64_t decidedMicroseconds);
+		Concurrency::task<void> ShowPreviewFrameAsync(Windows::Graphics::Imaging::SoftwareBitmap ^previewFrame, int64_t shown);
+		void SaveCaptures(Windows::Graphics::Imaging::SoftwareBitmap^ previewFrame, std::shared_ptr<PendingCapture> pending);
 
 		// Helpers
-		Concurrency::task<void> SaveSoftwareBitmapAsync(Windows::Graphics::Imaging::SoftwareBitmap^ bitmap);
+		Concurrency::task<void> SaveSoftwareBitmapAsync(Windows::Graphics::Imaging::SoftwareBitmap^ bitmap, std::shared_ptr<PendingCapture> pending);
+		Concurrency::task<void> SaveEncodedCapturesAsync(std::shared_ptr<PendingCapture> pending);
+		Concurrency::task<void> SaveClipAsync(const ClipInfo& info, std::shared_ptr<std::vector<unsigned char>> clip);
+		void ReportPersistence(PersistenceMode mode, unsigned long long bytes, double encodeMilliseconds);
 		Concurrency::task<Windows::Devices::Enumeration::DeviceInformation^> FindCameraDeviceByPanelAsync(Windows::Devices::Enumeration::Panel panel);
 		void WriteException(Platform::Exception^ ex);
 		int ConvertDisplayOrientationToDegrees(Windows::Graphics::Display::DisplayOrientations orientation);
@@ -0,0 +1,262 @@
+#include "MjpegStreamer.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+
+namespace PetDoor
+{
+	namespace
+	{
+		const char ResponseHeader[] =
+			"HTTP/1.0 200 OK\r\n"
+			"Cache-Control: no-cache\r\n"
+			"Pragma: no-cache\r\n"
+			"Connection: close\r\n"
+			"Content-Type: multipart/x-mixed-replace; boundary=" STREAM_BOUNDARY "\r\n"
+			"\r\n";
+
+		const char BusyResponse[] =
+			"HTTP/1.0 503 Service Unavailable\r\n"
+			"Connection: close\r\n"
+			"Content-Length: 0\r\n"
+			"\r\n";
+
+		void Append(std::vector<unsigned char>& out, const char* text, size_t length)
+		{
+			out.insert(out.end(), text, text + length);
+		}
+	}
+
+	bool IsStreamRequest(const std::string& request)
+	{
+		std::string line = request.substr(0, request.find("\r\n"));
+		const std::string get = "GET / HTTP/1.";
+		return line.size() == get.size() + 1 && line.compare(0, get.size(), get) == 0 && isdigit(static_cast<unsigned char>(line.back()));
+	}
+
+	MjpegStreamer::MjpegStreamer(IScheduler& scheduler, MjpegStreamOptions options)
+		: _scheduler(scheduler)
+		, _options(options)
+		, _responseHeader(std::make_shared<std::vector<unsigned char>>(ResponseHeader, ResponseHeader + sizeof(ResponseHeader) - 1))
+		, _busyResponse(std::make_shared<std::vector<unsigned char>>(BusyResponse, BusyResponse + sizeof(BusyResponse) - 1))
+		, _encoder(scheduler, options.frameWidth, options.jpegQuality, [this](const EncodedFrame& frame) { OnEncoded(frame); })
+		, _reserved(0)
+		, _sequence(0)
+		, _stats()
+	{
+	}
+
+	bool MjpegStreamer::ReserveClient()
+	{
+		CloseStalledClients();
+		std::lock_guard<std::mutex> lock(_lock);
+		if (_clients.size() + _reserved >= _options.maxClients) return false;
+		_reserved++;
+		return true;
+	}
+
+	void MjpegStreamer::ReleaseReservation()
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		if (_reserved > 0) _reserved--;
+	}
+
+	void MjpegStreamer::AddClient(std::shared_ptr<IStreamClient> connection, bool reserved)
+	{
+		auto client = std::make_shared<Client>();
+		client->connection = connection;
+		client->sequence = 0;
+		client->sending = true;
+		client->sendStarted = _scheduler.Now();
+		client->closed = false;
+		CloseStalledClients();
+		bool full;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			if (reserved && _reserved > 0) _reserved--;
+			full = !reserved && _clients.size() + _reserved >= _options.maxClients;
+			if (!full)
+			{
+				_clients.push_back(client);
+				_stats.clientsServed++;
+			}
+		}
+
+		if (full)
+		{
+			RefuseClient(connection);
+			return;
+		}
+
+		connection->SendAsync(_responseHeader, [this, client](bool sent)
+		{
+			OnSent(client, 0, sent);
+		});
+	}
+
+	void MjpegStreamer::RefuseClient(std::shared_ptr<IStreamClient> connection)
+	{
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			_stats.clientsRefused++;
+		}
+		connection->SendAsync(_busyResponse, [connection](bool)
+		{
+			connection->Close();
+		});
+	}
+
+	void MjpegStreamer::Publish(const cv::Mat& rgba, const std::vector<cv::Rect>& objects)
+	{
+		if (rgba.empty()) return;
+
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			_stats.framesPublished++;
+			if (_clients.empty())
+			{
+				_stats.framesDropped++;
+				return;
+			}
+		}
+
+		if (!_encoder.Submit(rgba, _scheduler.Now(), objects))
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			_stats.framesDropped++;
+		}
+	}
+
+	// Wraps each encoded frame in a multipart part and starts each client that is free on it
+	void MjpegStreamer::OnEncoded(const EncodedFrame& frame)
+	{
+		CloseStalledClients();
+		std::shared_ptr<std::vector<unsigned char>> part;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			part.swap(_spare);
+		}
+
+		// The whole multipart part, so a client sends a frame with one write
+		char partHeader[128];
+		int headerLength = snprintf(partHeader, sizeof(partHeader),
+			"--" STREAM_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n", static_cast<unsigned int>(frame.jpeg.size()));
+		if (!part) part = std::make_shared<std::vector<unsigned char>>();
+		part->clear();
+		part->reserve(headerLength + frame.jpeg.size() + 2);
+		Append(*part, partHeader, headerLength);
+		part->insert(part->end(), frame.jpeg.begin(), frame.jpeg.end());
+		Append(*part, "\r\n", 2);
+
+		std::vector<std::shared_ptr<Client>> idle;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			_stats.encodeMicroseconds += frame.encodeMicroseconds;
+			_stats.framesEncoded++;
+			// Clients only take a reference under the lock, so nobody else can be holding the old part
+			if (_latest && _latest.use_count() == 1) _spare.swap(_latest);
+			_latest = part;
+			_sequence++;
+			for (auto& client : _clients)
+			{
+				if (!client->sending) idle.push_back(client);
+			}
+		}
+
+		for (auto& client : idle) SendNext(client);
+	}
+
+	// Starts sending the newest frame if the client is free and has not had it
+	void MjpegStreamer::SendNext(std::shared_ptr<Client> client)
+	{
+		std::shared_ptr<const std::vector<unsigned char>> part;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			if (client->closed || client->sending || client->sequence == _sequence || !_latest) return;
+			if (client->sequence > 0) _stats.framesSkipped += _sequence - client->sequence - 1;
+			client->sequence = _sequence;
+			client->sending = true;
+			client->sendStarted = _scheduler.Now();
+			part = _latest;
+		}
+
+		size_t bytes = part->size();
+		client->connection->SendAsync(part, [this, client, bytes](bool sent)
+		{
+			OnSent(client, bytes, sent);
+		});
+	}
+
+	void MjpegStreamer::OnSent(std::shared_ptr<Client> client, size_t bytes, bool sent)
+	{
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			// Already closed, as stalled or by CloseAll
+			if (client->closed) return;
+			client->sending = false;
+			if (sent)
+			{
+				if (bytes > 0) _stats.framesSent++;
+				_stats.bytesSent += bytes;
+			}
+			else
+			{
+				_stats.sendFailures++;
+				client->closed = true;
+				_clients.erase(std::remove(_clients.begin(), _clients.end(), client), _clients.end());
+			}
+		}
+
+		if (!sent)
+		{
+			client->connection->Close();
+			return;
+		}
+		SendNext(client);
+	}
+
+	void MjpegStreamer::CloseStalledClients()
+	{
+		std::vector<std::shared_ptr<Client>> stalled;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			int64_t now = _scheduler.Now();
+			for (auto& client : _clients)
+			{
+				if (client->sending && now - client->sendStarted > _options.sendTimeoutMicroseconds)
+				{
+					client->closed = true;
+					stalled.push_back(client);
+				}
+			}
+			for (auto& client : stalled)
+			{
+				_clients.erase(std::remove(_clients.begin(), _clients.end(), client), _clients.end());
+			}
+			_stats.clientsTimedOut += stalled.size();
+		}
+
+		for (auto& client : stalled) client->connection->Close();
+	}
+
+	void MjpegStreamer::CloseAll()
+	{
+		std::vector<std::shared_ptr<Client>> clients;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			clients.swap(_clients);
+			for (auto& client : clients) client->closed = true;
+		}
+		for (auto& client : clients) client->connection->Close();
+	}
+
+	MjpegStreamStats MjpegStreamer::Stats()
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		MjpegStreamStats stats = _stats;
+		stats.clients = _clients.size();
+		return stats;
+	}
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include "Hal.h"
+#include "JpegFrameEncoder.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+// Streamed frames are scaled down to this width before they are compressed
+#define STREAM_FRAME_WIDTH 640
+#define STREAM_JPEG_QUALITY 75
+#define STREAM_BOUNDARY "petdoorframe"
+// Viewers served at once, counting connections still sending their request; more are answered 503 and closed
+#define STREAM_MAX_CLIENTS 4
+// A viewer whose send has not completed in this long has stopped reading, and is closed to free its place
+#define STREAM_SEND_TIMEOUT_MS 10000
+
+namespace PetDoor
+{
+	struct MjpegStreamOptions
+	{
+		int frameWidth = STREAM_FRAME_WIDTH;
+		int jpegQuality = STREAM_JPEG_QUALITY;
+		size_t maxClients = STREAM_MAX_CLIENTS;
+		int64_t sendTimeoutMicroseconds = STREAM_SEND_TIMEOUT_MS * 1000;
+	};
+
+	// Counts since the streamer was created
+	struct MjpegStreamStats
+	{
+		uint64_t framesPublished;
+		uint64_t framesEncoded;
+		// Replaced by a newer frame before the encoder got to them, or published with nobody watching
+		uint64_t framesDropped;
+		int64_t encodeMicroseconds;
+		size_t clients;
+		uint64_t clientsServed;
+		// Turned away with a 503 as maxClients were already being served or reserved
+		uint64_t clientsRefused;
+		// Closed after a send took longer than sendTimeoutMicroseconds
+		uint64_t clientsTimedOut;
+		// Summed over the clients
+		uint64_t framesSent;
+		// Frames a client was still busy sending the one before of
+		uint64_t framesSkipped;
+		uint64_t bytesSent;
+		uint64_t sendFailures;
+	};
+
+	// One HTTP connection the stream is sent down
+	class IStreamClient
+	{
+	public:
+		// sent: false if the connection failed, after which it is closed
+		typedef std::function<void(bool sent)> SendHandler;
+
+		virtual ~IStreamClient() {}
+
+		// Sends all of bytes, which are shared with other clients and must not be changed. The
+		// handler may run on another thread, or before SendAsync returns. One send at a time.
+		virtual void SendAsync(std::shared_ptr<const std::vector<unsigned char>> bytes, SendHandler handler) = 0;
+		virtual void Close() = 0;
+	};
+
+	// Whether an HTTP request asks for the stream: its request line must be "GET / HTTP/1.x"
+	bool IsStreamRequest(const std::string& request);
+
+	// Serves frames as multipart/x-mixed-replace JPEGs, the MJPEG stream browsers and
+	// video players show as live video. Each frame is compressed once, by a JpegFrameEncoder,
+	// into a buffer holding the whole multipart part, and every client sends
+	// that same buffer. A client still sending a frame when the next arrives skips to the
+	// newest one when it is done, so a slow client never holds the others up or makes
+	// frames queue. Nothing is compressed while nobody is watching.
+	class MjpegStreamer
+	{
+	public:
+		// The streamer must outlive the work it schedules and every client's sends
+		MjpegStreamer(IScheduler& scheduler, MjpegStreamOptions options = MjpegStreamOptions());
+
+		// Holds a place for a connection whose request is still being read, so it counts against
+		// maxClients. Returns false if maxClients are already served or held; refuse it then.
+		bool ReserveClient();
+		// Gives the place back, for a connection that did not ask for the stream after all
+		void ReleaseReservation();
+
+		// Takes a connection whose request has been read, in the place it reserved if reserved is set.
+		// It gets the response header, then the newest frame, then each new frame it keeps up with,
+		// until the connection fails or a send stalls. Without a place it is refused.
+		void AddClient(std::shared_ptr<IStreamClient> client, bool reserved = false);
+
+		// Answers 503 and closes the connection
+		void RefuseClient(std::shared_ptr<IStreamClient> client);
+
+		// Queues an RGBA frame; only copied here. A frame still waiting for the encoder is replaced.
+		// objects, in frame coordinates, are drawn over the scaled copy that is encoded, so frames
+		// nobody watches or that a newer one replaces are never annotated.
+		void Publish(const cv::Mat& rgba, const std::vector<cv::Rect>& objects = std::vector<cv::Rect>());
+
+		// Closes every connection
+		void CloseAll();
+
+		MjpegStreamStats Stats();
+
+	private:
+		struct Client
+		{
+			std::shared_ptr<IStreamClient> connection;
+			// Of the last frame sent; 0 before the first
+			uint64_t sequence;
+			bool sending;
+			// When the send in progress started, in scheduler time
+			int64_t sendStarted;
+			// Closed by the streamer; whatever its last send reports is ignored
+			bool closed;
+		};
+
+		void OnEncoded(const EncodedFrame& frame);
+		void SendNext(std::shared_ptr<Client> client);
+		void OnSent(std::shared_ptr<Client> client, size_t bytes, bool sent);
+		// Closes clients whose send has stalled. Checked whenever a place or a new frame is handed
+		// out, which is when a stalled client costs anything.
+		void CloseStalledClients();
+
+		IScheduler& _scheduler;
+		MjpegStreamOptions _options;
+		std::shared_ptr<const std::vector<unsigned char>> _responseHeader;
+		std::shared_ptr<const std::vector<unsigned char>> _busyResponse;
+
+		JpegFrameEncoder _encoder;
+
+		std::mutex _lock;
+		std::vector<std::shared_ptr<Client>> _clients;
+		// Places held for connections still sending their request
+		size_t _reserved;
+		// The newest part and its sequence number; clients hold it while they send it
+		std::shared_ptr<std::vector<unsigned char>> _latest;
+		uint64_t _sequence;
+		// A part no client holds any more, refilled for the next frame
+		std::shared_ptr<std::vector<unsigned char>> _spare;
+
+		MjpegStreamStats _stats;
+	};
+}
@@ -1,6 +1,7 @@
 #include "pch.h"
 #include "MotionSensor.h"
 #include "TimeSpanHelper.h"
+#include "Instrumentation.h"
 
 using namespace Microsoft::IoT::Lightning::Providers;
 
@@ -39,6 +40,7 @@ namespace PetDoor
 	// event handler for when the motion sensor triggers
 	void MotionSensor::Pin_ValueChanged(GpioPin ^sender, GpioPinValueChangedEventArgs ^e)
 	{
+		_lastEdgeMicroseconds = Instrumentation::Now();
 		_pinValue = _pin->Read();
 		// Motion detected, fire the event
 		if (_pinValue == GpioPinValue::High)
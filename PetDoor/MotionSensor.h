@@ -18,12 +18,15 @@ namespace PetDoor
 		MotionSensor(int pin);
 		event MotionDetectedEventHandler^ MotionDetected;
 		GpioPinValue GetPinValue();
+		// Instrumentation::Now() at the last rising edge, for timing the handlers
+		property int64 LastEdgeMicroseconds { int64 get() { return _lastEdgeMicroseconds; } }
 
 	private:
 		ThreadPoolTimer ^_timer;
 		int _timerInterval;
 		GpioPinValue _pinValue = Windows::Devices::Gpio::GpioPinValue::High;
 		GpioPin ^_pin;
+		int64 _lastEdgeMicroseconds = 0;
 		void Pin_ValueChanged(GpioPin ^sender, GpioPinValueChangedEventArgs ^e);
 	};
 }
@@ -0,0 +1,539 @@
+#include "MultiCascadeDetector.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/objdetect.hpp>
+
+// As CascadeClassifier: stage thresholds are relaxed by this much, and detections grouped with this eps
+#define STAGE_THRESHOLD_EPS 1e-5f
+#define GROUP_EPS 0.2
+// cv::resize's fixed-point scale for bilinear weights
+#define RESIZE_COEF_BITS 11
+#define RESIZE_COEF_SCALE (1 << RESIZE_COEF_BITS)
+// Rows of scan positions in a band, the unit the scan is split into between threads
+#define BAND_ROWS 8
+
+namespace PetDoor
+{
+	namespace
+	{
+		inline int RectSum(const int* origin, const int offsets[4])
+		{
+			return origin[offsets[0]] - origin[offsets[1]] - origin[offsets[2]] + origin[offsets[3]];
+		}
+
+		inline double RectSum(const double* origin, const int offsets[4])
+		{
+			return origin[offsets[0]] - origin[offsets[1]] - origin[offsets[2]] + origin[offsets[3]];
+		}
+
+		// Corners of an upright rectangle in an integral image with the given row stride
+		void UprightOffsets(const cv::Rect& rect, int stride, int offsets[4])
+		{
+			offsets[0] = rect.y * stride + rect.x;
+			offsets[1] = rect.y * stride + rect.x + rect.width;
+			offsets[2] = (rect.y + rect.height) * stride + rect.x;
+			offsets[3] = (rect.y + rect.height) * stride + rect.x + rect.width;
+		}
+
+		// How many bands a level of this height is scanned in
+		int BandCount(int rows, int step)
+		{
+			int rowsPerBand = BAND_ROWS * step;
+			return (rows + rowsPerBand - 1) / rowsPerBand;
+		}
+
+		// Follows a chain of parents to its root, pointing the chain at the root on the way
+		int FindRoot(std::vector<int>& parents, int node)
+		{
+			int root = node;
+			while (parents[root] != root) root = parents[root];
+			while (parents[node] != root)
+			{
+				int next = parents[node];
+				parents[node] = root;
+				node = next;
+			}
+			return root;
+		}
+
+		// Fixed-point bilinear weights, as cv::resize's INTER_LINEAR computes them for 8-bit images:
+		// the source pixel before each destination pixel and the weights of it and the next one.
+		// cv::resize clamps columns here and rows only as it reads them, so clampEdges is for columns.
+		void LinearCoefficients(int sourceSize, int size, bool clampEdges, std::vector<int>& offsets, std::vector<short>& weights)
+		{
+			double scale = 1 / (static_cast<double>(size) / sourceSize);
+			offsets.resize(size);
+			weights.resize(size * 2);
+			for (int i = 0; i < size; i++)
+			{
+				float fraction = static_cast<float>((i + 0.5) * scale - 0.5);
+				int offset = cvFloor(fraction);
+				fraction -= offset;
+				if (clampEdges && offset < 0)
+				{
+					fraction = 0;
+					offset = 0;
+				}
+				if (clampEdges && offset >= sourceSize - 1)
+				{
+					fraction = 0;
+					offset = sourceSize - 1;
+				}
+				offsets[i] = offset;
+				weights[i * 2] = cv::saturate_cast<short>((1.f - fraction) * RESIZE_COEF_SCALE);
+				weights[i * 2 + 1] = cv::saturate_cast<short>(fraction * RESIZE_COEF_SCALE);
+			}
+		}
+
+		// Corners of a rectangle rotated by 45 degrees in cv::integral's tilted sum
+		void TiltedOffsets(const cv::Rect& rect, int stride, int offsets[4])
+		{
+			offsets[0] = rect.y * stride + rect.x;
+			offsets[1] = (rect.y + rect.height) * stride + rect.x - rect.height;
+			offsets[2] = (rect.y + rect.width) * stride + rect.x + rect.width;
+			offsets[3] = (rect.y + rect.width + rect.height) * stride + rect.x + rect.width - rect.height;
+		}
+	}
+
+	// Scans bands of one level's rows, each into its own band's hits; the bands run in parallel
+	class MultiCascadeDetector::ScanRows : public cv::ParallelLoopBody
+	{
+	public:
+		ScanRows(const MultiCascadeDetector& detector, const Level& level, std::vector<Band>& bands, int rowsPerBand)
+			: _detector(detector)
+			, _level(level)
+			, _bands(bands)
+			, _rowsPerBand(rowsPerBand)
+		{
+		}
+
+		void operator()(const cv::Range& bands) const override
+		{
+			for (int b = bands.start; b < bands.end; b++)
+			{
+				_detector.ScanLevel(_level, b * _rowsPerBand, (b + 1) * _rowsPerBand, _bands[b].hits);
+			}
+		}
+
+	private:
+		ScanRows& operator=(const ScanRows&);
+
+		const MultiCascadeDetector& _detector;
+		const Level& _level;
+		std::vector<Band>& _bands;
+		int _rowsPerBand;
+	};
+
+	MultiCascadeDetector::MultiCascadeDetector(double scaleFactor, double imageScale)
+		: _scaleFactor(scaleFactor)
+		, _imageScale(imageScale)
+		, _hasTilted(false)
+		, _parallel(true)
+	{
+	}
+
+	int MultiCascadeDetector::AddCascade(const std::string& path, const CascadeScanOptions& options)
+	{
+		HaarCascade cascade;
+		if (!cascade.Load(path)) return -1;
+		return AddCascade(cascade, options);
+	}
+
+	int MultiCascadeDetector::AddCascade(const HaarCascade& haarCascade, const CascadeScanOptions& options)
+	{
+		if (haarCascade.stages.empty() || haarCascade.window.area() == 0) return -1;
+
+		Cascade cascade;
+		static_cast<HaarCascade&>(cascade) = haarCascade;
+		cascade.options = options;
+
+		// Relaxed once here rather than on every evaluation
+		for (auto& stage : cascade.stages) stage.threshold -= STAGE_THRESHOLD_EPS;
+		_hasTilted = _hasTilted || cascade.HasTilted();
+
+		_cascades.push_back(cascade);
+		// The pyramid depends on every cascade's window and size range
+		_frameSize = cv::Size();
+		return static_cast<int>(_cascades.size()) - 1;
+	}
+
+	void MultiCascadeDetector::BuildLevels(cv::Size frameSize)
+	{
+		_levels.clear();
+		_frameSize = frameSize;
+
+		for (double factor = 1; ; factor *= _scaleFactor)
+		{
+			cv::Size scaledSize(cvRound(frameSize.width / factor), cvRound(frameSize.height / factor));
+
+			Level level;
+			level.scale = factor;
+			level.step = factor * _imageScale > 2 ? 1 : 2;
+
+			// Like detectMultiScale, a cascade stops at the first scale its window outgrows the
+			// frame or its maximum size, and skips scales where it is below its minimum
+			bool anyGrowing = false;
+			bool anyActive = false;
+			for (auto& cascade : _cascades)
+			{
+				cv::Size window(cvRound(cascade.window.width * factor), cvRound(cascade.window.height * factor));
+				cv::Size maxSize = cascade.options.maxSize.area() > 0 ? cascade.options.maxSize : frameSize;
+				bool fits = scaledSize.width > cascade.window.width && scaledSize.height > cascade.window.height
+					&& window.width <= maxSize.width && window.height <= maxSize.height;
+
+				LevelCascade levelCascade;
+				levelCascade.active = fits && window.width >= cascade.options.minSize.width && window.height >= cascade.options.minSize.height;
+				levelCascade.scanSize = cv::Size(scaledSize.width - cascade.window.width + 1, scaledSize.height - cascade.window.height + 1);
+				level.cascades.push_back(levelCascade);
+
+				anyGrowing = anyGrowing || fits;
+				anyActive = anyActive || levelCascade.active;
+			}
+			if (!anyGrowing) break;
+			if (!anyActive) continue;
+
+			level.image.create(scaledSize, CV_8UC1);
+			LinearCoefficients(frameSize.width, scaledSize.width, true, level.xOffsets, level.xWeights);
+			LinearCoefficients(frameSize.height, scaledSize.height, false, level.yOffsets, level.yWeights);
+			PrepareLevel(level);
+			_levels.push_back(level);
+		}
+
+		// Sized for the widest and tallest level, so no scan grows them
+		size_t widest = 0;
+		size_t bands = 0;
+		for (auto& level : _levels)
+		{
+			widest = std::max(widest, static_cast<size_t>(level.image.cols));
+			bands = std::max(bands, static_cast<size_t>(BandCount(level.image.rows, level.step)));
+		}
+		_resizeRows.resize(widest * 2);
+		_bands.resize(bands);
+		for (auto& band : _bands) band.hits.resize(_cascades.size());
+	}
+
+	void MultiCascadeDetector::ResizeLevel(const cv::Mat& gray, Level& level)
+	{
+		int width = level.image.cols;
+		int* rows[2] = { &_resizeRows[0], &_resizeRows[width] };
+
+		for (int y = 0; y < level.image.rows; y++)
+		{
+			// Across first, into 11-bit fixed point, for the two source rows this row falls between
+			for (int k = 0; k < 2; k++)
+			{
+				int sourceY = std::min(std::max(level.yOffsets[y] + k, 0), gray.rows - 1);
+				const unsigned char* source = gray.ptr<unsigned char>(sourceY);
+				int* row = rows[k];
+				for (int x = 0; x < width; x++)
+				{
+					int sourceX = level.xOffsets[x];
+					const short* weights = &level.xWeights[x * 2];
+					row[x] = sourceX + 1 < gray.cols ? source[sourceX] * weights[0] + source[sourceX + 1] * weights[1] : source[sourceX] * RESIZE_COEF_SCALE;
+				}
+			}
+
+			// Then down, rounded as cv::resize rounds its 8-bit output
+			const short* weights = &level.yWeights[y * 2];
+			unsigned char* destination = level.image.ptr<unsigned char>(y);
+			for (int x = 0; x < width; x++)
+			{
+				destination[x] = static_cast<unsigned char>((((weights[0] * (rows[0][x] >> 4)) >> 16) + ((weights[1] * (rows[1][x] >> 4)) >> 16) + 2) >> 2);
+			}
+		}
+	}
+
+	void MultiCascadeDetector::PrepareLevel(Level& level)
+	{
+		// cv::integral's outputs are one column wider than the image and continuous
+		int stride = level.image.cols + 1;
+
+		for (size_t c = 0; c < _cascades.size(); c++)
+		{
+			const Cascade& cascade = _cascades[c];
+			LevelCascade& levelCascade = level.cascades[c];
+			if (!levelCascade.active) continue;
+
+			// The variance is taken over the window less a one-pixel border
+			UprightOffsets(cv::Rect(1, 1, cascade.window.width - 2, cascade.window.height - 2), stride, levelCascade.normOffsets);
+
+			levelCascade.features.resize(cascade.features.size());
+			for (size_t f = 0; f < cascade.features.size(); f++)
+			{
+				const HaarFeature& feature = cascade.features[f];
+				LevelFeature& levelFeature = levelCascade.features[f];
+				levelFeature.tilted = feature.tilted;
+				for (int r = 0; r < 3; r++)
+				{
+					if (r < feature.rectCount)
+					{
+						if (feature.tilted) TiltedOffsets(feature.rects[r].rect, stride, levelFeature.offsets[r]);
+						else UprightOffsets(feature.rects[r].rect, stride, levelFeature.offsets[r]);
+						levelFeature.weights[r] = feature.rects[r].weight;
+					}
+					else
+					{
+						std::fill(levelFeature.offsets[r], levelFeature.offsets[r] + 4, 0);
+						levelFeature.weights[r] = 0;
+					}
+				}
+			}
+		}
+	}
+
+	// cv::groupRectangles, which also keeps the highest level weight of each group. Its overload
+	// that takes level weights filters groups on their reject level rather than their size, so
+	// it would change which groups detectMultiScale's minNeighbors keeps. The partition is
+	// cv::partition's, numbering groups in the order they first appear, into kept scratch.
+	void MultiCascadeDetector::GroupHits(std::vector<cv::Rect>& rects, std::vector<double>& levelWeights, std::vector<int>& neighbors, int minNeighbors)
+	{
+		neighbors.assign(rects.size(), 1);
+		if (minNeighbors <= 0 || rects.empty()) return;
+
+		GroupScratch& scratch = _group;
+		int count = static_cast<int>(rects.size());
+		cv::SimilarRects similar(GROUP_EPS);
+		scratch.parents.resize(count);
+		for (int i = 0; i < count; i++) scratch.parents[i] = i;
+		for (int i = 0; i < count; i++)
+		{
+			for (int j = i + 1; j < count; j++)
+			{
+				if (!similar(rects[i], rects[j])) continue;
+				int root = FindRoot(scratch.parents, i);
+				int other = FindRoot(scratch.parents, j);
+				if (root != other) scratch.parents[std::max(root, other)] = std::min(root, other);
+			}
+		}
+
+		// Each group's root is its first hit, so numbering the roots in order numbers the groups as they appear
+		int groups = 0;
+		scratch.labels.resize(count);
+		for (int i = 0; i < count; i++)
+		{
+			int root = FindRoot(scratch.parents, i);
+			scratch.labels[i] = root == i ? groups++ : scratch.labels[root];
+		}
+
+		scratch.sums.assign(groups, cv::Rect(0, 0, 0, 0));
+		scratch.counts.assign(groups, 0);
+		scratch.weights.assign(groups, -DBL_MAX);
+		std::vector<cv::Rect>& sums = scratch.sums;
+		std::vector<int>& counts = scratch.counts;
+		for (size_t i = 0; i < rects.size(); i++)
+		{
+			int group = scratch.labels[i];
+			sums[group].x += rects[i].x;
+			sums[group].y += rects[i].y;
+			sums[group].width += rects[i].width;
+			sums[group].height += rects[i].height;
+			counts[group]++;
+			scratch.weights[group] = std::max(scratch.weights[group], levelWeights[i]);
+		}
+		for (int g = 0; g < groups; g++)
+		{
+			float scale = 1.0f / counts[g];
+			sums[g] = cv::Rect(cv::saturate_cast<int>(sums[g].x * scale), cv::saturate_cast<int>(sums[g].y * scale),
+				cv::saturate_cast<int>(sums[g].width * scale), cv::saturate_cast<int>(sums[g].height * scale));
+		}
+
+		rects.clear();
+		levelWeights.clear();
+		neighbors.clear();
+		for (int g = 0; g < groups; g++)
+		{
+			if (counts[g] <= minNeighbors) continue;
+
+			// Small groups inside a bigger, better supported one are dropped
+			const cv::Rect& inner = sums[g];
+			bool contained = false;
+			for (int h = 0; h < groups && !contained; h++)
+			{
+				if (h == g || counts[h] <= minNeighbors) continue;
+				const cv::Rect& outer = sums[h];
+				int dx = cv::saturate_cast<int>(outer.width * GROUP_EPS);
+				int dy = cv::saturate_cast<int>(outer.height * GROUP_EPS);
+				contained = inner.x >= outer.x - dx && inner.y >= outer.y - dy
+					&& inner.x + inner.width <= outer.x + outer.width + dx && inner.y + inner.height <= outer.y + outer.height + dy
+					&& (counts[h] > std::max(3, counts[g]) || counts[g] < 3);
+			}
+			if (contained) continue;
+
+			rects.push_back(inner);
+			levelWeights.push_back(scratch.weights[g]);
+			neighbors.push_back(counts[g]);
+		}
+	}
+
+	int MultiCascadeDetector::Evaluate(const Cascade& cascade, const LevelCascade& levelCascade, const int* sum, const int* tilted, float normFactor, double& levelWeight) const
+	{
+		for (size_t s = 0; s < cascade.stages.size(); s++)
+		{
+			const HaarStage& stage = cascade.stages[s];
+			double stageSum = 0;
+
+			for (int t = stage.firstTree; t < stage.firstTree + stage.treeCount; t++)
+			{
+				const HaarTree& tree = cascade.trees[t];
+				int index = 0;
+				do
+				{
+					const HaarNode& node = cascade.nodes[tree.firstNode + index];
+					const LevelFeature& feature = levelCascade.features[node.feature];
+					const int* origin = feature.tilted ? tilted : sum;
+
+					float value = feature.weights[0] * RectSum(origin, feature.offsets[0]) + feature.weights[1] * RectSum(origin, feature.offsets[1]);
+					if (feature.weights[2] != 0.0f) value += feature.weights[2] * RectSum(origin, feature.offsets[2]);
+
+					index = value * normFactor < node.threshold ? node.left : node.right;
+				} while (index > 0);
+
+				stageSum += cascade.leaves[tree.firstLeaf - index];
+			}
+
+			if (stageSum < stage.threshold) return -static_cast<int>(s);
+			levelWeight = stageSum;
+		}
+		return 1;
+	}
+
+	void MultiCascadeDetector::ScanLevel(const Level& level, int firstRow, int endRow, std::vector<std::vector<RawHit>>& hits) const
+	{
+		cv::Size scanSize;
+		for (auto& levelCascade : level.cascades)
+		{
+			if (!levelCascade.active) continue;
+			scanSize.width = std::max(scanSize.width, levelCascade.scanSize.width);
+			scanSize.height = std::max(scanSize.height, levelCascade.scanSize.height);
+		}
+
+		int step = level.step;
+		int y = (firstRow + step - 1) / step * step;
+		endRow = std::min(endRow, scanSize.height);
+
+		for (; y < endRow; y += step)
+		{
+			const int* sumRow = level.sum.ptr<int>(y);
+			const double* squareSumRow = level.squareSum.ptr<double>(y);
+			const int* tiltedRow = level.tiltedSum.empty() ? nullptr : level.tiltedSum.ptr<int>(y);
+
+			for (int x = 0; x < scanSize.width; x += step)
+			{
+				// Cascades with the same window share its variance
+				cv::Size normWindow;
+				float normFactor = 0;
+				bool anyPastFirstStage = false;
+
+				for (size_t c = 0; c < _cascades.size(); c++)
+				{
+					const Cascade& cascade = _cascades[c];
+					const LevelCascade& levelCascade = level.cascades[c];
+					if (!levelCascade.active || x >= levelCascade.scanSize.width || y >= levelCascade.scanSize.height) continue;
+
+					if (cascade.window != normWindow)
+					{
+						normWindow = cascade.window;
+						double area = (cascade.window.width - 2) * (cascade.window.height - 2);
+						int valueSum = RectSum(sumRow + x, levelCascade.normOffsets);
+						double squareSum = RectSum(squareSumRow + x, levelCascade.normOffsets);
+						double variance = area * squareSum - static_cast<double>(valueSum) * valueSum;
+
+						// Flat windows are skipped as CascadeClassifier does; they never hold a face
+						normFactor = variance > 0 ? static_cast<float>(1 / std::sqrt(variance)) : 0;
+						if (area * normFactor >= 0.1) normFactor = 0;
+					}
+					if (normFactor == 0)
+					{
+						anyPastFirstStage = true;
+						continue;
+					}
+
+					double levelWeight = 0;
+					int result = Evaluate(cascade, levelCascade, sumRow + x, tiltedRow ? tiltedRow + x : nullptr, normFactor, levelWeight);
+					if (result > 0)
+					{
+						RawHit hit = { cv::Rect(cvRound(x * level.scale), cvRound(y * level.scale),
+							cvRound(cascade.window.width * level.scale), cvRound(cascade.window.height * level.scale)), levelWeight };
+						hits[c].push_back(hit);
+					}
+					anyPastFirstStage = anyPastFirstStage || result != 0;
+				}
+
+				// Nothing came close here, so skip the next position as well
+				if (!anyPastFirstStage) x += step;
+			}
+		}
+	}
+
+	bool MultiCascadeDetector::Detect(const cv::Mat& gray, std::vector<std::vector<cv::Rect>>& hits, const std::atomic<bool>* cancel)
+	{
+		CV_Assert(gray.type() == CV_8UC1);
+
+		hits.resize(_cascades.size());
+		_raw.resize(_cascades.size());
+		_neighbors.resize(_cascades.size());
+		_confidences.resize(_cascades.size());
+		for (size_t c = 0; c < _cascades.size(); c++)
+		{
+			hits[c].clear();
+			_raw[c].clear();
+			_neighbors[c].clear();
+			_confidences[c].clear();
+		}
+		if (_cascades.empty() || gray.empty()) return true;
+
+		if (gray.size() != _frameSize) BuildLevels(gray.size());
+
+		for (auto& level : _levels)
+		{
+			if (cancel && cancel->load()) return false;
+
+			// One resize and one set of integral images per scale, for every cascade. The resize is
+			// cv::resize's INTER_LINEAR with the weights worked out once per frame size; cv::resize
+			// works them out, into a fresh buffer, on every call.
+			if (level.scale == 1) gray.copyTo(level.image);
+			else ResizeLevel(gray, level);
+
+			if (_hasTilted) cv::integral(level.image, level.sum, level.squareSum, level.tiltedSum, CV_32S, CV_64F);
+			else cv::integral(level.image, level.sum, level.squareSum, CV_32S, CV_64F);
+
+			// Bands of rows are scanned in parallel, as detectMultiScale does
+			int bands = BandCount(level.image.rows, level.step);
+			for (int b = 0; b < bands; b++)
+			{
+				for (auto& hits : _bands[b].hits) hits.clear();
+			}
+			ScanRows scanRows(*this, level, _bands, BAND_ROWS * level.step);
+			if (_parallel) cv::parallel_for_(cv::Range(0, bands), scanRows);
+			else scanRows(cv::Range(0, bands));
+
+			for (int b = 0; b < bands; b++)
+			{
+				for (size_t c = 0; c < _cascades.size(); c++)
+				{
+					_raw[c].insert(_raw[c].end(), _bands[b].hits[c].begin(), _bands[b].hits[c].end());
+				}
+			}
+		}
+
+		for (size_t c = 0; c < _cascades.size(); c++)
+		{
+			// Bands finish in any order; sorting first makes the grouped result the same on every run
+			std::sort(_raw[c].begin(), _raw[c].end(), [](const RawHit& a, const RawHit& b)
+			{
+				return a.rect.width != b.rect.width ? a.rect.width < b.rect.width : a.rect.y != b.rect.y ? a.rect.y < b.rect.y : a.rect.x < b.rect.x;
+			});
+
+			for (auto& hit : _raw[c])
+			{
+				hits[c].push_back(hit.rect);
+				_confidences[c].push_back(hit.levelWeight);
+			}
+			GroupHits(hits[c], _confidences[c], _neighbors[c], _cascades[c].options.minNeighbors);
+		}
+		return true;
+	}
+}
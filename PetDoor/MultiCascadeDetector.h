@@ -0,0 +1,145 @@
+#pragma once
+
+#include "HaarCascade.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+// Haar cascades in OpenCV's XML format, evaluated by our own scanner so that
+// several cascades share one image pyramid and one set of integral images.
+// Each scale is resized and integrated once and every window position is run
+// through each cascade in turn, so a second cascade only adds its own
+// classifier evaluations, not a second pass over the image. The evaluation
+// follows CascadeClassifier::detectMultiScale with CASCADE_SCALE_IMAGE.
+namespace PetDoor
+{
+	struct CascadeScanOptions
+	{
+		// Hits outside this size range are not looked for; an empty maxSize means the whole frame
+		cv::Size minSize;
+		cv::Size maxSize;
+		// Overlapping hits needed to keep a detection, as for detectMultiScale; 0 keeps every raw hit
+		int minNeighbors = 3;
+	};
+
+	class MultiCascadeDetector
+	{
+	public:
+		// imageScale is how much the frames have been shrunk before they are passed in. The scan step
+		// follows the scale relative to the original frame, so a shrunk frame is scanned as finely.
+		explicit MultiCascadeDetector(double scaleFactor = 1.1, double imageScale = 1);
+
+		// Reads a BOOST/HAAR cascade. Returns its index in the results, or -1 if it cannot be read.
+		int AddCascade(const std::string& path, const CascadeScanOptions& options);
+		// Adds a cascade already in memory, e.g. one being trained. Returns -1 if it has no stages.
+		int AddCascade(const HaarCascade& cascade, const CascadeScanOptions& options);
+
+		// Scans on the calling thread only, e.g. for background work that must not take cores from live detection
+		void SetParallel(bool parallel) { _parallel = parallel; }
+
+		size_t CascadeCount() const { return _cascades.size(); }
+		cv::Size WindowSize(int index) const { return _cascades[index].window; }
+
+		// Scans an 8-bit grayscale frame once; hits[i] gets the grouped detections of cascade i.
+		// The pyramid and every other buffer are kept between calls, so once a frame size has been
+		// scanned, frames of that size are scanned without allocating.
+		// Returns false, with the hits incomplete, if cancel was set before the scan finished.
+		bool Detect(const cv::Mat& gray, std::vector<std::vector<cv::Rect>>& hits, const std::atomic<bool>* cancel = nullptr);
+
+		// For each hit of cascade i in the last Detect, in the same order: the sum of its last stage
+		// (the highest in its group), how far it cleared the cascade, and the raw hits grouped into it.
+		// These are detectMultiScale's level weights and reject levels.
+		const std::vector<double>& Confidences(int index) const { return _confidences[index]; }
+		const std::vector<int>& Neighbors(int index) const { return _neighbors[index]; }
+
+	private:
+		struct Cascade : HaarCascade
+		{
+			CascadeScanOptions options;
+		};
+
+		// A feature's rectangles as offsets from the window's corner in one level's integral images
+		struct LevelFeature
+		{
+			int offsets[3][4];
+			float weights[3];
+			bool tilted;
+		};
+
+		struct LevelCascade
+		{
+			// Whether the cascade's window at this scale is within its size range
+			bool active;
+			cv::Size scanSize;
+			int normOffsets[4];
+			std::vector<LevelFeature> features;
+		};
+
+		struct Level
+		{
+			double scale;
+			int step;
+			// Source column and row of each pixel of image, with their fixed-point weights in pairs
+			std::vector<int> xOffsets;
+			std::vector<short> xWeights;
+			std::vector<int> yOffsets;
+			std::vector<short> yWeights;
+			cv::Mat image;
+			cv::Mat sum;
+			cv::Mat squareSum;
+			cv::Mat tiltedSum;
+			std::vector<LevelCascade> cascades;
+		};
+
+		struct RawHit
+		{
+			cv::Rect rect;
+			double levelWeight;
+		};
+
+		// What one band of rows found, per cascade; each band is scanned by one thread
+		struct Band
+		{
+			std::vector<std::vector<RawHit>> hits;
+		};
+
+		// Grouping one cascade's hits, as cv::groupRectangles does
+		struct GroupScratch
+		{
+			std::vector<int> parents;
+			std::vector<int> labels;
+			std::vector<cv::Rect> sums;
+			std::vector<int> counts;
+			std::vector<double> weights;
+		};
+
+		class ScanRows;
+
+		void BuildLevels(cv::Size frameSize);
+		void PrepareLevel(Level& level);
+		void ResizeLevel(const cv::Mat& gray, Level& level);
+		void GroupHits(std::vector<cv::Rect>& rects, std::vector<double>& levelWeights, std::vector<int>& neighbors, int minNeighbors);
+		// 1 if the window passes, with its last stage's sum in levelWeight, otherwise -(the stage it failed),
+		// so 0 means it failed the first stage
+		int Evaluate(const Cascade& cascade, const LevelCascade& levelCascade, const int* sum, const int* tilted, float normFactor, double& levelWeight) const;
+		void ScanLevel(const Level& level, int firstRow, int endRow, std::vector<std::vector<RawHit>>& hits) const;
+
+		double _scaleFactor;
+		double _imageScale;
+		std::vector<Cascade> _cascades;
+		bool _hasTilted;
+		bool _parallel;
+		cv::Size _frameSize;
+		std::vector<Level> _levels;
+		// Two rows of a level, shrunk across but not yet down
+		std::vector<int> _resizeRows;
+		std::vector<Band> _bands;
+		GroupScratch _group;
+		// Per cascade: the last scan's raw hits, and its grouped hits' neighbour counts and level weights
+		std::vector<std::vector<RawHit>> _raw;
+		std::vector<std::vector<int>> _neighbors;
+		std::vector<std::vector<double>> _confidences;
+	};
+}
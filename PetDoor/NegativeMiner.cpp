@@ -0,0 +1,137 @@
+#include "NegativeMiner.h"
+#include "VisionCore.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <opencv2/imgcodecs/imgcodecs.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/objdetect.hpp>
+
+namespace PetDoor
+{
+	uint64_t DifferenceHash(const cv::Mat& gray)
+	{
+		cv::Mat thumbnail;
+		cv::resize(gray, thumbnail, cv::Size(9, 8), 0, 0, cv::INTER_AREA);
+
+		uint64_t hash = 0;
+		for (int y = 0; y < 8; y++)
+		{
+			const unsigned char* row = thumbnail.ptr<unsigned char>(y);
+			for (int x = 0; x < 8; x++)
+			{
+				hash = hash << 1 | (row[x] < row[x + 1] ? 1 : 0);
+			}
+		}
+		return hash;
+	}
+
+	int HammingDistance(uint64_t a, uint64_t b)
+	{
+		int distance = 0;
+		for (uint64_t differing = a ^ b; differing; differing &= differing - 1) distance++;
+		return distance;
+	}
+
+	NegativeStore::NegativeStore(const std::string& directory, size_t maxWindows)
+		: _directory(directory)
+		, _maxWindows(maxWindows)
+	{
+	}
+
+	size_t NegativeStore::Load()
+	{
+		std::vector<cv::String> paths;
+		cv::glob(_directory + "/Negative_*.png", paths, false);
+
+		_hashes.clear();
+		for (auto& path : paths)
+		{
+			std::string file = path;
+			size_t start = file.find_last_of("/\\") + 1 + strlen("Negative_");
+			_hashes.push_back(strtoull(file.c_str() + start, nullptr, 16));
+		}
+		return _hashes.size();
+	}
+
+	bool NegativeStore::Add(const cv::Mat& grayWindow)
+	{
+		if (Full() || grayWindow.empty()) return false;
+
+		cv::resize(grayWindow, _window, cv::Size(NEGATIVE_WINDOW_SIZE, NEGATIVE_WINDOW_SIZE), 0, 0, cv::INTER_AREA);
+		uint64_t hash = DifferenceHash(_window);
+		bool duplicate = std::any_of(_hashes.begin(), _hashes.end(), [hash](uint64_t stored)
+		{
+			return HammingDistance(hash, stored) <= NEGATIVE_HASH_MAX_DISTANCE;
+		});
+		if (duplicate) return false;
+
+		char name[40];
+		snprintf(name, sizeof(name), "/Negative_%016llx.png", static_cast<unsigned long long>(hash));
+		if (!cv::imwrite(_directory + name, _window)) return false;
+		_hashes.push_back(hash);
+		return true;
+	}
+
+	NegativeMiner::NegativeMiner()
+		: _catIndex(-1)
+		, _humanIndex(-1)
+		, _catMinNeighbors(0)
+	{
+		_detector.SetParallel(false);
+	}
+
+	bool NegativeMiner::Load(const std::string& catCascadePath, const std::string& humanCascadePath)
+	{
+		// Every raw hit is kept and grouped here, so the size of each group is known
+		CascadeScanOptions catOptions = CatFaceScanOptions();
+		_catMinNeighbors = catOptions.minNeighbors;
+		catOptions.minNeighbors = 0;
+
+		_catIndex = _detector.AddCascade(catCascadePath, catOptions);
+		if (_catIndex < 0) return false;
+		if (!humanCascadePath.empty()) _humanIndex = _detector.AddCascade(humanCascadePath, HumanFaceScanOptions());
+		return true;
+	}
+
+	MiningResult NegativeMiner::Mine(const cv::Mat& gray, NegativeStore& store, const std::atomic<bool>* cancel)
+	{
+		MiningResult result;
+		if (_catIndex < 0 || store.Full()) return result;
+		if (!_detector.Detect(gray, _hits, cancel))
+		{
+			result.cancelled = true;
+			return result;
+		}
+
+		// Single raw hits are dropped; the groups left have at least two
+		std::vector<cv::Rect>& cats = _hits[_catIndex];
+		cv::groupRectangles(cats, _weights, 1, NEGATIVE_GROUP_EPS);
+
+		_candidates.clear();
+		for (size_t i = 0; i < cats.size(); i++)
+		{
+			bool human = _humanIndex >= 0 && std::any_of(_hits[_humanIndex].begin(), _hits[_humanIndex].end(),
+				[&cats, i](const cv::Rect& face) { return (cats[i] & face).area() > 0; });
+			if (!human && _weights[i] > _catMinNeighbors)
+			{
+				result.skipped = true;
+				return result;
+			}
+			Candidate candidate = { cats[i], _weights[i] };
+			_candidates.push_back(candidate);
+		}
+		result.candidates = _candidates.size();
+
+		std::stable_sort(_candidates.begin(), _candidates.end(), [](const Candidate& a, const Candidate& b) { return a.score > b.score; });
+		const cv::Rect frameBounds(0, 0, gray.cols, gray.rows);
+		for (size_t i = 0; i < _candidates.size() && i < NEGATIVE_MAX_PER_FRAME; i++)
+		{
+			cv::Rect window = _candidates[i].rect & frameBounds;
+			if (window.area() > 0 && store.Add(gray(window))) result.added++;
+		}
+		return result;
+	}
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "MultiCascadeDetector.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+// Stored windows closer than this many bits of their 64-bit difference hash are duplicates
+#define NEGATIVE_HASH_MAX_DISTANCE 5
+// Windows kept in the store; mining stops adding once it is full
+#define NEGATIVE_STORE_MAX_WINDOWS 5000
+// The highest scoring windows taken from one frame
+#define NEGATIVE_MAX_PER_FRAME 8
+// Side of the stored windows, in pixels; larger than the cascade's window so a trainer can pick its own
+#define NEGATIVE_WINDOW_SIZE 48
+// As MultiCascadeDetector groups detections
+#define NEGATIVE_GROUP_EPS 0.2
+
+namespace PetDoor
+{
+	// 64-bit difference hash of a grayscale image: one bit per horizontally adjacent pair of
+	// a 9x8 thumbnail. Near-identical windows hash to within a few bits of each other.
+	uint64_t DifferenceHash(const cv::Mat& gray);
+	int HammingDistance(uint64_t a, uint64_t b);
+
+	// A directory of mined negative windows, Negative_<hash>.png. The hashes are kept in
+	// memory, read back from the file names, so duplicates are caught without reading images.
+	class NegativeStore
+	{
+	public:
+		explicit NegativeStore(const std::string& directory, size_t maxWindows = NEGATIVE_STORE_MAX_WINDOWS);
+
+		// Reads the hashes of the windows already in the directory; returns how many there are
+		size_t Load();
+
+		// Writes a grayscale window unless the store is full or already holds a near duplicate.
+		// Returns true if it was written.
+		bool Add(const cv::Mat& grayWindow);
+
+		size_t Count() const { return _hashes.size(); }
+		bool Full() const { return _hashes.size() >= _maxWindows; }
+
+	private:
+		std::string _directory;
+		size_t _maxWindows;
+		std::vector<uint64_t> _hashes;
+		cv::Mat _window;
+	};
+
+	// What one frame gave the store
+	struct MiningResult
+	{
+		// The scan was cancelled; the frame should be mined again later
+		bool cancelled = false;
+		// A window scored as a cat the door would have seen, so the frame may hold a cat
+		// the door turned away for another reason, and nothing was taken from it
+		bool skipped = false;
+		size_t candidates = 0;
+		size_t added = 0;
+	};
+
+	// Finds the windows of cat-free frames that the cat cascade comes closest to accepting:
+	// groups of raw hits too small to count as a cat, and cat faces vetoed as human faces.
+	// A window's score is the number of raw hits in its group, the neighbour count
+	// detectMultiScale thresholds. The scan runs on the calling thread only.
+	class NegativeMiner
+	{
+	public:
+		NegativeMiner();
+
+		// Returns false if the cat cascade cannot be read. Without the human cascade only near misses are mined.
+		bool Load(const std::string& catCascadePath, const std::string& humanCascadePath);
+
+		// Mines an equalized grayscale frame in which the door found no cat to let in
+		MiningResult Mine(const cv::Mat& gray, NegativeStore& store, const std::atomic<bool>* cancel = nullptr);
+
+	private:
+		struct Candidate
+		{
+			cv::Rect rect;
+			int score;
+		};
+
+		MultiCascadeDetector _detector;
+		int _catIndex;
+		int _humanIndex;
+		int _catMinNeighbors;
+		std::vector<std::vector<cv::Rect>> _hits;
+		std::vector<int> _weights;
+		std::vector<Candidate> _candidates;
+	};
+}
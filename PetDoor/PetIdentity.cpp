@@ -0,0 +1,178 @@
+#include "PetIdentity.h"
+#include "Instrumentation.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <opencv2/imgcodecs/imgcodecs.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+// Faces are described at this size, in cells of LBP_GRID x LBP_GRID
+#define LBP_FACE_SIZE 64
+#define LBP_GRID 4
+// 58 uniform patterns and one bin for all the others
+#define LBP_BINS 59
+
+namespace PetDoor
+{
+	namespace
+	{
+		const int DescriptorLength = LBP_GRID * LBP_GRID * LBP_BINS;
+
+		// Maps each 8-bit local binary pattern to its histogram bin. Patterns with at most two
+		// 0/1 transitions around the circle (edges, corners, flat areas) get a bin each.
+		struct UniformPatterns
+		{
+			unsigned char bins[256];
+
+			UniformPatterns()
+			{
+				int next = 0;
+				for (int code = 0; code < 256; code++)
+				{
+					int rotated = ((code << 1) | (code >> 7)) & 0xFF;
+					int transitions = 0;
+					for (int changed = code ^ rotated; changed; changed &= changed - 1) transitions++;
+					bins[code] = static_cast<unsigned char>(transitions <= 2 ? next++ : LBP_BINS - 1);
+				}
+			}
+		};
+
+		const UniformPatterns& Uniform()
+		{
+			static const UniformPatterns patterns;
+			return patterns;
+		}
+	}
+
+	PetGallery::PetGallery(float maxDistance)
+		: _maxDistance(maxDistance)
+	{
+	}
+
+	int PetGallery::Enroll(const std::string& name, const cv::Mat& grayFace)
+	{
+		// A pet is only added along with its first face
+		if (grayFace.empty()) return -1;
+		int pet = static_cast<int>(std::find(_names.begin(), _names.end(), name) - _names.begin());
+		if (pet < static_cast<int>(_names.size()) && _faceCounts[pet] >= PET_GALLERY_MAX_FACES_PER_PET) return -1;
+		if (pet == static_cast<int>(_names.size()))
+		{
+			_names.push_back(name);
+			_faceCounts.push_back(0);
+		}
+
+		Describe(grayFace);
+		_descriptors.push_back(_query);
+		_owners.push_back(pet);
+		_faceCounts[pet]++;
+		return pet;
+	}
+
+	size_t PetGallery::EnrollDirectory(const std::string& directory, double cropPadding)
+	{
+		std::vector<cv::String> paths;
+		cv::glob(directory + "/*", paths, true);
+		std::sort(paths.begin(), paths.end());
+
+		size_t enrolled = 0;
+		for (auto& path : paths)
+		{
+			// The pet is named by the image's directory; images directly in directory belong to no one
+			std::string file = path;
+			size_t nameEnd = file.find_last_of("/\\");
+			if (nameEnd == std::string::npos || nameEnd <= directory.size()) continue;
+			size_t nameStart = file.find_last_of("/\\", nameEnd - 1) + 1;
+
+			cv::Mat crop = cv::imread(file, cv::IMREAD_GRAYSCALE);
+			if (crop.empty()) continue;
+
+			// The face is the middle of the padded crop. LBP only compares neighbouring
+			// pixels, so the crop does not need the frame-wide equalization the detector uses.
+			int width = cvRound(crop.cols / (1 + 2 * cropPadding));
+			int height = cvRound(crop.rows / (1 + 2 * cropPadding));
+			cv::Rect face((crop.cols - width) / 2, (crop.rows - height) / 2, width, height);
+			if (Enroll(file.substr(nameStart, nameEnd - nameStart), crop(face)) >= 0) enrolled++;
+		}
+		return enrolled;
+	}
+
+	size_t PetGallery::Identify(const cv::Mat& gray, const std::vector<cv::Rect>& faces, std::vector<PetMatch>& matches, int64_t budgetMicroseconds)
+	{
+		PETDOOR_TIME_STAGE(Stage::Identify);
+		int64_t start = Instrumentation::Now();
+		int64_t slowestFace = 0;
+		const cv::Rect frameBounds(0, 0, gray.cols, gray.rows);
+
+		matches.clear();
+		size_t checked = 0;
+		for (auto& face : faces)
+		{
+			PetMatch match = { -1, FLT_MAX };
+			cv::Rect inFrame = face & frameBounds;
+
+			// A face is only started if it can finish within the budget
+			int64_t faceStart = Instrumentation::Now();
+			if (!_owners.empty() && inFrame.area() > 0 && faceStart - start + slowestFace <= budgetMicroseconds)
+			{
+				Describe(gray(inFrame));
+				match = Match();
+				slowestFace = std::max(slowestFace, Instrumentation::Now() - faceStart);
+				checked++;
+			}
+			matches.push_back(match);
+		}
+		return checked;
+	}
+
+	void PetGallery::Describe(const cv::Mat& grayFace)
+	{
+		// One pixel of border, so every pixel of the face has all eight neighbours
+		cv::resize(grayFace, _face, cv::Size(LBP_FACE_SIZE + 2, LBP_FACE_SIZE + 2), 0, 0, cv::INTER_AREA);
+		_query.create(1, DescriptorLength, CV_32F);
+		_query.setTo(0);
+
+		const unsigned char* bins = Uniform().bins;
+		const int cellSize = LBP_FACE_SIZE / LBP_GRID;
+		float* histograms = _query.ptr<float>(0);
+
+		for (int y = 1; y <= LBP_FACE_SIZE; y++)
+		{
+			const unsigned char* above = _face.ptr<unsigned char>(y - 1);
+			const unsigned char* row = _face.ptr<unsigned char>(y);
+			const unsigned char* below = _face.ptr<unsigned char>(y + 1);
+			float* cells = histograms + (y - 1) / cellSize * LBP_GRID * LBP_BINS;
+
+			for (int x = 1; x <= LBP_FACE_SIZE; x++)
+			{
+				unsigned char center = row[x];
+				int code = (above[x - 1] >= center) << 7 | (above[x] >= center) << 6 | (above[x + 1] >= center) << 5
+					| (row[x + 1] >= center) << 4 | (below[x + 1] >= center) << 3 | (below[x] >= center) << 2
+					| (below[x - 1] >= center) << 1 | (row[x - 1] >= center);
+				cells[(x - 1) / cellSize * LBP_BINS + bins[code]] += 1;
+			}
+		}
+
+		// Square roots of each cell's normalized histogram have unit length, so the dot product
+		// of two descriptors is the cells' mean Bhattacharyya coefficient, and the distance
+		// between them a Hellinger distance that plain Euclidean nearest neighbour search finds.
+		const float scale = 1.0f / (cellSize * cellSize);
+		for (int i = 0; i < DescriptorLength; i++)
+		{
+			histograms[i] = std::sqrt(histograms[i] * scale) / LBP_GRID;
+		}
+	}
+
+	PetMatch PetGallery::Match()
+	{
+		// Every enrolled face at once; for unit vectors the nearest is the most similar
+		cv::gemm(_descriptors, _query, 1, cv::Mat(), 0, _similarities, cv::GEMM_2_T);
+
+		const float* similarities = _similarities.ptr<float>(0);
+		int nearest = static_cast<int>(std::max_element(similarities, similarities + _similarities.rows) - similarities);
+		float distance = std::sqrt(std::max(0.0f, 2 - 2 * similarities[nearest]));
+
+		PetMatch match = { distance <= _maxDistance ? _owners[nearest] : -1, distance };
+		return match;
+	}
+}
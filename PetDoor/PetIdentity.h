@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+// Faces further than this from every enrolled face of a pet are not that pet.
+// Distances run from 0 (identical descriptors) to 1.41 (nothing in common).
+#ifndef PET_MATCH_MAX_DISTANCE
+#define PET_MATCH_MAX_DISTANCE 0.45f
+#endif
+
+// Enrolled faces kept per pet; bounds the gallery's memory and the search time
+#define PET_GALLERY_MAX_FACES_PER_PET 64
+
+namespace PetDoor
+{
+	// The enrolled pet a face matched, if any
+	struct PetMatch
+	{
+		// Index of the pet in PetGallery, or -1 if no enrolled pet is close enough
+		int pet;
+		// To the nearest enrolled face, whoever it belongs to; FLT_MAX if the face was not checked
+		float distance;
+	};
+
+	// Tells enrolled pets apart by their faces. A face is described by local binary
+	// pattern histograms (LBPH) over a grid of cells, and matched to its nearest
+	// enrolled face. Descriptors are kept as unit vectors in one matrix, so the whole
+	// gallery is searched with a single matrix-vector product.
+	class PetGallery
+	{
+	public:
+		explicit PetGallery(float maxDistance = PET_MATCH_MAX_DISTANCE);
+
+		// Adds a face (a region of a grayscale image) to a pet, enrolling the pet
+		// if it is new. Returns the pet's index, or -1 if the face is empty or the pet already has
+		// the most faces kept; either way a new pet is not added.
+		int Enroll(const std::string& name, const cv::Mat& grayFace);
+
+		// Enrolls every image in each subdirectory of directory, under the subdirectory's name,
+		// e.g. <directory>/Tom/Event12_Entry_Cat1.jpg. The images are saved capture crops:
+		// cropPadding is the fraction of the face added on every side, as CaptureEncoder pads them.
+		// Returns the number of faces enrolled.
+		size_t EnrollDirectory(const std::string& directory, double cropPadding);
+
+		size_t PetCount() const { return _names.size(); }
+		size_t FaceCount() const { return _owners.size(); }
+		const std::string& PetName(int pet) const { return _names[pet]; }
+
+		// Matches the faces of a grayscale frame in order, until budgetMicroseconds
+		// have passed; faces left over when it runs out get pet -1 and distance FLT_MAX.
+		// Returns the number of faces checked.
+		size_t Identify(const cv::Mat& gray, const std::vector<cv::Rect>& faces, std::vector<PetMatch>& matches, int64_t budgetMicroseconds);
+
+	private:
+		// Describes a face into _query
+		void Describe(const cv::Mat& grayFace);
+		PetMatch Match();
+
+		float _maxDistance;
+		std::vector<std::string> _names;
+		std::vector<int> _faceCounts;
+		// One unit-length descriptor per row, and the pet each row belongs to
+		cv::Mat _descriptors;
+		std::vector<int> _owners;
+
+		// Scratch, kept so identifying does not allocate once warmed up
+		cv::Mat _face;
+		cv::Mat _query;
+		cv::Mat _similarities;
+	};
+}
@@ -0,0 +1,206 @@
+#include "SimulatedHal.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <opencv2/imgcodecs/imgcodecs.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#define DEFAULT_PIR_HIGH_MILLISECONDS 2000
+
+namespace PetDoor
+{
+	VirtualScheduler::VirtualScheduler()
+		: _now(0)
+		, _sequence(0)
+	{
+	}
+
+	void VirtualScheduler::Schedule(int64_t delayMicroseconds, Work work)
+	{
+		Item item = { _now + std::max<int64_t>(0, delayMicroseconds), _sequence++, work };
+		_queue.push(item);
+	}
+
+	bool VirtualScheduler::RunNext(int64_t limit)
+	{
+		if (_queue.empty() || _queue.top().time > limit) return false;
+
+		// Work may schedule more work, so take it off the queue first
+		Item item = _queue.top();
+		_queue.pop();
+		_now = std::max(_now, item.time);
+		item.work();
+		return true;
+	}
+
+	void VirtualScheduler::RunUntil(int64_t microseconds)
+	{
+		while (RunNext(microseconds))
+		{
+		}
+		_now = std::max(_now, microseconds);
+	}
+
+	void VirtualScheduler::RunAll()
+	{
+		while (RunNext(INT64_MAX))
+		{
+		}
+	}
+
+	SimulatedDigitalInput::SimulatedDigitalInput(IScheduler& scheduler)
+		: _scheduler(scheduler)
+		, _level(false)
+		, _activePulses(0)
+		, _risingEdges(0)
+	{
+	}
+
+	void SimulatedDigitalInput::Set(bool level)
+	{
+		bool rising = level && !_level;
+		_level = level;
+		if (!rising) return;
+
+		_risingEdges++;
+		if (_handler) _handler(_scheduler.Now());
+	}
+
+	void SimulatedDigitalInput::SchedulePulse(int64_t atMicroseconds, int64_t highMicroseconds)
+	{
+		int64_t delay = atMicroseconds - _scheduler.Now();
+		_scheduler.Schedule(delay, [this]()
+		{
+			if (_activePulses++ == 0) Set(true);
+		});
+		_scheduler.Schedule(delay + highMicroseconds, [this]()
+		{
+			if (--_activePulses == 0) Set(false);
+		});
+	}
+
+	void SimulatedPwmChannel::SetDutyCycle(double dutyCyclePercentage)
+	{
+		PwmCommand command = { _scheduler.Now(), dutyCyclePercentage };
+		_commands.push_back(command);
+	}
+
+	void SimulatedPwmChannel::Stop()
+	{
+		PwmCommand command = { _scheduler.Now(), -1 };
+		_commands.push_back(command);
+	}
+
+	ImageSequenceFrameSource::ImageSequenceFrameSource(IScheduler& scheduler, int64_t captureLatencyMicroseconds)
+		: _scheduler(scheduler)
+		, _captureLatencyMicroseconds(captureLatencyMicroseconds)
+		, _next(0)
+		, _previewing(true)
+		, _nextRequest(0)
+	{
+	}
+
+	size_t ImageSequenceFrameSource::LoadDirectory(const std::string& directory)
+	{
+		std::vector<cv::String> paths;
+		cv::glob(directory + "/*", paths, false);
+		std::sort(paths.begin(), paths.end());
+
+		size_t added = 0;
+		for (auto& path : paths)
+		{
+			cv::Mat frame = cv::imread(path, cv::IMREAD_COLOR);
+			if (frame.empty()) continue;
+			AddFrame(frame);
+			added++;
+		}
+		return added;
+	}
+
+	void ImageSequenceFrameSource::AddFrame(const cv::Mat& frame)
+	{
+		cv::Mat rgba;
+		switch (frame.channels())
+		{
+		case 1:
+			cv::cvtColor(frame, rgba, cv::COLOR_GRAY2RGBA);
+			break;
+		case 3:
+			cv::cvtColor(frame, rgba, cv::COLOR_BGR2RGBA);
+			break;
+		default:
+			rgba = frame.clone();
+			break;
+		}
+		_frames.push_back(rgba);
+	}
+
+	void ImageSequenceFrameSource::CaptureAsync(FrameHandler handler)
+	{
+		Request request = { _next, handler };
+		_requests.push_back(request);
+		_next = (_next + 1) % _frames.size();
+
+		_scheduler.Schedule(_captureLatencyMicroseconds, [this]()
+		{
+			Deliver();
+		});
+	}
+
+	void ImageSequenceFrameSource::Deliver()
+	{
+		Request request = std::move(_requests[_nextRequest++]);
+		if (_nextRequest == _requests.size())
+		{
+			_requests.clear();
+			_nextRequest = 0;
+		}
+
+		// The handler may draw on it; the sequence keeps the original
+		_frames[request.frameIndex].copyTo(_delivered);
+		request.handler(_delivered);
+	}
+
+	bool LoadPirTrace(const std::string& path, std::vector<PirTraceEdge>& edges, std::string& error)
+	{
+		std::ifstream trace(path);
+		if (!trace)
+		{
+			error = "cannot be read";
+			return false;
+		}
+
+		std::vector<PirTraceEdge> loaded;
+		std::string line;
+		for (int number = 1; std::getline(trace, line); number++)
+		{
+			if (line.empty() || line[0] == '#') continue;
+
+			std::ostringstream where;
+			where << "line " << number << ": ";
+			std::istringstream fields(line);
+			double milliseconds;
+			std::string sensor;
+			double highMilliseconds = DEFAULT_PIR_HIGH_MILLISECONDS;
+			if (!(fields >> milliseconds >> sensor))
+			{
+				error = where.str() + "expected <milliseconds> <indoor|outdoor> [high milliseconds]";
+				return false;
+			}
+			if (sensor != "indoor" && sensor != "outdoor")
+			{
+				error = where.str() + "unknown sensor '" + sensor + "', expected indoor or outdoor";
+				return false;
+			}
+			fields >> highMilliseconds;
+
+			PirTraceEdge edge = { static_cast<int64_t>(milliseconds * 1000), sensor == "outdoor", static_cast<int64_t>(highMilliseconds * 1000) };
+			loaded.push_back(edge);
+		}
+
+		edges.insert(edges.end(), loaded.begin(), loaded.end());
+		std::stable_sort(edges.begin(), edges.end(), [](const PirTraceEdge& a, const PirTraceEdge& b) { return a.microseconds < b.microseconds; });
+		return true;
+	}
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "Hal.h"
+
+#include <queue>
+#include <string>
+#include <vector>
+
+// Off-device back-ends for Hal.h. Everything runs on one thread against a
+// virtual clock: nothing happens until VirtualScheduler is run, and time
+// jumps straight to the next piece of work, so a day of door traffic
+// replays in as long as the detection itself takes.
+namespace PetDoor
+{
+	// Discrete-event scheduler; work at the same time runs in the order it was scheduled
+	class VirtualScheduler : public IScheduler
+	{
+	public:
+		VirtualScheduler();
+
+		int64_t Now() override { return _now; }
+		void Schedule(int64_t delayMicroseconds, Work work) override;
+
+		// Runs work in time order up to and including the given time, then sets the clock to it
+		void RunUntil(int64_t microseconds);
+
+		// Runs until no work is left
+		void RunAll();
+
+		bool Idle() const { return _queue.empty(); }
+
+	private:
+		struct Item
+		{
+			int64_t time;
+			uint64_t sequence;
+			Work work;
+
+			bool operator>(const Item& other) const
+			{
+				return time != other.time ? time > other.time : sequence > other.sequence;
+			}
+		};
+
+		bool RunNext(int64_t limit);
+
+		int64_t _now;
+		uint64_t _sequence;
+		std::priority_queue<Item, std::vector<Item>, std::greater<Item>> _queue;
+	};
+
+	// A digital input whose level is set by the simulation
+	class SimulatedDigitalInput : public IDigitalInput
+	{
+	public:
+		explicit SimulatedDigitalInput(IScheduler& scheduler);
+
+		bool Read() override { return _level; }
+		void SetRisingEdgeHandler(EdgeHandler handler) override { _handler = handler; }
+
+		// Changes the level now; a rising edge calls the handler
+		void Set(bool level);
+
+		// Schedules a high pulse, as a PIR sensor gives for one detection. Like a
+		// retriggering PIR, overlapping pulses keep the input high until the last one ends.
+		void SchedulePulse(int64_t atMicroseconds, int64_t highMicroseconds);
+
+		// Pulses that start while the input is still high merge into one and do not count
+		size_t RisingEdges() const { return _risingEdges; }
+
+	private:
+		IScheduler& _scheduler;
+		bool _level;
+		int _activePulses;
+		size_t _risingEdges;
+		EdgeHandler _handler;
+	};
+
+	// One command sent to a simulated PWM channel
+	struct PwmCommand
+	{
+		int64_t microseconds;
+		// Negative for Stop
+		double dutyCycle;
+	};
+
+	// Records every command with its time
+	class SimulatedPwmChannel : public IPwmChannel
+	{
+	public:
+		explicit SimulatedPwmChannel(IScheduler& scheduler) : _scheduler(scheduler) {}
+
+		void SetDutyCycle(double dutyCyclePercentage) override;
+		void Stop() override;
+
+		const std::vector<PwmCommand>& Commands() const { return _commands; }
+
+		// Makes room for this many commands, so recording them does not allocate
+		void Reserve(size_t commands) { _commands.reserve(commands); }
+
+	private:
+		IScheduler& _scheduler;
+		std::vector<PwmCommand> _commands;
+	};
+
+	// Hands out the frames of an image sequence in a loop, each after a fixed
+	// capture latency. Frames are decoded when the sequence is loaded, and
+	// handed out through a reused buffer, so a capture does not allocate.
+	class ImageSequenceFrameSource : public IFrameSource
+	{
+	public:
+		ImageSequenceFrameSource(IScheduler& scheduler, int64_t captureLatencyMicroseconds = 30000);
+
+		// Adds every readable image in the directory, in name order. Returns the number added.
+		size_t LoadDirectory(const std::string& directory);
+		// Adds one frame, converted to RGBA if it is BGR or gray
+		void AddFrame(const cv::Mat& frame);
+
+		size_t FrameCount() const { return _frames.size(); }
+
+		// Stops or restarts the preview; a stopped camera is not ready, as on the device
+		void SetPreviewing(bool previewing) { _previewing = previewing; }
+
+		bool IsReady() override { return _previewing && !_frames.empty(); }
+		void CaptureAsync(FrameHandler handler) override;
+
+	private:
+		struct Request
+		{
+			size_t frameIndex;
+			FrameHandler handler;
+		};
+
+		void Deliver();
+
+		IScheduler& _scheduler;
+		int64_t _captureLatencyMicroseconds;
+		std::vector<cv::Mat> _frames;
+		size_t _next;
+		bool _previewing;
+
+		// Captures in flight. All have the same latency, so they complete in order.
+		std::vector<Request> _requests;
+		size_t _nextRequest;
+		cv::Mat _delivered;
+	};
+
+	// A recorded PIR edge: "<milliseconds> <indoor|outdoor> [high milliseconds]" per line
+	struct PirTraceEdge
+	{
+		int64_t microseconds;
+		bool outdoor;
+		int64_t highMicroseconds;
+	};
+
+	// Reads a trace; lines starting with # are comments. Returns false, with the reason in error and the
+	// line where there is one, if the file cannot be read or a line has no time or an unknown sensor.
+	bool LoadPirTrace(const std::string& path, std::vector<PirTraceEdge>& edges, std::string& error);
+}
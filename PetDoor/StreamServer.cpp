@@ -0,0 +1,228 @@
+#include "pch.h"
+#include "StreamServer.h"
+
+#include <atomic>
+#include <robuffer.h>   // IBufferByteAccess
+#include <sstream>
+#include <string>
+#include <wrl/client.h>
+#include <wrl/implements.h>
+
+using namespace Concurrency;
+using namespace Microsoft::WRL;
+using namespace Platform;
+using namespace Windows::Foundation;
+using namespace Windows::Networking::Sockets;
+using namespace Windows::Storage::Streams;
+using namespace Windows::System::Threading;
+
+// Requests longer than this are not waited for; only the request line is looked at
+#define MAX_REQUEST_BYTES 4096
+// A connection that has not sent its whole request by then is closed, giving its place back
+#define REQUEST_TIMEOUT_MS 5000
+
+namespace PetDoor
+{
+	namespace
+	{
+		const char NotFoundResponse[] =
+			"HTTP/1.0 404 Not Found\r\n"
+			"Connection: close\r\n"
+			"Content-Length: 0\r\n"
+			"\r\n";
+
+		// An IBuffer over a part the streamer shares between clients, so a send does not copy it
+		class SharedBytesBuffer : public RuntimeClass<RuntimeClassFlags<RuntimeClassType::WinRtClassicComMix>,
+			ABI::Windows::Storage::Streams::IBuffer, Windows::Storage::Streams::IBufferByteAccess>
+		{
+			InspectableClass(L"PetDoor.SharedBytesBuffer", BaseTrust)
+
+		public:
+			HRESULT RuntimeClassInitialize(std::shared_ptr<const std::vector<unsigned char>> bytes)
+			{
+				_bytes = bytes;
+				return S_OK;
+			}
+
+			HRESULT STDMETHODCALLTYPE get_Capacity(UINT32* value) override
+			{
+				*value = static_cast<UINT32>(_bytes->size());
+				return S_OK;
+			}
+
+			HRESULT STDMETHODCALLTYPE get_Length(UINT32* value) override
+			{
+				*value = static_cast<UINT32>(_bytes->size());
+				return S_OK;
+			}
+
+			HRESULT STDMETHODCALLTYPE put_Length(UINT32 value) override
+			{
+				return value == _bytes->size() ? S_OK : E_INVALIDARG;
+			}
+
+			HRESULT STDMETHODCALLTYPE Buffer(byte** value) override
+			{
+				*value = const_cast<byte*>(_bytes->data());
+				return S_OK;
+			}
+
+		private:
+			std::shared_ptr<const std::vector<unsigned char>> _bytes;
+		};
+
+		class StreamSocketClient : public IStreamClient
+		{
+		public:
+			explicit StreamSocketClient(StreamSocket^ socket) : _socket(socket) {}
+
+			void SendAsync(std::shared_ptr<const std::vector<unsigned char>> bytes, SendHandler handler) override
+			{
+				ComPtr<SharedBytesBuffer> native;
+				if (FAILED(MakeAndInitialize<SharedBytesBuffer>(&native, bytes)))
+				{
+					handler(false);
+					return;
+				}
+				IBuffer^ buffer = reinterpret_cast<IBuffer^>(native.Get());
+
+				unsigned int size = static_cast<unsigned int>(bytes->size());
+				create_task(_socket->OutputStream->WriteAsync(buffer))
+					.then([handler, size](task<unsigned int> previousTask)
+				{
+					bool sent = false;
+					try
+					{
+						sent = previousTask.get() == size;
+					}
+					catch (Exception^)
+					{
+						// The viewer went away
+					}
+					handler(sent);
+				});
+			}
+
+			void Close() override
+			{
+				// IClosable.Close projects into CX as operator delete
+				delete _socket;
+			}
+
+		private:
+			StreamSocket^ _socket;
+		};
+	}
+
+	StreamServer::StreamServer(MjpegStreamer& streamer)
+		: _streamer(streamer)
+		, _listener(ref new StreamSocketListener())
+	{
+		_connectionToken = _listener->ConnectionReceived += ref new TypedEventHandler<StreamSocketListener^, StreamSocketListenerConnectionReceivedEventArgs^>(
+			[this](StreamSocketListener^, StreamSocketListenerConnectionReceivedEventArgs^ args)
+		{
+			OnConnection(args->Socket);
+		});
+	}
+
+	StreamServer::~StreamServer()
+	{
+		_listener->ConnectionReceived -= _connectionToken;
+		delete _listener;
+		_streamer.CloseAll();
+	}
+
+	task<void> StreamServer::StartAsync(unsigned short port)
+	{
+		return create_task(_listener->BindServiceNameAsync(port.ToString()))
+			.then([port]()
+		{
+			std::wstringstream message;
+			message << "Streaming detection frames on port " << port << "\n";
+			OutputDebugString(message.str().c_str());
+		});
+	}
+
+	// Reads the request up to its blank line, then hands the connection to the streamer if it asks for the stream
+	void StreamServer::OnConnection(StreamSocket^ socket)
+	{
+		// Connections still sending their request count against the viewers served, so a few idle
+		// connections cannot keep the place of every viewer
+		if (!_streamer.ReserveClient())
+		{
+			_streamer.RefuseClient(std::make_shared<StreamSocketClient>(socket));
+			return;
+		}
+
+		// Closing the socket fails the read in progress, which gives the place back. Whichever of the
+		// timer and the read gets to finished first decides what happens to the socket.
+		auto finished = std::make_shared<std::atomic<bool>>(false);
+		Windows::Foundation::TimeSpan timeout = { REQUEST_TIMEOUT_MS * 10000LL };
+		ThreadPoolTimer^ requestTimer = ThreadPoolTimer::CreateTimer(ref new TimerElapsedHandler([socket, finished](ThreadPoolTimer^)
+		{
+			if (!finished->exchange(true)) delete socket;
+		}), timeout);
+
+		auto reader = ref new DataReader(socket->InputStream);
+		reader->InputStreamOptions = InputStreamOptions::Partial;
+		auto request = std::make_shared<std::string>();
+		auto readRequest = std::make_shared<std::function<void()>>();
+		*readRequest = [this, socket, reader, request, readRequest, finished, requestTimer]()
+		{
+			create_task(reader->LoadAsync(MAX_REQUEST_BYTES))
+				.then([this, socket, reader, request, readRequest, finished, requestTimer](task<unsigned int> previousTask)
+			{
+				unsigned int loaded = 0;
+				try
+				{
+					loaded = previousTask.get();
+				}
+				catch (Exception^)
+				{
+				}
+				if (loaded == 0)
+				{
+					*readRequest = nullptr;
+					requestTimer->Cancel();
+					if (!finished->exchange(true)) delete socket;
+					_streamer.ReleaseReservation();
+					return;
+				}
+
+				size_t start = request->size();
+				request->resize(start + loaded);
+				reader->ReadBytes(ArrayReference<unsigned char>(reinterpret_cast<unsigned char*>(&(*request)[start]), loaded));
+				if (request->find("\r\n\r\n") == std::string::npos && request->size() < MAX_REQUEST_BYTES)
+				{
+					(*readRequest)();
+					return;
+				}
+
+				*readRequest = nullptr;
+				requestTimer->Cancel();
+				if (finished->exchange(true))
+				{
+					// Timed out just as the request came in; the socket is closed already
+					_streamer.ReleaseReservation();
+					return;
+				}
+
+				// The reader would close the socket's input with it
+				reader->DetachStream();
+				auto client = std::make_shared<StreamSocketClient>(socket);
+				if (!IsStreamRequest(*request))
+				{
+					_streamer.ReleaseReservation();
+					static const auto notFound = std::make_shared<const std::vector<unsigned char>>(NotFoundResponse, NotFoundResponse + sizeof(NotFoundResponse) - 1);
+					client->SendAsync(notFound, [client](bool)
+					{
+						client->Close();
+					});
+					return;
+				}
+				_streamer.AddClient(client, true);
+			});
+		};
+		(*readRequest)();
+	}
+}
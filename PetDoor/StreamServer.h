@@ -0,0 +1,29 @@
+#pragma once
+
+#include "MjpegStreamer.h"
+
+#include <memory>
+
+namespace PetDoor
+{
+	// Serves an MjpegStreamer over HTTP on the local network. "GET /" is answered with the
+	// stream; any other request gets a 404 and is closed. A connection holds one of the
+	// streamer's places from the moment it is accepted, and is closed if its request is not
+	// in within REQUEST_TIMEOUT_MS.
+	class StreamServer
+	{
+	public:
+		// The streamer must outlive the server
+		explicit StreamServer(MjpegStreamer& streamer);
+		~StreamServer();
+
+		Concurrency::task<void> StartAsync(unsigned short port);
+
+	private:
+		void OnConnection(Windows::Networking::Sockets::StreamSocket^ socket);
+
+		MjpegStreamer& _streamer;
+		Windows::Networking::Sockets::StreamSocketListener^ _listener;
+		Windows::Foundation::EventRegistrationToken _connectionToken;
+	};
+}
@@ -0,0 +1,96 @@
+#include "UiMailbox.h"
+
+#include <algorithm>
+
+namespace PetDoor
+{
+	UiMailbox::UiMailbox(IScheduler& scheduler, size_t slots, int64_t minIntervalMicroseconds, Dispatch dispatch)
+		: _scheduler(scheduler)
+		, _minIntervalMicroseconds(minIntervalMicroseconds)
+		, _dispatch(dispatch)
+		, _pending(slots)
+		, _scheduled(false)
+		, _closed(false)
+		, _lastRender(0)
+		, _stats()
+		, _rendering(slots)
+	{
+	}
+
+	void UiMailbox::Post(size_t slot, Update update)
+	{
+		int64_t delay;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			if (_closed)
+			{
+				_stats.dropped++;
+				return;
+			}
+			_stats.posted++;
+			if (_pending[slot]) _stats.coalesced++;
+			_pending[slot] = update;
+			if (_scheduled) return;
+
+			// The first update after a quiet spell goes straight out; later ones wait out the interval
+			_scheduled = true;
+			delay = _lastRender == 0 ? 0 : std::max<int64_t>(0, _lastRender + _minIntervalMicroseconds - _scheduler.Now());
+		}
+
+		_scheduler.Schedule(delay, [this]() { DispatchPending(); });
+	}
+
+	void UiMailbox::DispatchPending()
+	{
+		if (_dispatch([this]() { Render(); })) return;
+
+		std::lock_guard<std::mutex> lock(_lock);
+		for (auto& update : _pending)
+		{
+			if (update) _stats.dropped++;
+			update = nullptr;
+		}
+		_scheduled = false;
+	}
+
+	void UiMailbox::Render()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			_pending.swap(_rendering);
+			_scheduled = false;
+			_lastRender = _scheduler.Now();
+			if (_closed) return;
+			_stats.renders++;
+			for (auto& update : _rendering)
+			{
+				if (update) _stats.rendered++;
+			}
+		}
+
+		// Outside the lock, so updates posted meanwhile are not held up
+		for (auto& update : _rendering)
+		{
+			if (!update) continue;
+			update();
+			update = nullptr;
+		}
+	}
+
+	void UiMailbox::Close()
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		_closed = true;
+		for (auto& update : _pending)
+		{
+			if (update) _stats.dropped++;
+			update = nullptr;
+		}
+	}
+
+	UiMailboxStats UiMailbox::Stats()
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		return _stats;
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "Hal.h"
+
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace PetDoor
+{
+	// Counts since the mailbox was created
+	struct UiMailboxStats
+	{
+		uint64_t posted;
+		// Updates that reached the UI thread, and the renders they were batched into
+		uint64_t rendered;
+		uint64_t renders;
+		// Replaced by a newer update of the same slot before they were rendered
+		uint64_t coalesced;
+		// Posted after Close, or lost because the UI thread could not be reached
+		uint64_t dropped;
+	};
+
+	// Latest-value-wins updates for the UI thread. Each slot (a control, say) holds at most one
+	// pending update; a newer one replaces it, so a burst of triggers costs the UI thread one
+	// update per slot. Pending updates are rendered together, at most once per minimum interval.
+	// An update owns whatever it shows, so nothing it refers to can go away before it runs.
+	class UiMailbox
+	{
+	public:
+		typedef std::function<void()> Update;
+		// Runs render on the UI thread. Returns false if the UI thread cannot be reached.
+		typedef std::function<bool(std::function<void()> render)> Dispatch;
+
+		// The mailbox must outlive the work it schedules and dispatches
+		UiMailbox(IScheduler& scheduler, size_t slots, int64_t minIntervalMicroseconds, Dispatch dispatch);
+
+		// Called from any thread
+		void Post(size_t slot, Update update);
+
+		// Drops the pending updates and every later one, e.g. when the page goes away
+		void Close();
+
+		UiMailboxStats Stats();
+
+	private:
+		void DispatchPending();
+		void Render();
+
+		IScheduler& _scheduler;
+		int64_t _minIntervalMicroseconds;
+		Dispatch _dispatch;
+
+		std::mutex _lock;
+		std::vector<Update> _pending;
+		// A render is scheduled or dispatched and has not taken the pending updates yet
+		bool _scheduled;
+		bool _closed;
+		int64_t _lastRender;
+		UiMailboxStats _stats;
+
+		// Only touched by Render, on the UI thread
+		std::vector<Update> _rendering;
+	};
+}
@@ -0,0 +1,405 @@
+#include "VisionCore.h"
+#include "Instrumentation.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <opencv2/imgproc/imgproc.hpp>
+
+// Cat faces are looked for between these sizes, in pixels
+#define CAT_FACE_MIN_SIZE 100
+#define CAT_FACE_MAX_SIZE 300
+#define CAT_FACE_MIN_NEIGHBORS 5
+// Human faces only matter where they could overlap a cat face, so small ones are not looked for
+#define HUMAN_FACE_MIN_SIZE 80
+#define HUMAN_FACE_MIN_NEIGHBORS 3
+// Annotation of a frame at full size; copies scaled before annotating get it scaled with them
+#define ANNOTATION_BOX_THICKNESS 5
+#define ANNOTATION_LABEL_SCALE 0.55
+#define ANNOTATION_LABEL_THICKNESS 2
+#define ANNOTATION_LABEL_RAISE 10 // Pixels between the label's baseline and the top of the box
+#define ANNOTATION_MAX_LABELS 64
+
+namespace PetDoor
+{
+	namespace
+	{
+		// The same size range in an image shrunk by scale
+		CascadeScanOptions Shrink(CascadeScanOptions options, double scale)
+		{
+			options.minSize = cv::Size(cvFloor(options.minSize.width / scale), cvFloor(options.minSize.height / scale));
+			options.maxSize = cv::Size(cvCeil(options.maxSize.width / scale), cvCeil(options.maxSize.height / scale));
+			return options;
+		}
+
+		// A label rendered as a mask; origin is where putText's origin falls in it
+		struct Glyph
+		{
+			cv::Mat mask;
+			cv::Point origin;
+		};
+
+		// "Cat #n" labels, rendered on first use for each number and scale and kept. Lookups take a
+		// short lock; a glyph never changes once it is in the cache, so it is blitted without one.
+		class LabelCache
+		{
+		public:
+			const Glyph& Get(unsigned int number, double scale)
+			{
+				// Scales are bucketed so a stream or thumbnail width that wobbles does not grow the cache
+				int scaleKey = std::max(1, static_cast<int>(std::lround(scale * 64)));
+				std::lock_guard<std::mutex> lock(_lock);
+				auto found = _glyphs.find(std::make_pair(number, scaleKey));
+				if (found != _glyphs.end()) return found->second;
+
+				double fontScale = ANNOTATION_LABEL_SCALE * scaleKey / 64;
+				int thickness = std::max(1, static_cast<int>(std::lround(ANNOTATION_LABEL_THICKNESS * scaleKey / 64.0)));
+				char text[16];
+				snprintf(text, sizeof(text), "Cat #%u", number);
+				int baseline = 0;
+				cv::Size size = cv::getTextSize(text, cv::FONT_HERSHEY_SIMPLEX, fontScale, thickness, &baseline);
+
+				Glyph& glyph = _glyphs[std::make_pair(number, scaleKey)];
+				glyph.origin = cv::Point(thickness, thickness + size.height);
+				glyph.mask = cv::Mat::zeros(size.height + baseline + 2 * thickness, size.width + 2 * thickness, CV_8UC1);
+				cv::putText(glyph.mask, text, glyph.origin, cv::FONT_HERSHEY_SIMPLEX, fontScale, cv::Scalar(255), thickness);
+				return glyph;
+			}
+
+		private:
+			std::mutex _lock;
+			// std::map, so glyphs handed out stay where they are as others are added
+			std::map<std::pair<unsigned int, int>, Glyph> _glyphs;
+		};
+
+		// Copies color into image wherever the glyph is set, clipped to the image
+		void BlitGlyph(cv::Mat& image, const Glyph& glyph, cv::Point textOrigin, const cv::Scalar& color)
+		{
+			cv::Point topLeft = textOrigin - glyph.origin;
+			cv::Rect target = cv::Rect(topLeft, glyph.mask.size()) & cv::Rect(0, 0, image.cols, image.rows);
+			if (target.area() == 0) return;
+
+			cv::Mat region = image(target);
+			region.setTo(color, glyph.mask(target - topLeft));
+		}
+
+		// Removes the cats that intersect a human face, and their confidences, and returns how many it removed
+		size_t RejectHumanFaces(std::vector<cv::Rect>& cats, std::vector<double>& confidences, const std::vector<cv::Rect>& humans)
+		{
+			size_t kept = 0;
+			for (size_t i = 0; i < cats.size(); i++)
+			{
+				const cv::Rect& cat = cats[i];
+				if (std::any_of(humans.begin(), humans.end(), [&cat](const cv::Rect& human) { return (cat & human).area() > 0; })) continue;
+				cats[kept] = cats[i];
+				confidences[kept++] = confidences[i];
+			}
+			size_t rejected = cats.size() - kept;
+			cats.resize(kept);
+			confidences.resize(kept);
+			return rejected;
+		}
+
+		// Removes the cats the door is not confident enough in
+		void DropUnconfident(std::vector<cv::Rect>& cats, std::vector<double>& confidences, double minConfidence)
+		{
+			size_t kept = 0;
+			for (size_t i = 0; i < cats.size(); i++)
+			{
+				if (confidences[i] < minConfidence) continue;
+				cats[kept] = cats[i];
+				confidences[kept++] = confidences[i];
+			}
+			cats.resize(kept);
+			confidences.resize(kept);
+		}
+	}
+
+	// Runs a range of the sweep's angles
+	class CatFaceDetector::SweepAngles : public cv::ParallelLoopBody
+	{
+	public:
+		SweepAngles(CatFaceDetector& detector, std::atomic<bool>& found, const std::atomic<bool>* cancel)
+			: _detector(detector), _found(found), _cancel(cancel) {}
+
+		void operator()(const cv::Range& angles) const override
+		{
+			for (int i = angles.start; i < angles.end && !_found.load() && !(_cancel && _cancel->load()); i++)
+			{
+				_detector.ScanRotated(_detector._sweep[i], _found);
+			}
+		}
+
+	private:
+		CatFaceDetector& _detector;
+		std::atomic<bool>& _found;
+		const std::atomic<bool>* _cancel;
+	};
+
+	CascadeScanOptions CatFaceScanOptions()
+	{
+		CascadeScanOptions options;
+		options.minSize = cv::Size(CAT_FACE_MIN_SIZE, CAT_FACE_MIN_SIZE);
+		options.maxSize = cv::Size(CAT_FACE_MAX_SIZE, CAT_FACE_MAX_SIZE);
+		options.minNeighbors = CAT_FACE_MIN_NEIGHBORS;
+		return options;
+	}
+
+	CascadeScanOptions HumanFaceScanOptions()
+	{
+		CascadeScanOptions options;
+		options.minSize = cv::Size(HUMAN_FACE_MIN_SIZE, HUMAN_FACE_MIN_SIZE);
+		options.minNeighbors = HUMAN_FACE_MIN_NEIGHBORS;
+		return options;
+	}
+
+	void PreprocessFrame(const cv::Mat& rgba, cv::Mat& gray)
+	{
+		PETDOOR_TIME_STAGE(Stage::Preprocess);
+		cv::cvtColor(rgba, gray, cv::COLOR_RGBA2GRAY);
+		cv::equalizeHist(gray, gray);
+	}
+
+	void DetectObjects(cv::Mat& inputImg, std::vector<cv::Rect>& objectVector, cv::CascadeClassifier& cat_cascade, cv::Mat& gray)
+	{
+		PreprocessFrame(inputImg, gray);
+
+		// Detect cat faces
+		PETDOOR_TIME_STAGE(Stage::Detect);
+		cat_cascade.detectMultiScale(gray, objectVector, 1.1, CAT_FACE_MIN_NEIGHBORS, 0 | cv::CASCADE_SCALE_IMAGE,
+			cv::Size(CAT_FACE_MIN_SIZE, CAT_FACE_MIN_SIZE), cv::Size(CAT_FACE_MAX_SIZE, CAT_FACE_MAX_SIZE));
+	}
+
+	CatFaceDetector::CatFaceDetector()
+		: _detector(DetectionSettings().scaleFactor)
+		, _catIndex(-1)
+		, _humanIndex(-1)
+		, _rejected(0)
+		, _parallel(true)
+		, _sweepScale(1)
+		, _matchedAngle(0)
+	{
+	}
+
+	bool CatFaceDetector::Load(const std::string& catCascadePath, const std::string& humanCascadePath)
+	{
+		HaarCascade catCascade;
+		return catCascade.Load(catCascadePath) && Load(catCascade, humanCascadePath);
+	}
+
+	bool CatFaceDetector::Load(const HaarCascade& catCascade, const std::string& humanCascadePath)
+	{
+		_catIndex = _detector.AddCascade(catCascade, _settings.cat);
+		if (_catIndex < 0) return false;
+		_catCascade = catCascade;
+
+		if (!humanCascadePath.empty() && _humanCascade.Load(humanCascadePath))
+		{
+			_humanIndex = _detector.AddCascade(_humanCascade, _settings.human);
+		}
+		return true;
+	}
+
+	bool CatFaceDetector::Configure(const DetectionSettings& settings)
+	{
+		if (_catIndex < 0) return false;
+
+		MultiCascadeDetector detector(settings.scaleFactor);
+		detector.SetParallel(_parallel);
+		if (detector.AddCascade(_catCascade, settings.cat) != _catIndex) return false;
+		if (_humanIndex >= 0 && detector.AddCascade(_humanCascade, settings.human) != _humanIndex) return false;
+
+		DetectionSettings previous = _settings;
+		std::swap(_detector, detector);
+		_settings = settings;
+		if (!BuildSweep())
+		{
+			std::swap(_detector, detector);
+			_settings = previous;
+			BuildSweep();
+			return false;
+		}
+		return true;
+	}
+
+	void CatFaceDetector::SetParallel(bool parallel)
+	{
+		_parallel = parallel;
+		_detector.SetParallel(parallel);
+	}
+
+	bool CatFaceDetector::SetRotationSweep(const std::vector<double>& angles)
+	{
+		_sweepAngles = angles;
+		return BuildSweep();
+	}
+
+	bool CatFaceDetector::BuildSweep()
+	{
+		_sweep.clear();
+		_sweepFrameSize = cv::Size();
+		if (_sweepAngles.empty()) return true;
+		if (_catIndex < 0) return false;
+
+		// No face smaller than a cascade's minimum size is looked for, so the rotated images can
+		// be shrunk until the smallest face is one cascade window: the warp and the pyramid then
+		// cover a fraction of the frame's pixels.
+		cv::Size catWindow = _detector.WindowSize(_catIndex);
+		_sweepScale = std::min(static_cast<double>(_settings.cat.minSize.width) / catWindow.width, static_cast<double>(_settings.cat.minSize.height) / catWindow.height);
+		if (_humanIndex >= 0)
+		{
+			cv::Size humanWindow = _detector.WindowSize(_humanIndex);
+			_sweepScale = std::min(_sweepScale, std::min(static_cast<double>(_settings.human.minSize.width) / humanWindow.width, static_cast<double>(_settings.human.minSize.height) / humanWindow.height));
+		}
+		_sweepScale = std::max(_sweepScale, 1.0);
+
+		// Read once and copied to every angle; a detector that has not scanned yet holds no image buffers to share
+		MultiCascadeDetector rotated(_settings.scaleFactor, _sweepScale);
+		if (rotated.AddCascade(_catCascade, Shrink(_settings.cat, _sweepScale)) != _catIndex) return false;
+		if (_humanIndex >= 0 && rotated.AddCascade(_humanCascade, Shrink(_settings.human, _sweepScale)) != _humanIndex) return false;
+
+		for (double angle : _sweepAngles)
+		{
+			RotatedScan scan;
+			scan.angle = angle;
+			scan.detector = rotated;
+			scan.rejected = 0;
+			_sweep.push_back(scan);
+		}
+		return true;
+	}
+
+	void CatFaceDetector::PrepareSweep(cv::Size frameSize)
+	{
+		_sweepFrameSize = frameSize;
+		cv::Point2f center(frameSize.width / 2.0f, frameSize.height / 2.0f);
+
+		for (auto& scan : _sweep)
+		{
+			// Big enough for the whole rotated frame, so none of its corners are cut off
+			double radians = scan.angle * CV_PI / 180;
+			double cosine = std::abs(std::cos(radians));
+			double sine = std::abs(std::sin(radians));
+			cv::Size rotatedSize(cvCeil((frameSize.width * cosine + frameSize.height * sine) / _sweepScale),
+				cvCeil((frameSize.width * sine + frameSize.height * cosine) / _sweepScale));
+
+			scan.toRotated = cv::getRotationMatrix2D(center, scan.angle, 1 / _sweepScale);
+			scan.toRotated.at<double>(0, 2) += rotatedSize.width / 2.0 - center.x;
+			scan.toRotated.at<double>(1, 2) += rotatedSize.height / 2.0 - center.y;
+			cv::invertAffineTransform(scan.toRotated, scan.toFrame);
+			scan.image.create(rotatedSize, CV_8UC1);
+		}
+	}
+
+	void CatFaceDetector::ScanRotated(RotatedScan& scan, std::atomic<bool>& found)
+	{
+		scan.cats.clear();
+		scan.confidences.clear();
+		scan.rejected = 0;
+
+		// Rotated and shrunk in one pass from the equalized frame the upright scan used. The
+		// corners outside the frame are black, and flat windows are skipped without evaluation.
+		cv::warpAffine(_gray, scan.image, scan.toRotated, scan.image.size(), cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar(0));
+		if (!scan.detector.Detect(scan.image, scan.hits, &found)) return;
+
+		scan.cats.swap(scan.hits[_catIndex]);
+		scan.confidences.assign(scan.detector.Confidences(_catIndex).begin(), scan.detector.Confidences(_catIndex).end());
+		if (_humanIndex >= 0) scan.rejected += RejectHumanFaces(scan.cats, scan.confidences, scan.hits[_humanIndex]);
+
+		// The face is tilted in the frame; keep its size and move its centre back
+		const double* toFrame = scan.toFrame.ptr<double>(0);
+		cv::Rect frameBounds(0, 0, _gray.cols, _gray.rows);
+		for (auto& cat : scan.cats)
+		{
+			double x = cat.x + cat.width / 2.0;
+			double y = cat.y + cat.height / 2.0;
+			double frameX = toFrame[0] * x + toFrame[1] * y + toFrame[2];
+			double frameY = toFrame[3] * x + toFrame[4] * y + toFrame[5];
+			int width = cvRound(cat.width * _sweepScale);
+			int height = cvRound(cat.height * _sweepScale);
+			cat = cv::Rect(cvRound(frameX - width / 2.0), cvRound(frameY - height / 2.0), width, height) & frameBounds;
+		}
+		if (_humanIndex >= 0) scan.rejected += RejectHumanFaces(scan.cats, scan.confidences, _hits[_humanIndex]);
+		DropUnconfident(scan.cats, scan.confidences, _settings.minConfidence);
+
+		if (!scan.cats.empty()) found = true;
+	}
+
+	void CatFaceDetector::Detect(cv::Mat& inputImg, std::vector<cv::Rect>& objectVector)
+	{
+		Detect(inputImg, objectVector, nullptr);
+	}
+
+	bool CatFaceDetector::Detect(cv::Mat& inputImg, std::vector<cv::Rect>& objectVector, const std::atomic<bool>* cancel)
+	{
+		PreprocessFrame(inputImg, _gray);
+
+		_matchedAngle = 0;
+		bool finished;
+		{
+			PETDOOR_TIME_STAGE(Stage::Detect);
+			finished = _detector.Detect(_gray, _hits, cancel);
+		}
+		if (!finished)
+		{
+			objectVector.clear();
+			_confidences.clear();
+			_rejected = 0;
+			return false;
+		}
+
+		objectVector.swap(_hits[_catIndex]);
+		_confidences.assign(_detector.Confidences(_catIndex).begin(), _detector.Confidences(_catIndex).end());
+		_rejected = _humanIndex >= 0 ? RejectHumanFaces(objectVector, _confidences, _hits[_humanIndex]) : 0;
+		DropUnconfident(objectVector, _confidences, _settings.minConfidence);
+		if (!objectVector.empty() || _sweep.empty()) return true;
+
+		PETDOOR_TIME_STAGE(Stage::RotationSweep);
+		if (_gray.size() != _sweepFrameSize) PrepareSweep(_gray.size());
+
+		std::atomic<bool> found(false);
+		cv::parallel_for_(cv::Range(0, static_cast<int>(_sweep.size())), SweepAngles(*this, found, cancel));
+		if (cancel && *cancel && !found) return false;
+
+		// Angles that found a cat before the others stopped are taken in the order they were given
+		for (auto& scan : _sweep)
+		{
+			_rejected += scan.rejected;
+			if (objectVector.empty() && !scan.cats.empty())
+			{
+				objectVector.swap(scan.cats);
+				_confidences.swap(scan.confidences);
+				_matchedAngle = scan.angle;
+			}
+		}
+		return true;
+	}
+
+	const std::vector<cv::Rect>& CatFaceDetector::HumanFaces() const
+	{
+		return _humanIndex >= 0 && _humanIndex < static_cast<int>(_hits.size()) ? _hits[_humanIndex] : _noHumans;
+	}
+
+	void drawRectOverObjects(cv::Mat& image, const std::vector<cv::Rect>& objectVector, double scale)
+	{
+		if (objectVector.empty()) return;
+		PETDOOR_TIME_STAGE(Stage::Annotate);
+		static LabelCache labels;
+
+		int boxThickness = std::max(1, static_cast<int>(std::lround(ANNOTATION_BOX_THICKNESS * scale)));
+		int raise = static_cast<int>(std::lround(ANNOTATION_LABEL_RAISE * scale));
+		for (unsigned int x = 0; x < objectVector.size(); x++)
+		{
+			const cv::Rect& object = objectVector[x];
+			cv::Rect box(cvRound(object.x * scale), cvRound(object.y * scale), cvRound(object.width * scale), cvRound(object.height * scale));
+			cv::rectangle(image, box, cv::Scalar(0, 0, 255, 255), boxThickness);
+			// Frames are RGBA, so the boxes are blue and the labels red
+			if (x < ANNOTATION_MAX_LABELS) {
+				BlitGlyph(image, labels.Get(x + 1, scale), cv::Point(box.x, box.y - raise), cv::Scalar(255, 0, 0, 255));
+			}
+		}
+	}
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "MultiCascadeDetector.h"
+
+#include <atomic>
+#include <cfloat>
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <opencv2/objdetect.hpp>
+
+// The detection pipeline shared by the app and the desktop tools. Only
+// depends on OpenCV, so it builds on Linux as well as on the device.
+namespace PetDoor
+{
+	// The size ranges and grouping the door scans for cat and human faces with
+	CascadeScanOptions CatFaceScanOptions();
+	CascadeScanOptions HumanFaceScanOptions();
+
+	// How CatFaceDetector scans; the defaults are the door's
+	struct DetectionSettings
+	{
+		// Between the scales of the image pyramid, as for detectMultiScale
+		double scaleFactor = 1.1;
+		CascadeScanOptions cat = CatFaceScanOptions();
+		CascadeScanOptions human = HumanFaceScanOptions();
+		// Cats below this confidence are not reported
+		double minConfidence = -DBL_MAX;
+	};
+
+	// Grayscale and histogram-equalized copy of an RGBA frame, the input the cascade expects
+	void PreprocessFrame(const cv::Mat& rgba, cv::Mat& gray);
+
+	/// <summary>
+	/// takes an image (inputImg), runs the cat face classifier on it, and stores the results in objectVector.
+	/// gray is scratch for the preprocessed frame; keep it across calls so frames of the same size reuse it.
+	/// </summary>
+	void DetectObjects(cv::Mat& inputImg, std::vector<cv::Rect>& objectVector, cv::CascadeClassifier& cat_cascade, cv::Mat& gray);
+
+	// The cat face cascade and a human face cascade, evaluated together in one scan.
+	// The cat cascade's notes warn that human faces can pass for cat faces, so cat
+	// faces that intersect a human face are rejected.
+	class CatFaceDetector
+	{
+	public:
+		CatFaceDetector();
+
+		// Returns false if the cat cascade cannot be read. Without the human cascade nothing is rejected.
+		bool Load(const std::string& catCascadePath, const std::string& humanCascadePath);
+		// As above, with a cat cascade already in memory, e.g. one cut down to fewer stages
+		bool Load(const HaarCascade& catCascade, const std::string& humanCascadePath);
+
+		bool HasHumanVeto() const { return _humanIndex >= 0; }
+
+		// Scans with new settings from the next Detect on. The cascades already in memory are set up
+		// again, so no file is read; the pyramid is rebuilt on the next frame. Returns false, and
+		// keeps the old settings, if the cascades cannot be set up with the new ones.
+		bool Configure(const DetectionSettings& settings);
+		const DetectionSettings& Settings() const { return _settings; }
+
+		// Scans on the calling thread only, for callers that run several detectors side by side
+		void SetParallel(bool parallel);
+
+		// The cascades expect an upright face, so a tilted head can be missed. When the upright scan
+		// finds no cat, the frame is rotated by each of these angles (in degrees) and scanned again,
+		// the angles in parallel. The first angle to find a cat stops the others. Call after Load;
+		// an empty list turns the sweep off. Returns false if the cascades cannot be read again.
+		bool SetRotationSweep(const std::vector<double>& angles);
+
+		// The angle the last Detect found its cats at, 0 if upright
+		double MatchedAngle() const { return _matchedAngle; }
+
+		// Cats whose confidence is below this are not reported; by default every cat is.
+		// ThresholdCalibrator picks it from a labelled replay set.
+		void SetMinConfidence(double minConfidence) { _settings.minConfidence = minConfidence; }
+
+		/// <summary>
+		/// takes an RGBA image (inputImg), runs both classifiers on it, and stores the cat faces that are not human faces in objectVector
+		/// </summary>
+		void Detect(cv::Mat& inputImg, std::vector<cv::Rect>& objectVector);
+		// As above, giving up once cancel is set: within a pyramid level of the upright scan, or an
+		// angle of the sweep. Returns false if it gave up, leaving objectVector empty.
+		bool Detect(cv::Mat& inputImg, std::vector<cv::Rect>& objectVector, const std::atomic<bool>* cancel);
+
+		// The confidence of each cat the last Detect reported, in the same order: the sum of the
+		// cascade's last stage, the highest in the cat's group of hits (detectMultiScale's level weight)
+		const std::vector<double>& Confidences() const { return _confidences; }
+
+		// The equalized grayscale frame the last Detect scanned
+		const cv::Mat& Gray() const { return _gray; }
+
+		// Human faces found by the last Detect, and how many cat faces they rejected
+		const std::vector<cv::Rect>& HumanFaces() const;
+		size_t RejectedCount() const { return _rejected; }
+
+	private:
+		// One angle of the sweep, with its own detector and scratch so the angles can run in parallel
+		struct RotatedScan
+		{
+			double angle;
+			MultiCascadeDetector detector;
+			// Frame to rotated image and back, for the current frame size
+			cv::Mat toRotated;
+			cv::Mat toFrame;
+			cv::Mat image;
+			std::vector<std::vector<cv::Rect>> hits;
+			std::vector<cv::Rect> cats;
+			std::vector<double> confidences;
+			size_t rejected;
+		};
+
+		class SweepAngles;
+
+		void PrepareSweep(cv::Size frameSize);
+		// Must be called with the cascades added to _detector
+		bool BuildSweep();
+		void ScanRotated(RotatedScan& scan, std::atomic<bool>& found);
+
+		// Kept to build the sweep's detectors from
+		HaarCascade _catCascade;
+		HaarCascade _humanCascade;
+		MultiCascadeDetector _detector;
+		int _catIndex;
+		int _humanIndex;
+		cv::Mat _gray;
+		std::vector<std::vector<cv::Rect>> _hits;
+		std::vector<double> _confidences;
+		std::vector<cv::Rect> _noHumans;
+		size_t _rejected;
+		DetectionSettings _settings;
+		bool _parallel;
+
+		std::vector<double> _sweepAngles;
+		std::vector<RotatedScan> _sweep;
+		// How much smaller than the frame the rotated images are
+		double _sweepScale;
+		cv::Size _sweepFrameSize;
+		double _matchedAngle;
+	};
+
+	// Place a rectangle and a label around all detected objects in image. The labels are rendered once
+	// and blitted from a cache, so drawing is a few masked copies. Detections stay in frame coordinates;
+	// scale is the image's size over the frame's, for copies that were scaled down before annotating.
+	void drawRectOverObjects(cv::Mat& image, const std::vector<cv::Rect>& objectVector, double scale = 1);
+}
@@ -0,0 +1,869 @@
+// CascadeTrainer: trains boosted Haar stages on the door's own saved captures.
+// Positives are the face crops saved for cats that were let in
+// (Event<id>_Entry_Cat<n>.jpg). Negatives are windows of frames where the door
+// stayed shut (Event<id>_Blocked_PreviewFrame.jpg), and the hard negatives the door
+// mined from them into LocalState\Negatives (--mined). With --base, the new stages
+// are appended to an existing cascade and trained only on the windows it still
+// accepts. The cascade keeps what it knows about cats in general and learns
+// to reject this particular garden.
+//
+// Each stage is trained with Gentle AdaBoost on decision stumps over upright
+// Haar features, as opencv_traincascade does by default. Feature values are
+// computed in parallel across cores. The sorted values of as many features as
+// fit in --precalc-mb are kept for the whole stage; the rest are recomputed
+// for every weak classifier, so memory stays bounded whatever the pool size.
+// Negative frames are read from disk as each stage visits them and never held
+// all at once, so memory does not grow with the number of captures either.
+//
+// A held-out share of the captures is run through CatFaceDetector with the
+// base and the new cascade, to report the change in recall, false positives
+// and detection time, along with training time and peak memory.
+//
+// CascadeTrainer <captures dir> --output cascade.xml [--base cascade.xml]
+//                [--stages N] [--min-hit-rate 0.995] [--max-false-alarm 0.5] [--max-weak N]
+//                [--negatives N] [--feature-step N] [--precalc-mb N] [--min-size N] [--max-size N]
+//                [--holdout 0.2] [--seed N] [--mined negatives dir] [--report report.json]
+
+#include "CaptureEncoder.h"
+#include "HaarCascade.h"
+#include "MultiCascadeDetector.h"
+#include "NegativeMiner.h"
+#include "VisionCore.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <opencv2/imgcodecs/imgcodecs.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/objdetect.hpp>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+using namespace PetDoor;
+
+struct Options
+{
+	std::string capturesDirectory;
+	std::string outputPath;
+	std::string basePath;
+	std::string minedPath;
+	std::string reportPath;
+	int stages = 5;
+	double minHitRate = 0.995;
+	double maxFalseAlarm = 0.5;
+	int maxWeak = 100;
+	int negatives = 2000;
+	int featureStep = 2;
+	int precalcMegabytes = 256;
+	int minSize = 100;
+	int maxSize = 300;
+	double holdout = 0.2;
+	unsigned int seed = 1;
+};
+
+static void Usage()
+{
+	std::cerr << "usage: CascadeTrainer <captures dir> --output cascade.xml [--base cascade.xml]\n"
+		<< "                      [--stages N] [--min-hit-rate 0.995] [--max-false-alarm 0.5] [--max-weak N]\n"
+		<< "                      [--negatives N] [--feature-step N] [--precalc-mb N] [--min-size N] [--max-size N]\n"
+		<< "                      [--holdout 0.2] [--seed N] [--mined negatives dir] [--report report.json]\n";
+}
+
+static bool ParseOptions(int argc, char** argv, Options& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--output" && hasValue) options.outputPath = argv[++i];
+		else if (arg == "--base" && hasValue) options.basePath = argv[++i];
+		else if (arg == "--report" && hasValue) options.reportPath = argv[++i];
+		else if (arg == "--mined" && hasValue) options.minedPath = argv[++i];
+		else if (arg == "--stages" && hasValue) options.stages = std::max(1, atoi(argv[++i]));
+		else if (arg == "--min-hit-rate" && hasValue) options.minHitRate = atof(argv[++i]);
+		else if (arg == "--max-false-alarm" && hasValue) options.maxFalseAlarm = atof(argv[++i]);
+		else if (arg == "--max-weak" && hasValue) options.maxWeak = std::max(1, atoi(argv[++i]));
+		else if (arg == "--negatives" && hasValue) options.negatives = std::max(1, atoi(argv[++i]));
+		else if (arg == "--feature-step" && hasValue) options.featureStep = std::max(1, atoi(argv[++i]));
+		else if (arg == "--precalc-mb" && hasValue) options.precalcMegabytes = std::max(0, atoi(argv[++i]));
+		else if (arg == "--min-size" && hasValue) options.minSize = atoi(argv[++i]);
+		else if (arg == "--max-size" && hasValue) options.maxSize = atoi(argv[++i]);
+		else if (arg == "--holdout" && hasValue) options.holdout = atof(argv[++i]);
+		else if (arg == "--seed" && hasValue) options.seed = static_cast<unsigned int>(atoi(argv[++i]));
+		else if (arg.compare(0, 2, "--") != 0 && options.capturesDirectory.empty()) options.capturesDirectory = arg;
+		else return false;
+	}
+	return !options.capturesDirectory.empty() && !options.outputPath.empty();
+}
+
+// Saved captures, split into what is trained on and what is held out
+struct CaptureSet
+{
+	std::vector<std::string> trainPositives;
+	std::vector<std::string> trainNegatives;
+	std::vector<std::string> testPositives;
+	std::vector<std::string> testNegatives;
+};
+
+static CaptureSet FindCaptures(const Options& options, std::mt19937& random)
+{
+	std::vector<cv::String> paths;
+	cv::glob(options.capturesDirectory + "/*", paths, false);
+	std::sort(paths.begin(), paths.end());
+
+	std::vector<std::string> positives;
+	std::vector<std::string> negatives;
+	for (auto& path : paths)
+	{
+		std::string file = path;
+		if (file.find("_Entry_Cat") != std::string::npos) positives.push_back(file);
+		else if (file.find("_Blocked_") != std::string::npos) negatives.push_back(file);
+	}
+
+	CaptureSet set;
+	auto split = [&](std::vector<std::string>& files, std::vector<std::string>& train, std::vector<std::string>& test)
+	{
+		std::shuffle(files.begin(), files.end(), random);
+		size_t testCount = static_cast<size_t>(files.size() * options.holdout);
+		test.assign(files.begin(), files.begin() + testCount);
+		train.assign(files.begin() + testCount, files.end());
+	};
+	split(positives, set.trainPositives, set.testPositives);
+	split(negatives, set.trainNegatives, set.testNegatives);
+	return set;
+}
+
+// The face in a saved crop: CaptureEncoder pads the detection on every side
+static cv::Rect FaceInCrop(cv::Size crop)
+{
+	int width = cvRound(crop.width / (1 + 2 * CAPTURE_CROP_PADDING));
+	int height = cvRound(crop.height / (1 + 2 * CAPTURE_CROP_PADDING));
+	return cv::Rect((crop.width - width) / 2, (crop.height - height) / 2, width, height);
+}
+
+// A window-sized sample with its integral images and variance normalization, as the detector sees it
+struct Window
+{
+	cv::Mat sum;
+	cv::Mat squareSum;
+	cv::Mat tiltedSum;
+	// 0 for a flat window, which the detector never evaluates
+	float normFactor;
+};
+
+static void MakeWindow(const cv::Mat& patch, Window& window)
+{
+	cv::integral(patch, window.sum, window.squareSum, window.tiltedSum, CV_32S, CV_64F);
+
+	int width = patch.cols;
+	int height = patch.rows;
+	double area = (width - 2) * (height - 2);
+	const int* sum = window.sum.ptr<int>(0);
+	const double* squareSum = window.squareSum.ptr<double>(0);
+	int stride = width + 1;
+	int valueSum = sum[stride + 1] - sum[stride + width - 1] - sum[(height - 1) * stride + 1] + sum[(height - 1) * stride + width - 1];
+	double valueSquareSum = squareSum[stride + 1] - squareSum[stride + width - 1] - squareSum[(height - 1) * stride + 1] + squareSum[(height - 1) * stride + width - 1];
+	double variance = area * valueSquareSum - static_cast<double>(valueSum) * valueSum;
+
+	window.normFactor = variance > 0 ? static_cast<float>(1 / std::sqrt(variance)) : 0;
+	if (area * window.normFactor >= 0.1) window.normFactor = 0;
+}
+
+static int RectSum(const int* integral, int stride, const cv::Rect& rect, bool tilted)
+{
+	if (tilted)
+	{
+		return integral[rect.y * stride + rect.x] - integral[(rect.y + rect.height) * stride + rect.x - rect.height]
+			- integral[(rect.y + rect.width) * stride + rect.x + rect.width]
+			+ integral[(rect.y + rect.width + rect.height) * stride + rect.x + rect.width - rect.height];
+	}
+	return integral[rect.y * stride + rect.x] - integral[rect.y * stride + rect.x + rect.width]
+		- integral[(rect.y + rect.height) * stride + rect.x] + integral[(rect.y + rect.height) * stride + rect.x + rect.width];
+}
+
+// Whether a window passes every stage of the cascade, evaluated as MultiCascadeDetector does
+static bool Passes(const HaarCascade& cascade, const Window& window)
+{
+	int stride = window.sum.cols;
+	const int* sum = window.sum.ptr<int>(0);
+	const int* tilted = window.tiltedSum.ptr<int>(0);
+
+	for (auto& stage : cascade.stages)
+	{
+		double stageSum = 0;
+		for (int t = stage.firstTree; t < stage.firstTree + stage.treeCount; t++)
+		{
+			const HaarTree& tree = cascade.trees[t];
+			int index = 0;
+			do
+			{
+				const HaarNode& node = cascade.nodes[tree.firstNode + index];
+				const HaarFeature& feature = cascade.features[node.feature];
+				float value = 0;
+				for (int r = 0; r < feature.rectCount; r++)
+				{
+					value += feature.rects[r].weight * RectSum(feature.tilted ? tilted : sum, stride, feature.rects[r].rect, feature.tilted);
+				}
+				index = value * window.normFactor < node.threshold ? node.left : node.right;
+			} while (index > 0);
+			stageSum += cascade.leaves[tree.firstLeaf - index];
+		}
+		if (stageSum < stage.threshold - 1e-5f) return false;
+	}
+	return true;
+}
+
+// One upright Haar feature of the pool, with its rectangles as offsets into a sample's integral image
+struct PoolFeature
+{
+	HaarFeature haar;
+	int offsets[3][4];
+};
+
+static void AddPoolFeature(std::vector<PoolFeature>& pool, int stride, std::initializer_list<HaarRect> rects)
+{
+	PoolFeature feature = {};
+	for (auto& rect : rects)
+	{
+		const cv::Rect& r = rect.rect;
+		int* offsets = feature.offsets[feature.haar.rectCount];
+		offsets[0] = r.y * stride + r.x;
+		offsets[1] = r.y * stride + r.x + r.width;
+		offsets[2] = (r.y + r.height) * stride + r.x;
+		offsets[3] = (r.y + r.height) * stride + r.x + r.width;
+		feature.haar.rects[feature.haar.rectCount++] = rect;
+	}
+	pool.push_back(feature);
+}
+
+// The BASIC set of opencv_traincascade: two and three rectangle edges and lines and the four rectangle
+// diagonal, with weights that cancel out over a flat window. step thins positions and sizes.
+static std::vector<PoolFeature> FeaturePool(cv::Size window, int step)
+{
+	std::vector<PoolFeature> pool;
+	int stride = window.width + 1;
+	for (int y = 0; y < window.height; y += step)
+	{
+		for (int x = 0; x < window.width; x += step)
+		{
+			for (int dy = 1; y + dy <= window.height; dy += step)
+			{
+				for (int dx = 1; x + dx <= window.width; dx += step)
+				{
+					if (x + 2 * dx <= window.width)
+						AddPoolFeature(pool, stride, { { cv::Rect(x, y, 2 * dx, dy), -1 }, { cv::Rect(x + dx, y, dx, dy), 2 } });
+					if (y + 2 * dy <= window.height)
+						AddPoolFeature(pool, stride, { { cv::Rect(x, y, dx, 2 * dy), -1 }, { cv::Rect(x, y + dy, dx, dy), 2 } });
+					if (x + 3 * dx <= window.width)
+						AddPoolFeature(pool, stride, { { cv::Rect(x, y, 3 * dx, dy), -1 }, { cv::Rect(x + dx, y, dx, dy), 3 } });
+					if (y + 3 * dy <= window.height)
+						AddPoolFeature(pool, stride, { { cv::Rect(x, y, dx, 3 * dy), -1 }, { cv::Rect(x, y + dy, dx, dy), 3 } });
+					if (x + 2 * dx <= window.width && y + 2 * dy <= window.height)
+						AddPoolFeature(pool, stride, { { cv::Rect(x, y, 2 * dx, 2 * dy), -1 }, { cv::Rect(x, y, dx, dy), 2 }, { cv::Rect(x + dx, y + dy, dx, dy), 2 } });
+				}
+			}
+		}
+	}
+	return pool;
+}
+
+// The samples of one stage: positives first, then negatives
+struct TrainingSet
+{
+	cv::Size window;
+	int positives = 0;
+	int count = 0;
+	// (window.width + 1) * (window.height + 1) integral values per sample
+	std::vector<int> sums;
+	std::vector<float> normFactors;
+
+	void Add(const Window& sample)
+	{
+		const int* sum = sample.sum.ptr<int>(0);
+		sums.insert(sums.end(), sum, sum + sample.sum.total());
+		normFactors.push_back(sample.normFactor);
+		count++;
+	}
+
+	float Label(int sample) const { return sample < positives ? 1.0f : -1.0f; }
+
+	float Value(const PoolFeature& feature, int sample) const
+	{
+		const int* sum = &sums[static_cast<size_t>(sample) * (window.width + 1) * (window.height + 1)];
+		float value = 0;
+		for (int r = 0; r < feature.haar.rectCount; r++)
+		{
+			const int* o = feature.offsets[r];
+			value += feature.haar.rects[r].weight * (sum[o[0]] - sum[o[1]] - sum[o[2]] + sum[o[3]]);
+		}
+		return value * normFactors[sample];
+	}
+};
+
+// A decision stump: samples whose feature value is below the threshold get left, the others right
+struct Stump
+{
+	int feature = -1;
+	float threshold = 0;
+	float left = 0;
+	float right = 0;
+	double error = 0;
+};
+
+// Sorted values of one feature over every sample
+struct SortedFeature
+{
+	std::vector<float> values;
+	std::vector<int> order;
+};
+
+static void SortFeature(const TrainingSet& set, const PoolFeature& feature, std::vector<float>& values, std::vector<int>& order)
+{
+	values.resize(set.count);
+	order.resize(set.count);
+	for (int i = 0; i < set.count; i++)
+	{
+		values[i] = set.Value(feature, i);
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), [&values](int a, int b) { return values[a] < values[b]; });
+}
+
+// Gentle AdaBoost's best split: each side predicts its weighted mean label, and the split
+// that leaves the least weighted squared error wins
+static void BestSplit(const std::vector<float>& values, const std::vector<int>& order, const std::vector<double>& weights,
+	const TrainingSet& set, int featureIndex, Stump& best)
+{
+	double totalWeight = 0;
+	double totalWeightedLabel = 0;
+	for (int i = 0; i < set.count; i++)
+	{
+		totalWeight += weights[i];
+		totalWeightedLabel += weights[i] * set.Label(i);
+	}
+
+	double leftWeight = 0;
+	double leftWeightedLabel = 0;
+	for (int i = 0; i + 1 < set.count; i++)
+	{
+		int sample = order[i];
+		leftWeight += weights[sample];
+		leftWeightedLabel += weights[sample] * set.Label(sample);
+
+		float value = values[sample];
+		float next = values[order[i + 1]];
+		if (value == next) continue;
+
+		double rightWeight = totalWeight - leftWeight;
+		double rightWeightedLabel = totalWeightedLabel - leftWeightedLabel;
+		if (leftWeight <= 0 || rightWeight <= 0) continue;
+
+		double error = -(leftWeightedLabel * leftWeightedLabel / leftWeight + rightWeightedLabel * rightWeightedLabel / rightWeight);
+		if (best.feature < 0 || error < best.error)
+		{
+			best.feature = featureIndex;
+			best.threshold = (value + next) / 2;
+			best.left = static_cast<float>(leftWeightedLabel / leftWeight);
+			best.right = static_cast<float>(rightWeightedLabel / rightWeight);
+			best.error = error;
+		}
+	}
+}
+
+// Searches a range of the pool for the best stump; ranges run in parallel
+class FindStump : public cv::ParallelLoopBody
+{
+public:
+	FindStump(const TrainingSet& set, const std::vector<PoolFeature>& pool, const std::vector<SortedFeature>& precalculated,
+		const std::vector<double>& weights, Stump& best, std::mutex& bestLock)
+		: _set(set), _pool(pool), _precalculated(precalculated), _weights(weights), _best(best), _bestLock(bestLock)
+	{
+	}
+
+	void operator()(const cv::Range& features) const override
+	{
+		Stump best;
+		std::vector<float> values;
+		std::vector<int> order;
+		for (int f = features.start; f < features.end; f++)
+		{
+			if (f < static_cast<int>(_precalculated.size()))
+			{
+				BestSplit(_precalculated[f].values, _precalculated[f].order, _weights, _set, f, best);
+			}
+			else
+			{
+				SortFeature(_set, _pool[f], values, order);
+				BestSplit(values, order, _weights, _set, f, best);
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(_bestLock);
+		// Ties go to the lower feature, so the result does not depend on how the ranges were split
+		if (best.feature >= 0 && (_best.feature < 0 || best.error < _best.error || (best.error == _best.error && best.feature < _best.feature)))
+		{
+			_best = best;
+		}
+	}
+
+private:
+	FindStump& operator=(const FindStump&);
+
+	const TrainingSet& _set;
+	const std::vector<PoolFeature>& _pool;
+	const std::vector<SortedFeature>& _precalculated;
+	const std::vector<double>& _weights;
+	Stump& _best;
+	std::mutex& _bestLock;
+};
+
+// Sorts the features that fit in the precalculation budget, in parallel
+class PrecalculateFeatures : public cv::ParallelLoopBody
+{
+public:
+	PrecalculateFeatures(const TrainingSet& set, const std::vector<PoolFeature>& pool, std::vector<SortedFeature>& precalculated)
+		: _set(set), _pool(pool), _precalculated(precalculated)
+	{
+	}
+
+	void operator()(const cv::Range& features) const override
+	{
+		for (int f = features.start; f < features.end; f++)
+		{
+			SortFeature(_set, _pool[f], _precalculated[f].values, _precalculated[f].order);
+		}
+	}
+
+private:
+	PrecalculateFeatures& operator=(const PrecalculateFeatures&);
+
+	const TrainingSet& _set;
+	const std::vector<PoolFeature>& _pool;
+	std::vector<SortedFeature>& _precalculated;
+};
+
+struct StageReport
+{
+	int weakClassifiers = 0;
+	double hitRate = 0;
+	double falseAlarm = 0;
+	int negatives = 0;
+	double seconds = 0;
+};
+
+// Trains one stage and appends it, and the features it uses, to the cascade
+static StageReport TrainStage(const TrainingSet& set, const std::vector<PoolFeature>& pool, const Options& options, HaarCascade& cascade)
+{
+	auto start = std::chrono::steady_clock::now();
+	StageReport report;
+	report.negatives = set.count - set.positives;
+
+	// Values only change between stages, so the features that fit are sorted once
+	size_t bytesPerFeature = static_cast<size_t>(set.count) * (sizeof(float) + sizeof(int));
+	size_t precalculatedCount = std::min(pool.size(), static_cast<size_t>(options.precalcMegabytes) * 1024 * 1024 / std::max<size_t>(bytesPerFeature, 1));
+	std::vector<SortedFeature> precalculated(precalculatedCount);
+	cv::parallel_for_(cv::Range(0, static_cast<int>(precalculatedCount)), PrecalculateFeatures(set, pool, precalculated));
+
+	std::vector<double> weights(set.count, 1.0 / set.count);
+	std::vector<double> scores(set.count, 0);
+	std::vector<double> positiveScores;
+	std::vector<Stump> stumps;
+	float threshold = 0;
+
+	while (static_cast<int>(stumps.size()) < options.maxWeak)
+	{
+		Stump best;
+		std::mutex bestLock;
+		cv::parallel_for_(cv::Range(0, static_cast<int>(pool.size())), FindStump(set, pool, precalculated, weights, best, bestLock));
+		if (best.feature < 0) break;
+		stumps.push_back(best);
+
+		double totalWeight = 0;
+		for (int i = 0; i < set.count; i++)
+		{
+			float prediction = set.Value(pool[best.feature], i) < best.threshold ? best.left : best.right;
+			scores[i] += prediction;
+			weights[i] *= std::exp(-set.Label(i) * prediction);
+			totalWeight += weights[i];
+		}
+		for (auto& weight : weights) weight /= totalWeight;
+
+		// The threshold that keeps the required share of positives, and the negatives it lets through
+		positiveScores.assign(scores.begin(), scores.begin() + set.positives);
+		std::sort(positiveScores.begin(), positiveScores.end());
+		int lost = std::min(set.positives - 1, static_cast<int>((1 - options.minHitRate) * set.positives));
+		threshold = static_cast<float>(positiveScores[lost]);
+
+		int passedNegatives = 0;
+		for (int i = set.positives; i < set.count; i++)
+		{
+			if (scores[i] >= threshold) passedNegatives++;
+		}
+		report.hitRate = static_cast<double>(set.positives - lost) / set.positives;
+		report.falseAlarm = report.negatives > 0 ? static_cast<double>(passedNegatives) / report.negatives : 0;
+		if (report.falseAlarm <= options.maxFalseAlarm) break;
+	}
+
+	HaarStage stage = { static_cast<int>(cascade.trees.size()), 0, threshold };
+	for (auto& stump : stumps)
+	{
+		HaarTree tree = { static_cast<int>(cascade.nodes.size()), static_cast<int>(cascade.leaves.size()) };
+		HaarNode node = { 0, -1, static_cast<int>(cascade.features.size()), stump.threshold };
+		cascade.features.push_back(pool[stump.feature].haar);
+		cascade.nodes.push_back(node);
+		cascade.leaves.push_back(stump.left);
+		cascade.leaves.push_back(stump.right);
+		cascade.trees.push_back(tree);
+		stage.treeCount++;
+	}
+	cascade.stages.push_back(stage);
+
+	report.weakClassifiers = stage.treeCount;
+	report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return report;
+}
+
+static bool LoadPositive(const std::string& path, cv::Size window, Window& sample)
+{
+	cv::Mat crop = cv::imread(path, cv::IMREAD_GRAYSCALE);
+	if (crop.empty()) return false;
+
+	// Equalized on its own; the detector equalizes the whole frame, which a crop can only approximate
+	cv::Mat face;
+	cv::equalizeHist(crop, crop);
+	cv::resize(crop(FaceInCrop(crop.size())), face, window, 0, 0, cv::INTER_AREA);
+	MakeWindow(face, sample);
+	return sample.normFactor > 0;
+}
+
+static cv::Mat LoadNegativeFrame(const std::string& path)
+{
+	cv::Mat gray = cv::imread(path, cv::IMREAD_GRAYSCALE);
+	if (!gray.empty()) cv::equalizeHist(gray, gray);
+	return gray;
+}
+
+// Windows of the negative frames that the cascade still accepts, found by scanning the frames
+// with it the way the door does. Before there are any stages, windows are picked at random.
+// Frames are read one at a time as they are visited, so memory does not grow with the captures.
+// As in NegativeMiner, a frame where the cascade still finds a cat face is skipped: the door may
+// have blocked a real cat there, as a stranger or below detection.minConfidence.
+static size_t HarvestNegatives(const std::vector<std::string>& framePaths, const HaarCascade& cascade, const Options& options,
+	size_t wanted, std::mt19937& random, TrainingSet& set, uint64_t& framesScanned, uint64_t& catFramesSkipped)
+{
+	size_t added = 0;
+	cv::Mat frame;
+	cv::Mat patch;
+	Window sample;
+
+	// Raw hits, not grouped: every accepted window is a hard negative
+	CascadeScanOptions scanOptions;
+	scanOptions.minSize = cv::Size(options.minSize, options.minSize);
+	scanOptions.maxSize = cv::Size(options.maxSize, options.maxSize);
+	scanOptions.minNeighbors = 0;
+	MultiCascadeDetector detector;
+	if (!cascade.stages.empty()) detector.AddCascade(cascade, scanOptions);
+
+	std::vector<size_t> frameOrder(framePaths.size());
+	for (size_t i = 0; i < frameOrder.size(); i++) frameOrder[i] = i;
+	std::shuffle(frameOrder.begin(), frameOrder.end(), random);
+
+	// No frame may supply more than its share, so one busy frame does not crowd out the rest
+	size_t perFrame = std::max<size_t>(1, 2 * wanted / std::max<size_t>(1, framePaths.size()));
+	const int catMinNeighbors = CatFaceScanOptions().minNeighbors;
+	std::vector<std::vector<cv::Rect>> hits;
+	std::vector<cv::Rect> groups;
+	std::vector<int> groupSizes;
+	for (size_t i : frameOrder)
+	{
+		if (added >= wanted) break;
+		frame = LoadNegativeFrame(framePaths[i]);
+		if (frame.empty()) continue;
+
+		size_t fromFrame = 0;
+		if (cascade.stages.empty())
+		{
+			int maxSize = std::min(options.maxSize, std::min(frame.cols, frame.rows));
+			if (maxSize < options.minSize) continue;
+			for (size_t attempt = 0; added < wanted && fromFrame < perFrame && attempt < perFrame * 10; attempt++)
+			{
+				int size = std::uniform_int_distribution<int>(options.minSize, maxSize)(random);
+				int x = std::uniform_int_distribution<int>(0, frame.cols - size)(random);
+				int y = std::uniform_int_distribution<int>(0, frame.rows - size)(random);
+				cv::resize(frame(cv::Rect(x, y, size, size)), patch, cascade.window, 0, 0, cv::INTER_LINEAR);
+				MakeWindow(patch, sample);
+				if (sample.normFactor == 0) continue;
+				set.Add(sample);
+				added++;
+				fromFrame++;
+			}
+			continue;
+		}
+
+		detector.Detect(frame, hits);
+		framesScanned++;
+
+		// Grouped as the door groups them; a group the door would report is a cat face
+		groups = hits[0];
+		cv::groupRectangles(groups, groupSizes, 1, NEGATIVE_GROUP_EPS);
+		if (std::any_of(groupSizes.begin(), groupSizes.end(), [catMinNeighbors](int size) { return size > catMinNeighbors; }))
+		{
+			catFramesSkipped++;
+			continue;
+		}
+
+		std::shuffle(hits[0].begin(), hits[0].end(), random);
+		for (auto& hit : hits[0])
+		{
+			if (added >= wanted || fromFrame >= perFrame) break;
+			cv::resize(frame(hit & cv::Rect(0, 0, frame.cols, frame.rows)), patch, cascade.window, 0, 0, cv::INTER_LINEAR);
+			MakeWindow(patch, sample);
+			if (sample.normFactor == 0 || !Passes(cascade, sample)) continue;
+			set.Add(sample);
+			added++;
+			fromFrame++;
+		}
+	}
+	return added;
+}
+
+// Recall, false positives and detection time of one cascade on the held-out captures
+struct Evaluation
+{
+	bool valid = false;
+	double recall = 0;
+	double falsePositivesPerFrame = 0;
+	double millisecondsPerFrame = 0;
+};
+
+static Evaluation Evaluate(const std::string& cascadePath, const CaptureSet& captures)
+{
+	Evaluation evaluation;
+	CatFaceDetector detector;
+	if (!detector.Load(cascadePath, "")) return evaluation;
+	evaluation.valid = true;
+
+	std::vector<cv::Rect> cats;
+	cv::Mat rgba;
+	size_t found = 0;
+	size_t positives = 0;
+	for (auto& path : captures.testPositives)
+	{
+		cv::Mat bgr = cv::imread(path, cv::IMREAD_COLOR);
+		if (bgr.empty()) continue;
+		cv::cvtColor(bgr, rgba, cv::COLOR_BGR2RGBA);
+		detector.Detect(rgba, cats);
+
+		// Found if a detection covers most of the face and is not much bigger than it
+		cv::Rect face = FaceInCrop(rgba.size());
+		bool hit = std::any_of(cats.begin(), cats.end(), [&face](const cv::Rect& cat)
+		{
+			double overlap = (cat & face).area();
+			return overlap / (cat.area() + face.area() - overlap) >= 0.4;
+		});
+		if (hit) found++;
+		positives++;
+	}
+
+	size_t falsePositives = 0;
+	size_t frames = 0;
+	double seconds = 0;
+	for (auto& path : captures.testNegatives)
+	{
+		cv::Mat bgr = cv::imread(path, cv::IMREAD_COLOR);
+		if (bgr.empty()) continue;
+		cv::cvtColor(bgr, rgba, cv::COLOR_BGR2RGBA);
+
+		auto start = std::chrono::steady_clock::now();
+		detector.Detect(rgba, cats);
+		seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		falsePositives += cats.size();
+		frames++;
+	}
+
+	evaluation.recall = positives > 0 ? static_cast<double>(found) / positives : 0;
+	evaluation.falsePositivesPerFrame = frames > 0 ? static_cast<double>(falsePositives) / frames : 0;
+	evaluation.millisecondsPerFrame = frames > 0 ? seconds * 1000 / frames : 0;
+	return evaluation;
+}
+
+static double PeakMemoryMegabytes()
+{
+#ifndef _WIN32
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) return usage.ru_maxrss / 1024.0;
+#endif
+	return 0;
+}
+
+static std::string EvaluationJson(const Evaluation& evaluation)
+{
+	if (!evaluation.valid) return "null";
+	std::ostringstream json;
+	json << "{\"recall\": " << evaluation.recall
+		<< ", \"falsePositivesPerFrame\": " << evaluation.falsePositivesPerFrame
+		<< ", \"millisecondsPerFrame\": " << evaluation.millisecondsPerFrame << "}";
+	return json.str();
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	if (!ParseOptions(argc, argv, options))
+	{
+		Usage();
+		return 2;
+	}
+
+	auto trainingStart = std::chrono::steady_clock::now();
+	std::mt19937 random(options.seed);
+
+	HaarCascade cascade;
+	if (!options.basePath.empty() && !cascade.Load(options.basePath))
+	{
+		std::cerr << "Couldn't load cascade '" << options.basePath << "'\n";
+		return 2;
+	}
+	if (cascade.window.area() == 0) cascade.window = cv::Size(24, 24);
+	size_t baseStages = cascade.stages.size();
+
+	CaptureSet captures = FindCaptures(options, random);
+	std::cerr << "Captures: " << captures.trainPositives.size() << " positives and " << captures.trainNegatives.size() << " negative frames to train on, "
+		<< captures.testPositives.size() << " and " << captures.testNegatives.size() << " held out\n";
+
+	// Positives the cascade already rejects cannot be won back by adding stages, so they are left out
+	std::vector<Window> positives;
+	size_t rejectedByBase = 0;
+	for (auto& path : captures.trainPositives)
+	{
+		// Kept by reference to its integral images, so every sample needs its own
+		Window sample;
+		if (!LoadPositive(path, cascade.window, sample)) continue;
+		if (!Passes(cascade, sample))
+		{
+			rejectedByBase++;
+			continue;
+		}
+		positives.push_back(sample);
+	}
+
+	if (positives.empty() || captures.trainNegatives.empty())
+	{
+		std::cerr << "Need both saved cat crops the cascade accepts and blocked frames to train on\n";
+		return 2;
+	}
+
+	// Windows the door mined from blocked frames, already cut out and equalized
+	std::vector<Window> mined;
+	if (!options.minedPath.empty())
+	{
+		std::vector<cv::String> paths;
+		cv::glob(options.minedPath + "/Negative_*.png", paths, false);
+		cv::Mat window;
+		for (auto& path : paths)
+		{
+			cv::Mat stored = cv::imread(path, cv::IMREAD_GRAYSCALE);
+			if (stored.empty()) continue;
+			cv::resize(stored, window, cascade.window, 0, 0, cv::INTER_AREA);
+			Window sample;
+			MakeWindow(window, sample);
+			if (sample.normFactor > 0) mined.push_back(sample);
+		}
+	}
+
+	std::vector<PoolFeature> pool = FeaturePool(cascade.window, options.featureStep);
+	std::cerr << pool.size() << " candidate features, " << positives.size() << " positives (" << rejectedByBase << " rejected by the base cascade)\n";
+
+	std::vector<StageReport> stageReports;
+	uint64_t framesScanned = 0;
+	uint64_t catFramesSkipped = 0;
+	std::string stopReason = "stage count reached";
+	for (int s = 0; s < options.stages; s++)
+	{
+		TrainingSet set;
+		set.window = cascade.window;
+		for (auto& positive : positives)
+		{
+			if (Passes(cascade, positive)) set.Add(positive);
+		}
+		set.positives = set.count;
+
+		// Mined windows the cascade still accepts come first; the frames make up the rest
+		size_t negatives = 0;
+		for (auto& window : mined)
+		{
+			if (negatives >= static_cast<size_t>(options.negatives)) break;
+			if (!Passes(cascade, window)) continue;
+			set.Add(window);
+			negatives++;
+		}
+		negatives += HarvestNegatives(captures.trainNegatives, cascade, options, options.negatives - negatives, random, set, framesScanned, catFramesSkipped);
+		if (negatives == 0)
+		{
+			stopReason = "no negative windows left that the cascade accepts";
+			break;
+		}
+
+		StageReport report = TrainStage(set, pool, options, cascade);
+		stageReports.push_back(report);
+		std::cerr << "Stage " << cascade.stages.size() << ": " << report.weakClassifiers << " weak classifiers, hit rate " << report.hitRate
+			<< ", false alarm " << report.falseAlarm << " on " << report.negatives << " negatives, " << report.seconds << "s\n";
+	}
+
+	if (!cascade.Save(options.outputPath))
+	{
+		std::cerr << "Couldn't write '" << options.outputPath << "'\n";
+		return 2;
+	}
+	double trainingSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - trainingStart).count();
+
+	Evaluation base = options.basePath.empty() ? Evaluation() : Evaluate(options.basePath, captures);
+	Evaluation retrained = Evaluate(options.outputPath, captures);
+
+	std::ostringstream json;
+	json << "{\n"
+		<< "  \"trainingSeconds\": " << trainingSeconds << ",\n"
+		<< "  \"peakMemoryMB\": " << PeakMemoryMegabytes() << ",\n"
+		<< "  \"features\": " << pool.size() << ",\n"
+		<< "  \"positives\": " << positives.size() << ",\n"
+		<< "  \"positivesRejectedByBase\": " << rejectedByBase << ",\n"
+		<< "  \"negativeFrames\": " << captures.trainNegatives.size() << ",\n"
+		<< "  \"minedNegatives\": " << mined.size() << ",\n"
+		<< "  \"negativeFrameScans\": " << framesScanned << ",\n"
+		<< "  \"negativeFrameScansWithCats\": " << catFramesSkipped << ",\n"
+		<< "  \"baseStages\": " << baseStages << ",\n"
+		<< "  \"stopReason\": \"" << stopReason << "\",\n"
+		<< "  \"stages\": [";
+	for (size_t i = 0; i < stageReports.size(); i++)
+	{
+		const StageReport& report = stageReports[i];
+		json << (i ? ",\n" : "\n") << "    {\"weakClassifiers\": " << report.weakClassifiers << ", \"hitRate\": " << report.hitRate
+			<< ", \"falseAlarm\": " << report.falseAlarm << ", \"negatives\": " << report.negatives << ", \"seconds\": " << report.seconds << "}";
+	}
+	json << "\n  ],\n"
+		<< "  \"heldOut\": {\"positives\": " << captures.testPositives.size() << ", \"negativeFrames\": " << captures.testNegatives.size() << "},\n"
+		<< "  \"base\": " << EvaluationJson(base) << ",\n"
+		<< "  \"retrained\": " << EvaluationJson(retrained) << "\n"
+		<< "}\n";
+
+	if (options.reportPath.empty())
+	{
+		std::cout << json.str();
+	}
+	else
+	{
+		std::ofstream(options.reportPath) << json.str();
+	}
+	return 0;
+}
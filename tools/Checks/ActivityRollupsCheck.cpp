@@ -0,0 +1,143 @@
+// ActivityRollupsCheck: records 40 days of door events into ActivityRollups and
+// fails if a query over a random window does not cover the window, or does not
+// count exactly the events in the span it reports. The 40 days age the first
+// ones out of the hour ring, so windows reaching back into them are answered
+// from the day ring. Events arriving late, for an hour that has left the ring
+// and for one that has not, must land only where they belong and wipe nothing.
+// The same queries are run again on the rollups loaded back from the file.
+//
+// ActivityRollupsCheck [rollup file]
+
+#include "ActivityRollups.h"
+
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace PetDoor;
+
+#define DAYS 40         // Days of events recorded, more than the hour ring holds
+#define QUERIES 2000    // Random query windows checked
+#define MAX_WINDOW_DAYS 30
+
+static const int64_t TicksPerHour = 36000000000LL;
+
+struct Expected
+{
+	uint32_t entries = 0;
+	uint32_t exits = 0;
+	uint32_t blocked = 0;
+};
+
+static Expected CountEvents(const std::vector<DoorEventRecord>& events, int64_t from, int64_t to)
+{
+	Expected expected;
+	for (auto& event : events)
+	{
+		if (event.timestamp < from || event.timestamp >= to) continue;
+		switch (event.decision)
+		{
+		case DoorDecision::Entered: expected.entries++; break;
+		case DoorDecision::Exited: expected.exits++; break;
+		case DoorDecision::Blocked: expected.blocked++; break;
+		}
+	}
+	return expected;
+}
+
+// Runs every window against the rollups; returns the number that failed
+static int CheckQueries(ActivityRollups& rollups, const std::vector<DoorEventRecord>& events,
+	const std::vector<std::pair<int64_t, int64_t>>& windows, const char* pass)
+{
+	int failures = 0;
+	for (auto& window : windows)
+	{
+		ActivitySummary summary = rollups.Query(window.first, window.second);
+		Expected expected = CountEvents(events, summary.from, summary.to);
+		bool covers = summary.from <= window.first && summary.to >= window.second;
+		bool counts = summary.entries == expected.entries && summary.exits == expected.exits && summary.blocked == expected.blocked;
+		if (covers && counts) continue;
+
+		if (failures++ < 10)
+		{
+			std::cerr << "FAIL " << pass << ": [" << window.first / TicksPerHour << "h, " << window.second / TicksPerHour << "h)"
+				<< " answered for [" << summary.from / TicksPerHour << "h, " << summary.to / TicksPerHour << "h)"
+				<< " with " << summary.entries << "/" << summary.exits << "/" << summary.blocked
+				<< " entries/exits/blocked, expected " << expected.entries << "/" << expected.exits << "/" << expected.blocked << "\n";
+		}
+	}
+	std::cerr << (failures == 0 ? "ok   " : "FAIL ") << pass << ": " << windows.size() - failures << " of " << windows.size() << " windows\n";
+	return failures;
+}
+
+static DoorEventRecord MakeEvent(int64_t timestamp, std::mt19937& random)
+{
+	static const DoorDecision decisions[] = { DoorDecision::Entered, DoorDecision::Exited, DoorDecision::Blocked };
+
+	DoorEventRecord record = {};
+	record.timestamp = timestamp;
+	record.sensor = random() % 2 == 0 ? DoorSensor::Indoor : DoorSensor::Outdoor;
+	record.decision = decisions[random() % 3];
+	record.detectionLatencyMicroseconds = 1000 + random() % 200000;
+	return record;
+}
+
+int main(int argc, char** argv)
+{
+	std::string path = argc > 1 ? argv[1] : "ActivityRollupsCheck.bin";
+	std::remove(path.c_str());
+	std::wstring widePath(path.begin(), path.end());
+
+	std::mt19937 random(3);
+	const int64_t base = 100000 * TicksPerHour;
+	std::vector<DoorEventRecord> events;
+	int failures = 0;
+	{
+		ActivityRollups rollups(widePath);
+		for (int64_t hour = 0; hour < DAYS * 24; hour++)
+		{
+			int count = random() % 4;
+			for (int i = 0; i < count; i++)
+			{
+				events.push_back(MakeEvent(base + hour * TicksPerHour + random() % TicksPerHour, random));
+				rollups.Record(events.back());
+			}
+		}
+
+		// Late arrivals: one for an hour long gone from the hour ring, whose slot now holds a newer
+		// hour, and one for an hour still in it
+		events.push_back(MakeEvent(base + 2 * TicksPerHour + 1, random));
+		rollups.Record(events.back());
+		events.push_back(MakeEvent(base + (DAYS * 24 - 100) * TicksPerHour + 1, random));
+		rollups.Record(events.back());
+
+		std::vector<std::pair<int64_t, int64_t>> windows;
+		for (int i = 0; i < QUERIES; i++)
+		{
+			int64_t from = base + (random() % (DAYS * 24)) * TicksPerHour + random() % TicksPerHour;
+			int64_t to = from + (random() % (MAX_WINDOW_DAYS * 24)) * TicksPerHour + random() % TicksPerHour + 1;
+			windows.emplace_back(from, to);
+		}
+
+		failures += CheckQueries(rollups, events, windows, "recorded");
+		rollups.Flush();
+
+		ActivityRollups loaded(widePath);
+		if (!loaded.Loaded())
+		{
+			std::cerr << "FAIL could not load " << path << " back\n";
+			return 1;
+		}
+		failures += CheckQueries(loaded, events, windows, "loaded");
+	}
+	std::remove(path.c_str());
+
+	if (failures > 0)
+	{
+		std::cerr << failures << " checks failed\n";
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,140 @@
+// CaptureFormatCheck: runs ChooseCaptureFormat over sample camera format lists and
+// fails if it does not pick the expected format. Covers a typical USB camera list
+// with the default geometry, and the tie breaks: equal cost with fewer pixels,
+// equal cost and pixels with the lower frame rate, the cheaper subtype at the same
+// size and rate, frame rates reported a hair under the minimum, duplicates, and
+// lists with no acceptable format at all.
+//
+// CaptureFormatCheck
+
+#include "CaptureFormat.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace PetDoor;
+
+// The detector's default minimum cat face
+#define MIN_FACE_PIXELS 100
+
+static int g_failures = 0;
+
+static void Expect(const std::string& name, const std::vector<CaptureFormat>& formats, const CameraGeometry& geometry, size_t expected)
+{
+	size_t chosen = ChooseCaptureFormat(formats, geometry, MIN_FACE_PIXELS);
+	std::string got = chosen < formats.size() ? DescribeCaptureFormat(formats[chosen]) : "none";
+	std::string wanted = expected < formats.size() ? DescribeCaptureFormat(formats[expected]) : "none";
+	if (chosen != expected)
+	{
+		std::cerr << "FAIL " << name << ": chose " << got << " (" << chosen << "), expected " << wanted << " (" << expected << ")\n";
+		g_failures++;
+		return;
+	}
+	std::cerr << "ok   " << name << ": " << got << "\n";
+}
+
+// The same list in reverse, so a tie is not decided by the order of the list
+static std::vector<CaptureFormat> Reversed(const std::vector<CaptureFormat>& formats)
+{
+	return std::vector<CaptureFormat>(formats.rbegin(), formats.rend());
+}
+
+int main()
+{
+	const CameraGeometry geometry;
+
+	// A USB camera as MediaCapture lists it. At 320 pixels across a face at the door is about
+	// 55 pixels, at 640 about 111, so the 640 wide formats are the smallest that qualify.
+	std::vector<CaptureFormat> camera =
+	{
+		{ 1920, 1080, 30, "MJPG" },
+		{ 1280, 720, 30, "MJPG" },
+		{ 1280, 720, 10, "YUY2" },
+		{ 640, 480, 30, "YUY2" },
+		{ 640, 480, 15, "YUY2" },
+		{ 320, 240, 30, "YUY2" },
+	};
+	Expect("default geometry", camera, geometry, 4);
+	Expect("default geometry, reversed", Reversed(camera), geometry, 1);
+
+	// The door twice as far away needs twice the width; 1280x720 YUY2 is too slow, so MJPG it is
+	CameraGeometry farDoor = geometry;
+	farDoor.doorDistanceMillimeters = 800;
+	Expect("far door", camera, farDoor, 1);
+
+	// Same cost: 640x480 at 30 fps and 960x640 at 15 fps, both NV12. Fewer pixels win.
+	std::vector<CaptureFormat> equalCost =
+	{
+		{ 960, 640, 15, "NV12" },
+		{ 640, 480, 30, "NV12" },
+	};
+	Expect("equal cost, fewer pixels", equalCost, geometry, 1);
+	Expect("equal cost, fewer pixels, reversed", Reversed(equalCost), geometry, 0);
+
+	// Same cost and pixels: NV12 at 20 fps and YUY2 at 15 fps. The lower frame rate wins.
+	std::vector<CaptureFormat> equalArea =
+	{
+		{ 640, 480, 20, "NV12" },
+		{ 640, 480, 15, "YUY2" },
+	};
+	Expect("equal cost and area, lower frame rate", equalArea, geometry, 1);
+	Expect("equal cost and area, lower frame rate, reversed", Reversed(equalArea), geometry, 0);
+
+	// Same size and rate: the subtype that is cheapest to convert wins, unknown ones cost the most
+	std::vector<CaptureFormat> subtypes =
+	{
+		{ 640, 480, 30, "H264" },
+		{ 640, 480, 30, "MJPG" },
+		{ 640, 480, 30, "RGB32" },
+		{ 640, 480, 30, "YUY2" },
+		{ 640, 480, 30, "NV12" },
+	};
+	Expect("subtype preference", subtypes, geometry, 4);
+	Expect("subtype preference, reversed", Reversed(subtypes), geometry, 0);
+
+	// Identical formats: the first one listed
+	std::vector<CaptureFormat> duplicates =
+	{
+		{ 640, 480, 30, "NV12" },
+		{ 640, 480, 30, "NV12" },
+	};
+	Expect("duplicates", duplicates, geometry, 0);
+
+	// 15 fps is often reported as 30000/2001; that still meets a 15 fps minimum, 14 fps does not
+	std::vector<CaptureFormat> ratios =
+	{
+		{ 640, 480, 14, "NV12" },
+		{ 640, 480, 30000.0 / 2001, "YUY2" },
+		{ 640, 480, 30, "YUY2" },
+	};
+	Expect("frame rate ratio", ratios, geometry, 1);
+
+	// Nothing qualifies: too small, or too slow
+	std::vector<CaptureFormat> tooSmall =
+	{
+		{ 320, 240, 30, "NV12" },
+		{ 160, 120, 30, "NV12" },
+	};
+	Expect("all too small", tooSmall, geometry, tooSmall.size());
+
+	std::vector<CaptureFormat> tooSlow =
+	{
+		{ 1920, 1080, 5, "NV12" },
+		{ 640, 480, 10, "YUY2" },
+	};
+	Expect("all too slow", tooSlow, geometry, tooSlow.size());
+
+	CameraGeometry unreachable = geometry;
+	unreachable.doorDistanceMillimeters = 5000;
+	Expect("door out of reach", camera, unreachable, camera.size());
+
+	Expect("no formats", std::vector<CaptureFormat>(), geometry, 0);
+
+	if (g_failures > 0)
+	{
+		std::cerr << g_failures << " checks failed\n";
+		return 1;
+	}
+	return 0;
+}
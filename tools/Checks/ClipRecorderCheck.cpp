@@ -0,0 +1,108 @@
+// ClipRecorderCheck: feeds ClipRecorder 8 seconds of synthetic 10 fps frames on the
+// virtual scheduler, triggers a clip in the middle, writes the AVI it hands over to
+// a file and reads it back with OpenCV. Fails if the clip cannot be opened, or if
+// the frames read back, their size or the frame rate differ from what the recorder
+// says it wrote.
+//
+// ClipRecorderCheck [clip file]
+
+#include "ClipRecorder.h"
+#include "SimulatedHal.h"
+
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/videoio/videoio.hpp>
+
+using namespace PetDoor;
+
+#define FRAME_WIDTH 640
+#define FRAME_HEIGHT 480
+#define FRAMES_PER_SECOND 10
+#define DURATION_SECONDS 8
+
+int main(int argc, char** argv)
+{
+	std::string path = argc > 1 ? argv[1] : "ClipRecorderCheck.avi";
+
+	VirtualScheduler scheduler;
+	ClipRecorder recorder(scheduler);
+
+	ClipInfo clipInfo = {};
+	std::shared_ptr<std::vector<unsigned char>> clip;
+	recorder.SetClipHandler([&](const ClipInfo& info, std::shared_ptr<std::vector<unsigned char>> bytes)
+	{
+		clipInfo = info;
+		clip = bytes;
+	});
+
+	// A bright square moving across a dark frame, so consecutive JPEGs differ
+	cv::Mat frame(FRAME_HEIGHT, FRAME_WIDTH, CV_8UC4);
+	const int64_t frameMicroseconds = 1000000 / FRAMES_PER_SECOND;
+	for (int i = 0; i < DURATION_SECONDS * FRAMES_PER_SECOND; i++)
+	{
+		scheduler.Schedule(i * frameMicroseconds, [&, i]()
+		{
+			frame.setTo(cv::Scalar(40, 40, 40, 255));
+			cv::rectangle(frame, cv::Rect((i * 8) % (FRAME_WIDTH - 80), 200, 80, 80), cv::Scalar(255, 255, 255, 255), cv::FILLED);
+			recorder.Submit(frame, scheduler.Now());
+		});
+	}
+	scheduler.Schedule(DURATION_SECONDS * 1000000 / 2, [&]() { recorder.Trigger(1, scheduler.Now()); });
+	scheduler.RunAll();
+
+	if (!clip)
+	{
+		std::cerr << "FAIL no clip was recorded\n";
+		return 1;
+	}
+
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	file.write(reinterpret_cast<const char*>(clip->data()), clip->size());
+	file.close();
+
+	cv::VideoCapture capture(path);
+	if (!capture.isOpened())
+	{
+		std::cerr << "FAIL could not open " << path << "\n";
+		return 1;
+	}
+
+	int failures = 0;
+	size_t framesRead = 0;
+	cv::Mat decoded;
+	cv::Size expectedSize(CLIP_FRAME_WIDTH, FRAME_HEIGHT * CLIP_FRAME_WIDTH / FRAME_WIDTH);
+	while (capture.read(decoded))
+	{
+		if (decoded.size() != expectedSize && failures++ < 10)
+		{
+			std::cerr << "FAIL frame " << framesRead << " is " << decoded.cols << "x" << decoded.rows
+				<< ", expected " << expectedSize.width << "x" << expectedSize.height << "\n";
+		}
+		framesRead++;
+	}
+
+	if (framesRead != clipInfo.frames)
+	{
+		std::cerr << "FAIL read " << framesRead << " frames back, the recorder wrote " << clipInfo.frames << "\n";
+		failures++;
+	}
+
+	double fps = capture.get(cv::CAP_PROP_FPS);
+	if (std::fabs(fps - FRAMES_PER_SECOND) > 0.5)
+	{
+		std::cerr << "FAIL clip plays at " << fps << " fps, recorded at " << FRAMES_PER_SECOND << "\n";
+		failures++;
+	}
+
+	if (failures > 0)
+	{
+		std::cerr << failures << " checks failed\n";
+		return 1;
+	}
+	std::cerr << "ok   " << framesRead << " frames of " << expectedSize.width << "x" << expectedSize.height
+		<< " at " << fps << " fps, " << clip->size() << " bytes" << (clipInfo.truncated ? ", pre-roll truncated" : "") << "\n";
+	return 0;
+}
@@ -0,0 +1,96 @@
+#include "ReplaySet.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <sstream>
+#include <opencv2/imgcodecs/imgcodecs.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+namespace PetDoor
+{
+	std::vector<cv::Mat> LoadFrames(const std::string& directory)
+	{
+		std::vector<cv::String> paths;
+		cv::glob(directory + "/*", paths, false);
+		std::sort(paths.begin(), paths.end());
+
+		std::vector<cv::Mat> frames;
+		for (auto& path : paths)
+		{
+			cv::Mat bgr = cv::imread(path, cv::IMREAD_COLOR);
+			if (bgr.empty()) continue;
+
+			cv::Mat rgba;
+			cv::cvtColor(bgr, rgba, cv::COLOR_BGR2RGBA);
+			frames.push_back(rgba);
+		}
+		return frames;
+	}
+
+	double WallSeconds()
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	double ThreadSeconds()
+	{
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+		timespec now;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+		return now.tv_sec + now.tv_nsec / 1e9;
+#else
+		return WallSeconds();
+#endif
+	}
+
+	double ShareAtOrAbove(const std::vector<double>& scores, double threshold)
+	{
+		if (scores.empty()) return 0;
+		return static_cast<double>(std::count_if(scores.begin(), scores.end(), [threshold](double score) { return score >= threshold; })) / scores.size();
+	}
+
+	double ScoreFrame(CatFaceDetector& detector, cv::Mat& work, const cv::Mat& frame, std::vector<cv::Rect>& cats,
+		double(*clock)(), double& seconds)
+	{
+		frame.copyTo(work);
+		double start = clock();
+		detector.Detect(work, cats);
+		seconds = clock() - start;
+
+		const std::vector<double>& confidences = detector.Confidences();
+		return confidences.empty() ? -DBL_MAX : *std::max_element(confidences.begin(), confidences.end());
+	}
+
+	std::vector<CurvePoint> BuildCurve(const std::vector<double>& catScores, const std::vector<double>& noCatScores)
+	{
+		// Every score any frame got is a threshold where the curve may change
+		std::vector<double> thresholds;
+		for (double score : catScores) if (score > -DBL_MAX) thresholds.push_back(score);
+		for (double score : noCatScores) if (score > -DBL_MAX) thresholds.push_back(score);
+		std::sort(thresholds.begin(), thresholds.end());
+		thresholds.erase(std::unique(thresholds.begin(), thresholds.end()), thresholds.end());
+		thresholds.push_back(thresholds.empty() ? 0 : std::nextafter(thresholds.back(), DBL_MAX));
+		thresholds.insert(thresholds.begin(), -DBL_MAX);
+
+		std::vector<CurvePoint> curve;
+		for (double threshold : thresholds)
+		{
+			CurvePoint point = { threshold, ShareAtOrAbove(catScores, threshold), ShareAtOrAbove(noCatScores, threshold) };
+			if (!curve.empty() && curve.back().recall == point.recall && curve.back().falseAcceptRate == point.falseAcceptRate) continue;
+			curve.push_back(point);
+		}
+		return curve;
+	}
+
+	std::string ThresholdJson(double threshold)
+	{
+		std::ostringstream json;
+		json.precision(9);
+		if (threshold == -DBL_MAX) json << "null";
+		else json << threshold;
+		return json.str();
+	}
+}
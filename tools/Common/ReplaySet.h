@@ -0,0 +1,47 @@
+#pragma once
+
+// What the tools that replay recorded frames through the detector share: loading
+// the frames, scoring them the way the door does, and the operating curve of a
+// cat/ and nocat/ replay set.
+
+#include "VisionCore.h"
+
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+namespace PetDoor
+{
+	// Decodes every frame of a directory up front, in name order, as RGBA like the camera
+	// delivers, so disk I/O is not measured
+	std::vector<cv::Mat> LoadFrames(const std::string& directory);
+
+	// Clocks for ScoreFrame. Wall time, for a detector that scans on several threads, and the CPU
+	// time of the calling thread, so workers on a busy machine are timed fairly.
+	double WallSeconds();
+	double ThreadSeconds();
+
+	// Recall and false accept rate of a replay set at one confidence threshold
+	struct CurvePoint
+	{
+		double threshold;
+		double recall;
+		double falseAcceptRate;
+	};
+
+	double ShareAtOrAbove(const std::vector<double>& scores, double threshold);
+
+	// Detects on a copy of frame, in work, and returns its score: the most confident cat the
+	// detector reports, as the door sees it, or -DBL_MAX if there is none. seconds is set to the
+	// time the detection took on clock.
+	double ScoreFrame(CatFaceDetector& detector, cv::Mat& work, const cv::Mat& frame, std::vector<cv::Rect>& cats,
+		double(*clock)(), double& seconds);
+
+	// Recall and false accept rate at every threshold where either changes, lowest first. The
+	// first point is no threshold at all (-DBL_MAX), which lets in every frame with a cat; the
+	// last is just above the highest score, which lets nothing in.
+	std::vector<CurvePoint> BuildCurve(const std::vector<double>& catScores, const std::vector<double>& noCatScores);
+
+	// A threshold for a JSON report; no threshold is null
+	std::string ThresholdJson(double threshold);
+}
@@ -0,0 +1,609 @@
+// DetectionBench: replays a directory of recorded frames through the same
+// preprocessing, detection and annotation the door runs, and reports
+// throughput, per-stage latency percentiles, allocations and detections
+// as JSON. Detection is CatFaceDetector, with the human face veto when
+// --human-cascade is given, as on the door. A run can be compared against a
+// stored baseline.
+//
+// With --human-cascade, the frames are also run through detectMultiScale, the
+// detection the door used before CatFaceDetector, once with the cat cascade and
+// once with each cascade, and through CatFaceDetector without the veto, to show
+// what the veto costs and what sharing the scan saves.
+//
+// With --rotation-sweep, CatFaceDetector is run with and without the given
+// sweep angles, to show how much latency the sweep adds to frames where no
+// upright cat is found and how many cats it finds that the upright scan missed.
+//
+// With --gallery, pets are enrolled from the saved crops in each subdirectory
+// of the gallery directory and every detected face is identified, to show
+// which pets are recognised and what identification costs.
+//
+// DetectionBench <frames dir> --cascade <cascade.xml> [--human-cascade <cascade.xml>]
+//                [--rotation-sweep <degrees,degrees,...>] [--gallery <dir> [--identity-budget-ms N]]
+//                [--repeat N] [--warmup N]
+//                [--output results.json] [--baseline baseline.json] [--tolerance 0.10]
+
+#include "AllocationCounter.h"
+#include "CaptureEncoder.h"
+#include "Instrumentation.h"
+#include "PetIdentity.h"
+#include "ReplaySet.h"
+#include "VisionCore.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <opencv2/imgcodecs/imgcodecs.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+using namespace PetDoor;
+
+struct Options
+{
+	std::string framesDirectory;
+	std::string cascadePath;
+	std::string humanCascadePath;
+	std::string outputPath;
+	std::string baselinePath;
+	std::vector<double> sweepAngles;
+	std::string galleryDirectory;
+	double identityBudgetMilliseconds = 20;
+	int repeat = 1;
+	int warmup = 3;
+	double tolerance = 0.10;
+};
+
+struct BenchResult
+{
+	size_t frames = 0;
+	double framesPerSecond = 0;
+	double allocationsPerFrame = 0;
+	uint64_t detections = 0;
+	// Cat faces the human face veto rejected, in the first pass
+	uint64_t rejectedCats = 0;
+	std::vector<int> frameDetections;
+	std::vector<Instrumentation::StageSummary> stages;
+};
+
+// Frames per second of each way of running the cat and human face cascades. CatFaceDetector
+// with both is the main run; detectMultiScale is the detection it replaced.
+struct CascadeCostResult
+{
+	double detectMultiScaleFps = 0;
+	double twoDetectMultiScaleFps = 0;
+	double catOnlyFps = 0;
+	double catAndHumanFps = 0;
+	uint64_t rejectedCats = 0;
+	// Frames where CatFaceDetector without the veto finds a different number of cats than detectMultiScale
+	size_t framesDifferingFromDetectMultiScale = 0;
+};
+
+// CatFaceDetector without and with the rotation sweep
+struct RotationSweepResult
+{
+	double uprightFps = 0;
+	double sweepFps = 0;
+	// Frames where the upright scan found nothing and the sweep ran, and how long it took
+	Instrumentation::StageSummary sweep = {};
+	uint64_t rotatedCats = 0;
+	uint64_t framesFoundRotated = 0;
+};
+
+// Detected faces matched against an enrolled gallery
+struct IdentityResult
+{
+	size_t pets = 0;
+	size_t enrolledFaces = 0;
+	uint64_t faces = 0;
+	// Faces left unchecked when the budget ran out
+	uint64_t overBudget = 0;
+	uint64_t unknown = 0;
+	// Faces identified as each pet
+	std::vector<uint64_t> identified;
+	std::vector<std::string> names;
+	Instrumentation::StageSummary identify = {};
+};
+
+static void Usage()
+{
+	std::cerr << "usage: DetectionBench <frames dir> --cascade <cascade.xml> [--human-cascade <cascade.xml>]\n"
+		<< "                      [--rotation-sweep <degrees,degrees,...>] [--gallery <dir> [--identity-budget-ms N]]\n"
+		<< "                      [--repeat N] [--warmup N]\n"
+		<< "                      [--output results.json] [--baseline baseline.json] [--tolerance 0.10]\n";
+}
+
+static bool ParseOptions(int argc, char** argv, Options& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--cascade" && hasValue) options.cascadePath = argv[++i];
+		else if (arg == "--human-cascade" && hasValue) options.humanCascadePath = argv[++i];
+		else if (arg == "--rotation-sweep" && hasValue)
+		{
+			std::istringstream list(argv[++i]);
+			std::string angle;
+			while (std::getline(list, angle, ',')) options.sweepAngles.push_back(atof(angle.c_str()));
+		}
+		else if (arg == "--gallery" && hasValue) options.galleryDirectory = argv[++i];
+		else if (arg == "--identity-budget-ms" && hasValue) options.identityBudgetMilliseconds = atof(argv[++i]);
+		else if (arg == "--output" && hasValue) options.outputPath = argv[++i];
+		else if (arg == "--baseline" && hasValue) options.baselinePath = argv[++i];
+		else if (arg == "--repeat" && hasValue) options.repeat = std::max(1, atoi(argv[++i]));
+		else if (arg == "--warmup" && hasValue) options.warmup = std::max(0, atoi(argv[++i]));
+		else if (arg == "--tolerance" && hasValue) options.tolerance = atof(argv[++i]);
+		else if (arg.compare(0, 2, "--") != 0 && options.framesDirectory.empty()) options.framesDirectory = arg;
+		else return false;
+	}
+	return !options.framesDirectory.empty() && !options.cascadePath.empty();
+}
+
+static BenchResult Run(const std::vector<cv::Mat>& frames, CatFaceDetector& detector, const Options& options)
+{
+	BenchResult result;
+	cv::Mat work;
+	std::vector<cv::Rect> objects;
+
+	for (int i = 0; i < options.warmup && !frames.empty(); i++)
+	{
+		frames[i % frames.size()].copyTo(work);
+		detector.Detect(work, objects);
+		drawRectOverObjects(work, objects);
+	}
+	Instrumentation::Reset();
+
+	uint64_t allocationsBefore = AllocationCounter::TotalAllocations();
+	auto start = std::chrono::steady_clock::now();
+
+	for (int pass = 0; pass < options.repeat; pass++)
+	{
+		for (auto& frame : frames)
+		{
+			frame.copyTo(work);
+			detector.Detect(work, objects);
+			drawRectOverObjects(work, objects);
+
+			result.detections += objects.size();
+			if (pass == 0)
+			{
+				result.frameDetections.push_back(static_cast<int>(objects.size()));
+				result.rejectedCats += detector.RejectedCount();
+			}
+		}
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	uint64_t allocations = AllocationCounter::TotalAllocations() - allocationsBefore;
+
+	result.frames = frames.size() * options.repeat;
+	result.framesPerSecond = seconds > 0 ? result.frames / seconds : 0;
+	result.allocationsPerFrame = result.frames > 0 ? static_cast<double>(allocations) / result.frames : 0;
+	result.stages = Instrumentation::Snapshot();
+	return result;
+}
+
+// Seconds to run detect over every frame, repeat times, after warming up
+template<typename Detect>
+static double TimeFrames(const std::vector<cv::Mat>& frames, const Options& options, Detect detect)
+{
+	cv::Mat work;
+	for (int i = 0; i < options.warmup && !frames.empty(); i++)
+	{
+		frames[i % frames.size()].copyTo(work);
+		detect(work, 0);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	for (int pass = 0; pass < options.repeat; pass++)
+	{
+		for (size_t i = 0; i < frames.size(); i++)
+		{
+			frames[i].copyTo(work);
+			detect(work, pass == 0 ? static_cast<int>(i) : -1);
+		}
+	}
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static bool RunCascadeCost(const std::vector<cv::Mat>& frames, const BenchResult& door, const Options& options, CascadeCostResult& result)
+{
+	cv::CascadeClassifier catCascade;
+	cv::CascadeClassifier humanCascade;
+	CatFaceDetector catOnly;
+	if (!catCascade.load(options.cascadePath) || !humanCascade.load(options.humanCascadePath) || !catOnly.Load(options.cascadePath, ""))
+	{
+		return false;
+	}
+
+	double frameCount = static_cast<double>(frames.size() * options.repeat);
+	cv::Mat gray;
+	std::vector<cv::Rect> cats;
+	std::vector<cv::Rect> humans;
+	std::vector<int> detectMultiScaleCats;
+
+	// Before: detectMultiScale with the cat cascade, as the door detected before CatFaceDetector
+	double seconds = TimeFrames(frames, options, [&](cv::Mat& frame, int index)
+	{
+		DetectObjects(frame, cats, catCascade, gray);
+		if (index >= 0) detectMultiScaleCats.push_back(static_cast<int>(cats.size()));
+	});
+	result.detectMultiScaleFps = seconds > 0 ? frameCount / seconds : 0;
+
+	// What the veto would cost done the obvious way: a second detectMultiScale on the same frame
+	seconds = TimeFrames(frames, options, [&](cv::Mat& frame, int)
+	{
+		DetectObjects(frame, cats, catCascade, gray);
+		humanCascade.detectMultiScale(gray, humans, 1.1, 3, cv::CASCADE_SCALE_IMAGE, cv::Size(80, 80));
+	});
+	result.twoDetectMultiScaleFps = seconds > 0 ? frameCount / seconds : 0;
+
+	seconds = TimeFrames(frames, options, [&](cv::Mat& frame, int index)
+	{
+		catOnly.Detect(frame, cats);
+		if (index >= 0 && index < static_cast<int>(detectMultiScaleCats.size()) && static_cast<int>(cats.size()) != detectMultiScaleCats[index])
+		{
+			result.framesDifferingFromDetectMultiScale++;
+		}
+	});
+	result.catOnlyFps = seconds > 0 ? frameCount / seconds : 0;
+
+	// The main run is CatFaceDetector with both cascades
+	result.catAndHumanFps = door.framesPerSecond;
+	result.rejectedCats = door.rejectedCats;
+	return true;
+}
+
+static bool RunRotationSweep(const std::vector<cv::Mat>& frames, const Options& options, RotationSweepResult& result)
+{
+	CatFaceDetector upright;
+	CatFaceDetector sweep;
+	if (!upright.Load(options.cascadePath, options.humanCascadePath) || !sweep.Load(options.cascadePath, options.humanCascadePath)
+		|| !sweep.SetRotationSweep(options.sweepAngles))
+	{
+		return false;
+	}
+
+	double frameCount = static_cast<double>(frames.size() * options.repeat);
+	std::vector<cv::Rect> cats;
+
+	double seconds = TimeFrames(frames, options, [&](cv::Mat& frame, int) { upright.Detect(frame, cats); });
+	result.uprightFps = seconds > 0 ? frameCount / seconds : 0;
+
+	// The stage timers are the only way to tell the sweep's time from the upright scan's,
+	// so the warmup is done here to keep it out of them
+	cv::Mat work;
+	for (int i = 0; i < options.warmup && !frames.empty(); i++)
+	{
+		frames[i % frames.size()].copyTo(work);
+		sweep.Detect(work, cats);
+	}
+	Instrumentation::Reset();
+
+	Options warm = options;
+	warm.warmup = 0;
+	seconds = TimeFrames(frames, warm, [&](cv::Mat& frame, int index)
+	{
+		sweep.Detect(frame, cats);
+		if (index >= 0 && sweep.MatchedAngle() != 0)
+		{
+			result.rotatedCats += cats.size();
+			result.framesFoundRotated++;
+		}
+	});
+	result.sweepFps = seconds > 0 ? frameCount / seconds : 0;
+
+	for (auto& stage : Instrumentation::Snapshot())
+	{
+		if (stage.stage == Stage::RotationSweep) result.sweep = stage;
+	}
+	return true;
+}
+
+static bool RunIdentity(const std::vector<cv::Mat>& frames, const Options& options, IdentityResult& result)
+{
+	CatFaceDetector detector;
+	PetGallery gallery;
+	if (!detector.Load(options.cascadePath, options.humanCascadePath)) return false;
+
+	// Saved crops are padded as CaptureEncoder pads them
+	result.enrolledFaces = gallery.EnrollDirectory(options.galleryDirectory, CAPTURE_CROP_PADDING);
+	result.pets = gallery.PetCount();
+	for (size_t pet = 0; pet < result.pets; pet++)
+	{
+		result.names.push_back(gallery.PetName(static_cast<int>(pet)));
+	}
+	result.identified.assign(result.pets, 0);
+
+	int64_t budget = static_cast<int64_t>(options.identityBudgetMilliseconds * 1000);
+	cv::Mat work;
+	std::vector<cv::Rect> cats;
+	std::vector<PetMatch> matches;
+	for (int i = 0; i < options.warmup && !frames.empty(); i++)
+	{
+		frames[i % frames.size()].copyTo(work);
+		detector.Detect(work, cats);
+		gallery.Identify(detector.Gray(), cats, matches, budget);
+	}
+	Instrumentation::Reset();
+
+	for (auto& frame : frames)
+	{
+		frame.copyTo(work);
+		detector.Detect(work, cats);
+		size_t checked = gallery.Identify(detector.Gray(), cats, matches, budget);
+
+		result.faces += cats.size();
+		result.overBudget += cats.size() - checked;
+		for (auto& match : matches)
+		{
+			if (match.pet >= 0) result.identified[match.pet]++;
+			else if (match.distance != FLT_MAX) result.unknown++;
+		}
+	}
+
+	for (auto& stage : Instrumentation::Snapshot())
+	{
+		if (stage.stage == Stage::Identify) result.identify = stage;
+	}
+	return true;
+}
+
+static std::string ToJson(const BenchResult& result, const CascadeCostResult* cascadeCost, const RotationSweepResult* rotationSweep, const IdentityResult* identity)
+{
+	std::ostringstream json;
+	json << "{\n"
+		<< "  \"frames\": " << result.frames << ",\n"
+		<< "  \"fps\": " << result.framesPerSecond << ",\n"
+		<< "  \"allocationsPerFrame\": " << result.allocationsPerFrame << ",\n"
+		<< "  \"detections\": " << result.detections << ",\n"
+		<< "  \"stages\": {";
+
+	bool first = true;
+	for (auto& stage : result.stages)
+	{
+		if (stage.count == 0) continue;
+		json << (first ? "\n" : ",\n") << "    \"" << StageName(stage.stage) << "\": {"
+			<< "\"count\": " << stage.count
+			<< ", \"mean\": " << stage.meanMicroseconds
+			<< ", \"p50\": " << stage.p50Microseconds
+			<< ", \"p95\": " << stage.p95Microseconds
+			<< ", \"p99\": " << stage.p99Microseconds << "}";
+		first = false;
+	}
+
+	json << "\n  },\n";
+
+	if (cascadeCost)
+	{
+		// Cost is relative to detectMultiScale with the cat cascade alone, the detection before CatFaceDetector
+		double before = cascadeCost->detectMultiScaleFps;
+		json << "  \"cascadeCost\": {"
+			<< "\"detectMultiScaleFps\": " << before
+			<< ", \"twoDetectMultiScaleFps\": " << cascadeCost->twoDetectMultiScaleFps
+			<< ", \"catOnlyFps\": " << cascadeCost->catOnlyFps
+			<< ", \"catAndHumanFps\": " << cascadeCost->catAndHumanFps
+			<< ", \"twoDetectMultiScaleCost\": " << (cascadeCost->twoDetectMultiScaleFps > 0 ? before / cascadeCost->twoDetectMultiScaleFps : 0)
+			<< ", \"catOnlyCost\": " << (cascadeCost->catOnlyFps > 0 ? before / cascadeCost->catOnlyFps : 0)
+			<< ", \"catAndHumanCost\": " << (cascadeCost->catAndHumanFps > 0 ? before / cascadeCost->catAndHumanFps : 0)
+			<< ", \"rejectedCats\": " << cascadeCost->rejectedCats
+			<< ", \"framesDifferingFromDetectMultiScale\": " << cascadeCost->framesDifferingFromDetectMultiScale << "},\n";
+	}
+
+	if (rotationSweep)
+	{
+		// Latency the sweep adds to each frame where it runs, and to a frame on average
+		json << "  \"rotationSweep\": {"
+			<< "\"uprightFps\": " << rotationSweep->uprightFps
+			<< ", \"sweepFps\": " << rotationSweep->sweepFps
+			<< ", \"sweeps\": " << rotationSweep->sweep.count
+			<< ", \"sweepMean\": " << rotationSweep->sweep.meanMicroseconds
+			<< ", \"sweepP50\": " << rotationSweep->sweep.p50Microseconds
+			<< ", \"sweepP95\": " << rotationSweep->sweep.p95Microseconds
+			<< ", \"addedMicrosecondsPerFrame\": " << (rotationSweep->sweepFps > 0 && rotationSweep->uprightFps > 0 ? 1e6 / rotationSweep->sweepFps - 1e6 / rotationSweep->uprightFps : 0)
+			<< ", \"framesFoundRotated\": " << rotationSweep->framesFoundRotated
+			<< ", \"rotatedCats\": " << rotationSweep->rotatedCats << "},\n";
+	}
+
+	if (identity)
+	{
+		json << "  \"identity\": {"
+			<< "\"pets\": " << identity->pets
+			<< ", \"enrolledFaces\": " << identity->enrolledFaces
+			<< ", \"faces\": " << identity->faces
+			<< ", \"unknown\": " << identity->unknown
+			<< ", \"overBudget\": " << identity->overBudget
+			<< ", \"identifyP50\": " << identity->identify.p50Microseconds
+			<< ", \"identifyP95\": " << identity->identify.p95Microseconds
+			<< ", \"identifyP99\": " << identity->identify.p99Microseconds
+			<< ", \"identified\": {";
+		for (size_t pet = 0; pet < identity->pets; pet++)
+		{
+			json << (pet ? ", " : "") << "\"" << identity->names[pet] << "\": " << identity->identified[pet];
+		}
+		json << "}},\n";
+	}
+
+	json << "  \"frameDetections\": [";
+	for (size_t i = 0; i < result.frameDetections.size(); i++)
+	{
+		json << (i ? ", " : "") << result.frameDetections[i];
+	}
+	json << "]\n}\n";
+	return json.str();
+}
+
+// Finds "key": <number> in the JSON written by ToJson, inside the object named
+// section if one is given. Enough for our own files; not a general parser.
+static bool FindNumber(const std::string& json, const std::string& section, const std::string& key, double& value)
+{
+	size_t from = 0;
+	size_t to = json.size();
+	if (!section.empty())
+	{
+		from = json.find("\"" + section + "\": {");
+		if (from == std::string::npos) return false;
+		to = json.find('}', from);
+	}
+
+	size_t at = json.find("\"" + key + "\": ", from);
+	if (at == std::string::npos || at > to) return false;
+	value = atof(json.c_str() + at + key.size() + 4);
+	return true;
+}
+
+static std::vector<int> FindFrameDetections(const std::string& json)
+{
+	std::vector<int> detections;
+	size_t at = json.find("\"frameDetections\": [");
+	if (at == std::string::npos) return detections;
+
+	std::istringstream list(json.substr(at + 20, json.find(']', at) - at - 20));
+	std::string item;
+	while (std::getline(list, item, ','))
+	{
+		detections.push_back(atoi(item.c_str()));
+	}
+	return detections;
+}
+
+// Prints how this run differs from the baseline. Returns false on a regression:
+// fps or any stage p95 worse than the tolerance, more allocations, or different detections.
+static bool CompareWithBaseline(const BenchResult& result, const std::string& baseline, double tolerance)
+{
+	bool ok = true;
+
+	double baselineFps;
+	if (FindNumber(baseline, "", "fps", baselineFps) && baselineFps > 0)
+	{
+		double change = result.framesPerSecond / baselineFps - 1;
+		bool regressed = change < -tolerance;
+		std::cerr << "fps: " << baselineFps << " -> " << result.framesPerSecond << " (" << change * 100 << "%)" << (regressed ? " REGRESSED" : "") << "\n";
+		ok &= !regressed;
+	}
+
+	double baselineAllocations;
+	if (FindNumber(baseline, "", "allocationsPerFrame", baselineAllocations))
+	{
+		bool regressed = result.allocationsPerFrame > baselineAllocations * (1 + tolerance) + 0.5;
+		std::cerr << "allocations/frame: " << baselineAllocations << " -> " << result.allocationsPerFrame << (regressed ? " REGRESSED" : "") << "\n";
+		ok &= !regressed;
+	}
+
+	for (auto& stage : result.stages)
+	{
+		double baselineP95;
+		if (stage.count == 0 || !FindNumber(baseline, StageName(stage.stage), "p95", baselineP95)) continue;
+
+		bool regressed = stage.p95Microseconds > baselineP95 * (1 + tolerance);
+		std::cerr << StageName(stage.stage) << " p95: " << baselineP95 << "us -> " << stage.p95Microseconds << "us" << (regressed ? " REGRESSED" : "") << "\n";
+		ok &= !regressed;
+	}
+
+	std::vector<int> baselineDetections = FindFrameDetections(baseline);
+	if (!baselineDetections.empty())
+	{
+		size_t changed = 0;
+		for (size_t i = 0; i < result.frameDetections.size(); i++)
+		{
+			if (i >= baselineDetections.size() || baselineDetections[i] != result.frameDetections[i]) changed++;
+		}
+		if (baselineDetections.size() != result.frameDetections.size())
+		{
+			std::cerr << "frame count differs from the baseline: " << baselineDetections.size() << " -> " << result.frameDetections.size() << "\n";
+		}
+		std::cerr << "frames with different detections: " << changed << "\n";
+		ok &= changed == 0 && baselineDetections.size() == result.frameDetections.size();
+	}
+
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	if (!ParseOptions(argc, argv, options))
+	{
+		Usage();
+		return 2;
+	}
+
+	// The door's detector: the cat cascade, and the human face veto if there is a human cascade
+	CatFaceDetector detector;
+	if (!detector.Load(options.cascadePath, options.humanCascadePath))
+	{
+		std::cerr << "Couldn't load cascade '" << options.cascadePath << "'\n";
+		return 2;
+	}
+	if (!options.humanCascadePath.empty() && !detector.HasHumanVeto())
+	{
+		std::cerr << "Couldn't load cascade '" << options.humanCascadePath << "'\n";
+		return 2;
+	}
+
+	std::vector<cv::Mat> frames = LoadFrames(options.framesDirectory);
+	if (frames.empty())
+	{
+		std::cerr << "No readable frames in '" << options.framesDirectory << "'\n";
+		return 2;
+	}
+
+	BenchResult result = Run(frames, detector, options);
+
+	CascadeCostResult cascadeCost;
+	bool hasCascadeCost = !options.humanCascadePath.empty();
+	if (hasCascadeCost && !RunCascadeCost(frames, result, options, cascadeCost))
+	{
+		std::cerr << "Couldn't load the cascades for detectMultiScale\n";
+		return 2;
+	}
+
+	RotationSweepResult rotationSweep;
+	bool hasRotationSweep = !options.sweepAngles.empty();
+	if (hasRotationSweep && !RunRotationSweep(frames, options, rotationSweep))
+	{
+		std::cerr << "Couldn't load the cascades for the rotation sweep\n";
+		return 2;
+	}
+
+	IdentityResult identity;
+	bool hasIdentity = !options.galleryDirectory.empty();
+	if (hasIdentity && !RunIdentity(frames, options, identity))
+	{
+		std::cerr << "Couldn't load the cascades for identification\n";
+		return 2;
+	}
+
+	std::string json = ToJson(result, hasCascadeCost ? &cascadeCost : nullptr, hasRotationSweep ? &rotationSweep : nullptr, hasIdentity ? &identity : nullptr);
+
+	if (options.outputPath.empty())
+	{
+		std::cout << json;
+	}
+	else
+	{
+		std::ofstream(options.outputPath) << json;
+	}
+
+	if (!options.baselinePath.empty())
+	{
+		std::ifstream baselineFile(options.baselinePath);
+		if (!baselineFile)
+		{
+			std::cerr << "Couldn't read baseline '" << options.baselinePath << "'\n";
+			return 2;
+		}
+		std::stringstream baseline;
+		baseline << baselineFile.rdbuf();
+		return CompareWithBaseline(result, baseline.str(), options.tolerance) ? 0 : 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,580 @@
+// DoorSim: runs DoorController against the simulated back-ends on a virtual
+// clock, driven by a recorded PIR trace or by synthetic Poisson triggers on
+// both sensors, and reports throughput, decision latency, queueing delay,
+// servo duty and any servo commands that overlap. The same options and seed
+// always give the same result; an hour of traffic replays in well under a
+// second with the synthetic detector.
+//
+// Detections go through the same bounded worker pool as on the device. With
+// --cameras above --entry-cameras the remaining cameras are background
+// cameras, each asking for a scan every --background-ms, so throughput and
+// latency of both kinds of detection can be measured as cameras are added.
+//
+// With --idle-ms the entry cameras stop previewing after that long without a
+// trigger, as on the device, and take --wake-ms to start again; the report
+// says how much of the run they slept and what waking cost the first frame.
+//
+// Once the first cat has been let in, every buffer on the trigger path has
+// been sized, so the rest of the run should not allocate at all, detector
+// included; --check-allocations fails the run if it does. The tools' ctest
+// runs it that way. Given --cascade without --frames, the cascades scan a
+// frame of noise on every detection, so their work and allocations are real,
+// while --cat-probability decides whether a cat was there.
+//
+// DoorSim [--trace trace.txt | --rate <triggers per minute per sensor> --duration <seconds>]
+//         [[--frames <dir>] --cascade <cascade.xml> [--human-cascade <cascade.xml>]] [--cat-probability <0..1>]
+//         [--capture-ms N] [--detection-ms N] [--pir-high-ms N] [--seed N]
+//         [--cameras N] [--entry-cameras N] [--workers N] [--background-ms N]
+//         [--idle-ms N [--wake-ms N]]
+//         [--output results.json] [--fail-on-overlap] [--check-allocations]
+
+#include "AllocationCounter.h"
+#include "DetectorPool.h"
+#include "DoorController.h"
+#include "IdlePreview.h"
+#include "LatencyBuckets.h"
+#include "SimulatedHal.h"
+#include "VisionCore.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <opencv2/imgproc/imgproc.hpp>
+
+using namespace PetDoor;
+
+struct Options
+{
+	std::string tracePath;
+	std::string framesDirectory;
+	std::string cascadePath;
+	std::string humanCascadePath;
+	std::string outputPath;
+	double ratePerMinute = 60;
+	double durationSeconds = 600;
+	double catProbability = 0.5;
+	int64_t captureMicroseconds = 30000;
+	int64_t detectionMicroseconds = 150000;
+	int64_t pirHighMicroseconds = 2000000;
+	size_t cameras = 1;
+	size_t entryCameras = 1;
+	size_t workers = 1;
+	int64_t backgroundMicroseconds = 1000000;
+	int64_t idleMicroseconds = 0;
+	int64_t wakeMicroseconds = 300000;
+	unsigned int seed = 1;
+	bool failOnOverlap = false;
+	bool checkAllocations = false;
+};
+
+// Percentiles of one latency, in microseconds
+class LatencyHistogram
+{
+public:
+	LatencyHistogram() : _counts(LatencyBuckets::Count, 0), _count(0), _max(0) {}
+
+	void Add(int64_t microseconds)
+	{
+		uint64_t value = microseconds > 0 ? static_cast<uint64_t>(microseconds) : 0;
+		_counts[LatencyBuckets::Index(value)]++;
+		_count++;
+		_max = std::max(_max, value);
+	}
+
+	std::string ToJson() const
+	{
+		// A bucket's upper bound can overshoot the largest sample
+		std::ostringstream json;
+		json << "{\"count\": " << _count
+			<< ", \"p50\": " << std::min(_max, LatencyBuckets::Percentile(_counts.data(), 0.50))
+			<< ", \"p95\": " << std::min(_max, LatencyBuckets::Percentile(_counts.data(), 0.95))
+			<< ", \"p99\": " << std::min(_max, LatencyBuckets::Percentile(_counts.data(), 0.99))
+			<< ", \"max\": " << _max << "}";
+		return json.str();
+	}
+
+private:
+	std::vector<uint64_t> _counts;
+	uint64_t _count;
+	uint64_t _max;
+};
+
+// Replays one servo's commands against what the door state machine may send:
+// open from rest, close once the open position is reached, stop once the
+// closed position is reached, or reopen at any time while closing. Anything
+// else means two door sequences drove the servo at once.
+struct ServoReport
+{
+	size_t commands = 0;
+	size_t openings = 0;
+	size_t reversals = 0;
+	size_t overlaps = 0;
+	int64_t poweredMicroseconds = 0;
+	int64_t openMicroseconds = 0;
+};
+
+static ServoReport CheckServo(const std::vector<PwmCommand>& commands, double openDutyCycle, int64_t travelMicroseconds, int64_t endMicroseconds)
+{
+	enum { Stopped, Opening, Closing } state = Stopped;
+	ServoReport report;
+	int64_t lastCommand = 0;
+	int64_t poweredSince = 0;
+	int64_t openSince = 0;
+
+	for (auto& command : commands)
+	{
+		report.commands++;
+		bool travelDone = command.microseconds - lastCommand >= travelMicroseconds;
+		bool open = command.dutyCycle >= 0 && command.dutyCycle == openDutyCycle;
+		bool stop = command.dutyCycle < 0;
+
+		if (open)
+		{
+			if (state == Stopped)
+			{
+				report.openings++;
+				poweredSince = command.microseconds;
+				openSince = command.microseconds;
+			}
+			else if (state == Closing)
+			{
+				report.reversals++;
+				openSince = command.microseconds;
+			}
+			else
+			{
+				report.overlaps++;
+			}
+			state = Opening;
+		}
+		else if (stop)
+		{
+			if (state != Closing || !travelDone) report.overlaps++;
+			if (state != Stopped) report.poweredMicroseconds += command.microseconds - poweredSince;
+			state = Stopped;
+		}
+		else
+		{
+			if (state != Opening || !travelDone) report.overlaps++;
+			if (state == Opening) report.openMicroseconds += command.microseconds - openSince;
+			if (state == Stopped) poweredSince = command.microseconds;
+			state = Closing;
+		}
+		lastCommand = command.microseconds;
+	}
+
+	if (state != Stopped) report.poweredMicroseconds += endMicroseconds - poweredSince;
+	if (state == Opening) report.openMicroseconds += endMicroseconds - openSince;
+	return report;
+}
+
+static void Usage()
+{
+	std::cerr << "usage: DoorSim [--trace trace.txt | --rate <per minute per sensor> --duration <seconds>]\n"
+		<< "               [[--frames <dir>] --cascade <cascade.xml> [--human-cascade <cascade.xml>]] [--cat-probability <0..1>]\n"
+		<< "               [--capture-ms N] [--detection-ms N] [--pir-high-ms N] [--seed N]\n"
+		<< "               [--cameras N] [--entry-cameras N] [--workers N] [--background-ms N]\n"
+		<< "               [--idle-ms N [--wake-ms N]]\n"
+		<< "               [--output results.json] [--fail-on-overlap] [--check-allocations]\n";
+}
+
+static bool ParseOptions(int argc, char** argv, Options& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--trace" && hasValue) options.tracePath = argv[++i];
+		else if (arg == "--frames" && hasValue) options.framesDirectory = argv[++i];
+		else if (arg == "--cascade" && hasValue) options.cascadePath = argv[++i];
+		else if (arg == "--human-cascade" && hasValue) options.humanCascadePath = argv[++i];
+		else if (arg == "--output" && hasValue) options.outputPath = argv[++i];
+		else if (arg == "--rate" && hasValue) options.ratePerMinute = atof(argv[++i]);
+		else if (arg == "--duration" && hasValue) options.durationSeconds = atof(argv[++i]);
+		else if (arg == "--cat-probability" && hasValue) options.catProbability = atof(argv[++i]);
+		else if (arg == "--capture-ms" && hasValue) options.captureMicroseconds = static_cast<int64_t>(atof(argv[++i]) * 1000);
+		else if (arg == "--detection-ms" && hasValue) options.detectionMicroseconds = static_cast<int64_t>(atof(argv[++i]) * 1000);
+		else if (arg == "--pir-high-ms" && hasValue) options.pirHighMicroseconds = static_cast<int64_t>(atof(argv[++i]) * 1000);
+		else if (arg == "--cameras" && hasValue) options.cameras = static_cast<size_t>(atoi(argv[++i]));
+		else if (arg == "--entry-cameras" && hasValue) options.entryCameras = static_cast<size_t>(atoi(argv[++i]));
+		else if (arg == "--workers" && hasValue) options.workers = static_cast<size_t>(atoi(argv[++i]));
+		else if (arg == "--background-ms" && hasValue) options.backgroundMicroseconds = static_cast<int64_t>(atof(argv[++i]) * 1000);
+		else if (arg == "--idle-ms" && hasValue) options.idleMicroseconds = static_cast<int64_t>(atof(argv[++i]) * 1000);
+		else if (arg == "--wake-ms" && hasValue) options.wakeMicroseconds = static_cast<int64_t>(atof(argv[++i]) * 1000);
+		else if (arg == "--seed" && hasValue) options.seed = static_cast<unsigned int>(atoi(argv[++i]));
+		else if (arg == "--fail-on-overlap") options.failOnOverlap = true;
+		else if (arg == "--check-allocations") options.checkAllocations = true;
+		else return false;
+	}
+	return (options.framesDirectory.empty() || !options.cascadePath.empty())
+		&& options.entryCameras >= 1 && options.entryCameras <= options.cameras && options.workers >= 1;
+}
+
+// Poisson arrivals on both sensors
+static std::vector<PirTraceEdge> SyntheticTrace(const Options& options, std::mt19937& random)
+{
+	std::vector<PirTraceEdge> edges;
+	if (options.ratePerMinute <= 0) return edges;
+
+	int64_t duration = static_cast<int64_t>(options.durationSeconds * 1000000);
+	std::exponential_distribution<double> gap(options.ratePerMinute / 60e6);
+
+	for (int sensor = 0; sensor < 2; sensor++)
+	{
+		for (double at = gap(random); at < duration; at += gap(random))
+		{
+			PirTraceEdge edge = { static_cast<int64_t>(at), sensor == 1, options.pirHighMicroseconds };
+			edges.push_back(edge);
+		}
+	}
+
+	std::stable_sort(edges.begin(), edges.end(), [](const PirTraceEdge& a, const PirTraceEdge& b) { return a.microseconds < b.microseconds; });
+	return edges;
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	if (!ParseOptions(argc, argv, options))
+	{
+		Usage();
+		return 2;
+	}
+
+	std::mt19937 random(options.seed);
+
+	std::vector<PirTraceEdge> edges;
+	if (!options.tracePath.empty())
+	{
+		std::string error;
+		if (!LoadPirTrace(options.tracePath, edges, error))
+		{
+			std::cerr << "Couldn't read trace '" << options.tracePath << "': " << error << "\n";
+			return 2;
+		}
+		options.durationSeconds = edges.empty() ? 0 : edges.back().microseconds / 1e6;
+	}
+	else
+	{
+		edges = SyntheticTrace(options, random);
+	}
+
+	VirtualScheduler scheduler;
+	SimulatedDigitalInput indoorSensor(scheduler);
+	SimulatedDigitalInput outdoorSensor(scheduler);
+	SimulatedPwmChannel leftServo(scheduler);
+	SimulatedPwmChannel rightServo(scheduler);
+
+	// Detection runs concurrently with the rest of the door on the device, so
+	// its time is modelled as part of the frame's latency, not charged to the
+	// clock. That also means a preempted background detection holds its worker
+	// until its modelled time is up and only then gives up; on the device it
+	// gives up within a pyramid level.
+	std::vector<std::unique_ptr<ImageSequenceFrameSource>> cameras;
+	for (size_t i = 0; i < options.cameras; i++)
+	{
+		cameras.emplace_back(new ImageSequenceFrameSource(scheduler, options.captureMicroseconds + options.detectionMicroseconds));
+	}
+
+	// Each worker has a detector of its own, as on the device
+	std::vector<std::unique_ptr<CatFaceDetector>> catFaceDetectors;
+	std::vector<std::vector<cv::Rect>> scanned(options.workers);
+	DetectorPool::Detector detect;
+	if (!options.cascadePath.empty())
+	{
+		for (size_t i = 0; i < options.workers; i++)
+		{
+			catFaceDetectors.emplace_back(new CatFaceDetector());
+			if (!catFaceDetectors.back()->Load(options.cascadePath, options.humanCascadePath))
+			{
+				std::cerr << "Couldn't load cascade '" << options.cascadePath << "'\n";
+				return 2;
+			}
+			if (!options.humanCascadePath.empty() && !catFaceDetectors.back()->HasHumanVeto())
+			{
+				std::cerr << "Couldn't load cascade '" << options.humanCascadePath << "'\n";
+				return 2;
+			}
+		}
+	}
+
+	std::bernoulli_distribution catPresent(options.catProbability);
+	if (!options.framesDirectory.empty())
+	{
+		for (auto& camera : cameras)
+		{
+			if (camera->LoadDirectory(options.framesDirectory) == 0)
+			{
+				std::cerr << "No readable frames in '" << options.framesDirectory << "'\n";
+				return 2;
+			}
+		}
+		detect = [&catFaceDetectors](size_t worker, size_t, cv::Mat& frame, std::vector<cv::Rect>& objects, const std::atomic<bool>& cancel)
+		{
+			return catFaceDetectors[worker]->Detect(frame, objects, &cancel);
+		};
+	}
+	else if (!catFaceDetectors.empty())
+	{
+		cv::Mat noise(480, 640, CV_8UC4);
+		cv::RNG(options.seed).fill(noise, cv::RNG::UNIFORM, 0, 256);
+		for (auto& camera : cameras)
+		{
+			camera->AddFrame(noise);
+		}
+		detect = [&catFaceDetectors, &scanned, &random, catPresent](size_t worker, size_t, cv::Mat& frame, std::vector<cv::Rect>& objects, const std::atomic<bool>& cancel) mutable
+		{
+			objects.clear();
+			if (!catFaceDetectors[worker]->Detect(frame, scanned[worker], &cancel)) return false;
+			if (catPresent(random)) objects.push_back(cv::Rect(100, 60, 120, 120));
+			return true;
+		};
+	}
+	else
+	{
+		for (auto& camera : cameras)
+		{
+			camera->AddFrame(cv::Mat(240, 320, CV_8UC4, cv::Scalar(0, 0, 0, 255)));
+		}
+		detect = [&random, catPresent](size_t, size_t, cv::Mat&, std::vector<cv::Rect>& objects, const std::atomic<bool>& cancel) mutable
+		{
+			objects.clear();
+			if (cancel) return false;
+			if (catPresent(random)) objects.push_back(cv::Rect(100, 60, 120, 120));
+			return true;
+		};
+	}
+
+	// The detector's share is reported on its own, but counts against the check like the rest.
+	// Counted on every thread, as the cascades scan on OpenCV's.
+	uint64_t detectorAllocations = 0;
+	DetectorPool::Detector detector = [&detect, &detectorAllocations](size_t worker, size_t source, cv::Mat& frame, std::vector<cv::Rect>& objects, const std::atomic<bool>& cancel)
+	{
+		uint64_t before = AllocationCounter::TotalAllocations();
+		bool finished = detect(worker, source, frame, objects, cancel);
+		detectorAllocations += AllocationCounter::TotalAllocations() - before;
+		return finished;
+	};
+
+	// An idle entry camera stops right away and takes --wake-ms to start again. The transitions
+	// are finished from the scheduler, as MediaCapture finishes them asynchronously.
+	struct IdleCamera
+	{
+		std::unique_ptr<IdlePreviewSource> source;
+		IdlePreviewSource::Done done;
+	};
+	std::vector<IdleCamera> idleCameras(options.idleMicroseconds > 0 ? options.entryCameras : 0);
+	for (size_t i = 0; i < idleCameras.size(); i++)
+	{
+		IdleCamera& idle = idleCameras[i];
+		ImageSequenceFrameSource& camera = *cameras[i];
+		idle.source.reset(new IdlePreviewSource(camera, scheduler, options.idleMicroseconds,
+			[&scheduler, &idle, &camera](IdlePreviewSource::Done done)
+		{
+			camera.SetPreviewing(false);
+			idle.done = done;
+			scheduler.Schedule(0, [&idle]()
+			{
+				// Copied, as finishing one transition may start the next
+				IdlePreviewSource::Done finish = idle.done;
+				finish(true);
+			});
+		},
+			[&scheduler, &options, &idle, &camera](IdlePreviewSource::Done done)
+		{
+			idle.done = done;
+			scheduler.Schedule(options.wakeMicroseconds, [&idle, &camera]()
+			{
+				camera.SetPreviewing(true);
+				IdlePreviewSource::Done finish = idle.done;
+				finish(true);
+			});
+		}));
+	}
+
+	DetectorPool pool(scheduler, options.workers, detector);
+	for (size_t i = 0; i < cameras.size(); i++)
+	{
+		if (i < idleCameras.size()) pool.AddSource(*idleCameras[i].source);
+		else pool.AddSource(*cameras[i]);
+	}
+
+	DoorTiming timing;
+	DoorServoPositions positions;
+	DoorController controller(indoorSensor, outdoorSensor, leftServo, rightServo, pool, scheduler, timing, positions);
+	for (size_t i = 0; i < options.entryCameras; i++)
+	{
+		controller.AddEntryCamera(i);
+	}
+
+	LatencyHistogram decisionLatency;
+	LatencyHistogram queueingDelay;
+	uint64_t entered = 0;
+	uint64_t exited = 0;
+	uint64_t blocked = 0;
+	bool steadyState = false;
+	uint64_t steadyStateStart = 0;
+	uint64_t steadyStateDetectorStart = 0;
+	controller.SetDecisionHandler([&](const DoorOutcome& outcome, cv::Mat*, std::vector<cv::Rect>&)
+	{
+		if (!steadyState && outcome.decision == DoorDecision::Entered)
+		{
+			steadyState = true;
+			steadyStateStart = AllocationCounter::TotalAllocations();
+			steadyStateDetectorStart = detectorAllocations;
+		}
+
+		// Someone went out, so someone may come back
+		if (outcome.sensor == DoorSensor::Indoor)
+		{
+			for (auto& idle : idleCameras) idle.source->Wake(outcome.edgeMicroseconds);
+		}
+
+		switch (outcome.decision)
+		{
+		case DoorDecision::Entered: entered++; break;
+		case DoorDecision::Exited: exited++; break;
+		case DoorDecision::Blocked: blocked++; break;
+		}
+		if (outcome.sensor == DoorSensor::Outdoor)
+		{
+			decisionLatency.Add(outcome.decidedMicroseconds - outcome.edgeMicroseconds);
+			queueingDelay.Add(outcome.detectionStartMicroseconds - outcome.edgeMicroseconds);
+		}
+	});
+
+	// Background cameras scan on a fixed period, staggered so they do not all ask at once
+	LatencyHistogram backgroundLatency;
+	LatencyHistogram backgroundQueueingDelay;
+	uint64_t backgroundCats = 0;
+	pool.SetResultHandler(DetectionPriority::Background, [&](const PooledDetection& detection, cv::Mat&, std::vector<cv::Rect>& objects)
+	{
+		if (!objects.empty()) backgroundCats++;
+		backgroundLatency.Add(detection.finishedMicroseconds - detection.requestedMicroseconds);
+		backgroundQueueingDelay.Add(detection.startedMicroseconds - detection.requestedMicroseconds);
+	});
+
+	int64_t duration = static_cast<int64_t>(options.durationSeconds * 1000000);
+	std::function<void(size_t)> backgroundScan = [&](size_t camera)
+	{
+		pool.Request(camera, DetectionPriority::Background, scheduler.Now());
+		if (scheduler.Now() + options.backgroundMicroseconds < duration)
+		{
+			scheduler.Schedule(options.backgroundMicroseconds, [&backgroundScan, camera]() { backgroundScan(camera); });
+		}
+	};
+	size_t backgroundCameras = options.cameras - options.entryCameras;
+	for (size_t i = 0; i < backgroundCameras && options.backgroundMicroseconds > 0; i++)
+	{
+		size_t camera = options.entryCameras + i;
+		scheduler.Schedule(options.backgroundMicroseconds * static_cast<int64_t>(i) / static_cast<int64_t>(backgroundCameras),
+			[&backgroundScan, camera]() { backgroundScan(camera); });
+	}
+
+	size_t outdoorTriggers = 0;
+	for (auto& edge : edges)
+	{
+		(edge.outdoor ? outdoorSensor : indoorSensor).SchedulePulse(edge.microseconds, edge.highMicroseconds);
+		if (edge.outdoor) outdoorTriggers++;
+	}
+
+	// Every trigger opens the door at most once, and a reopening replaces a stop: four commands per trigger is plenty
+	leftServo.Reserve(edges.size() * 4 + 8);
+	rightServo.Reserve(edges.size() * 4 + 8);
+
+	// Play the trace, then let the last detection finish and the door close
+	scheduler.RunUntil(duration);
+	uint64_t steadyStateAllocations = steadyState ? AllocationCounter::TotalAllocations() - steadyStateStart : 0;
+	uint64_t steadyStateDetectorAllocations = steadyState ? detectorAllocations - steadyStateDetectorStart : 0;
+	scheduler.RunAll();
+	int64_t end = std::max(duration, scheduler.Now());
+
+	ServoReport left = CheckServo(leftServo.Commands(), positions.leftOpen, timing.servoTravelMicroseconds, end);
+	ServoReport right = CheckServo(rightServo.Commands(), positions.rightOpen, timing.servoTravelMicroseconds, end);
+	size_t overlaps = left.overlaps + right.overlaps;
+	double minutes = options.durationSeconds > 0 ? options.durationSeconds / 60 : 1;
+	DetectorPoolStats poolStats = pool.Stats();
+	const int entry = static_cast<int>(DetectionPriority::Entry);
+	const int background = static_cast<int>(DetectionPriority::Background);
+	IdlePreviewStats idleStats = {};
+	for (auto& idle : idleCameras)
+	{
+		IdlePreviewStats stats = idle.source->Stats();
+		idleStats.sleeps += stats.sleeps;
+		idleStats.wakes += stats.wakes;
+		idleStats.failedWakes += stats.failedWakes;
+		idleStats.asleepMicroseconds += stats.asleepMicroseconds;
+		idleStats.timedWakes += stats.timedWakes;
+		idleStats.wakeToFrameMicroseconds += stats.wakeToFrameMicroseconds;
+		idleStats.maxWakeToFrameMicroseconds = std::max(idleStats.maxWakeToFrameMicroseconds, stats.maxWakeToFrameMicroseconds);
+	}
+	double cameraMicroseconds = static_cast<double>(end) * std::max<size_t>(idleCameras.size(), 1);
+
+	std::ostringstream json;
+	json << "{\n"
+		<< "  \"simulatedSeconds\": " << end / 1e6 << ",\n"
+		<< "  \"triggers\": {\"indoor\": " << edges.size() - outdoorTriggers << ", \"outdoor\": " << outdoorTriggers << "},\n"
+		<< "  \"edges\": {\"indoor\": " << indoorSensor.RisingEdges() << ", \"outdoor\": " << outdoorSensor.RisingEdges() << "},\n"
+		<< "  \"decisions\": {\"entered\": " << entered << ", \"exited\": " << exited << ", \"blocked\": " << blocked << "},\n"
+		<< "  \"decisionsPerMinute\": " << (entered + exited + blocked) / minutes << ",\n"
+		<< "  \"coalescedOutdoorEdges\": " << poolStats.coalesced[entry] << ",\n"
+		<< "  \"decisionLatency\": " << decisionLatency.ToJson() << ",\n"
+		<< "  \"queueingDelay\": " << queueingDelay.ToJson() << ",\n"
+		<< "  \"pool\": {\"cameras\": " << options.cameras << ", \"entryCameras\": " << options.entryCameras << ", \"workers\": " << options.workers
+		<< ",\n           \"detectionsPerMinute\": {\"entry\": " << poolStats.completed[entry] / minutes << ", \"background\": " << poolStats.completed[background] / minutes << "}"
+		<< ",\n           \"coalesced\": {\"entry\": " << poolStats.coalesced[entry] << ", \"background\": " << poolStats.coalesced[background] << "}"
+		<< ",\n           \"preempted\": " << poolStats.preempted
+		<< ", \"workerUtilization\": " << (end > 0 ? static_cast<double>(poolStats.busyMicroseconds) / (end * static_cast<double>(options.workers)) : 0)
+		<< ",\n           \"backgroundCats\": " << backgroundCats
+		<< ",\n           \"backgroundLatency\": " << backgroundLatency.ToJson()
+		<< ",\n           \"backgroundQueueingDelay\": " << backgroundQueueingDelay.ToJson() << "},\n"
+		<< "  \"idlePreview\": {\"idleMs\": " << options.idleMicroseconds / 1000 << ", \"wakeMs\": " << options.wakeMicroseconds / 1000
+		<< ", \"sleeps\": " << idleStats.sleeps << ", \"wakes\": " << idleStats.wakes << ", \"failedWakes\": " << idleStats.failedWakes
+		<< ",\n                  \"asleepFraction\": " << (end > 0 ? idleStats.asleepMicroseconds / cameraMicroseconds : 0)
+		<< ", \"wakeToFrame\": {\"count\": " << idleStats.timedWakes
+		<< ", \"mean\": " << (idleStats.timedWakes > 0 ? idleStats.wakeToFrameMicroseconds / static_cast<int64_t>(idleStats.timedWakes) : 0)
+		<< ", \"max\": " << idleStats.maxWakeToFrameMicroseconds << "}},\n"
+		<< "  \"servo\": {\"openings\": " << left.openings << ", \"reversals\": " << left.reversals
+		<< ", \"dutyFraction\": " << (end > 0 ? static_cast<double>(left.poweredMicroseconds) / end : 0)
+		<< ", \"openFraction\": " << (end > 0 ? static_cast<double>(left.openMicroseconds) / end : 0)
+		<< ", \"commands\": " << left.commands + right.commands << "},\n"
+		<< "  \"steadyStateAllocations\": {\"total\": " << steadyStateAllocations << ", \"detector\": " << steadyStateDetectorAllocations << "},\n"
+		<< "  \"overlappingServoCommands\": " << overlaps << "\n"
+		<< "}\n";
+
+	if (options.outputPath.empty())
+	{
+		std::cout << json.str();
+	}
+	else
+	{
+		std::ofstream(options.outputPath) << json.str();
+	}
+
+	int result = 0;
+	if (overlaps > 0)
+	{
+		std::cerr << overlaps << " servo commands overlapped another door sequence\n";
+		if (options.failOnOverlap) result = 1;
+	}
+	if (options.checkAllocations)
+	{
+		if (!steadyState)
+		{
+			std::cerr << "No cat was let in, so the steady state was never reached\n";
+			result = 1;
+		}
+		else if (steadyStateAllocations > 0)
+		{
+			std::cerr << steadyStateAllocations << " allocations on the trigger path after warming up, " << steadyStateDetectorAllocations << " of them in the detector\n";
+			result = 1;
+		}
+	}
+	return result;
+}
@@ -0,0 +1,538 @@
+// ParameterTuner: searches the cat scan's parameters (pyramid scale factor,
+// minNeighbors and the face size range) for the fastest settings that still
+// find the cats of a labelled replay set.
+//
+// The replay set is laid out as for ThresholdCalibrator: a cat/ and a nocat/
+// subdirectory of recorded frames. Each candidate setting is run over every
+// frame and scored like the door: a frame counts as a cat if its most
+// confident cat reaches the threshold. Latency is the CPU time per frame of a
+// single-threaded scan, so candidates evaluated side by side on several cores
+// do not slow each other down in the figures.
+//
+// The search starts with the grid of the given values plus the settings of
+// --base-config, then for --refine rounds tries the midpoints between the
+// values of the most promising candidates and their neighbours. Candidates are
+// evaluated in parallel, one detector per worker.
+//
+// Every candidate, with every threshold, is a point of latency, recall and
+// false accept rate; the report lists the points no other point beats on all
+// three (the Pareto front). The recommended point is the fastest on the front
+// with at least --min-recall and at most --max-false-accept. --write-config
+// writes it, over --base-config, as a DoorConfig.txt for the app's LocalState.
+//
+// ParameterTuner <replay dir> --cascade <cascade.xml> [--human-cascade <cascade.xml>]
+//                [--base-config DoorConfig.txt] [--scale-factors 1.05,1.1,1.2,1.3]
+//                [--min-neighbors 2,3,5] [--min-sizes 60,100,140] [--max-sizes 300,0]
+//                [--min-recall 0.95] [--max-false-accept 0.01] [--refine 2] [--threads N]
+//                [--write-config DoorConfig.txt] [--output report.json]
+
+#include "DoorConfig.h"
+#include "HaarCascade.h"
+#include "ReplaySet.h"
+#include "VisionCore.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+using namespace PetDoor;
+
+struct Options
+{
+	std::string replayDirectory;
+	std::string cascadePath;
+	std::string humanCascadePath;
+	std::string baseConfigPath;
+	std::string writeConfigPath;
+	std::string outputPath;
+	std::vector<double> scaleFactors = { 1.05, 1.1, 1.2, 1.3 };
+	std::vector<double> minNeighbors = { 2, 3, 5 };
+	std::vector<double> minSizes = { 60, 100, 140 };
+	std::vector<double> maxSizes = { 300, 0 };
+	double minRecall = 0.95;
+	double maxFalseAccept = 0.01;
+	int refineRounds = 2;
+	int threads = 0;
+};
+
+static void Usage()
+{
+	std::cerr << "usage: ParameterTuner <replay dir> --cascade <cascade.xml> [--human-cascade <cascade.xml>]\n"
+		<< "                      [--base-config DoorConfig.txt] [--scale-factors 1.05,1.1,1.2,1.3]\n"
+		<< "                      [--min-neighbors 2,3,5] [--min-sizes 60,100,140] [--max-sizes 300,0]\n"
+		<< "                      [--min-recall 0.95] [--max-false-accept 0.01] [--refine 2] [--threads N]\n"
+		<< "                      [--write-config DoorConfig.txt] [--output report.json]\n";
+}
+
+static std::vector<double> ParseList(const char* text)
+{
+	std::vector<double> values;
+	std::istringstream list(text);
+	std::string value;
+	while (std::getline(list, value, ',')) values.push_back(atof(value.c_str()));
+	return values;
+}
+
+static bool ParseOptions(int argc, char** argv, Options& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--cascade" && hasValue) options.cascadePath = argv[++i];
+		else if (arg == "--human-cascade" && hasValue) options.humanCascadePath = argv[++i];
+		else if (arg == "--base-config" && hasValue) options.baseConfigPath = argv[++i];
+		else if (arg == "--scale-factors" && hasValue) options.scaleFactors = ParseList(argv[++i]);
+		else if (arg == "--min-neighbors" && hasValue) options.minNeighbors = ParseList(argv[++i]);
+		else if (arg == "--min-sizes" && hasValue) options.minSizes = ParseList(argv[++i]);
+		else if (arg == "--max-sizes" && hasValue) options.maxSizes = ParseList(argv[++i]);
+		else if (arg == "--min-recall" && hasValue) options.minRecall = atof(argv[++i]);
+		else if (arg == "--max-false-accept" && hasValue) options.maxFalseAccept = atof(argv[++i]);
+		else if (arg == "--refine" && hasValue) options.refineRounds = atoi(argv[++i]);
+		else if (arg == "--threads" && hasValue) options.threads = atoi(argv[++i]);
+		else if (arg == "--write-config" && hasValue) options.writeConfigPath = argv[++i];
+		else if (arg == "--output" && hasValue) options.outputPath = argv[++i];
+		else if (arg.compare(0, 2, "--") != 0 && options.replayDirectory.empty()) options.replayDirectory = arg;
+		else return false;
+	}
+	return !options.replayDirectory.empty() && !options.cascadePath.empty();
+}
+
+// One point of the search space
+struct Candidate
+{
+	double scaleFactor;
+	int minNeighbors;
+	int minSize;
+	// 0 is up to the whole frame
+	int maxSize;
+
+	std::tuple<long, int, int, int> Key() const
+	{
+		return std::make_tuple(std::lround(scaleFactor * 10000), minNeighbors, minSize, maxSize);
+	}
+};
+
+struct CandidateResult
+{
+	Candidate candidate;
+	double millisecondsPerFrame = 0;
+	double p95Milliseconds = 0;
+	// Most confident cat per frame; -DBL_MAX where none was found
+	std::vector<double> catScores;
+	std::vector<double> noCatScores;
+	// Only the thresholds where recall or false accept rate change, lowest first
+	std::vector<CurvePoint> curve;
+};
+
+// A candidate at one threshold
+struct FrontPoint
+{
+	size_t result;
+	CurvePoint point;
+	double millisecondsPerFrame;
+};
+
+// The candidate's settings over the base configuration; false if the app would reject them
+static bool MakeConfig(const DoorConfig& base, const Candidate& candidate, double threshold, DoorConfig& config)
+{
+	config = base;
+	config.detection.scaleFactor = candidate.scaleFactor;
+	config.detection.cat.minNeighbors = candidate.minNeighbors;
+	config.detection.cat.minSize = cv::Size(candidate.minSize, candidate.minSize);
+	config.detection.cat.maxSize = cv::Size(candidate.maxSize, candidate.maxSize);
+	config.detection.minConfidence = threshold;
+
+	// Checked by the same parser the app loads the file with
+	DoorConfig parsed;
+	std::string error;
+	return ParseDoorConfig(FormatDoorConfig(config), parsed, error);
+}
+
+// Evaluates the candidates on as many workers as there are stripes, each with its own detector.
+// Workers take the next candidate as they finish, so slow settings do not hold up the rest.
+class EvaluateCandidates : public cv::ParallelLoopBody
+{
+public:
+	EvaluateCandidates(const HaarCascade& cascade, const Options& options, const std::vector<cv::Mat>& catFrames, const std::vector<cv::Mat>& noCatFrames,
+		std::vector<CandidateResult>& results, std::atomic<size_t>& next, std::atomic<bool>& failed)
+		: _cascade(cascade), _options(options), _catFrames(catFrames), _noCatFrames(noCatFrames), _results(results), _next(next), _failed(failed)
+	{
+	}
+
+	void operator()(const cv::Range& range) const override
+	{
+		for (int worker = range.start; worker < range.end; worker++)
+		{
+			CatFaceDetector detector;
+			if (!detector.Load(_cascade, _options.humanCascadePath))
+			{
+				_failed = true;
+				return;
+			}
+			detector.SetParallel(false);
+
+			cv::Mat work;
+			std::vector<cv::Rect> cats;
+			std::vector<double> milliseconds;
+			for (size_t index = _next++; index < _results.size(); index = _next++)
+			{
+				CandidateResult& result = _results[index];
+				const Candidate& candidate = result.candidate;
+				DetectionSettings settings = detector.Settings();
+				settings.scaleFactor = candidate.scaleFactor;
+				settings.cat.minNeighbors = candidate.minNeighbors;
+				settings.cat.minSize = cv::Size(candidate.minSize, candidate.minSize);
+				settings.cat.maxSize = cv::Size(candidate.maxSize, candidate.maxSize);
+				if (!detector.Configure(settings))
+				{
+					_failed = true;
+					return;
+				}
+
+				// One frame to size the pyramid, not timed
+				double seconds;
+				ScoreFrame(detector, work, _catFrames[0], cats, ThreadSeconds, seconds);
+
+				milliseconds.clear();
+				for (auto& frame : _catFrames)
+				{
+					result.catScores.push_back(ScoreFrame(detector, work, frame, cats, ThreadSeconds, seconds));
+					milliseconds.push_back(seconds * 1000);
+				}
+				for (auto& frame : _noCatFrames)
+				{
+					result.noCatScores.push_back(ScoreFrame(detector, work, frame, cats, ThreadSeconds, seconds));
+					milliseconds.push_back(seconds * 1000);
+				}
+				double total = 0;
+				for (double frameMilliseconds : milliseconds) total += frameMilliseconds;
+				result.millisecondsPerFrame = total / milliseconds.size();
+				std::sort(milliseconds.begin(), milliseconds.end());
+				result.p95Milliseconds = milliseconds[std::min(milliseconds.size() - 1, milliseconds.size() * 95 / 100)];
+				result.curve = BuildCurve(result.catScores, result.noCatScores);
+
+				std::lock_guard<std::mutex> lock(_reportLock);
+				std::cerr << "scale " << candidate.scaleFactor << ", neighbors " << candidate.minNeighbors << ", size " << candidate.minSize << "-" << candidate.maxSize
+					<< ": " << result.millisecondsPerFrame << " ms per frame, recall " << result.curve.front().recall
+					<< " at false accept rate " << result.curve.front().falseAcceptRate << " without a threshold\n";
+			}
+		}
+	}
+
+private:
+	const HaarCascade& _cascade;
+	const Options& _options;
+	const std::vector<cv::Mat>& _catFrames;
+	const std::vector<cv::Mat>& _noCatFrames;
+	std::vector<CandidateResult>& _results;
+	std::atomic<size_t>& _next;
+	std::atomic<bool>& _failed;
+	static std::mutex _reportLock;
+};
+
+std::mutex EvaluateCandidates::_reportLock;
+
+static bool Dominates(const FrontPoint& a, const FrontPoint& b)
+{
+	bool noWorse = a.millisecondsPerFrame <= b.millisecondsPerFrame && a.point.recall >= b.point.recall && a.point.falseAcceptRate <= b.point.falseAcceptRate;
+	bool better = a.millisecondsPerFrame < b.millisecondsPerFrame || a.point.recall > b.point.recall || a.point.falseAcceptRate < b.point.falseAcceptRate;
+	return noWorse && better;
+}
+
+// The points of every candidate's curve that no other point beats, fastest first
+static std::vector<FrontPoint> ParetoFront(const std::vector<CandidateResult>& results)
+{
+	std::vector<FrontPoint> points;
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		for (auto& point : results[i].curve) points.push_back({ i, point, results[i].millisecondsPerFrame });
+	}
+	// Sorted so that no point can be dominated by one after it
+	std::sort(points.begin(), points.end(), [](const FrontPoint& a, const FrontPoint& b)
+	{
+		if (a.millisecondsPerFrame != b.millisecondsPerFrame) return a.millisecondsPerFrame < b.millisecondsPerFrame;
+		if (a.point.recall != b.point.recall) return a.point.recall > b.point.recall;
+		return a.point.falseAcceptRate < b.point.falseAcceptRate;
+	});
+
+	std::vector<FrontPoint> front;
+	for (auto& point : points)
+	{
+		bool dominated = std::any_of(front.begin(), front.end(), [&point](const FrontPoint& member)
+		{
+			return Dominates(member, point) || (member.point.recall == point.point.recall && member.point.falseAcceptRate == point.point.falseAcceptRate);
+		});
+		if (!dominated) front.push_back(point);
+	}
+	return front;
+}
+
+static bool MeetsTarget(const FrontPoint& point, const Options& options)
+{
+	return point.point.recall >= options.minRecall && point.point.falseAcceptRate <= options.maxFalseAccept;
+}
+
+// Midpoints between each promising candidate's value and the next values tried on either side,
+// one setting at a time
+static std::vector<Candidate> Refine(const std::vector<CandidateResult>& results, const std::vector<FrontPoint>& front, const Options& options)
+{
+	std::set<size_t> promising;
+	for (auto& point : front)
+	{
+		if (MeetsTarget(point, options)) promising.insert(point.result);
+	}
+	if (promising.empty())
+	{
+		for (auto& point : front) promising.insert(point.result);
+	}
+
+	std::set<double> tried[4];
+	for (auto& result : results)
+	{
+		const Candidate& candidate = result.candidate;
+		tried[0].insert(candidate.scaleFactor);
+		tried[1].insert(candidate.minNeighbors);
+		tried[2].insert(candidate.minSize);
+		tried[3].insert(candidate.maxSize);
+	}
+
+	std::vector<Candidate> refined;
+	for (size_t index : promising)
+	{
+		const Candidate& candidate = results[index].candidate;
+		double values[4] = { candidate.scaleFactor, double(candidate.minNeighbors), double(candidate.minSize), double(candidate.maxSize) };
+		for (int dimension = 0; dimension < 4; dimension++)
+		{
+			// Up to the whole frame is not a size to take midpoints with
+			if (dimension == 3 && candidate.maxSize == 0) continue;
+
+			auto at = tried[dimension].find(values[dimension]);
+			std::vector<double> neighbours;
+			if (at != tried[dimension].begin()) neighbours.push_back(*std::prev(at));
+			if (std::next(at) != tried[dimension].end()) neighbours.push_back(*std::next(at));
+			for (double neighbour : neighbours)
+			{
+				if (dimension == 3 && neighbour == 0) continue;
+				double middle = (values[dimension] + neighbour) / 2;
+				if (dimension > 0) middle = std::round(middle);
+				if (middle == values[dimension] || middle == neighbour) continue;
+
+				Candidate next = candidate;
+				if (dimension == 0) next.scaleFactor = std::round(middle * 1000) / 1000;
+				if (dimension == 1) next.minNeighbors = int(middle);
+				if (dimension == 2) next.minSize = int(middle);
+				if (dimension == 3) next.maxSize = int(middle);
+				refined.push_back(next);
+			}
+		}
+	}
+	return refined;
+}
+
+static std::string CandidateJson(const Candidate& candidate)
+{
+	std::ostringstream json;
+	json << "\"scaleFactor\": " << candidate.scaleFactor << ", \"minNeighbors\": " << candidate.minNeighbors
+		<< ", \"minSize\": " << candidate.minSize << ", \"maxSize\": " << candidate.maxSize;
+	return json.str();
+}
+
+static std::string FrontPointJson(const std::vector<CandidateResult>& results, const FrontPoint& point)
+{
+	std::ostringstream json;
+	json.precision(9);
+	json << "{" << CandidateJson(results[point.result].candidate) << ", \"threshold\": " << ThresholdJson(point.point.threshold)
+		<< ", \"millisecondsPerFrame\": " << point.millisecondsPerFrame << ", \"recall\": " << point.point.recall
+		<< ", \"falseAcceptRate\": " << point.point.falseAcceptRate << "}";
+	return json.str();
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	if (!ParseOptions(argc, argv, options))
+	{
+		Usage();
+		return 2;
+	}
+
+	HaarCascade cascade;
+	if (!cascade.Load(options.cascadePath))
+	{
+		std::cerr << "Couldn't load cascade '" << options.cascadePath << "'\n";
+		return 2;
+	}
+
+	DoorConfig base;
+	if (!options.baseConfigPath.empty())
+	{
+		std::ifstream file(options.baseConfigPath);
+		std::stringstream text;
+		text << file.rdbuf();
+		std::string error;
+		if (!file || !ParseDoorConfig(text.str(), base, error))
+		{
+			std::cerr << "Couldn't read '" << options.baseConfigPath << "': " << error << "\n";
+			return 2;
+		}
+	}
+
+	std::vector<cv::Mat> catFrames = LoadFrames(options.replayDirectory + "/cat");
+	std::vector<cv::Mat> noCatFrames = LoadFrames(options.replayDirectory + "/nocat");
+	if (catFrames.empty() || noCatFrames.empty())
+	{
+		std::cerr << "Need frames in both '" << options.replayDirectory << "/cat' and '" << options.replayDirectory << "/nocat'\n";
+		return 2;
+	}
+
+	// The settings the door runs with now, then the grid
+	const DetectionSettings& current = base.detection;
+	Candidate baseline = { current.scaleFactor, current.cat.minNeighbors, current.cat.minSize.width, current.cat.maxSize.width };
+	std::vector<Candidate> pending = { baseline };
+	for (double scaleFactor : options.scaleFactors)
+		for (double minNeighbors : options.minNeighbors)
+			for (double minSize : options.minSizes)
+				for (double maxSize : options.maxSizes)
+					pending.push_back({ scaleFactor, int(minNeighbors), int(minSize), int(maxSize) });
+
+	int workers = options.threads > 0 ? options.threads : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+	cv::setNumThreads(workers);
+
+	std::vector<CandidateResult> results;
+	std::vector<FrontPoint> front;
+	std::set<std::tuple<long, int, int, int>> seen;
+	auto start = std::chrono::steady_clock::now();
+	for (int round = 0; round <= options.refineRounds && !pending.empty(); round++)
+	{
+		size_t first = results.size();
+		for (auto& candidate : pending)
+		{
+			DoorConfig config;
+			if (!seen.insert(candidate.Key()).second) continue;
+			if (!MakeConfig(base, candidate, -DBL_MAX, config))
+			{
+				std::cerr << "Skipping scale " << candidate.scaleFactor << ", neighbors " << candidate.minNeighbors << ", size "
+					<< candidate.minSize << "-" << candidate.maxSize << "; DoorConfig.txt does not allow it\n";
+				continue;
+			}
+			CandidateResult result;
+			result.candidate = candidate;
+			results.push_back(result);
+		}
+		if (results.size() == first) break;
+
+		std::cerr << "Round " << round << ": " << results.size() - first << " candidates on " << workers << " workers\n";
+		std::atomic<size_t> next(first);
+		std::atomic<bool> failed(false);
+		cv::parallel_for_(cv::Range(0, workers), EvaluateCandidates(cascade, options, catFrames, noCatFrames, results, next, failed), workers);
+		if (failed)
+		{
+			std::cerr << "Couldn't set up the cascades\n";
+			return 2;
+		}
+
+		front = ParetoFront(results);
+		pending = Refine(results, front, options);
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	const FrontPoint* recommended = nullptr;
+	for (auto& point : front)
+	{
+		if (MeetsTarget(point, options))
+		{
+			recommended = &point;
+			break;
+		}
+	}
+
+	// The baseline at the threshold it runs with, for comparison
+	const CandidateResult& baselineResult = results[0];
+	CurvePoint baselinePoint = baselineResult.curve.front();
+	for (auto& point : baselineResult.curve)
+	{
+		if (point.threshold <= current.minConfidence) baselinePoint = point;
+	}
+	std::cerr << "Current settings: " << baselineResult.millisecondsPerFrame << " ms per frame, recall " << baselinePoint.recall
+		<< " at false accept rate " << baselinePoint.falseAcceptRate << "\n";
+	std::cerr << results.size() << " candidates in " << seconds << " s, " << front.size() << " on the Pareto front\n";
+
+	int exitCode = 0;
+	if (recommended)
+	{
+		const Candidate& candidate = results[recommended->result].candidate;
+		std::cerr << "Recommended: scale " << candidate.scaleFactor << ", neighbors " << candidate.minNeighbors << ", size " << candidate.minSize << "-" << candidate.maxSize
+			<< ", threshold " << ThresholdJson(recommended->point.threshold) << ": " << recommended->millisecondsPerFrame << " ms per frame, recall "
+			<< recommended->point.recall << " at false accept rate " << recommended->point.falseAcceptRate << "\n";
+
+		if (!options.writeConfigPath.empty())
+		{
+			DoorConfig config;
+			MakeConfig(base, candidate, recommended->point.threshold, config);
+			std::ofstream file(options.writeConfigPath);
+			file << "# Written by ParameterTuner from " << catFrames.size() << " cat and " << noCatFrames.size() << " no-cat frames\n"
+				<< FormatDoorConfig(config);
+			if (!file)
+			{
+				std::cerr << "Couldn't write '" << options.writeConfigPath << "'\n";
+				return 2;
+			}
+		}
+	}
+	else
+	{
+		std::cerr << "No candidate reaches recall " << options.minRecall << " at false accept rate " << options.maxFalseAccept << "\n";
+		exitCode = 1;
+	}
+
+	std::ostringstream json;
+	json.precision(9);
+	json << "{\n"
+		<< "  \"catFrames\": " << catFrames.size() << ",\n"
+		<< "  \"noCatFrames\": " << noCatFrames.size() << ",\n"
+		<< "  \"minRecall\": " << options.minRecall << ",\n"
+		<< "  \"maxFalseAccept\": " << options.maxFalseAccept << ",\n"
+		<< "  \"workers\": " << workers << ",\n"
+		<< "  \"seconds\": " << seconds << ",\n"
+		<< "  \"current\": {" << CandidateJson(baseline) << ", \"threshold\": " << ThresholdJson(current.minConfidence)
+		<< ", \"millisecondsPerFrame\": " << baselineResult.millisecondsPerFrame << ", \"recall\": " << baselinePoint.recall
+		<< ", \"falseAcceptRate\": " << baselinePoint.falseAcceptRate << "},\n"
+		<< "  \"recommended\": " << (recommended ? FrontPointJson(results, *recommended) : "null") << ",\n"
+		<< "  \"front\": [";
+	for (size_t i = 0; i < front.size(); i++)
+	{
+		json << (i ? "," : "") << "\n    " << FrontPointJson(results, front[i]);
+	}
+	json << "\n  ],\n  \"candidates\": [";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const CandidateResult& result = results[i];
+		json << (i ? "," : "") << "\n    {" << CandidateJson(result.candidate)
+			<< ", \"millisecondsPerFrame\": " << result.millisecondsPerFrame << ", \"p95Milliseconds\": " << result.p95Milliseconds
+			<< ", \"recall\": " << result.curve.front().recall << ", \"falseAcceptRate\": " << result.curve.front().falseAcceptRate << "}";
+	}
+	json << "\n  ]\n}\n";
+
+	if (options.outputPath.empty())
+	{
+		std::cout << json.str();
+	}
+	else
+	{
+		std::ofstream(options.outputPath) << json.str();
+	}
+	return exitCode;
+}
@@ -0,0 +1,623 @@
+// StreamBench: serves MjpegStreamer over HTTP on a loopback port to viewers in
+// the same process, and measures what streaming costs as viewers are added.
+//
+// For each viewer count, frames (from a directory of recorded frames, or
+// synthetic ones) are published with a detection at --fps for --seconds, the
+// streamer drawing it over the copy it encodes, while the viewers read the
+// stream and check every part is a whole JPEG. --slow of the viewers sleep
+// --slow-ms after each frame, to show that they skip frames instead of holding
+// up the others. Socket buffers are kept small, as on the
+// device, so a slow viewer is felt within a frame or two.
+//
+// CPU is measured per thread: the encoder and the senders are the streaming
+// cost, the viewers' own reading is reported apart. The run fails (exit code
+// 1) if any part is not a whole JPEG, or if a fast viewer gets fewer than
+// --min-fast-share of the frames encoded.
+//
+// StreamBench [<frames dir>] [--clients 1,2,4,8,16] [--slow N] [--slow-ms 250]
+//             [--fps 10] [--seconds 5] [--socket-buffer 65536] [--min-fast-share 0.9]
+//             [--output results.json]
+
+#include "Instrumentation.h"
+#include "MjpegStreamer.h"
+#include "ReplaySet.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/imgcodecs/imgcodecs.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace PetDoor;
+
+struct Options
+{
+	std::string framesDirectory;
+	std::string outputPath;
+	std::vector<int> clientCounts;
+	int slow = 1;
+	int slowMilliseconds = 250;
+	double fps = 10;
+	double seconds = 5;
+	int socketBuffer = 65536;
+	double minFastShare = 0.9;
+};
+
+static void Usage()
+{
+	std::cerr << "usage: StreamBench [<frames dir>] [--clients 1,2,4,8,16] [--slow N] [--slow-ms 250]\n"
+		<< "                   [--fps 10] [--seconds 5] [--socket-buffer 65536] [--min-fast-share 0.9]\n"
+		<< "                   [--output results.json]\n";
+}
+
+static bool ParseOptions(int argc, char** argv, Options& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--clients" && hasValue)
+		{
+			std::istringstream list(argv[++i]);
+			std::string count;
+			while (std::getline(list, count, ',')) options.clientCounts.push_back(atoi(count.c_str()));
+		}
+		else if (arg == "--slow" && hasValue) options.slow = atoi(argv[++i]);
+		else if (arg == "--slow-ms" && hasValue) options.slowMilliseconds = atoi(argv[++i]);
+		else if (arg == "--fps" && hasValue) options.fps = atof(argv[++i]);
+		else if (arg == "--seconds" && hasValue) options.seconds = atof(argv[++i]);
+		else if (arg == "--socket-buffer" && hasValue) options.socketBuffer = atoi(argv[++i]);
+		else if (arg == "--min-fast-share" && hasValue) options.minFastShare = atof(argv[++i]);
+		else if (arg == "--output" && hasValue) options.outputPath = argv[++i];
+		else if (arg.compare(0, 2, "--") != 0 && options.framesDirectory.empty()) options.framesDirectory = arg;
+		else return false;
+	}
+	if (options.clientCounts.empty()) options.clientCounts = { 1, 2, 4, 8, 16 };
+	return options.fps > 0 && options.seconds > 0;
+}
+
+static int64_t CpuMicroseconds(clockid_t clock)
+{
+	timespec now;
+	clock_gettime(clock, &now);
+	return static_cast<int64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+// CPU time of the threads that do the streaming, and of the viewers reading it
+static std::atomic<int64_t> g_serverCpuMicroseconds(0);
+static std::atomic<int64_t> g_viewerCpuMicroseconds(0);
+// Sender threads still running; each adds its CPU time when it ends
+static std::atomic<int> g_liveSenders(0);
+
+// Runs work on a few threads in real time
+class ThreadScheduler : public IScheduler
+{
+public:
+	explicit ThreadScheduler(int threads) : _stopping(false)
+	{
+		for (int i = 0; i < threads; i++) _threads.emplace_back([this]() { Run(); });
+	}
+
+	~ThreadScheduler()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			_stopping = true;
+		}
+		_wake.notify_all();
+		for (auto& thread : _threads) thread.join();
+	}
+
+	int64_t Now() override { return Instrumentation::Now(); }
+
+	void Schedule(int64_t delayMicroseconds, Work work) override
+	{
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			_work.emplace(Now() + std::max<int64_t>(delayMicroseconds, 0), work);
+		}
+		_wake.notify_one();
+	}
+
+	// The CPU the scheduler's threads have used so far
+	int64_t CpuUsed() { return _cpuMicroseconds; }
+
+private:
+	void Run()
+	{
+		std::unique_lock<std::mutex> lock(_lock);
+		int64_t cpuStart = CpuMicroseconds(CLOCK_THREAD_CPUTIME_ID);
+		while (!_stopping)
+		{
+			if (_work.empty())
+			{
+				_wake.wait(lock);
+				continue;
+			}
+			int64_t due = _work.begin()->first;
+			if (due > Now())
+			{
+				_wake.wait_for(lock, std::chrono::microseconds(due - Now()));
+				continue;
+			}
+			Work work = _work.begin()->second;
+			_work.erase(_work.begin());
+			lock.unlock();
+			work();
+			int64_t cpu = CpuMicroseconds(CLOCK_THREAD_CPUTIME_ID);
+			_cpuMicroseconds += cpu - cpuStart;
+			cpuStart = cpu;
+			lock.lock();
+		}
+	}
+
+	std::mutex _lock;
+	std::condition_variable _wake;
+	std::multimap<int64_t, Work> _work;
+	std::vector<std::thread> _threads;
+	std::atomic<int64_t> _cpuMicroseconds{ 0 };
+	bool _stopping;
+};
+
+// A connection the streamer sends down, with a thread doing the blocking sends
+class SocketClient : public IStreamClient
+{
+public:
+	explicit SocketClient(int socket) : _connection(std::make_shared<Connection>())
+	{
+		_connection->socket = socket;
+		g_liveSenders++;
+		std::thread(Send, _connection).detach();
+	}
+
+	~SocketClient() { Close(); }
+
+	void SendAsync(std::shared_ptr<const std::vector<unsigned char>> bytes, SendHandler handler) override
+	{
+		{
+			std::lock_guard<std::mutex> lock(_connection->lock);
+			_connection->bytes = bytes;
+			_connection->handler = handler;
+		}
+		_connection->wake.notify_one();
+	}
+
+	void Close() override
+	{
+		{
+			std::lock_guard<std::mutex> lock(_connection->lock);
+			if (_connection->closed) return;
+			_connection->closed = true;
+		}
+		shutdown(_connection->socket, SHUT_RDWR);
+		_connection->wake.notify_one();
+	}
+
+private:
+	struct Connection
+	{
+		int socket = -1;
+		std::mutex lock;
+		std::condition_variable wake;
+		std::shared_ptr<const std::vector<unsigned char>> bytes;
+		SendHandler handler;
+		bool closed = false;
+	};
+
+	// The thread holds the connection, as the client may go away in the handler it calls
+	static void Send(std::shared_ptr<Connection> connection)
+	{
+		for (;;)
+		{
+			std::shared_ptr<const std::vector<unsigned char>> bytes;
+			SendHandler handler;
+			{
+				std::unique_lock<std::mutex> lock(connection->lock);
+				connection->wake.wait(lock, [&connection]() { return connection->bytes || connection->closed; });
+				if (!connection->bytes) break;
+				bytes.swap(connection->bytes);
+				handler.swap(connection->handler);
+			}
+
+			bool sent = true;
+			for (size_t offset = 0; offset < bytes->size() && sent;)
+			{
+				ssize_t written = send(connection->socket, bytes->data() + offset, bytes->size() - offset, MSG_NOSIGNAL);
+				sent = written > 0;
+				if (sent) offset += written;
+			}
+			handler(sent);
+		}
+
+		close(connection->socket);
+		g_serverCpuMicroseconds += CpuMicroseconds(CLOCK_THREAD_CPUTIME_ID);
+		g_liveSenders--;
+	}
+
+	std::shared_ptr<Connection> _connection;
+};
+
+// Accepts viewers on a loopback port and hands them to the streamer once their request is in
+class LoopbackServer
+{
+public:
+	LoopbackServer(MjpegStreamer& streamer, int socketBuffer) : _streamer(streamer), _socketBuffer(socketBuffer), _listener(-1), _port(0)
+	{
+		_listener = socket(AF_INET, SOCK_STREAM, 0);
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t length = sizeof(address);
+		if (bind(_listener, reinterpret_cast<sockaddr*>(&address), length) != 0 || listen(_listener, 64) != 0
+			|| getsockname(_listener, reinterpret_cast<sockaddr*>(&address), &length) != 0)
+		{
+			return;
+		}
+		_port = ntohs(address.sin_port);
+		_acceptor = std::thread([this]() { Accept(); });
+	}
+
+	~LoopbackServer()
+	{
+		shutdown(_listener, SHUT_RDWR);
+		if (_acceptor.joinable()) _acceptor.join();
+		close(_listener);
+	}
+
+	unsigned short Port() const { return _port; }
+
+private:
+	void Accept()
+	{
+		int64_t cpuStart = CpuMicroseconds(CLOCK_THREAD_CPUTIME_ID);
+		for (;;)
+		{
+			int connection = accept(_listener, nullptr, nullptr);
+			if (connection < 0) break;
+			setsockopt(connection, SOL_SOCKET, SO_SNDBUF, &_socketBuffer, sizeof(_socketBuffer));
+
+			std::string request;
+			char buffer[512];
+			while (request.find("\r\n\r\n") == std::string::npos && request.size() < 4096)
+			{
+				ssize_t received = recv(connection, buffer, sizeof(buffer), 0);
+				if (received <= 0) break;
+				request.append(buffer, received);
+			}
+			if (!IsStreamRequest(request))
+			{
+				close(connection);
+				continue;
+			}
+			_streamer.AddClient(std::make_shared<SocketClient>(connection));
+		}
+		g_serverCpuMicroseconds += CpuMicroseconds(CLOCK_THREAD_CPUTIME_ID) - cpuStart;
+	}
+
+	MjpegStreamer& _streamer;
+	int _socketBuffer;
+	int _listener;
+	unsigned short _port;
+	std::thread _acceptor;
+};
+
+struct ViewerResult
+{
+	bool slow = false;
+	bool connected = false;
+	uint64_t frames = 0;
+	uint64_t invalidFrames = 0;
+	uint64_t bytes = 0;
+};
+
+// Reads the stream as a browser would, checking each part is a whole JPEG
+class Viewer
+{
+public:
+	Viewer(unsigned short port, int socketBuffer, int slowMilliseconds, ViewerResult& result)
+		: _socket(-1), _slowMilliseconds(slowMilliseconds), _result(result)
+	{
+		_socket = socket(AF_INET, SOCK_STREAM, 0);
+		setsockopt(_socket, SOL_SOCKET, SO_RCVBUF, &socketBuffer, sizeof(socketBuffer));
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		address.sin_port = htons(port);
+		const char request[] = "GET / HTTP/1.0\r\n\r\n";
+		_result.connected = connect(_socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0
+			&& send(_socket, request, sizeof(request) - 1, MSG_NOSIGNAL) == sizeof(request) - 1;
+	}
+
+	~Viewer() { close(_socket); }
+
+	void Run()
+	{
+		int64_t cpuStart = CpuMicroseconds(CLOCK_THREAD_CPUTIME_ID);
+		std::string line;
+		bool streaming = false;
+		while (ReadLine(line) && !line.empty())
+		{
+			if (line.find("multipart/x-mixed-replace; boundary=" STREAM_BOUNDARY) != std::string::npos) streaming = true;
+		}
+
+		while (streaming && ReadLine(line))
+		{
+			if (line.empty()) continue;
+			if (line != "--" STREAM_BOUNDARY) break;
+
+			size_t length = 0;
+			while (ReadLine(line) && !line.empty())
+			{
+				if (line.compare(0, 16, "Content-Length: ") == 0) length = strtoul(line.c_str() + 16, nullptr, 10);
+			}
+			std::vector<unsigned char> jpeg;
+			if (!Read(jpeg, length)) break;
+
+			bool whole = length > 4 && jpeg[0] == 0xff && jpeg[1] == 0xd8 && jpeg[length - 2] == 0xff && jpeg[length - 1] == 0xd9;
+			(whole ? _result.frames : _result.invalidFrames)++;
+			_result.bytes += length;
+			if (_slowMilliseconds > 0) std::this_thread::sleep_for(std::chrono::milliseconds(_slowMilliseconds));
+		}
+		g_viewerCpuMicroseconds += CpuMicroseconds(CLOCK_THREAD_CPUTIME_ID) - cpuStart;
+	}
+
+private:
+	bool Fill()
+	{
+		char buffer[16384];
+		ssize_t received = recv(_socket, buffer, sizeof(buffer), 0);
+		if (received <= 0) return false;
+		_buffered.append(buffer, received);
+		return true;
+	}
+
+	bool ReadLine(std::string& line)
+	{
+		size_t end;
+		while ((end = _buffered.find("\r\n")) == std::string::npos)
+		{
+			if (!Fill()) return false;
+		}
+		line.assign(_buffered, 0, end);
+		_buffered.erase(0, end + 2);
+		return true;
+	}
+
+	bool Read(std::vector<unsigned char>& bytes, size_t length)
+	{
+		while (_buffered.size() < length)
+		{
+			if (!Fill()) return false;
+		}
+		bytes.assign(_buffered.begin(), _buffered.begin() + length);
+		_buffered.erase(0, length);
+		return true;
+	}
+
+	int _socket;
+	int _slowMilliseconds;
+	ViewerResult& _result;
+	std::string _buffered;
+};
+
+// A textured 640x480 scene, so frames compress about as well as camera frames
+static std::vector<cv::Mat> SyntheticFrames()
+{
+	cv::Mat noise(480, 640, CV_8UC3);
+	cv::randu(noise, cv::Scalar::all(0), cv::Scalar::all(255));
+	cv::GaussianBlur(noise, noise, cv::Size(0, 0), 3);
+
+	std::vector<cv::Mat> frames;
+	for (int i = 0; i < 16; i++)
+	{
+		cv::Mat bgr = noise.clone();
+		cv::circle(bgr, cv::Point(100 + 25 * i, 240), 60, cv::Scalar(40, 90, 160), -1);
+		cv::Mat rgba;
+		cv::cvtColor(bgr, rgba, cv::COLOR_BGR2RGBA);
+		frames.push_back(rgba);
+	}
+	return frames;
+}
+
+struct RunResult
+{
+	int clients = 0;
+	double seconds = 0;
+	MjpegStreamStats stream = {};
+	double serverCpuPercent = 0;
+	// Time the encoder spent on frames, CPU or not
+	double encodeBusyPercent = 0;
+	double viewerCpuPercent = 0;
+	std::vector<ViewerResult> viewers;
+	double minFastShare = 1;
+	double slowFramesPerSecond = 0;
+};
+
+static bool RunClients(const Options& options, const std::vector<cv::Mat>& frames, int clients, RunResult& result)
+{
+	result.clients = clients;
+	result.viewers.resize(clients);
+	ThreadScheduler scheduler(2);
+	MjpegStreamOptions streamOptions;
+	streamOptions.maxClients = clients;
+	MjpegStreamer streamer(scheduler, streamOptions);
+	g_serverCpuMicroseconds = 0;
+	g_viewerCpuMicroseconds = 0;
+
+	std::vector<std::thread> viewerThreads;
+	{
+		LoopbackServer server(streamer, options.socketBuffer);
+		if (server.Port() == 0) return false;
+
+		std::vector<std::unique_ptr<Viewer>> viewers;
+		for (int i = 0; i < clients; i++)
+		{
+			ViewerResult& viewer = result.viewers[i];
+			viewer.slow = i < options.slow;
+			viewers.emplace_back(new Viewer(server.Port(), options.socketBuffer, viewer.slow ? options.slowMilliseconds : 0, viewer));
+			if (!viewer.connected) return false;
+		}
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+		while (streamer.Stats().clients < static_cast<size_t>(clients) && std::chrono::steady_clock::now() < deadline)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		for (auto& viewer : viewers)
+		{
+			Viewer* reader = viewer.release();
+			viewerThreads.emplace_back([reader]() { reader->Run(); delete reader; });
+		}
+
+		// Publish as the door does headless: the detections go along and are drawn over the encoded copy
+		std::vector<cv::Rect> objects = { cv::Rect(60, 60, 120, 120) };
+		int64_t publisherCpu = CpuMicroseconds(CLOCK_THREAD_CPUTIME_ID);
+		auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1 / options.fps));
+		auto start = std::chrono::steady_clock::now();
+		auto next = start;
+		for (size_t i = 0; std::chrono::steady_clock::now() - start < std::chrono::duration<double>(options.seconds); i++)
+		{
+			streamer.Publish(frames[i % frames.size()], objects);
+			next += interval;
+			std::this_thread::sleep_until(next);
+		}
+		// Let the last frame reach the fast viewers
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		g_serverCpuMicroseconds += CpuMicroseconds(CLOCK_THREAD_CPUTIME_ID) - publisherCpu;
+		// The encoder must be done before the streamer goes
+		for (;;)
+		{
+			result.stream = streamer.Stats();
+			if (result.stream.framesEncoded + result.stream.framesDropped == result.stream.framesPublished) break;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+
+	streamer.CloseAll();
+	for (auto& thread : viewerThreads) thread.join();
+	while (g_liveSenders > 0) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	int64_t wallMicroseconds = static_cast<int64_t>(result.seconds * 1000000);
+	result.serverCpuPercent = 100.0 * (g_serverCpuMicroseconds + scheduler.CpuUsed()) / wallMicroseconds;
+	result.encodeBusyPercent = 100.0 * result.stream.encodeMicroseconds / wallMicroseconds;
+	result.viewerCpuPercent = 100.0 * g_viewerCpuMicroseconds / wallMicroseconds;
+
+	int slow = 0;
+	for (auto& viewer : result.viewers)
+	{
+		if (viewer.slow)
+		{
+			result.slowFramesPerSecond += viewer.frames / result.seconds;
+			slow++;
+		}
+		else if (result.stream.framesEncoded > 0)
+		{
+			result.minFastShare = std::min(result.minFastShare, static_cast<double>(viewer.frames) / result.stream.framesEncoded);
+		}
+	}
+	if (slow > 0) result.slowFramesPerSecond /= slow;
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	if (!ParseOptions(argc, argv, options))
+	{
+		Usage();
+		return 2;
+	}
+
+	std::vector<cv::Mat> frames = options.framesDirectory.empty() ? SyntheticFrames() : LoadFrames(options.framesDirectory);
+	if (frames.empty())
+	{
+		std::cerr << "No frames in '" << options.framesDirectory << "'\n";
+		return 2;
+	}
+
+	bool failed = false;
+	std::vector<RunResult> results;
+	for (int clients : options.clientCounts)
+	{
+		if (clients < 1) continue;
+
+		RunResult result;
+		if (!RunClients(options, frames, clients, result))
+		{
+			std::cerr << "Couldn't serve " << clients << " viewers on a loopback port\n";
+			return 2;
+		}
+		uint64_t invalid = 0;
+		for (auto& viewer : result.viewers) invalid += viewer.invalidFrames;
+		bool hasFast = clients > options.slow;
+		std::cerr << clients << " viewers: " << result.serverCpuPercent << "% CPU streaming (encoder busy " << result.encodeBusyPercent << "%), "
+			<< result.stream.framesEncoded << " frames encoded, " << result.stream.framesSkipped << " skipped by slow viewers";
+		if (hasFast) std::cerr << ", fast viewers got at least " << 100 * result.minFastShare << "%";
+		std::cerr << "\n";
+
+		if (invalid > 0)
+		{
+			std::cerr << "  " << invalid << " parts were not whole JPEGs\n";
+			failed = true;
+		}
+		if (hasFast && result.minFastShare < options.minFastShare)
+		{
+			std::cerr << "  a fast viewer fell behind\n";
+			failed = true;
+		}
+		results.push_back(result);
+	}
+
+	std::ostringstream json;
+	json << "{\n"
+		<< "  \"fps\": " << options.fps << ",\n"
+		<< "  \"slowViewers\": " << options.slow << ",\n"
+		<< "  \"slowMilliseconds\": " << options.slowMilliseconds << ",\n"
+		<< "  \"runs\": [";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const RunResult& result = results[i];
+		json << (i ? "," : "") << "\n    {\"clients\": " << result.clients
+			<< ", \"seconds\": " << result.seconds
+			<< ", \"serverCpuPercent\": " << result.serverCpuPercent
+			<< ", \"encodeBusyPercent\": " << result.encodeBusyPercent
+			<< ", \"viewerCpuPercent\": " << result.viewerCpuPercent
+			<< ",\n     \"framesPublished\": " << result.stream.framesPublished
+			<< ", \"framesEncoded\": " << result.stream.framesEncoded
+			<< ", \"framesDropped\": " << result.stream.framesDropped
+			<< ", \"framesSent\": " << result.stream.framesSent
+			<< ", \"framesSkipped\": " << result.stream.framesSkipped
+			<< ", \"bytesSent\": " << result.stream.bytesSent
+			<< ",\n     \"minFastShare\": " << result.minFastShare
+			<< ", \"slowFramesPerSecond\": " << result.slowFramesPerSecond << "}";
+	}
+	json << "\n  ]\n}\n";
+
+	if (options.outputPath.empty())
+	{
+		std::cout << json.str();
+	}
+	else
+	{
+		std::ofstream(options.outputPath) << json.str();
+	}
+	return failed ? 1 : 0;
+}
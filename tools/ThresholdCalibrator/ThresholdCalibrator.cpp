@@ -0,0 +1,248 @@
+// ThresholdCalibrator: measures how well the cat cascade's confidence separates
+// frames with a cat from frames without one, at several cascade depths.
+//
+// The replay set is a directory with a cat/ and a nocat/ subdirectory of
+// recorded frames. Each frame is scored by the most confident cat CatFaceDetector
+// reports in it, as the door sees it. For every depth (the cascade cut down to
+// its first N stages) the operating curve gives recall and false accept rate at
+// each threshold. The operating point is the lowest threshold whose false
+// accept rate is within --max-false-accept. Fewer stages scan faster but
+// accept more, so the recommended depth is the shallowest whose recall there is
+// within --recall-tolerance of the deepest's. Its threshold goes into
+// detection.minConfidence in DoorConfig.txt; with --write-cascade, the cascade cut down to that depth is
+// written for the app to load from LocalState\CatFaceCascade.xml.
+//
+// ThresholdCalibrator <replay dir> --cascade <cascade.xml> [--human-cascade <cascade.xml>]
+//                     [--depths N,N,...] [--max-false-accept 0.01] [--recall-tolerance 0.01]
+//                     [--write-cascade cascade.xml] [--output report.json]
+
+#include "HaarCascade.h"
+#include "ReplaySet.h"
+#include "VisionCore.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace PetDoor;
+
+struct Options
+{
+	std::string replayDirectory;
+	std::string cascadePath;
+	std::string humanCascadePath;
+	std::string writeCascadePath;
+	std::string outputPath;
+	std::vector<int> depths;
+	double maxFalseAccept = 0.01;
+	double recallTolerance = 0.01;
+};
+
+static void Usage()
+{
+	std::cerr << "usage: ThresholdCalibrator <replay dir> --cascade <cascade.xml> [--human-cascade <cascade.xml>]\n"
+		<< "                           [--depths N,N,...] [--max-false-accept 0.01] [--recall-tolerance 0.01]\n"
+		<< "                           [--write-cascade cascade.xml] [--output report.json]\n";
+}
+
+static bool ParseOptions(int argc, char** argv, Options& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--cascade" && hasValue) options.cascadePath = argv[++i];
+		else if (arg == "--human-cascade" && hasValue) options.humanCascadePath = argv[++i];
+		else if (arg == "--depths" && hasValue)
+		{
+			std::istringstream list(argv[++i]);
+			std::string depth;
+			while (std::getline(list, depth, ',')) options.depths.push_back(atoi(depth.c_str()));
+		}
+		else if (arg == "--max-false-accept" && hasValue) options.maxFalseAccept = atof(argv[++i]);
+		else if (arg == "--recall-tolerance" && hasValue) options.recallTolerance = atof(argv[++i]);
+		else if (arg == "--write-cascade" && hasValue) options.writeCascadePath = argv[++i];
+		else if (arg == "--output" && hasValue) options.outputPath = argv[++i];
+		else if (arg.compare(0, 2, "--") != 0 && options.replayDirectory.empty()) options.replayDirectory = arg;
+		else return false;
+	}
+	return !options.replayDirectory.empty() && !options.cascadePath.empty();
+}
+
+struct DepthResult
+{
+	int stages = 0;
+	double millisecondsPerFrame = 0;
+	// Most confident cat per frame; -DBL_MAX where none was found
+	std::vector<double> catScores;
+	std::vector<double> noCatScores;
+	std::vector<CurvePoint> curve;
+	CurvePoint operatingPoint = {};
+};
+
+static bool RunDepth(const HaarCascade& full, int stages, const std::vector<cv::Mat>& catFrames, const std::vector<cv::Mat>& noCatFrames,
+	const Options& options, DepthResult& result)
+{
+	HaarCascade cascade = full;
+	cascade.stages.resize(stages);
+
+	CatFaceDetector detector;
+	if (!detector.Load(cascade, options.humanCascadePath)) return false;
+	result.stages = stages;
+
+	cv::Mat work;
+	std::vector<cv::Rect> cats;
+	double frameSeconds;
+	// One frame to size the pyramid, not timed
+	ScoreFrame(detector, work, catFrames.empty() ? noCatFrames[0] : catFrames[0], cats, WallSeconds, frameSeconds);
+
+	// The detector scans on every core, so it is timed on the wall clock
+	double seconds = 0;
+	for (auto& frame : catFrames)
+	{
+		result.catScores.push_back(ScoreFrame(detector, work, frame, cats, WallSeconds, frameSeconds));
+		seconds += frameSeconds;
+	}
+	for (auto& frame : noCatFrames)
+	{
+		result.noCatScores.push_back(ScoreFrame(detector, work, frame, cats, WallSeconds, frameSeconds));
+		seconds += frameSeconds;
+	}
+	result.millisecondsPerFrame = seconds * 1000 / (catFrames.size() + noCatFrames.size());
+
+	// The last point lets nothing in, so there always is one within the false accept rate
+	result.curve = BuildCurve(result.catScores, result.noCatScores);
+	for (auto& point : result.curve)
+	{
+		if (point.falseAcceptRate <= options.maxFalseAccept)
+		{
+			result.operatingPoint = point;
+			break;
+		}
+	}
+	return true;
+}
+
+static std::string PointJson(const CurvePoint& point)
+{
+	std::ostringstream json;
+	json << "{\"threshold\": " << ThresholdJson(point.threshold) << ", \"recall\": " << point.recall << ", \"falseAcceptRate\": " << point.falseAcceptRate << "}";
+	return json.str();
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	if (!ParseOptions(argc, argv, options))
+	{
+		Usage();
+		return 2;
+	}
+
+	HaarCascade cascade;
+	if (!cascade.Load(options.cascadePath))
+	{
+		std::cerr << "Couldn't load cascade '" << options.cascadePath << "'\n";
+		return 2;
+	}
+
+	std::vector<cv::Mat> catFrames = LoadFrames(options.replayDirectory + "/cat");
+	std::vector<cv::Mat> noCatFrames = LoadFrames(options.replayDirectory + "/nocat");
+	if (catFrames.empty() || noCatFrames.empty())
+	{
+		std::cerr << "Need frames in both '" << options.replayDirectory << "/cat' and '" << options.replayDirectory << "/nocat'\n";
+		return 2;
+	}
+
+	// By default the full cascade and every second depth below it, down to a few stages less
+	int fullDepth = static_cast<int>(cascade.stages.size());
+	if (options.depths.empty())
+	{
+		for (int depth = fullDepth; depth > 0 && depth >= fullDepth - 6; depth -= 2) options.depths.push_back(depth);
+	}
+	std::sort(options.depths.begin(), options.depths.end());
+	options.depths.erase(std::unique(options.depths.begin(), options.depths.end()), options.depths.end());
+
+	std::vector<DepthResult> results;
+	for (int depth : options.depths)
+	{
+		if (depth < 1 || depth > fullDepth)
+		{
+			std::cerr << "Skipping depth " << depth << "; the cascade has " << fullDepth << " stages\n";
+			continue;
+		}
+
+		DepthResult result;
+		if (!RunDepth(cascade, depth, catFrames, noCatFrames, options, result))
+		{
+			std::cerr << "Couldn't load the cascades\n";
+			return 2;
+		}
+		std::cerr << depth << " stages: " << result.millisecondsPerFrame << " ms per frame, recall " << result.operatingPoint.recall
+			<< " at false accept rate " << result.operatingPoint.falseAcceptRate << " (threshold " << ThresholdJson(result.operatingPoint.threshold) << ")\n";
+		results.push_back(result);
+	}
+	if (results.empty()) return 2;
+
+	// The shallowest depth that keeps close to the deepest one's recall
+	const DepthResult* recommended = &results.back();
+	for (auto& result : results)
+	{
+		if (result.operatingPoint.recall >= results.back().operatingPoint.recall - options.recallTolerance)
+		{
+			recommended = &result;
+			break;
+		}
+	}
+	std::cerr << "Recommended: " << recommended->stages << " stages, detection.minConfidence = "
+		<< (recommended->operatingPoint.threshold == -DBL_MAX ? "none" : ThresholdJson(recommended->operatingPoint.threshold)) << "\n";
+
+	if (!options.writeCascadePath.empty())
+	{
+		HaarCascade cut = cascade;
+		cut.stages.resize(recommended->stages);
+		if (!cut.Save(options.writeCascadePath))
+		{
+			std::cerr << "Couldn't write '" << options.writeCascadePath << "'\n";
+			return 2;
+		}
+	}
+
+	std::ostringstream json;
+	json.precision(9);
+	json << "{\n"
+		<< "  \"catFrames\": " << catFrames.size() << ",\n"
+		<< "  \"noCatFrames\": " << noCatFrames.size() << ",\n"
+		<< "  \"maxFalseAccept\": " << options.maxFalseAccept << ",\n"
+		<< "  \"recommended\": {\"stages\": " << recommended->stages << ", \"threshold\": " << ThresholdJson(recommended->operatingPoint.threshold) << "},\n"
+		<< "  \"depths\": [";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const DepthResult& result = results[i];
+		json << (i ? "," : "") << "\n    {\"stages\": " << result.stages
+			<< ", \"millisecondsPerFrame\": " << result.millisecondsPerFrame
+			<< ",\n     \"operatingPoint\": " << PointJson(result.operatingPoint)
+			<< ",\n     \"curve\": [";
+		for (size_t p = 0; p < result.curve.size(); p++)
+		{
+			json << (p ? ", " : "") << PointJson(result.curve[p]);
+		}
+		json << "]}";
+	}
+	json << "\n  ]\n}\n";
+
+	if (options.outputPath.empty())
+	{
+		std::cout << json.str();
+	}
+	else
+	{
+		std::ofstream(options.outputPath) << json.str();
+	}
+	return 0;
+}